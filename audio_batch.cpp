@@ -0,0 +1,280 @@
+﻿#include "audio_batch.hpp"
+#include "ffmpeg_xaudio2_internal.hpp"
+#include "audio_worker_pool.hpp"
+#include "audio_segment_decode.hpp"
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <cstdio>
+#include <cstring>
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <glob.h>
+#include <sys/resource.h>
+#endif
+
+namespace audio
+{
+	struct batch_file_result
+	{
+		bool ok = false;
+		uint64_t input_bytes = 0;
+		double audio_seconds = 0;
+		double wall_seconds = 0;
+		// 各流水线阶段busy时间之和，作为该文件占用的cpu时间的估计
+		double cpu_seconds = 0;
+	};
+
+	// 进程的用户态与内核态cpu时间之和
+	static double get_process_cpu_seconds()
+	{
+#if defined(_WIN32)
+		FILETIME creation_time, exit_time, kernel_time, user_time;
+		if (!GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time))
+			return 0;
+		auto to_seconds = [](const FILETIME& time) {
+			return double((uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7; // 100ns
+			};
+		return to_seconds(kernel_time) + to_seconds(user_time);
+#else
+		rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage))
+			return 0;
+		return double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+			+ double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#endif
+	}
+
+	int expand_batch_pattern(const char* pattern, std::vector<std::string>& paths)
+	{
+		const char* name = pattern;
+		for (const char* p = pattern; *p; ++p)
+		{
+			if (*p == '/' || *p == '\\')
+				name = p + 1;
+		}
+		if (!std::strpbrk(name, "*?"))
+		{
+			paths.push_back(pattern);
+			return 1;
+		}
+
+		std::vector<std::string> matches;
+#if defined(_WIN32)
+		std::string dir(pattern, name);
+		WIN32_FIND_DATAA find_data;
+		HANDLE find_handle = FindFirstFileA(pattern, &find_data);
+		if (find_handle != INVALID_HANDLE_VALUE)
+		{
+			do
+			{
+				if (!(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+					matches.push_back(dir + find_data.cFileName);
+			} while (FindNextFileA(find_handle, &find_data));
+			FindClose(find_handle);
+		}
+#else
+		glob_t result = {};
+		if (glob(pattern, GLOB_MARK, nullptr, &result) == 0)
+		{
+			for (size_t i = 0; i < result.gl_pathc; ++i)
+			{
+				// GLOB_MARK为目录加上结尾的'/'
+				size_t length = std::strlen(result.gl_pathv[i]);
+				if (length && result.gl_pathv[i][length - 1] != '/')
+					matches.push_back(result.gl_pathv[i]);
+			}
+		}
+		globfree(&result);
+#endif
+		if (matches.empty())
+			std::printf("warn: no file matches %s\n", pattern);
+		std::sort(matches.begin(), matches.end());
+		paths.insert(paths.end(), matches.begin(), matches.end());
+		return static_cast<int>(matches.size());
+	}
+
+	int read_batch_list(const char* list_path, std::vector<std::string>& paths)
+	{
+		std::ifstream list(list_path);
+		if (!list)
+		{
+			std::printf("err: open batch list %s failed\n", list_path);
+			return -1;
+		}
+		int count = 0;
+		std::string line;
+		while (std::getline(list, line))
+		{
+			line.erase(line.find_last_not_of(" \t\r") + 1);
+			if (line.empty() || line[0] == '#')
+				continue;
+			count += expand_batch_pattern(line.c_str(), paths);
+		}
+		return count;
+	}
+
+	// 输出文件名取输入文件名去掉扩展名，重名时加上序号
+	static std::vector<std::string> make_output_paths(const std::vector<std::string>& paths, const char* output_dir,
+		const char* extension)
+	{
+		std::vector<std::string> output_paths;
+		std::set<std::string> used_names;
+		std::string dir = output_dir;
+		if (!dir.empty() && dir.back() != '/' && dir.back() != '\\')
+			dir += '/';
+		for (const auto& path : paths)
+		{
+			size_t name_begin = path.find_last_of("/\\");
+			std::string name = path.substr(name_begin == std::string::npos ? 0 : name_begin + 1);
+			size_t dot = name.find_last_of('.');
+			if (dot != std::string::npos && dot > 0)
+				name.erase(dot);
+			std::string unique_name = name;
+			for (int i = 1; !used_names.insert(unique_name).second; ++i)
+				unique_name = name + "_" + std::to_string(i);
+			output_paths.push_back(dir + unique_name + extension);
+		}
+		return output_paths;
+	}
+
+	// 与播放使用同一条demux -> decode -> resample/output流水线，输出端不模拟时钟，解码速度只受cpu与i/o限制
+	static void decode_batch_file(audio_worker_pool* pool, const char* path, const char* output_path,
+		const batch_decode_config& config, batch_file_result& result)
+	{
+		audio_sink_config sink_config = config.sink;
+		sink_config.clock_speed = 0;
+		sink_config.output_path = output_path;
+		if (!output_path)
+			sink_config.type = audio_sink_type::null;
+
+		auto begin = std::chrono::steady_clock::now();
+		result.input_bytes = get_file_size(path);
+		if (config.segment_parallel)
+		{
+			// 分段并行不经过流水线，各段作为同一线程池上的任务解码
+			segment_decode_config segment_config;
+			segment_config.sink = sink_config;
+			segment_config.input = config.input;
+			segment_config.pool = pool;
+			segment_config.segments = config.segments;
+			segment_config.verify = config.segment_verify;
+			segment_decode_result segment_result;
+			int res = decode_file_segmented(path, segment_config, segment_result);
+			result.audio_seconds = segment_result.audio_seconds;
+			result.cpu_seconds = segment_result.decode_seconds;
+			result.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+			result.ok = res == 0 && result.audio_seconds > 0;
+			return;
+		}
+		audio_player* player = create_audio_player(pool);
+		int res = player->load(path, config.input);
+		if (!res)
+			res = player->initialize(sink_config);
+		if (!res)
+		{
+			player->start();
+			player->wait();
+			result.audio_seconds = player->get_output_seconds();
+			pipeline_stage_stats stage_stats[3];
+			int stage_count = player->get_pipeline_stage_stats(stage_stats, 3);
+			for (int i = 0; i < stage_count; ++i)
+				result.cpu_seconds += stage_stats[i].busy_seconds;
+		}
+		// 同时停止播放并关闭所有曲目
+		delete player;
+		result.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		result.ok = res == 0 && result.audio_seconds > 0;
+	}
+
+	int run_batch_decode(const std::vector<std::string>& paths, const batch_decode_config& config)
+	{
+		if (paths.empty())
+		{
+			std::printf("err: no input file for batch decode\n");
+			return -1;
+		}
+		std::vector<std::string> output_paths;
+		if (config.sink.type == audio_sink_type::wav_file || config.sink.type == audio_sink_type::raw_pcm_file)
+		{
+			if (!config.output_dir)
+			{
+				std::printf("err: batch decode to wav/raw needs --output-dir\n");
+				return -1;
+			}
+			output_paths = make_output_paths(paths, config.output_dir,
+				config.sink.type == audio_sink_type::wav_file ? ".wav" : ".pcm");
+		}
+
+		audio_worker_pool* pool = create_audio_worker_pool(config.threads);
+		int thread_count = pool->get_thread_count();
+		// 每个文件的load/initialize/wait在调度线程中执行，解码本身在线程池中
+		int jobs = config.jobs > 0 ? config.jobs : config.segment_parallel ? 1 : thread_count;
+		if (size_t(jobs) > paths.size())
+			jobs = static_cast<int>(paths.size());
+		std::printf("info: batch decode %d files, threads=%d, jobs=%d%s%s\n", int(paths.size()), thread_count, jobs,
+			config.segment_parallel ? ", segment parallel" : "", config.input.generate_peaks ? ", peaks" : "");
+		if (config.segment_parallel && config.input.generate_peaks)
+			std::printf("warn: peaks are not generated in segment parallel mode\n");
+
+		std::vector<batch_file_result> results(paths.size());
+		std::atomic<size_t> next_file{ 0 };
+		std::atomic<int> finished_count{ 0 };
+		double cpu_begin = get_process_cpu_seconds();
+		auto wall_begin = std::chrono::steady_clock::now();
+		std::vector<std::thread> dispatchers;
+		for (int i = 0; i < jobs; ++i)
+		{
+			dispatchers.emplace_back([&] {
+				size_t index;
+				while ((index = next_file.fetch_add(1)) < paths.size())
+				{
+					const char* path = paths[index].c_str();
+					batch_file_result& result = results[index];
+					decode_batch_file(pool, path, output_paths.empty() ? nullptr : output_paths[index].c_str(), config, result);
+					int finished = ++finished_count;
+					if (!result.ok)
+					{
+						std::printf("err: batch [%d/%d] decode failed: %s\n", finished, int(paths.size()), path);
+						continue;
+					}
+					double wall = result.wall_seconds > 0 ? result.wall_seconds : 1e-9;
+					std::printf("info: batch [%d/%d] %.2fs audio in %.3fs, %.1fx realtime, %.1f MB/s, cpu %.3fs: %s\n",
+						finished, int(paths.size()), result.audio_seconds, result.wall_seconds,
+						result.audio_seconds / wall, result.input_bytes / wall / 1e6, result.cpu_seconds, path);
+				}
+				});
+		}
+		for (auto& dispatcher : dispatchers)
+			dispatcher.join();
+		double wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_begin).count();
+		double cpu_seconds = get_process_cpu_seconds() - cpu_begin;
+		destroy_audio_worker_pool(pool);
+
+		int failed = 0;
+		double audio_seconds = 0;
+		uint64_t input_bytes = 0;
+		for (const auto& result : results)
+		{
+			if (!result.ok)
+			{
+				failed++;
+				continue;
+			}
+			audio_seconds += result.audio_seconds;
+			input_bytes += result.input_bytes;
+		}
+		double wall = wall_seconds > 0 ? wall_seconds : 1e-9;
+		std::printf("info: batch finished: %d files, %d failed\n", int(paths.size()), failed);
+		std::printf("info: batch total: %.2fs audio, %.1f MB in %.3fs, %.1fx realtime, %.1f MB/s, "
+			"cpu %.3fs (%.0f%% of %d threads)\n",
+			audio_seconds, input_bytes / 1e6, wall_seconds, audio_seconds / wall, input_bytes / wall / 1e6,
+			cpu_seconds, cpu_seconds * 100 / (wall * thread_count), thread_count);
+		return failed;
+	}
+}
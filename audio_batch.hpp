@@ -0,0 +1,37 @@
+﻿#if !defined(AUDIO_BATCH_HPP_)
+#define AUDIO_BATCH_HPP_
+#include "audio_play_interface.hpp"
+#include <string>
+#include <vector>
+
+namespace audio
+{
+	// 批量解码：不经过声卡，以最快速度把每个文件解码到null/wav/raw输出端，用于入库与校验
+	struct batch_decode_config
+	{
+		// sink.type为wav_file/raw_pcm_file时每个文件输出到output_dir下的同名文件，其余输出到null
+		// 批量模式总是不模拟时钟（clock_speed = 0）
+		audio_sink_config sink;
+		audio_input_config input;
+		const char* output_dir = nullptr;
+		// 线程池的线程数，0为cpu核心数
+		int threads = 0;
+		// 同时解码的文件数，0为线程池的线程数（分段并行时为1）
+		int jobs = 0;
+		// 分段并行：每个文件切分为若干段在多个线程上解码，适合少量长文件
+		bool segment_parallel = false;
+		// 每个文件的段数，0为线程数的2倍
+		int segments = 0;
+		// 分段并行时另外按顺序解码一次，检查输出是否逐位一致
+		bool segment_verify = false;
+	};
+
+	// 展开路径中文件名部分的通配符（*、?），没有通配符时原样加入；返回加入的路径数
+	int expand_batch_pattern(const char* pattern, std::vector<std::string>& paths);
+	// 逐行读取路径列表，空行与#开头的行被忽略；无法打开时返回-1
+	int read_batch_list(const char* list_path, std::vector<std::string>& paths);
+	// 解码所有文件，逐个报告并汇总吞吐量（x-realtime、MB/s、cpu秒）；返回失败的文件数
+	int run_batch_decode(const std::vector<std::string>& paths, const batch_decode_config& config);
+}
+
+#endif // AUDIO_BATCH_HPP_
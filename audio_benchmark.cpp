@@ -0,0 +1,643 @@
+﻿#include "audio_benchmark.hpp"
+#include "ffmpeg_xaudio2_internal.hpp"
+#include "sample_convert.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace audio
+{
+	// 结果格式的版本，字段含义改变时递增，比较结果的脚本据此拒绝不兼容的文件
+	constexpr int benchmark_schema_version = 1;
+
+	// 素材矩阵：覆盖常见的编码、采样率与声道数
+	struct corpus_entry
+	{
+		const char* codec_name;
+		// 优先使用的编码器（如libopus），找不到时按codec_id查找
+		const char* encoder_name;
+		AVCodecID codec_id;
+		const char* extension;
+		int sample_rate;
+		int channels;
+		// 编码器支持时使用的样本格式，AV_SAMPLE_FMT_NONE为编码器的第一个格式
+		AVSampleFormat sample_fmt;
+		int bits_per_raw_sample;
+		int64_t bit_rate;
+	};
+
+	static const corpus_entry corpus_entries[] = {
+		{ "flac", nullptr, AV_CODEC_ID_FLAC, "flac", 44100, 2, AV_SAMPLE_FMT_S16, 16, 0 },
+		{ "flac", nullptr, AV_CODEC_ID_FLAC, "flac", 96000, 2, AV_SAMPLE_FMT_S32, 24, 0 },
+		{ "flac", nullptr, AV_CODEC_ID_FLAC, "flac", 48000, 6, AV_SAMPLE_FMT_S16, 16, 0 },
+		{ "mp3", "libmp3lame", AV_CODEC_ID_MP3, "mp3", 44100, 2, AV_SAMPLE_FMT_NONE, 0, 192000 },
+		{ "mp3", "libmp3lame", AV_CODEC_ID_MP3, "mp3", 48000, 1, AV_SAMPLE_FMT_NONE, 0, 96000 },
+		{ "aac", nullptr, AV_CODEC_ID_AAC, "m4a", 44100, 2, AV_SAMPLE_FMT_NONE, 0, 160000 },
+		// adts没有索引，覆盖定位索引的路径
+		{ "aac", nullptr, AV_CODEC_ID_AAC, "aac", 48000, 6, AV_SAMPLE_FMT_NONE, 0, 384000 },
+		// opus只支持48000Hz
+		{ "opus", "libopus", AV_CODEC_ID_OPUS, "opus", 48000, 2, AV_SAMPLE_FMT_NONE, 0, 128000 },
+		{ "wav", nullptr, AV_CODEC_ID_PCM_S16LE, "wav", 44100, 2, AV_SAMPLE_FMT_S16, 0, 0 },
+		{ "wav", nullptr, AV_CODEC_ID_PCM_S16LE, "wav", 96000, 2, AV_SAMPLE_FMT_S16, 0, 0 },
+	};
+
+	// swr_convert的格式组合，输入为内存中生成的信号
+	struct swr_bench_case
+	{
+		const char* name;
+		AVSampleFormat in_fmt;
+		int in_rate;
+		AVChannelLayout in_layout;
+		AVSampleFormat out_fmt;
+		int out_rate;
+		AVChannelLayout out_layout;
+	};
+
+	static const swr_bench_case swr_bench_cases[] = {
+		{ "s16_44100_2ch-s16_48000_2ch", AV_SAMPLE_FMT_S16, 44100, AV_CHANNEL_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, 48000, AV_CHANNEL_LAYOUT_STEREO },
+		{ "fltp_44100_2ch-s16_44100_2ch", AV_SAMPLE_FMT_FLTP, 44100, AV_CHANNEL_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, 44100, AV_CHANNEL_LAYOUT_STEREO },
+		{ "fltp_44100_2ch-flt_48000_2ch", AV_SAMPLE_FMT_FLTP, 44100, AV_CHANNEL_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, 48000, AV_CHANNEL_LAYOUT_STEREO },
+		{ "s32p_96000_2ch-s16_48000_2ch", AV_SAMPLE_FMT_S32P, 96000, AV_CHANNEL_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, 48000, AV_CHANNEL_LAYOUT_STEREO },
+		{ "s16p_48000_6ch-s16_48000_6ch", AV_SAMPLE_FMT_S16P, 48000, AV_CHANNEL_LAYOUT_5POINT1, AV_SAMPLE_FMT_S16, 48000, AV_CHANNEL_LAYOUT_5POINT1 },
+		{ "fltp_48000_6ch-flt_48000_2ch", AV_SAMPLE_FMT_FLTP, 48000, AV_CHANNEL_LAYOUT_5POINT1, AV_SAMPLE_FMT_FLT, 48000, AV_CHANNEL_LAYOUT_STEREO },
+		{ "fltp_48000_6ch-s16_44100_2ch", AV_SAMPLE_FMT_FLTP, 48000, AV_CHANNEL_LAYOUT_5POINT1, AV_SAMPLE_FMT_S16, 44100, AV_CHANNEL_LAYOUT_STEREO },
+	};
+
+	// 每次swr测量转换的输入时长与每次调用的帧数
+	constexpr double swr_bench_seconds = 5.0;
+	constexpr int swr_bench_chunk = 1024;
+
+	// 测试信号：每个声道一个对数扫频正弦（起始频率按声道错开）加上固定种子的噪声，
+	// 同样的参数总是生成同样的样本
+	class bench_signal
+	{
+	public:
+		bench_signal(int sample_rate, int channels, double seconds)
+			: sample_rate(sample_rate), channels(channels), seconds(seconds), phases(size_t(channels), 0.0)
+		{
+		}
+
+		// 下一个样本帧中第ch个声道的值，须按声道顺序逐个取
+		double next(int ch)
+		{
+			constexpr double pi = 3.14159265358979323846;
+			double f0 = 40.0 * (1.0 + 0.25 * ch);
+			double f1 = std::min(16000.0, sample_rate * 0.45);
+			double t = double(position) / sample_rate;
+			double frequency = f0 * std::pow(f1 / f0, std::fmod(t, seconds) / seconds);
+			double value = 0.4 * std::sin(phases[size_t(ch)]);
+			phases[size_t(ch)] = std::fmod(phases[size_t(ch)] + 2 * pi * frequency / sample_rate, 2 * pi);
+			seed = seed * 1664525u + 1013904223u;
+			value += 0.05 * (double(seed >> 8) / double(1 << 24) * 2.0 - 1.0);
+			if (ch + 1 == channels)
+				position++;
+			return value;
+		}
+
+	private:
+		int sample_rate;
+		int channels;
+		double seconds;
+		std::vector<double> phases;
+		int64_t position = 0;
+		uint32_t seed = 0x2545f491u;
+	};
+
+	// 按样本格式写入第index个样本帧中第ch个声道，value在[-1, 1)之间
+	static void store_sample(uint8_t* const* data, AVSampleFormat fmt, int channels, int ch, int index, double value)
+	{
+		bool planar = av_sample_fmt_is_planar(fmt) != 0;
+		uint8_t* plane = data[planar ? ch : 0];
+		int i = planar ? index : index * channels + ch;
+		switch (av_get_packed_sample_fmt(fmt))
+		{
+		case AV_SAMPLE_FMT_U8: plane[i] = uint8_t(std::lrint(value * 127.0) + 128); break;
+		case AV_SAMPLE_FMT_S16: reinterpret_cast<int16_t*>(plane)[i] = int16_t(std::lrint(value * 32767.0)); break;
+		case AV_SAMPLE_FMT_S32: reinterpret_cast<int32_t*>(plane)[i] = int32_t(std::llrint(value * 2147483647.0)); break;
+		case AV_SAMPLE_FMT_FLT: reinterpret_cast<float*>(plane)[i] = float(value); break;
+		case AV_SAMPLE_FMT_DBL: reinterpret_cast<double*>(plane)[i] = value; break;
+		default: break;
+		}
+	}
+
+	static int make_directory(const char* path)
+	{
+#if defined(_WIN32)
+		if (_mkdir(path) == 0 || errno == EEXIST)
+			return 0;
+#else
+		if (mkdir(path, 0755) == 0 || errno == EEXIST)
+			return 0;
+#endif
+		std::printf("err: create benchmark corpus directory %s failed\n", path);
+		return -1;
+	}
+
+	static std::string get_corpus_name(const corpus_entry& entry, double seconds)
+	{
+		char name[128];
+		std::snprintf(name, sizeof(name), "%s_%d_%dch_%gs", entry.codec_name, entry.sample_rate, entry.channels, seconds);
+		return name;
+	}
+
+	static const AVCodec* find_corpus_encoder(const corpus_entry& entry)
+	{
+		const AVCodec* codec = entry.encoder_name ? avcodec_find_encoder_by_name(entry.encoder_name) : nullptr;
+		return codec ? codec : avcodec_find_encoder(entry.codec_id);
+	}
+
+	// 把所有可以取出的packet写入文件，frame为nullptr时冲刷编码器
+	static int write_encoded_packets(AVFormatContext* format_context, AVCodecContext* codec_context, AVStream* stream,
+		AVPacket* packet, const AVFrame* frame)
+	{
+		int res = avcodec_send_frame(codec_context, frame);
+		if (res < 0)
+			return res;
+		while ((res = avcodec_receive_packet(codec_context, packet)) >= 0)
+		{
+			av_packet_rescale_ts(packet, codec_context->time_base, stream->time_base);
+			packet->stream_index = stream->index;
+			res = av_interleaved_write_frame(format_context, packet);
+			av_packet_unref(packet);
+			if (res < 0)
+				return res;
+		}
+		return res == AVERROR(EAGAIN) || res == AVERROR_EOF ? 0 : res;
+	}
+
+	// 编码一个素材文件，失败时删除写了一半的文件
+	static int encode_corpus_file(const corpus_entry& entry, const AVCodec* codec, const char* path, double seconds)
+	{
+		AVFormatContext* format_context = nullptr;
+		AVCodecContext* codec_context = nullptr;
+		AVFrame* frame = nullptr;
+		AVPacket* packet = nullptr;
+		bool header_written = false;
+		int res = avformat_alloc_output_context2(&format_context, nullptr, nullptr, path);
+		if (res < 0 || !format_context)
+		{
+			std::printf("err: no muxer for %s\n", path);
+			return -1;
+		}
+		AVStream* stream = avformat_new_stream(format_context, nullptr);
+		codec_context = avcodec_alloc_context3(codec);
+		if (!stream || !codec_context)
+			res = -1;
+		if (res >= 0)
+		{
+			codec_context->sample_rate = entry.sample_rate;
+			av_channel_layout_default(&codec_context->ch_layout, entry.channels);
+			codec_context->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_S16;
+			for (const AVSampleFormat* fmt = codec->sample_fmts; fmt && *fmt != AV_SAMPLE_FMT_NONE; ++fmt)
+			{
+				if (*fmt == entry.sample_fmt)
+					codec_context->sample_fmt = entry.sample_fmt;
+			}
+			if (entry.bits_per_raw_sample && codec_context->sample_fmt == entry.sample_fmt)
+				codec_context->bits_per_raw_sample = entry.bits_per_raw_sample;
+			codec_context->bit_rate = entry.bit_rate;
+			codec_context->time_base = AVRational{ 1, entry.sample_rate };
+			// ffmpeg内置的opus编码器为实验性质
+			codec_context->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+			if (format_context->oformat->flags & AVFMT_GLOBALHEADER)
+				codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+			res = avcodec_open2(codec_context, codec, nullptr);
+			if (res < 0)
+				std::printf("err: open encoder %s for %s failed\n", codec->name, path);
+		}
+		if (res >= 0)
+		{
+			stream->time_base = codec_context->time_base;
+			res = avcodec_parameters_from_context(stream->codecpar, codec_context);
+		}
+		if (res >= 0 && !(format_context->oformat->flags & AVFMT_NOFILE))
+			res = avio_open(&format_context->pb, path, AVIO_FLAG_WRITE);
+		if (res >= 0)
+		{
+			res = avformat_write_header(format_context, nullptr);
+			header_written = res >= 0;
+		}
+
+		if (res >= 0)
+		{
+			int frame_size = codec_context->frame_size > 0 ? codec_context->frame_size : 1024;
+			// 不支持较短的最后一帧的编码器须每帧都是frame_size，总长向上取整到整帧
+			int64_t total = int64_t(seconds * entry.sample_rate);
+			total = (total + frame_size - 1) / frame_size * frame_size;
+			bench_signal signal(entry.sample_rate, entry.channels, seconds);
+			frame = av_frame_alloc();
+			packet = av_packet_alloc();
+			frame->nb_samples = frame_size;
+			frame->format = codec_context->sample_fmt;
+			frame->sample_rate = entry.sample_rate;
+			av_channel_layout_copy(&frame->ch_layout, &codec_context->ch_layout);
+			res = av_frame_get_buffer(frame, 0);
+			for (int64_t pts = 0; res >= 0 && pts < total; pts += frame_size)
+			{
+				res = av_frame_make_writable(frame);
+				if (res < 0)
+					break;
+				for (int i = 0; i < frame_size; ++i)
+				{
+					for (int ch = 0; ch < entry.channels; ++ch)
+						store_sample(frame->extended_data, codec_context->sample_fmt, entry.channels, ch, i, signal.next(ch));
+				}
+				frame->pts = pts;
+				res = write_encoded_packets(format_context, codec_context, stream, packet, frame);
+			}
+			if (res >= 0)
+				res = write_encoded_packets(format_context, codec_context, stream, packet, nullptr);
+		}
+		if (header_written)
+		{
+			int trailer_res = av_write_trailer(format_context);
+			if (res >= 0)
+				res = trailer_res;
+		}
+		if (format_context->pb && !(format_context->oformat->flags & AVFMT_NOFILE))
+			avio_closep(&format_context->pb);
+		av_frame_free(&frame);
+		av_packet_free(&packet);
+		avcodec_free_context(&codec_context);
+		avformat_free_context(format_context);
+		if (res < 0)
+		{
+			std::printf("err: encode benchmark corpus file %s failed (%d)\n", path, res);
+			std::remove(path);
+			return -1;
+		}
+		return 0;
+	}
+
+	struct corpus_file
+	{
+		const corpus_entry* entry;
+		std::string name;
+		std::string path;
+		std::string encoder;
+		uint64_t bytes = 0;
+	};
+
+	// 生成缺少的素材文件；编码器不可用的格式跳过并给出警告
+	static int prepare_corpus(const benchmark_config& config, std::vector<corpus_file>& files)
+	{
+		if (make_directory(config.corpus_dir))
+			return -1;
+		std::string dir = config.corpus_dir;
+		if (!dir.empty() && dir.back() != '/' && dir.back() != '\\')
+			dir += '/';
+		for (const auto& entry : corpus_entries)
+		{
+			corpus_file file;
+			file.entry = &entry;
+			file.name = get_corpus_name(entry, config.corpus_seconds);
+			file.path = dir + file.name + "." + entry.extension;
+			const AVCodec* codec = find_corpus_encoder(entry);
+			if (!codec)
+			{
+				std::printf("warn: no %s encoder in this ffmpeg build, %s skipped\n", entry.codec_name, file.name.c_str());
+				continue;
+			}
+			file.encoder = codec->name;
+			if (get_file_size(file.path.c_str()) == 0)
+			{
+				std::printf("info: generating benchmark corpus %s with %s\n", file.path.c_str(), codec->name);
+				if (encode_corpus_file(entry, codec, file.path.c_str(), config.corpus_seconds))
+					return -1;
+			}
+			file.bytes = get_file_size(file.path.c_str());
+			files.push_back(file);
+		}
+		if (files.empty())
+		{
+			std::printf("err: no benchmark corpus file could be generated\n");
+			return -1;
+		}
+		return 0;
+	}
+
+	// 一项测量的结果；higher_is_better决定best取最大值还是最小值
+	struct bench_result
+	{
+		const char* group;
+		std::string name;
+		const char* unit;
+		bool higher_is_better;
+		std::vector<double> values;
+		double median() const
+		{
+			std::vector<double> sorted = values;
+			std::sort(sorted.begin(), sorted.end());
+			size_t n = sorted.size();
+			return n == 0 ? 0 : (n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2);
+		}
+		double best() const
+		{
+			if (values.empty())
+				return 0;
+			return higher_is_better ? *std::max_element(values.begin(), values.end())
+				: *std::min_element(values.begin(), values.end());
+		}
+	};
+
+	using bench_clock = std::chrono::steady_clock;
+
+	static double seconds_since(bench_clock::time_point begin)
+	{
+		return std::chrono::duration<double>(bench_clock::now() - begin).count();
+	}
+
+	// 预热一次后重复repeat次，run返回本次的测量值，失败时返回负数
+	template <typename run_type>
+	static bool measure_repeated(bench_result& result, int repeat, run_type run)
+	{
+		if (run() < 0)
+			return false;
+		for (int i = 0; i < repeat; ++i)
+		{
+			double value = run();
+			if (value < 0)
+				return false;
+			result.values.push_back(value);
+		}
+		return true;
+	}
+
+	// 打开延迟：load_audio_context所经过的播放器load，即打开输入、探测、find_stream_info与打开解码器，单位为微秒
+	static double measure_open(audio_worker_pool* pool, const corpus_file& file,
+		const audio_input_config& input_config = audio_input_config())
+	{
+		audio_player* player = create_audio_player(pool);
+		auto begin = bench_clock::now();
+		int res = player->load(file.path.c_str(), input_config);
+		double elapsed = seconds_since(begin);
+		delete player;
+		return res ? -1 : elapsed * 1e6;
+	}
+
+	// 解码吞吐量：只计demux与解码，不含打开与样本转换，单位为样本帧/秒
+	static double measure_decode(const corpus_file& file)
+	{
+		audio_decoder_context* decoder = open_audio_decoder(file.path.c_str(), audio_input_config());
+		if (!decoder)
+			return -1;
+		AVPacket* packet = av_packet_alloc();
+		AVFrame* frame = av_frame_alloc();
+		int64_t samples = 0;
+		bool input_ended = false;
+		auto begin = bench_clock::now();
+		for (;;)
+		{
+			int res = avcodec_receive_frame(decoder->codec_context, frame);
+			if (res >= 0)
+			{
+				samples += frame->nb_samples;
+				av_frame_unref(frame);
+				continue;
+			}
+			if (res != AVERROR(EAGAIN) || input_ended)
+				break;
+			if (av_read_frame(decoder->format_context, packet) < 0)
+			{
+				input_ended = true;
+				avcodec_send_packet(decoder->codec_context, nullptr);
+				continue;
+			}
+			if (packet->stream_index == static_cast<int>(decoder->audio_stream_index))
+				avcodec_send_packet(decoder->codec_context, packet);
+			av_packet_unref(packet);
+		}
+		double elapsed = seconds_since(begin);
+		av_frame_free(&frame);
+		av_packet_free(&packet);
+		close_audio_decoder(decoder);
+		return samples > 0 && elapsed > 0 ? double(samples) / elapsed : -1;
+	}
+
+	// swr_convert吞吐量：按swr_bench_chunk帧一次转换swr_bench_seconds的输入，单位为输入样本帧/秒
+	static double measure_swr(const swr_bench_case& test_case, uint8_t** input, uint8_t** output, int output_capacity)
+	{
+		SwrContext* swr = nullptr;
+		swr_alloc_set_opts2(&swr, &test_case.out_layout, test_case.out_fmt, test_case.out_rate,
+			&test_case.in_layout, test_case.in_fmt, test_case.in_rate, 0, nullptr);
+		if (!swr || swr_init(swr) < 0)
+		{
+			swr_free(&swr);
+			return -1;
+		}
+		int total = int(swr_bench_seconds * test_case.in_rate);
+		int bytes_per_sample = av_get_bytes_per_sample(test_case.in_fmt);
+		bool planar = av_sample_fmt_is_planar(test_case.in_fmt) != 0;
+		int channels = test_case.in_layout.nb_channels;
+		const uint8_t* chunk[8];
+		auto begin = bench_clock::now();
+		for (int offset = 0; offset < total; offset += swr_bench_chunk)
+		{
+			// 输入缓冲区为1秒，循环使用
+			int position = offset % test_case.in_rate;
+			int count = std::min(swr_bench_chunk, test_case.in_rate - position);
+			for (int ch = 0; ch < (planar ? channels : 1); ++ch)
+				chunk[ch] = input[ch] + size_t(position) * bytes_per_sample * (planar ? 1 : channels);
+			if (swr_convert(swr, output, output_capacity, chunk, count) < 0)
+			{
+				swr_free(&swr);
+				return -1;
+			}
+		}
+		double elapsed = seconds_since(begin);
+		swr_free(&swr);
+		return elapsed > 0 ? total / elapsed : -1;
+	}
+
+	// 端到端：与播放相同的demux -> decode -> resample/output流水线，输出到不模拟时钟的null输出端，单位为样本帧/秒
+	static double measure_end_to_end(audio_worker_pool* pool, const corpus_file& file)
+	{
+		audio_sink_config sink_config;
+		sink_config.type = audio_sink_type::null;
+		sink_config.clock_speed = 0;
+		audio_player* player = create_audio_player(pool);
+		double result = -1;
+		if (!player->load(file.path.c_str()) && !player->initialize(sink_config))
+		{
+			auto begin = bench_clock::now();
+			player->start();
+			player->wait();
+			double elapsed = seconds_since(begin);
+			double output_seconds = player->get_output_seconds();
+			player->uninitialize();
+			if (output_seconds > 0 && elapsed > 0)
+				result = output_seconds * file.entry->sample_rate / elapsed;
+		}
+		delete player;
+		return result;
+	}
+
+	static const char* get_compiler_name()
+	{
+#if defined(_MSC_VER)
+		return "msvc";
+#elif defined(__clang__)
+		return "clang";
+#elif defined(__GNUC__)
+		return "gcc";
+#else
+		return "unknown";
+#endif
+	}
+
+	// 字段顺序与名称固定，不同提交之间的结果可以逐项比较中位数
+	static std::string format_benchmark_json(const benchmark_config& config, int thread_count,
+		const std::vector<corpus_file>& files, const std::vector<bench_result>& results)
+	{
+		std::string out;
+		append_format(out, "{\n  \"schema\": %d,\n  \"environment\": {\n", benchmark_schema_version);
+		append_format(out, "    \"avformat_version\": %u,\n    \"avcodec_version\": %u,\n"
+			"    \"avutil_version\": %u,\n    \"swresample_version\": %u,\n",
+			avformat_version(), avcodec_version(), avutil_version(), swresample_version());
+		append_format(out, "    \"compiler\": \"%s\",\n", get_compiler_name());
+#if defined(NDEBUG)
+		append_format(out, "    \"build\": \"release\",\n");
+#else
+		append_format(out, "    \"build\": \"debug\",\n");
+#endif
+		append_format(out, "    \"hardware_threads\": %u,\n    \"pool_threads\": %d,\n",
+			std::thread::hardware_concurrency(), thread_count);
+		append_format(out, "    \"convert_kernels\": \"%s\",\n", get_sample_convert_kernels().name);
+		append_format(out, "    \"repeat\": %d,\n    \"corpus_seconds\": %g\n  },\n  \"corpus\": [\n",
+			config.repeat, config.corpus_seconds);
+		for (size_t i = 0; i < files.size(); ++i)
+		{
+			const corpus_file& file = files[i];
+			append_format(out, "    {\"name\": \"%s\", \"codec\": \"%s\", \"encoder\": \"%s\", \"sample_rate\": %d, "
+				"\"channels\": %d, \"bytes\": %llu}%s\n",
+				file.name.c_str(), file.entry->codec_name, file.encoder.c_str(), file.entry->sample_rate,
+				file.entry->channels, static_cast<unsigned long long>(file.bytes), i + 1 < files.size() ? "," : "");
+		}
+		append_format(out, "  ],\n  \"results\": [\n");
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const bench_result& result = results[i];
+			append_format(out, "    {\"group\": \"%s\", \"name\": \"%s\", \"unit\": \"%s\", \"higher_is_better\": %s, "
+				"\"median\": %.6g, \"best\": %.6g, \"values\": [",
+				result.group, result.name.c_str(), result.unit, result.higher_is_better ? "true" : "false",
+				result.median(), result.best());
+			for (size_t v = 0; v < result.values.size(); ++v)
+				append_format(out, "%s%.6g", v ? ", " : "", result.values[v]);
+			append_format(out, "]}%s\n", i + 1 < results.size() ? "," : "");
+		}
+		out += "  ]\n}\n";
+		return out;
+	}
+
+	int run_audio_benchmark(const benchmark_config& config)
+	{
+		std::vector<corpus_file> files;
+		if (prepare_corpus(config, files))
+			return -1;
+		int repeat = config.repeat > 0 ? config.repeat : 1;
+		audio_worker_pool* pool = create_audio_worker_pool(config.threads);
+		int thread_count = pool->get_thread_count();
+		std::vector<bench_result> results;
+		int failures = 0;
+		auto report = [&](bench_result& result, bool ok) {
+			if (!ok)
+			{
+				std::printf("err: benchmark %s %s failed\n", result.group, result.name.c_str());
+				failures++;
+				return;
+			}
+			results.push_back(result);
+			};
+
+		for (const auto& file : files)
+		{
+			bench_result result = { "open", file.name, "us", false, {} };
+			report(result, measure_repeated(result, repeat, [&] { return measure_open(pool, file); }));
+		}
+		// 快速打开，以及流信息缓存命中（预热的一次写入缓存）
+		std::string stream_info_cache_path = std::string(config.corpus_dir) + "/stream_info.cache";
+		std::remove(stream_info_cache_path.c_str());
+		audio_input_config fast_open_config;
+		fast_open_config.fast_open = true;
+		audio_input_config cached_open_config;
+		cached_open_config.stream_info_cache = stream_info_cache_path.c_str();
+		for (const auto& file : files)
+		{
+			bench_result result = { "open_fast", file.name, "us", false, {} };
+			report(result, measure_repeated(result, repeat, [&] { return measure_open(pool, file, fast_open_config); }));
+		}
+		for (const auto& file : files)
+		{
+			bench_result result = { "open_cached", file.name, "us", false, {} };
+			report(result, measure_repeated(result, repeat, [&] { return measure_open(pool, file, cached_open_config); }));
+		}
+		for (const auto& file : files)
+		{
+			bench_result result = { "decode", file.name, "samples/s", true, {} };
+			report(result, measure_repeated(result, repeat, [&] { return measure_decode(file); }));
+		}
+		for (const auto& test_case : swr_bench_cases)
+		{
+			int channels = test_case.in_layout.nb_channels;
+			uint8_t* input[8] = {};
+			uint8_t* output[8] = {};
+			int output_capacity = int(av_rescale(swr_bench_chunk, test_case.out_rate, test_case.in_rate)) + 256;
+			bench_result result = { "swr_convert", test_case.name, "samples/s", true, {} };
+			bool ok = av_samples_alloc(input, nullptr, channels, test_case.in_rate, test_case.in_fmt, 0) >= 0
+				&& av_samples_alloc(output, nullptr, test_case.out_layout.nb_channels, output_capacity, test_case.out_fmt, 0) >= 0;
+			if (ok)
+			{
+				bench_signal signal(test_case.in_rate, channels, 1.0);
+				for (int i = 0; i < test_case.in_rate; ++i)
+				{
+					for (int ch = 0; ch < channels; ++ch)
+						store_sample(input, test_case.in_fmt, channels, ch, i, signal.next(ch));
+				}
+				ok = measure_repeated(result, repeat, [&] { return measure_swr(test_case, input, output, output_capacity); });
+			}
+			report(result, ok);
+			// av_samples_alloc把所有平面放在一块内存中
+			av_freep(&input[0]);
+			av_freep(&output[0]);
+		}
+		for (const auto& file : files)
+		{
+			bench_result result = { "end_to_end", file.name, "samples/s", true, {} };
+			report(result, measure_repeated(result, repeat, [&] { return measure_end_to_end(pool, file); }));
+		}
+		destroy_audio_worker_pool(pool);
+
+		std::printf("info: benchmark results, median and best of %d runs\n", repeat);
+		std::printf("%-12s %-32s %14s %14s %s\n", "group", "name", "median", "best", "unit");
+		for (const auto& result : results)
+		{
+			std::printf("%-12s %-32s %14.1f %14.1f %s\n", result.group, result.name.c_str(),
+				result.median(), result.best(), result.unit);
+		}
+
+		const char* output_path = config.output_path ? config.output_path : "bench_results.json";
+		std::string text = format_benchmark_json(config, thread_count, files, results);
+		std::FILE* output = std::fopen(output_path, "wb");
+		bool written = output && std::fwrite(text.data(), 1, text.size(), output) == text.size();
+		if (output)
+			written = std::fclose(output) == 0 && written;
+		if (!written)
+		{
+			std::printf("err: write benchmark results to %s failed\n", output_path);
+			return -1;
+		}
+		std::printf("info: benchmark results written to %s, %d failure(s)\n", output_path, failures);
+		return failures ? -1 : 0;
+	}
+}
@@ -0,0 +1,28 @@
+﻿#if !defined(AUDIO_BENCHMARK_HPP_)
+#define AUDIO_BENCHMARK_HPP_
+#include "audio_play_interface.hpp"
+
+namespace audio
+{
+	// 基准测试：测试素材由libavformat/libavcodec的编码器按固定的信号生成，不需要提交任何音频文件
+	// 测量打开延迟、解码吞吐量、各格式组合的swr_convert吞吐量，以及经null输出端的端到端吞吐量
+	struct benchmark_config
+	{
+		// 测试素材目录，不存在时创建；已生成的素材直接复用，删除目录即重新生成
+		const char* corpus_dir = "bench_corpus";
+		// json结果的输出路径，nullptr时为bench_results.json
+		const char* output_path = nullptr;
+		// 每个素材文件的时长
+		double corpus_seconds = 10.0;
+		// 每项测量重复的次数（另有一次不计入结果的预热），结果取中位数与最好值
+		int repeat = 5;
+		// 端到端测量使用的线程池的线程数，0为cpu核心数
+		int threads = 0;
+	};
+
+	// 生成素材并运行所有测量，人可读的汇总输出到标准输出，json结果写入output_path
+	// 返回非0表示素材无法生成或有测量失败
+	int run_audio_benchmark(const benchmark_config& config);
+}
+
+#endif // AUDIO_BENCHMARK_HPP_
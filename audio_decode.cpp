@@ -1,7 +1,15 @@
 ﻿#include <cstdlib>
 #include <cstdio>
-#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
 #include "ffmpeg_xaudio2_internal.hpp"
+#include "audio_input_source.hpp"
+#include "audio_seek_index.hpp"
+#include "audio_peaks.hpp"
+#include "audio_stream_info_cache.hpp"
+#include "audio_metrics.hpp"
+#include "audio_trace.hpp"
 
 #pragma comment(lib, "avformat.lib")
 #pragma comment(lib, "avcodec.lib")
@@ -9,127 +17,217 @@
 
 namespace audio
 {
-	// 流文件解析上下文
-	AVFormatContext* format_context = nullptr;
-	// 针对该文件，找到的解码器类型
-	AVCodec* codec = nullptr;
-	// 使用的解码器实例
-	AVCodecContext* codec_context = nullptr;
-	// 解码前的数据（流中的一个packet）
-	AVPacket* packet = nullptr;
-	// 解码后的数据（一帧数据）
-	AVFrame* frame = nullptr;
-	// 音频流编号
-	unsigned audio_stream_index = static_cast<unsigned>(-1); // inf
-	AVIOContext* avio_context = nullptr;
-	unsigned char* buffer = nullptr;
-	std::ifstream* file_stream = nullptr;
-	bool file_stream_end = false;
-
-	int64_t get_stream_rest_len(std::istream& stream)
-	{
-		auto pos = stream.tellg();
-		stream.seekg(0, std::ios::end);
-		size_t rest_len = stream.tellg() - pos;
-		stream.seekg(pos);
-		return rest_len;
-	}
+	// 快速打开时探测读取的数据量与时长的上限（ffmpeg默认为5MB与5秒）
+	constexpr int64_t fast_open_probesize = 32768;
+	constexpr int64_t fast_open_analyze_duration_us = 100000;
 
 	static int read_func(void* opaque, uint8_t* buf, int buf_size) {
-		auto& fin = *(std::ifstream*)opaque;
-		auto rest_len = get_stream_rest_len(fin);
-		std::printf("info: read buf_size=%d, rest=%lld\n", buf_size, rest_len);
-		if (rest_len == 0)
+		auto& decoder = *reinterpret_cast<audio_decoder_context*>(opaque);
+		AUDIO_TRACE_VERBOSE_SCOPE(read, "read");
+		audio_metrics& metrics = get_audio_metrics();
+		int64_t begin = now_ns();
+		int res = decoder.input_source->read(buf, buf_size);
+		metrics.record(metric_histogram::input_read_ns, uint64_t(now_ns() - begin));
+		metrics.add(metric_counter::input_reads);
+		decoder.read_calls++;
+		if (res > 0)
 		{
-			file_stream_end = true; return -1; // read operation failed
+			metrics.add(metric_counter::input_bytes_read, uint64_t(res));
+			decoder.bytes_read += uint64_t(res);
 		}
-		fin.read(reinterpret_cast<char*>(buf), buf_size);
-		return static_cast<int>(fin.gcount());
+		return res;
 	}
 
 	int64_t seek_func(void* opaque, int64_t offset, int whence)
 	{
-		std::printf("info: seek offset=%lld, whence=%d\n", offset, whence);
-		auto& me = *reinterpret_cast<std::istream*>(opaque);
-		auto pos = me.tellg();
-		me.seekg(0, std::ios::beg);
-		auto start_pos = me.tellg();
-		me.seekg(0, std::ios::end);
-		auto end_pos = me.tellg();
-		size_t file_len = end_pos - start_pos;
-		me.seekg(pos);
-		switch (whence)
-		{
-		case AVSEEK_SIZE:
-		{
-			// std::printf("info: AVSEEK_SIZE triggered\n");
-			return file_len;
-		}
-		default:
-			me.seekg(offset, whence);
-			return me.tellg();
+		auto& decoder = *reinterpret_cast<audio_decoder_context*>(opaque);
+		AUDIO_TRACE_VERBOSE_INSTANT(read, "seek", offset);
+		return decoder.input_source->seek(offset, whence);
+	}
+
+	static double elapsed_us(std::chrono::steady_clock::time_point& begin)
+	{
+		auto now = std::chrono::steady_clock::now();
+		double elapsed = std::chrono::duration<double, std::micro>(now - begin).count();
+		begin = now;
+		return elapsed;
+	}
+
+	// 容器头部已给出解码所需的参数：编码、采样率、声道数，以及时长（用于显示进度与定位）
+	static bool has_header_stream_info(const AVFormatContext* format_context)
+	{
+		for (unsigned i = 0; i < format_context->nb_streams; ++i)
+		{
+			const AVStream* stream = format_context->streams[i];
+			const AVCodecParameters* codecpar = stream->codecpar;
+			if (codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+				continue;
+			return codecpar->codec_id != AV_CODEC_ID_NONE && codecpar->sample_rate > 0
+				&& codecpar->ch_layout.nb_channels > 0 && avcodec_find_decoder(codecpar->codec_id)
+				&& (stream->duration != AV_NOPTS_VALUE || format_context->duration != AV_NOPTS_VALUE);
+		}
+		return false;
+	}
+
+	static const char* get_stream_info_source_name(audio_stream_info_source source)
+	{
+		switch (source)
+		{
+		case audio_stream_info_source::header: return "header";
+		case audio_stream_info_source::cached: return "cached";
+		default: return "probed";
+		}
+	}
+
+	// 从帧的开头丢弃samples个样本，只移动数据指针，av_frame_unref按buf释放，不受影响
+	static void trim_frame_front(AVFrame* frame, int samples)
+	{
+		AVSampleFormat format = static_cast<AVSampleFormat>(frame->format);
+		int channels = frame->ch_layout.nb_channels;
+		bool planar = av_sample_fmt_is_planar(format) != 0;
+		size_t offset = size_t(samples) * av_get_bytes_per_sample(format) * (planar ? 1 : channels);
+		for (int i = 0; i < (planar ? channels : 1); ++i)
+		{
+			frame->extended_data[i] += offset;
+			if (frame->extended_data != frame->data && i < AV_NUM_DATA_POINTERS)
+				frame->data[i] += offset;
+		}
+		frame->nb_samples -= samples;
+	}
+
+	static uint32_t read_le32(const uint8_t* data)
+	{
+		return uint32_t(data[0]) | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16) | (uint32_t(data[3]) << 24);
+	}
+
+	// 裁剪编码器延迟与容器标明的尾部样本，返回false表示整帧都被裁掉
+	// AV_FRAME_DATA_SKIP_SAMPLES：le32开头丢弃的样本数（可能跨越多帧），le32结尾丢弃的样本数
+	bool trim_decoded_frame(audio_decoder_context* decoder, AVFrame* frame)
+	{
+		int64_t discard_padding = 0;
+		const AVFrameSideData* side_data = av_frame_get_side_data(frame, AV_FRAME_DATA_SKIP_SAMPLES);
+		if (side_data && side_data->size >= 10)
+		{
+			decoder->skip_remaining += read_le32(side_data->data);
+			discard_padding = read_le32(side_data->data + 4);
+			if (discard_padding > 0)
+				decoder->discard_padding_seen = true;
+		}
+		else if (decoder->first_frame_pending)
+			// 容器没有给出裁剪信息，按AVCodecParameters中的编码器延迟裁剪
+			decoder->skip_remaining = decoder->initial_padding;
+		decoder->first_frame_pending = false;
+
+		int skip = static_cast<int>(std::min<int64_t>(decoder->skip_remaining, frame->nb_samples));
+		if (skip > 0)
+		{
+			trim_frame_front(frame, skip);
+			decoder->skip_remaining -= skip;
 		}
+		frame->nb_samples -= static_cast<int>(std::min<int64_t>(discard_padding, frame->nb_samples));
+		return frame->nb_samples > 0;
 	}
 
-	int load_audio_context(const char* audio_filename)
+	audio_decoder_context* open_audio_decoder(const char* audio_filename, const audio_input_config& config,
+		audio_worker_pool* pool)
 	{
-		// 打开文件流
-		// std::ios::sync_with_stdio(false);
-		file_stream = DBG_NEW std::ifstream(audio_filename, std::ios::binary);
-		auto& fin = *file_stream;
-		if (!fin.good())
+		auto decoder = DBG_NEW audio_decoder_context();
+		decoder->path = audio_filename;
+		audio_open_stats& open_stats = decoder->open_stats;
+		auto open_begin = std::chrono::steady_clock::now();
+		auto phase_begin = open_begin;
+		// 打开输入
+		decoder->input_source = create_input_source(audio_filename, config);
+		if (!decoder->input_source)
 		{
 			std::printf("err: file not exists!\n");
-			delete file_stream;
-			return -1;
+			close_audio_decoder(decoder);
+			return nullptr;
 		}
+		audio_input_source* input_source = decoder->input_source;
 
 		char* buf = DBG_NEW char[1024];
 		memset(buf, 0, sizeof(buf));
 
 		// 取得文件大小
-		format_context = avformat_alloc_context();
-		auto pos = fin.tellg();
-		fin.seekg(0, std::ios::end);
-		size_t file_len = fin.tellg() - pos;
-		fin.seekg(pos);
-		std::printf("info: file loaded, size = %zu\n", file_len);
-
-		constexpr size_t avio_buf_size = 8192;
+		decoder->format_context = avformat_alloc_context();
+		int64_t file_len = input_source->seek(0, AVSEEK_SIZE);
+		std::printf("info: file loaded, size = %lld, input = %s\n", static_cast<long long>(file_len), input_source->get_name());
+		open_stats.input_us = elapsed_us(phase_begin);
 
+		// avio_alloc_context的缓冲区大小为int
+		size_t avio_buf_size = config.avio_buffer_size;
+		if (avio_buf_size < 4096) avio_buf_size = 4096;
+		if (avio_buf_size > (1u << 30)) avio_buf_size = 1u << 30;
 
-		buffer = reinterpret_cast<unsigned char*>(av_malloc(avio_buf_size));
-		avio_context =
-			avio_alloc_context(buffer, avio_buf_size, 0,
-				reinterpret_cast<void*>(static_cast<std::istream*>(&fin)), &read_func, nullptr, &seek_func);
+		unsigned char* buffer = reinterpret_cast<unsigned char*>(av_malloc(avio_buf_size));
+		decoder->avio_context =
+			avio_alloc_context(buffer, static_cast<int>(avio_buf_size), 0,
+				reinterpret_cast<void*>(decoder), &read_func, nullptr,
+				input_source->is_seekable() ? &seek_func : nullptr);
+		if (!input_source->is_seekable())
+			decoder->avio_context->seekable = 0;
 
-		format_context->pb = avio_context;
+		decoder->format_context->pb = decoder->avio_context;
+		if (config.fast_open)
+		{
+			decoder->format_context->probesize = fast_open_probesize;
+			decoder->format_context->max_analyze_duration = fast_open_analyze_duration_us;
+		}
 
 		// 打开音频文件
-		int res = avformat_open_input(&format_context, 
+		int res = avformat_open_input(&decoder->format_context,
 			nullptr, // dummy parameter, read from memory stream
 			nullptr, // let ffmpeg auto detect format
 			nullptr  // no parateter specified
 		);
-		if (!format_context)
+		if (!decoder->format_context)
 		{
 			av_strerror(res, buf, 1024);
 			std::printf("err: avformat_open_input failed, reason = %s(%d)\n", buf, res);
-			release_audio_context();
+			close_audio_decoder(decoder);
 			delete[] buf;
-			return -1;
+			return nullptr;
 		}
+		AVFormatContext* format_context = decoder->format_context;
+		open_stats.open_input_us = elapsed_us(phase_begin);
 
-		res = avformat_find_stream_info(format_context, nullptr);
-		if (res == AVERROR_EOF)
+		// 缓存命中或快速打开且头部已足够时不再探测
+		// 标准输入与调用方提供的输入已读出的数据无法重新读取，头部不足时不能重新打开，只能完整探测
+		bool reopenable = !is_caller_provided_input(config) && input_source->is_seekable();
+		cached_stream_info cached_info;
+		bool use_cache = config.stream_info_cache && reopenable;
+		if (use_cache && lookup_stream_info(config.stream_info_cache, audio_filename, cached_info)
+			&& apply_stream_info(format_context, cached_info))
+			open_stats.stream_info = audio_stream_info_source::cached;
+		else if (config.fast_open && reopenable && has_header_stream_info(format_context))
+			open_stats.stream_info = audio_stream_info_source::header;
+		else
 		{
-			std::printf("err: no stream found in file\n");
-			release_audio_context();
-			delete[] buf;
-			return -1;
+			open_stats.stream_info = audio_stream_info_source::probed;
+			res = avformat_find_stream_info(format_context, nullptr);
+			if (res == AVERROR_EOF)
+			{
+				std::printf("err: no stream found in file\n");
+				close_audio_decoder(decoder);
+				delete[] buf;
+				return nullptr;
+			}
+		}
+		open_stats.stream_info_us = elapsed_us(phase_begin);
+
+		// 探测出码率后，按毫秒数确定预读窗口
+		if (config.read_ahead_ms > 0 && format_context->bit_rate > 0)
+		{
+			size_t window_bytes = size_t(format_context->bit_rate / 8 * config.read_ahead_ms / 1000);
+			if (window_bytes < config.read_ahead_bytes)
+				window_bytes = config.read_ahead_bytes;
+			input_source->set_read_ahead_window(window_bytes);
 		}
 
-		for (audio_stream_index = 0; audio_stream_index < format_context->nb_streams; ++audio_stream_index)
+		unsigned& audio_stream_index = decoder->audio_stream_index;
+		unsigned first_stream_index = open_stats.stream_info == audio_stream_info_source::cached ? cached_info.stream_index : 0;
+		for (audio_stream_index = first_stream_index; audio_stream_index < format_context->nb_streams; ++audio_stream_index)
 		{
 			// 枚举当前文件中所有流
 			AVStream* current_stream = format_context->streams[audio_stream_index];
@@ -145,8 +243,8 @@ namespace audio
 				}
 
 				// 侦测解码器
-				codec = const_cast<AVCodec*>(avcodec_find_decoder(current_stream->codecpar->codec_id));
-				if (!codec)
+				decoder->codec = const_cast<AVCodec*>(avcodec_find_decoder(current_stream->codecpar->codec_id));
+				if (!decoder->codec)
 				{
 					std::printf("warn: no valid decoder found, skipped stream id %d\n", audio_stream_index);
 					continue;
@@ -164,72 +262,126 @@ namespace audio
 		}
 
 		if (audio_stream_index == format_context->nb_streams
-			|| !codec)
+			|| !decoder->codec)
 		{
 			// 未选中任何解码器
 			std::printf("err: no codec selected, aborting...\n");
-			release_audio_context();
+			close_audio_decoder(decoder);
 			delete[] buf;
-			return -1;
+			return nullptr;
 		}
 
 		// 从0ms开始读取
 		avformat_seek_file(format_context, -1, INT64_MIN, 0, INT64_MAX, 0);
 		// codec is not null
 		// 建立解码器上下文
-		codec_context = avcodec_alloc_context3(codec);
-		if (codec_context == nullptr)
+		decoder->codec_context = avcodec_alloc_context3(decoder->codec);
+		if (decoder->codec_context == nullptr)
 		{
 			std::printf("err: avcodec_alloc_context3 failed\n");
-			release_audio_context();
+			close_audio_decoder(decoder);
 			delete[] buf;
-			return -1;
+			return nullptr;
 		}
-		avcodec_parameters_to_context(codec_context, format_context->streams[audio_stream_index]->codecpar);
+		const AVCodecParameters* codecpar = format_context->streams[audio_stream_index]->codecpar;
+		avcodec_parameters_to_context(decoder->codec_context, codecpar);
+		// 由decode阶段统一裁剪编码器延迟与填充，避免与容器中的信息重复裁剪
+		decoder->codec_context->flags2 |= AV_CODEC_FLAG2_SKIP_MANUAL;
+		decoder->initial_padding = codecpar->initial_padding > 0 ? codecpar->initial_padding : 0;
+		decoder->trailing_padding = codecpar->trailing_padding > 0 ? codecpar->trailing_padding : 0;
+
+		// 帧多线程与切片多线程均允许，由解码器按其能力选择
+		decoder->codec_context->thread_count = config.decoder_threads >= 0 ? config.decoder_threads : 1;
+		decoder->codec_context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
 
 		// 解码文件
-		res = avcodec_open2(codec_context, nullptr, nullptr);
+		res = avcodec_open2(decoder->codec_context, nullptr, nullptr);
 		if (res)
 		{
 			av_strerror(res, buf, 1024);
 			std::printf("err: avcodec_open2 failed, reason = %s\n", buf);
-			release_audio_context();
+			close_audio_decoder(decoder);
 			delete[] buf;
-			return -1;
+			return nullptr;
 		}
+		if (decoder->codec_context->sample_fmt == AV_SAMPLE_FMT_NONE
+			&& open_stats.stream_info == audio_stream_info_source::header)
+		{
+			// 解码器要到解码第一帧时才确定样本格式，头部的信息不足以确定输出格式，改为完整探测
+			std::printf("warn: sample format unknown before decoding, probing stream info\n");
+			close_audio_decoder(decoder);
+			delete[] buf;
+			audio_input_config probe_config = config;
+			probe_config.fast_open = false;
+			return open_audio_decoder(audio_filename, probe_config, pool);
+		}
+		open_stats.codec_open_us = elapsed_us(phase_begin);
 
 		// avoid ffmpeg warning
-		codec_context->pkt_timebase = format_context->streams[audio_stream_index]->time_base;
+		decoder->codec_context->pkt_timebase = format_context->streams[audio_stream_index]->time_base;
+		if (decoder->initial_padding || decoder->trailing_padding)
+			std::printf("info: encoder delay=%d, padding=%d samples\n", decoder->initial_padding, decoder->trailing_padding);
+		if (config.decoder_threads != 1)
+		{
+			int thread_type = decoder->codec_context->active_thread_type;
+			std::printf("info: decoder threads=%d, threading=%s\n", decoder->codec_context->thread_count,
+				thread_type & FF_THREAD_FRAME ? "frame" : (thread_type & FF_THREAD_SLICE ? "slice" : "none (not supported by codec)"));
+		}
+		open_seek_index(decoder, config, pool ? *pool : *get_default_audio_worker_pool());
+		open_stats.seek_index_us = elapsed_us(phase_begin);
+		open_peak_builder(decoder, config);
+
+		if (use_cache && open_stats.stream_info != audio_stream_info_source::cached
+			&& capture_stream_info(format_context, audio_stream_index, cached_info))
+			store_stream_info(config.stream_info_cache, audio_filename, cached_info);
+		open_stats.total_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - open_begin).count();
+		open_stats.read_calls = decoder->read_calls;
+		open_stats.bytes_read = decoder->bytes_read;
+		std::printf("info: open %.2fms: input %.2fms, open_input %.2fms, stream_info %.2fms (%s), codec %.2fms, "
+			"seek_index %.2fms; %llu reads, %llu bytes\n",
+			open_stats.total_us / 1000, open_stats.input_us / 1000, open_stats.open_input_us / 1000,
+			open_stats.stream_info_us / 1000, get_stream_info_source_name(open_stats.stream_info),
+			open_stats.codec_open_us / 1000, open_stats.seek_index_us / 1000,
+			static_cast<unsigned long long>(open_stats.read_calls), static_cast<unsigned long long>(open_stats.bytes_read));
 
 		delete[] buf;
-		return 0;
+		return decoder;
 	}
 
-	void release_audio_context()
+	void close_audio_decoder(audio_decoder_context* decoder)
 	{
-		if (avio_context)
+		if (!decoder)
+			return;
+		// 后台扫描使用自己的解析上下文，但sidecar的保存需要在关闭输入之前
+		close_seek_index(decoder);
+		close_peak_builder(decoder);
+		free_sample_converter(decoder->converter);
+		decoder->converter = nullptr;
+		if (decoder->avio_context)
 		{
-			// 释放缓冲区上下文
-			avio_context_free(&avio_context);
-			avio_context = nullptr;
+			// 释放缓冲区上下文，缓冲区可能已被ffmpeg替换，需从上下文中取得
+			av_freep(&decoder->avio_context->buffer);
+			avio_context_free(&decoder->avio_context);
+			decoder->avio_context = nullptr;
 		}
-		if (format_context)
+		if (decoder->format_context)
 		{
 			// 释放文件解析上下文
-			avformat_close_input(&format_context);
-			format_context = nullptr;
+			avformat_close_input(&decoder->format_context);
+			decoder->format_context = nullptr;
 		}
 
-		if (codec_context)
+		if (decoder->codec_context)
 		{
 			// 释放解码器上下文
-			avcodec_free_context(&codec_context);
-			codec_context = nullptr;
+			avcodec_free_context(&decoder->codec_context);
+			decoder->codec_context = nullptr;
 		}
-		if (file_stream)
+		if (decoder->input_source)
 		{
-			delete file_stream;
-			file_stream = nullptr;
+			delete decoder->input_source;
+			decoder->input_source = nullptr;
 		}
+		delete decoder;
 	}
-}
\ No newline at end of file
+}
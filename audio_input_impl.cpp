@@ -0,0 +1,427 @@
+﻿#include "audio_input_source.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <utility>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+namespace audio
+{
+	// 计算seek的目标位置，越界时返回-1
+	static int64_t resolve_seek_target(int64_t offset, int whence, int64_t position, int64_t length)
+	{
+		int64_t target;
+		switch (whence)
+		{
+		case SEEK_SET: target = offset; break;
+		case SEEK_CUR: target = position + offset; break;
+		case SEEK_END: target = length + offset; break;
+		default: return -1;
+		}
+		if (target < 0 || target > length)
+			return -1;
+		return target;
+	}
+
+	// 读取已在内存中的数据：read只是一次memcpy，AVSEEK_SIZE为O(1)，不产生任何系统调用
+	class memory_input_source : public audio_input_source
+	{
+	public:
+		memory_input_source() = default;
+		memory_input_source(const uint8_t* data, size_t size) : data(data), length(int64_t(size)) {}
+
+		int read(uint8_t* buf, int buf_size) override
+		{
+			int64_t rest_len = length - position;
+			if (rest_len <= 0)
+				return AVERROR_EOF;
+			int read_len = rest_len < buf_size ? static_cast<int>(rest_len) : buf_size;
+			std::memcpy(buf, data + position, read_len);
+			position += read_len;
+			return read_len;
+		}
+
+		int64_t seek(int64_t offset, int whence) override
+		{
+			if (whence & AVSEEK_SIZE)
+				return length;
+			int64_t target = resolve_seek_target(offset, whence & ~AVSEEK_FORCE, position, length);
+			if (target < 0)
+				return -1;
+			position = target;
+			return position;
+		}
+
+		bool is_seekable() const override { return true; }
+
+		const uint8_t* get_data() const override { return data; }
+
+		const char* get_name() const override { return "memory"; }
+
+	protected:
+		const uint8_t* data = nullptr;
+		int64_t length = 0;
+		int64_t position = 0;
+	};
+
+	// 系统的页大小，madvise/PrefetchVirtualMemory的起始地址按此对齐
+	static int64_t query_page_size()
+	{
+#if defined(_WIN32)
+		SYSTEM_INFO system_info;
+		GetSystemInfo(&system_info);
+		return int64_t(system_info.dwPageSize);
+#else
+		long size = sysconf(_SC_PAGESIZE);
+		return size > 0 ? int64_t(size) : 4096;
+#endif
+	}
+
+	// 通过内存映射读取整个文件
+	class mmap_input_source : public memory_input_source
+	{
+	public:
+		mmap_input_source() : page_size(query_page_size()) {}
+		~mmap_input_source() override { close(); }
+
+		int open(const char* path)
+		{
+#if defined(_WIN32)
+			file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+				OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if (file_handle == INVALID_HANDLE_VALUE)
+				return -1;
+			LARGE_INTEGER file_size;
+			if (GetFileType(file_handle) != FILE_TYPE_DISK || !GetFileSizeEx(file_handle, &file_size)
+				|| file_size.QuadPart <= 0 || uint64_t(file_size.QuadPart) > SIZE_MAX)
+			{
+				close();
+				return -1;
+			}
+			length = file_size.QuadPart;
+			mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (!mapping_handle)
+			{
+				close();
+				return -1;
+			}
+			data = reinterpret_cast<const uint8_t*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+			if (!data)
+			{
+				close();
+				return -1;
+			}
+#else
+			int fd = ::open(path, O_RDONLY);
+			if (fd < 0)
+				return -1;
+			struct stat file_stat;
+			if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) || file_stat.st_size <= 0
+				|| uint64_t(file_stat.st_size) > SIZE_MAX)
+			{
+				::close(fd);
+				return -1;
+			}
+			length = file_stat.st_size;
+			void* mapping = mmap(nullptr, size_t(length), PROT_READ, MAP_PRIVATE, fd, 0);
+			// 映射建立后即可关闭文件描述符
+			::close(fd);
+			if (mapping == MAP_FAILED)
+			{
+				length = 0;
+				return -1;
+			}
+			data = reinterpret_cast<const uint8_t*>(mapping);
+			madvise(mapping, size_t(length), MADV_SEQUENTIAL);
+#endif
+			return 0;
+		}
+
+		void close()
+		{
+#if defined(_WIN32)
+			if (data)
+				UnmapViewOfFile(data);
+			if (mapping_handle)
+				CloseHandle(mapping_handle);
+			if (file_handle != INVALID_HANDLE_VALUE)
+				CloseHandle(file_handle);
+			mapping_handle = nullptr;
+			file_handle = INVALID_HANDLE_VALUE;
+#else
+			if (data)
+				munmap(const_cast<uint8_t*>(data), size_t(length));
+#endif
+			data = nullptr;
+			length = 0;
+			position = 0;
+		}
+
+		void prefetch_hint(int64_t offset, int64_t hint_length) override
+		{
+			if (offset < 0 || offset >= length)
+				return;
+			if (hint_length > length - offset)
+				hint_length = length - offset;
+			// 按页对齐后提示内核提前读入，之后的memcpy不再因缺页而阻塞
+			int64_t aligned_offset = offset & ~(page_size - 1);
+			size_t aligned_length = size_t(hint_length + (offset - aligned_offset));
+#if defined(_WIN32)
+			WIN32_MEMORY_RANGE_ENTRY range;
+			range.VirtualAddress = const_cast<uint8_t*>(data) + aligned_offset;
+			range.NumberOfBytes = aligned_length;
+			PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+			madvise(const_cast<uint8_t*>(data) + aligned_offset, aligned_length, MADV_WILLNEED);
+#endif
+		}
+
+		const char* get_name() const override { return "mmap"; }
+
+	private:
+		// 2的幂
+		int64_t page_size;
+#if defined(_WIN32)
+		HANDLE file_handle = INVALID_HANDLE_VALUE;
+		HANDLE mapping_handle = nullptr;
+#endif
+	};
+
+	// 基于std::ifstream的输入，用于无法映射的文件（管道、设备文件等）
+	// 文件长度只在打开时获取一次；长度未知时不支持AVSEEK_SIZE
+	class file_stream_input_source : public audio_input_source
+	{
+	public:
+#if !defined(_WIN32)
+		~file_stream_input_source() override
+		{
+			if (hint_fd >= 0)
+				::close(hint_fd);
+		}
+#endif
+
+		int open(const char* path)
+		{
+			stream.open(path, std::ios::binary);
+			if (!stream.good())
+				return -1;
+#if !defined(_WIN32)
+			// std::ifstream不提供文件描述符；page cache按文件共享，另开一个描述符用于posix_fadvise
+			hint_fd = ::open(path, O_RDONLY);
+#endif
+#if defined(_WIN32)
+			struct _stat64 file_stat;
+			if (_stat64(path, &file_stat) == 0 && (file_stat.st_mode & _S_IFMT) == _S_IFREG)
+				length = file_stat.st_size;
+#else
+			struct stat file_stat;
+			if (stat(path, &file_stat) == 0 && S_ISREG(file_stat.st_mode))
+				length = file_stat.st_size;
+#endif
+			return 0;
+		}
+
+		int read(uint8_t* buf, int buf_size) override
+		{
+			stream.read(reinterpret_cast<char*>(buf), buf_size);
+			int read_len = static_cast<int>(stream.gcount());
+			if (read_len == 0)
+				return AVERROR_EOF;
+			position += read_len;
+			return read_len;
+		}
+
+		int64_t seek(int64_t offset, int whence) override
+		{
+			if (whence & AVSEEK_SIZE)
+				return length;
+			if (length < 0)
+				return -1;
+			int64_t target = resolve_seek_target(offset, whence & ~AVSEEK_FORCE, position, length);
+			if (target < 0)
+				return -1;
+			// 之前的读取可能已设置eof标志
+			stream.clear();
+			stream.seekg(target, std::ios::beg);
+			if (!stream.good())
+				return -1;
+			position = target;
+			return position;
+		}
+
+		bool is_seekable() const override { return length >= 0; }
+
+		void prefetch_hint(int64_t offset, int64_t hint_length) override
+		{
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+			if (hint_fd >= 0 && length >= 0)
+				posix_fadvise(hint_fd, offset, hint_length, POSIX_FADV_WILLNEED);
+#else
+			(void)offset; (void)hint_length;
+#endif
+		}
+
+		const char* get_name() const override { return "file stream"; }
+
+	private:
+		std::ifstream stream;
+#if !defined(_WIN32)
+		int hint_fd = -1;
+#endif
+		int64_t length = -1;
+		int64_t position = 0;
+	};
+
+	// 标准输入：直接读取文件描述符，管道中有数据即返回，不等待填满缓冲区
+	class stdin_input_source : public audio_input_source
+	{
+	public:
+		stdin_input_source()
+		{
+#if defined(_WIN32)
+			// 文本模式会转换换行符
+			_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		}
+
+		int read(uint8_t* buf, int buf_size) override
+		{
+#if defined(_WIN32)
+			int read_len = _read(_fileno(stdin), buf, unsigned(buf_size));
+#else
+			ssize_t read_len;
+			do
+				read_len = ::read(STDIN_FILENO, buf, size_t(buf_size));
+			while (read_len < 0 && errno == EINTR);
+#endif
+			if (read_len == 0)
+				return AVERROR_EOF;
+			if (read_len < 0)
+				return AVERROR(EIO);
+			return static_cast<int>(read_len);
+		}
+
+		int64_t seek(int64_t, int) override { return -1; }
+		bool is_seekable() const override { return false; }
+		const char* get_name() const override { return "stdin"; }
+	};
+
+	// 调用者的拉取回调，不可定位
+	class callback_input_source : public audio_input_source
+	{
+	public:
+		explicit callback_input_source(audio_read_callback callback) : callback(std::move(callback)) {}
+
+		int read(uint8_t* buf, int buf_size) override
+		{
+			int read_len = callback(buf, buf_size);
+			if (read_len == 0)
+				return AVERROR_EOF;
+			if (read_len < 0)
+				return AVERROR(EIO);
+			return read_len < buf_size ? read_len : buf_size;
+		}
+
+		int64_t seek(int64_t, int) override { return -1; }
+		bool is_seekable() const override { return false; }
+		const char* get_name() const override { return "callback"; }
+
+	private:
+		audio_read_callback callback;
+	};
+
+	audio_input_source* create_mmap_input_source(const char* path)
+	{
+		auto source = DBG_NEW mmap_input_source();
+		if (source->open(path))
+		{
+			delete source;
+			return nullptr;
+		}
+		return source;
+	}
+
+	audio_input_source* create_file_stream_input_source(const char* path)
+	{
+		auto source = DBG_NEW file_stream_input_source();
+		if (source->open(path))
+		{
+			delete source;
+			return nullptr;
+		}
+		return source;
+	}
+
+	audio_input_source* create_stdin_input_source()
+	{
+		return DBG_NEW stdin_input_source();
+	}
+
+	audio_input_source* create_memory_input_source(const uint8_t* data, size_t size)
+	{
+		if (!data || !size)
+			return nullptr;
+		return DBG_NEW memory_input_source(data, size);
+	}
+
+	audio_input_source* create_callback_input_source(audio_read_callback callback)
+	{
+		if (!callback)
+			return nullptr;
+		return DBG_NEW callback_input_source(std::move(callback));
+	}
+
+	audio_input_source* create_input_source(const char* path, const audio_input_config& config)
+	{
+		audio_input_source* source = nullptr;
+		if (config.memory_data)
+			source = create_memory_input_source(config.memory_data, config.memory_size);
+		else if (config.read_callback)
+			source = create_callback_input_source(config.read_callback);
+		else if (std::strcmp(path, "-") == 0)
+			source = create_stdin_input_source();
+		else
+		{
+			switch (config.mode)
+			{
+			case audio_input_mode::automatic:
+				// 普通文件使用mmap，映射失败（非普通文件、空文件、地址空间不足）时退回文件流
+				source = create_mmap_input_source(path);
+				if (!source)
+					source = create_file_stream_input_source(path);
+				break;
+			case audio_input_mode::mmap:
+				source = create_mmap_input_source(path);
+				break;
+			case audio_input_mode::file_stream:
+				source = create_file_stream_input_source(path);
+				break;
+			}
+		}
+		if (!source)
+			return nullptr;
+
+		if (config.throttle_bytes_per_second > 0)
+			source = create_throttled_input_source(source, config.throttle_bytes_per_second);
+		if (config.read_ahead_bytes > 0 || config.read_ahead_ms > 0)
+		{
+			// 按毫秒计算的窗口要等探测出码率后才能确定，在此之前使用默认窗口
+			constexpr size_t default_read_ahead_bytes = 1 << 20;
+			source = create_read_ahead_input_source(source,
+				config.read_ahead_bytes > 0 ? config.read_ahead_bytes : default_read_ahead_bytes);
+		}
+		return source;
+	}
+}
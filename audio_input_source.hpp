@@ -0,0 +1,49 @@
+﻿#if !defined(AUDIO_INPUT_SOURCE_HPP_)
+#define AUDIO_INPUT_SOURCE_HPP_
+#include "audio_play_interface.hpp"
+
+namespace audio
+{
+	// 输入端抽象接口，语义与AVIOContext的read_packet/seek回调一致
+	class audio_input_source
+	{
+	public:
+		virtual ~audio_input_source() = default;
+
+		// 读取至多buf_size字节，返回读取的字节数，已到达结尾时返回AVERROR_EOF
+		virtual int read(uint8_t* buf, int buf_size) = 0;
+		// whence为SEEK_SET/SEEK_CUR/SEEK_END或AVSEEK_SIZE，返回新的位置或总长度，失败时返回负数
+		virtual int64_t seek(int64_t offset, int whence) = 0;
+		virtual bool is_seekable() const = 0;
+
+		// 提示即将读取[offset, offset + length)，由实现决定是否预读（madvise/posix_fadvise WILLNEED）
+		virtual void prefetch_hint(int64_t offset, int64_t length) { (void)offset; (void)length; }
+		// 调整预读窗口的大小，仅对预读输入有效
+		virtual void set_read_ahead_window(size_t window_bytes) { (void)window_bytes; }
+		// 整个输入都在内存中时（内存、mmap）返回起始地址，长度由seek(0, AVSEEK_SIZE)取得；其余返回nullptr
+		virtual const uint8_t* get_data() const { return nullptr; }
+
+		virtual const char* get_name() const = 0;
+	};
+
+	// 打开失败时返回nullptr
+	audio_input_source* create_input_source(const char* path, const audio_input_config& config);
+	audio_input_source* create_mmap_input_source(const char* path);
+	audio_input_source* create_file_stream_input_source(const char* path);
+	// 标准输入（管道），不可定位
+	audio_input_source* create_stdin_input_source();
+	// 调用者的内存，不复制、不接管所有权
+	audio_input_source* create_memory_input_source(const uint8_t* data, size_t size);
+	audio_input_source* create_callback_input_source(audio_read_callback callback);
+	// 输入由调用者提供（内存或回调），不对应文件系统中的文件
+	inline bool is_caller_provided_input(const audio_input_config& config)
+	{
+		return config.memory_data || config.read_callback;
+	}
+	// 在独立的i/o线程中提前读取window_bytes字节，接管inner的所有权
+	audio_input_source* create_read_ahead_input_source(audio_input_source* inner, size_t window_bytes);
+	// 将inner的读取速度限制为bytes_per_second，用于模拟慢速磁盘/网络文件系统，接管inner的所有权
+	audio_input_source* create_throttled_input_source(audio_input_source* inner, size_t bytes_per_second);
+}
+
+#endif // AUDIO_INPUT_SOURCE_HPP_
@@ -0,0 +1,825 @@
+﻿#include "audio_loudness.hpp"
+#include "ffmpeg_xaudio2_internal.hpp"
+#include "audio_mixer.hpp"
+#include "audio_trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace audio
+{
+	// BS.1770-4 Annex 2的4倍过采样FIR，按[tap][phase]排列
+	alignas(16) const float true_peak_coefficients[true_peak_taps][4] = {
+		{ 0.0017089843750f, -0.0291748046875f, -0.0189208984375f, -0.0083007812500f },
+		{ 0.0109863281250f, 0.0292968750000f, 0.0330810546875f, 0.0148925781250f },
+		{ -0.0196533203125f, -0.0517578125000f, -0.0582275390625f, -0.0266113281250f },
+		{ 0.0332031250000f, 0.0891113281250f, 0.1015625000000f, 0.0476074218750f },
+		{ -0.0594482421875f, -0.1665039062500f, -0.2003173828125f, -0.1022949218750f },
+		{ 0.1373291015625f, 0.4650878906250f, 0.7797851562500f, 0.9721679687500f },
+		{ 0.9721679687500f, 0.7797851562500f, 0.4650878906250f, 0.1373291015625f },
+		{ -0.1022949218750f, -0.2003173828125f, -0.1665039062500f, -0.0594482421875f },
+		{ 0.0476074218750f, 0.1015625000000f, 0.0891113281250f, 0.0332031250000f },
+		{ -0.0266113281250f, -0.0582275390625f, -0.0517578125000f, -0.0196533203125f },
+		{ 0.0148925781250f, 0.0330810546875f, 0.0292968750000f, 0.0109863281250f },
+		{ -0.0083007812500f, -0.0189208984375f, -0.0291748046875f, 0.0017089843750f }
+	};
+
+	// ---- 标量内核 ----
+
+	static void k_weight_scalar(const float* src, int frames, int channels, const k_weight_coefficients& coefficients,
+		k_weight_state& state, double* sums)
+	{
+		for (int ch = 0; ch < channels; ++ch)
+			k_weight_channel(src, frames, channels, ch, coefficients, state, sums);
+	}
+
+	static float true_peak_scalar(const float* src, int frames, int channels)
+	{
+		float peak = 0.0f;
+		for (int ch = 0; ch < channels; ++ch)
+		{
+			for (int i = 0; i < frames; ++i)
+			{
+				const float* x = src + i * channels + ch;
+				for (int phase = 0; phase < 4; ++phase)
+				{
+					float sum = 0.0f;
+					for (int tap = 0; tap < true_peak_taps; ++tap)
+						sum = sum + x[-tap * channels] * true_peak_coefficients[tap][phase];
+					peak = std::max(peak, std::fabs(sum));
+				}
+			}
+		}
+		return peak;
+	}
+
+	const loudness_kernels& get_scalar_loudness_kernels()
+	{
+		static const loudness_kernels kernels = {
+			"scalar",
+			k_weight_scalar,
+			true_peak_scalar
+		};
+		return kernels;
+	}
+
+	int get_available_loudness_kernels(const loudness_kernels** kernels, int max_count)
+	{
+		int count = 0;
+		auto add = [&](const loudness_kernels* candidate) {
+			if (candidate && count < max_count)
+				kernels[count++] = candidate;
+		};
+		add(&get_scalar_loudness_kernels());
+#if defined(SAMPLE_CONVERT_X86)
+		if (cpu_has_sse2())
+			add(get_sse2_loudness_kernels());
+		if (cpu_has_avx2())
+			add(get_avx2_loudness_kernels());
+#endif
+#if defined(SAMPLE_CONVERT_NEON)
+		add(get_neon_loudness_kernels());
+#endif
+		return count;
+	}
+
+	const loudness_kernels& get_loudness_kernels()
+	{
+		static const loudness_kernels* best = [] {
+			const loudness_kernels* kernels[4];
+			int count = get_available_loudness_kernels(kernels, 4);
+			return kernels[count - 1];
+		}();
+		return *best;
+	}
+
+	// 模拟原型的参数取自BS.1770在48kHz下给出的系数，其他采样率经双线性变换得到
+	void compute_k_weight_coefficients(int sample_rate, k_weight_coefficients& coefficients)
+	{
+		constexpr double pi = 3.14159265358979323846;
+		// 第一级：高架滤波，模拟头部的声学效应
+		double f0 = 1681.974450955533;
+		double gain_db = 3.999843853973347;
+		double q = 0.7071752369554196;
+		double k = std::tan(pi * f0 / sample_rate);
+		double vh = std::pow(10.0, gain_db / 20.0);
+		double vb = std::pow(vh, 0.4996667741545416);
+		double a0 = 1.0 + k / q + k * k;
+		coefficients.b[0][0] = (vh + vb * k / q + k * k) / a0;
+		coefficients.b[0][1] = 2.0 * (k * k - vh) / a0;
+		coefficients.b[0][2] = (vh - vb * k / q + k * k) / a0;
+		coefficients.a[0][0] = 2.0 * (k * k - 1.0) / a0;
+		coefficients.a[0][1] = (1.0 - k / q + k * k) / a0;
+		// 第二级：RLB高通
+		f0 = 38.13547087602444;
+		q = 0.5003270373238773;
+		k = std::tan(pi * f0 / sample_rate);
+		a0 = 1.0 + k / q + k * k;
+		coefficients.b[1][0] = 1.0;
+		coefficients.b[1][1] = -2.0;
+		coefficients.b[1][2] = 1.0;
+		coefficients.a[1][0] = 2.0 * (k * k - 1.0) / a0;
+		coefficients.a[1][1] = (1.0 - k / q + k * k) / a0;
+	}
+
+	// ---- 测量 ----
+
+	constexpr double absolute_gate_lufs = -70.0;
+	constexpr double integrated_relative_gate_lu = -10.0;
+	constexpr double range_relative_gate_lu = -20.0;
+	// 400ms块与3秒短时块包含的100ms子块数，块每次移动一个子块
+	constexpr int momentary_sub_blocks = 4;
+	constexpr int short_term_sub_blocks = 30;
+	// 96kHz及以上的采样率下样本峰值与true peak的差异可以忽略
+	constexpr int true_peak_max_sample_rate = 96000;
+
+	static double energy_to_lufs(double energy)
+	{
+		return -0.691 + 10.0 * std::log10(energy);
+	}
+
+	static double lufs_to_energy(double lufs)
+	{
+		return std::pow(10.0, (lufs + 0.691) / 10.0);
+	}
+
+	// BS.1770-4：左、右、中置为1.0，环绕声道为1.41，LFE不计入
+	static double get_channel_weight(AVChannel channel)
+	{
+		switch (channel)
+		{
+		case AV_CHAN_LOW_FREQUENCY:
+		case AV_CHAN_LOW_FREQUENCY_2:
+			return 0.0;
+		case AV_CHAN_SIDE_LEFT:
+		case AV_CHAN_SIDE_RIGHT:
+		case AV_CHAN_BACK_LEFT:
+		case AV_CHAN_BACK_RIGHT:
+			return 1.41;
+		default:
+			return 1.0;
+		}
+	}
+
+	int loudness_meter::initialize(int rate, const AVChannelLayout& layout, const loudness_kernels* selected)
+	{
+		if (rate <= 0 || layout.nb_channels < 1 || layout.nb_channels > loudness_max_channels)
+			return -1;
+		kernels = selected ? selected : &get_loudness_kernels();
+		sample_rate = rate;
+		channels = layout.nb_channels;
+		oversample = rate < true_peak_max_sample_rate;
+		compute_k_weight_coefficients(rate, coefficients);
+		state = k_weight_state();
+		for (int ch = 0; ch < channels; ++ch)
+		{
+			weights[ch] = get_channel_weight(av_channel_layout_channel_from_index(&layout, unsigned(ch)));
+			sums[ch] = 0;
+		}
+		sub_block_frames = std::max((rate + 5) / 10, 1);
+		sub_block_filled = 0;
+		sub_blocks.clear();
+		true_peak = 0.0f;
+		total_frames = 0;
+		return 0;
+	}
+
+	void loudness_meter::process(const float* src, int frames)
+	{
+		if (frames <= 0)
+			return;
+		float peak = oversample ? kernels->true_peak(src, frames, channels)
+			: get_mix_kernels().peak_f32(src, frames * channels);
+		true_peak = std::max(true_peak, peak);
+		total_frames += uint64_t(frames);
+		while (frames > 0)
+		{
+			int count = std::min(frames, sub_block_frames - sub_block_filled);
+			kernels->k_weight(src, count, channels, coefficients, state, sums);
+			src += size_t(count) * channels;
+			frames -= count;
+			sub_block_filled += count;
+			if (sub_block_filled < sub_block_frames)
+				break;
+			double energy = 0;
+			for (int ch = 0; ch < channels; ++ch)
+			{
+				energy += weights[ch] * sums[ch];
+				sums[ch] = 0;
+			}
+			sub_blocks.push_back(energy / sub_block_frames);
+			sub_block_filled = 0;
+		}
+		// 静音时滤波器状态逐渐衰减为非规格化数，之后的运算会慢得多
+		for (auto& row : state.z)
+		{
+			for (double& z : row)
+			{
+				if (std::fabs(z) < 1e-30)
+					z = 0;
+			}
+		}
+	}
+
+	// 长为window个子块的各个块中超过绝对门限的块能量追加到blocks
+	static void collect_gated_blocks(const std::vector<double>& sub_blocks, int window, std::vector<double>& blocks)
+	{
+		double threshold = lufs_to_energy(absolute_gate_lufs);
+		for (size_t end = size_t(window); end <= sub_blocks.size(); ++end)
+		{
+			double sum = 0;
+			for (size_t i = end - size_t(window); i < end; ++i)
+				sum += sub_blocks[i];
+			double energy = sum / window;
+			if (energy > threshold)
+				blocks.push_back(energy);
+		}
+	}
+
+	static double mean_energy(const std::vector<double>& blocks, double threshold, size_t& count)
+	{
+		double sum = 0;
+		count = 0;
+		for (double energy : blocks)
+		{
+			if (energy >= threshold)
+			{
+				sum += energy;
+				count++;
+			}
+		}
+		return count ? sum / double(count) : 0.0;
+	}
+
+	void compute_loudness(const std::vector<const std::vector<double>*>& tracks, loudness_result& result)
+	{
+		std::vector<double> blocks;
+		std::vector<double> short_term_blocks;
+		for (const auto* sub_blocks : tracks)
+		{
+			collect_gated_blocks(*sub_blocks, momentary_sub_blocks, blocks);
+			collect_gated_blocks(*sub_blocks, short_term_sub_blocks, short_term_blocks);
+		}
+
+		// 相对门限为超过绝对门限的块的平均响度减去10 LU
+		result.integrated_lufs = -HUGE_VAL;
+		size_t count;
+		double mean = mean_energy(blocks, 0.0, count);
+		if (count)
+		{
+			double gated = mean_energy(blocks, mean * std::pow(10.0, integrated_relative_gate_lu / 10.0), count);
+			if (count)
+				result.integrated_lufs = energy_to_lufs(gated);
+		}
+
+		// loudness range：相对门限为-20 LU，取余下短时响度分布的10%与95%分位数之差
+		result.range_lu = 0;
+		mean = mean_energy(short_term_blocks, 0.0, count);
+		if (!count)
+			return;
+		double threshold = mean * std::pow(10.0, range_relative_gate_lu / 10.0);
+		std::vector<double> loudness;
+		for (double energy : short_term_blocks)
+		{
+			if (energy >= threshold)
+				loudness.push_back(energy_to_lufs(energy));
+		}
+		if (loudness.size() < 2)
+			return;
+		std::sort(loudness.begin(), loudness.end());
+		auto percentile = [&](double p) {
+			return loudness[size_t(double(loudness.size() - 1) * p + 0.5)];
+		};
+		result.range_lu = percentile(0.95) - percentile(0.10);
+	}
+
+	// ---- sidecar ----
+
+	constexpr char loudness_sidecar_magic[4] = { 'F', 'X', 'L', 'N' };
+	constexpr uint32_t loudness_sidecar_version = 1;
+
+	struct loudness_info
+	{
+		loudness_result track;
+		loudness_result album;
+		bool has_album = false;
+	};
+
+	static std::string get_loudness_sidecar_path(const std::string& media_path)
+	{
+		return media_path + ".loudness";
+	}
+
+	// write_field按整数写入，double按位存储
+	static void write_double(std::string& out, double value)
+	{
+		uint64_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		write_field(out, bits);
+	}
+
+	static bool read_double(const uint8_t*& data, const uint8_t* end, double& value)
+	{
+		uint64_t bits;
+		if (!read_field(data, end, bits))
+			return false;
+		std::memcpy(&value, &bits, sizeof(value));
+		return true;
+	}
+
+	static void write_loudness_result(std::string& out, const loudness_result& result)
+	{
+		write_double(out, result.integrated_lufs);
+		write_double(out, result.range_lu);
+		write_double(out, result.true_peak);
+		write_double(out, result.duration_seconds);
+	}
+
+	static bool read_loudness_result(const uint8_t*& data, const uint8_t* end, loudness_result& result)
+	{
+		return read_double(data, end, result.integrated_lufs) && read_double(data, end, result.range_lu)
+			&& read_double(data, end, result.true_peak) && read_double(data, end, result.duration_seconds);
+	}
+
+	// 文件大小或修改时间与媒体文件不一致时视为失效，返回-1
+	static int load_loudness_sidecar(const std::string& media_path, uint64_t file_size, int64_t file_mtime,
+		loudness_info& info)
+	{
+		std::ifstream file(get_loudness_sidecar_path(media_path), std::ios::binary);
+		if (!file)
+			return -1;
+		std::vector<uint8_t> content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		const uint8_t* data = content.data();
+		const uint8_t* end = data + content.size();
+		uint32_t version = 0, flags = 0;
+		uint64_t measured_size = 0;
+		int64_t measured_mtime = 0;
+		if (content.size() < sizeof(loudness_sidecar_magic)
+			|| std::memcmp(data, loudness_sidecar_magic, sizeof(loudness_sidecar_magic)))
+			return -1;
+		data += sizeof(loudness_sidecar_magic);
+		if (!read_field(data, end, version) || version != loudness_sidecar_version
+			|| !read_field(data, end, measured_size) || !read_field(data, end, measured_mtime)
+			|| !read_field(data, end, flags) || !read_loudness_result(data, end, info.track)
+			|| !read_loudness_result(data, end, info.album))
+			return -1;
+		if (measured_size != file_size || measured_mtime != file_mtime)
+			return -1;
+		info.has_album = (flags & 1) != 0;
+		return 0;
+	}
+
+	static int save_loudness_sidecar(const std::string& media_path, const loudness_info& info)
+	{
+		uint64_t file_size;
+		int64_t file_mtime;
+		if (!get_file_info(media_path.c_str(), file_size, file_mtime))
+			return -1;
+		std::string out;
+		out.append(loudness_sidecar_magic, sizeof(loudness_sidecar_magic));
+		write_field(out, loudness_sidecar_version);
+		write_field(out, file_size);
+		write_field(out, file_mtime);
+		write_field(out, uint32_t(info.has_album ? 1 : 0));
+		write_loudness_result(out, info.track);
+		write_loudness_result(out, info.album);
+		std::string sidecar_path = get_loudness_sidecar_path(media_path);
+		if (!write_file_replace(sidecar_path, out))
+		{
+			std::printf("warn: write loudness sidecar %s failed\n", sidecar_path.c_str());
+			return -1;
+		}
+		return 0;
+	}
+
+	// ---- 回放增益 ----
+
+	static const AVDictionaryEntry* find_tag(const audio_decoder_context* decoder, const char* key)
+	{
+		const AVDictionaryEntry* entry = av_dict_get(decoder->format_context->metadata, key, nullptr, 0);
+		if (!entry)
+			entry = av_dict_get(decoder->format_context->streams[decoder->audio_stream_index]->metadata, key, nullptr, 0);
+		return entry;
+	}
+
+	// REPLAYGAIN_*_GAIN形如"-6.54 dB"；R128_*_GAIN（opus）为相对-23 LUFS的Q7.8定点dB，换算到-18 LUFS的参考响度
+	static bool read_replay_gain_tags(const audio_decoder_context* decoder, bool album, double& gain_db, double& peak)
+	{
+		const AVDictionaryEntry* gain = find_tag(decoder, album ? "REPLAYGAIN_ALBUM_GAIN" : "REPLAYGAIN_TRACK_GAIN");
+		if (gain)
+		{
+			gain_db = std::strtod(gain->value, nullptr);
+			const AVDictionaryEntry* peak_tag = find_tag(decoder, album ? "REPLAYGAIN_ALBUM_PEAK" : "REPLAYGAIN_TRACK_PEAK");
+			peak = peak_tag ? std::strtod(peak_tag->value, nullptr) : 0.0;
+			return true;
+		}
+		gain = find_tag(decoder, album ? "R128_ALBUM_GAIN" : "R128_TRACK_GAIN");
+		if (gain)
+		{
+			gain_db = std::strtol(gain->value, nullptr, 10) / 256.0 + (replay_gain_reference_lufs + 23.0);
+			peak = 0.0;
+			return true;
+		}
+		return false;
+	}
+
+	double get_replay_gain(const audio_decoder_context* decoder, audio_replay_gain_mode mode, double preamp_db)
+	{
+		if (mode == audio_replay_gain_mode::off)
+			return 1.0;
+		bool album = mode == audio_replay_gain_mode::album;
+		double gain_db = 0.0, peak = 0.0;
+		const char* source = nullptr;
+		uint64_t file_size;
+		int64_t file_mtime;
+		loudness_info info;
+		if (get_file_info(decoder->path.c_str(), file_size, file_mtime)
+			&& !load_loudness_sidecar(decoder->path, file_size, file_mtime, info))
+		{
+			album = album && info.has_album;
+			const loudness_result& result = album ? info.album : info.track;
+			gain_db = get_replay_gain_db(result);
+			peak = result.true_peak;
+			source = "sidecar";
+		}
+		else
+		{
+			if (album && !read_replay_gain_tags(decoder, true, gain_db, peak))
+				album = false;
+			if (album || read_replay_gain_tags(decoder, false, gain_db, peak))
+				source = "tags";
+		}
+		if (!source)
+		{
+			std::printf("info: no loudness data, replay gain not applied: %s\n", decoder->path.c_str());
+			return 1.0;
+		}
+		double gain = std::pow(10.0, (gain_db + preamp_db) / 20.0);
+		bool limited = peak > 0 && gain * peak > 1.0;
+		if (limited)
+			gain = 1.0 / peak;
+		std::printf("info: replay gain %+.2f dB (%s, %s%s): %s\n", 20.0 * std::log10(gain), album ? "album" : "track",
+			source, limited ? ", limited by peak" : "", decoder->path.c_str());
+		return gain;
+	}
+
+	// ---- 扫描 ----
+
+	// 每次运行送入解码器的packet数，之后重新调度，不长时间占用工作线程
+	constexpr int scan_batch_packets = 64;
+
+	struct loudness_track
+	{
+		std::string path;
+		// 专辑为同一目录下的曲目
+		std::string album_key;
+		bool ok = false;
+		loudness_result result;
+		std::vector<double> sub_blocks;
+	};
+
+	// 一个曲目的解码与测量状态，与播放使用同一套打开、解码与裁剪编码器延迟的代码
+	struct track_scanner
+	{
+		~track_scanner()
+		{
+			av_frame_free(&frame);
+			av_packet_free(&packet);
+			swr_free(&swr_ctx);
+			if (decoder)
+				close_audio_decoder(decoder);
+		}
+
+		audio_decoder_context* decoder = nullptr;
+		SwrContext* swr_ctx = nullptr;
+		AVPacket* packet = nullptr;
+		AVFrame* frame = nullptr;
+		loudness_meter meter;
+		int channels = 0;
+		int in_fmt = AV_SAMPLE_FMT_NONE;
+		int in_rate = 0;
+		// 交错float：true_peak_taps - 1帧历史，之后为pending_frames帧尚未测量的样本
+		// 没有帧上的裁剪信息时，最后trailing_padding帧要到结尾才能确定是否属于填充，暂不测量
+		std::vector<float> buffer;
+		int pending_frames = 0;
+		bool input_ended = false;
+	};
+
+	static track_scanner* open_track_scanner(const char* path, const audio_input_config& config)
+	{
+		auto scanner = std::unique_ptr<track_scanner>(DBG_NEW track_scanner());
+		// 扫描只测量响度，波形摘要由播放或批量解码建立
+		audio_input_config input_config = config;
+		input_config.generate_peaks = false;
+		scanner->decoder = open_audio_decoder(path, input_config);
+		if (!scanner->decoder)
+			return nullptr;
+		const AVCodecContext* context = scanner->decoder->codec_context;
+		if (scanner->meter.initialize(context->sample_rate, context->ch_layout))
+		{
+			std::printf("err: loudness scan supports up to %d channels, %s has %d\n", loudness_max_channels, path,
+				context->ch_layout.nb_channels);
+			return nullptr;
+		}
+		// 只转换样本格式：采样率与声道不变
+		swr_alloc_set_opts2(&scanner->swr_ctx, &context->ch_layout, AV_SAMPLE_FMT_FLT, context->sample_rate,
+			&context->ch_layout, context->sample_fmt, context->sample_rate, 0, nullptr);
+		if (!scanner->swr_ctx || swr_init(scanner->swr_ctx) < 0)
+		{
+			std::printf("err: swr_init for loudness scan failed: %s\n", path);
+			return nullptr;
+		}
+		scanner->channels = context->ch_layout.nb_channels;
+		scanner->in_fmt = context->sample_fmt;
+		scanner->in_rate = context->sample_rate;
+		scanner->buffer.assign(size_t(true_peak_taps - 1) * scanner->channels, 0.0f);
+		scanner->packet = av_packet_alloc();
+		scanner->frame = av_frame_alloc();
+		return scanner.release();
+	}
+
+	// 测量除最后hold_frames帧之外的样本，保留最后true_peak_taps - 1帧作为之后的历史
+	static void measure_pending(track_scanner* scanner, int hold_frames)
+	{
+		int ready = scanner->pending_frames - hold_frames;
+		if (ready <= 0)
+			return;
+		const int history = true_peak_taps - 1;
+		int channels = scanner->channels;
+		scanner->meter.process(scanner->buffer.data() + size_t(history) * channels, ready);
+		std::memmove(scanner->buffer.data(), scanner->buffer.data() + size_t(ready) * channels,
+			size_t(history + hold_frames) * channels * sizeof(float));
+		scanner->pending_frames = hold_frames;
+	}
+
+	// frame为nullptr时取出重采样器中缓存的样本
+	static int append_frame(track_scanner* scanner, const AVFrame* frame)
+	{
+		if (frame && (frame->format != scanner->in_fmt || frame->sample_rate != scanner->in_rate
+			|| frame->ch_layout.nb_channels != scanner->channels))
+		{
+			std::printf("err: decoder output format changed, not supported by loudness scan\n");
+			return -1;
+		}
+		int in_samples = frame ? frame->nb_samples : 0;
+		int max_out_samples = swr_get_out_samples(scanner->swr_ctx, in_samples);
+		if (max_out_samples <= 0)
+			return 0;
+		size_t offset = size_t(true_peak_taps - 1 + scanner->pending_frames) * scanner->channels;
+		if (scanner->buffer.size() < offset + size_t(max_out_samples) * scanner->channels)
+			scanner->buffer.resize(offset + size_t(max_out_samples) * scanner->channels);
+		uint8_t* out = reinterpret_cast<uint8_t*>(scanner->buffer.data() + offset);
+		int out_samples = swr_convert(scanner->swr_ctx, &out, max_out_samples,
+			frame ? const_cast<const uint8_t**>(frame->extended_data) : nullptr, in_samples);
+		if (out_samples < 0)
+			return -1;
+		scanner->pending_frames += out_samples;
+		audio_decoder_context* decoder = scanner->decoder;
+		measure_pending(scanner, decoder->discard_padding_seen ? 0 : decoder->trailing_padding);
+		return 0;
+	}
+
+	// 解码至多scan_batch_packets个packet；返回0为尚未结束，1为全部测量完毕，-1为出错
+	static int scan_track_batch(track_scanner* scanner)
+	{
+		audio_decoder_context* decoder = scanner->decoder;
+		int packets = 0;
+		while (packets < scan_batch_packets)
+		{
+			int res = avcodec_receive_frame(decoder->codec_context, scanner->frame);
+			if (res >= 0)
+			{
+				if (trim_decoded_frame(decoder, scanner->frame))
+					res = append_frame(scanner, scanner->frame);
+				av_frame_unref(scanner->frame);
+				if (res < 0)
+					return -1;
+				continue;
+			}
+			if (res == AVERROR_EOF)
+			{
+				if (append_frame(scanner, nullptr))
+					return -1;
+				// 容器标明、帧上没有裁剪信息的尾部填充
+				if (!decoder->discard_padding_seen)
+					scanner->pending_frames -= std::min(scanner->pending_frames, decoder->trailing_padding);
+				measure_pending(scanner, 0);
+				return 1;
+			}
+			if (res != AVERROR(EAGAIN) || scanner->input_ended)
+			{
+				std::printf("err: avcodec_receive_frame failed in loudness scan\n");
+				return -1;
+			}
+			if (av_read_frame(decoder->format_context, scanner->packet) < 0)
+			{
+				scanner->input_ended = true;
+				avcodec_send_packet(decoder->codec_context, nullptr);
+				continue;
+			}
+			if (scanner->packet->stream_index == static_cast<int>(decoder->audio_stream_index))
+			{
+				// 损坏的packet被跳过，与播放时一致
+				avcodec_send_packet(decoder->codec_context, scanner->packet);
+				packets++;
+			}
+			av_packet_unref(scanner->packet);
+		}
+		return 0;
+	}
+
+	// 所有扫描任务共享的状态
+	struct loudness_scan_state
+	{
+		std::vector<loudness_track> tracks;
+		audio_input_config input;
+		std::atomic<size_t> next_track{ 0 };
+		std::atomic<int> finished_tracks{ 0 };
+		std::mutex mutex;
+		std::condition_variable done_cv;
+		int finished_jobs = 0;
+	};
+
+	// 线程池中的一个扫描任务：依次取出下一个曲目，每次运行解码一批packet后重新调度，
+	// jobs个任务同时在池中运行，不同的曲目在不同的核心上扫描
+	class loudness_scan_job
+	{
+	public:
+		loudness_scan_job(audio_worker_pool* pool, loudness_scan_state& state)
+			: state(state), task(pool, [this] { run(); }) {}
+
+		void start() { task.schedule(); }
+		const pool_task& get_task() const { return task; }
+
+	private:
+		void run()
+		{
+			AUDIO_TRACE_SCOPE(decode, "loudness scan");
+			if (!scanner)
+			{
+				track_index = state.next_track.fetch_add(1);
+				if (track_index >= state.tracks.size())
+				{
+					{
+						std::lock_guard<std::mutex> lock(state.mutex);
+						state.finished_jobs++;
+					}
+					state.done_cv.notify_all();
+					return;
+				}
+				scanner.reset(open_track_scanner(state.tracks[track_index].path.c_str(), state.input));
+				if (!scanner)
+					report(false);
+				task.schedule();
+				return;
+			}
+			int res = scan_track_batch(scanner.get());
+			if (res != 0)
+			{
+				if (res > 0)
+				{
+					loudness_track& track = state.tracks[track_index];
+					track.sub_blocks = scanner->meter.get_sub_blocks();
+					compute_loudness({ &track.sub_blocks }, track.result);
+					track.result.true_peak = scanner->meter.get_true_peak();
+					track.result.duration_seconds = scanner->meter.get_duration_seconds();
+					track.ok = true;
+				}
+				scanner.reset();
+				report(res > 0);
+			}
+			task.schedule();
+		}
+
+		void report(bool ok)
+		{
+			const loudness_track& track = state.tracks[track_index];
+			int finished = ++state.finished_tracks;
+			if (!ok)
+			{
+				std::printf("err: loudness [%d/%d] scan failed: %s\n", finished, int(state.tracks.size()), track.path.c_str());
+				return;
+			}
+			const loudness_result& result = track.result;
+			std::printf("info: loudness [%d/%d] %.2f LUFS, range %.2f LU, true peak %.2f dBTP, gain %+.2f dB, %.2fs: %s\n",
+				finished, int(state.tracks.size()), result.integrated_lufs, result.range_lu,
+				20.0 * std::log10(std::max(result.true_peak, 1e-10)), get_replay_gain_db(result), result.duration_seconds,
+				track.path.c_str());
+		}
+
+		loudness_scan_state& state;
+		std::unique_ptr<track_scanner> scanner;
+		size_t track_index = 0;
+		pool_task task;
+	};
+
+	static std::string get_album_key(const std::string& path)
+	{
+		size_t name_begin = path.find_last_of("/\\");
+		return name_begin == std::string::npos ? std::string() : path.substr(0, name_begin);
+	}
+
+	int run_loudness_scan(const std::vector<std::string>& paths, const loudness_scan_config& config)
+	{
+		if (paths.empty())
+		{
+			std::printf("err: no input file for loudness scan\n");
+			return -1;
+		}
+		loudness_scan_state state;
+		state.input = config.input;
+		state.input.seek_index = audio_seek_index_mode::disabled;
+		state.input.seek_index_scan = false;
+		state.tracks.resize(paths.size());
+		for (size_t i = 0; i < paths.size(); ++i)
+		{
+			state.tracks[i].path = paths[i];
+			state.tracks[i].album_key = get_album_key(paths[i]);
+		}
+
+		audio_worker_pool* pool = create_audio_worker_pool(config.threads);
+		int jobs = config.jobs > 0 ? config.jobs : pool->get_thread_count();
+		jobs = std::min(jobs, static_cast<int>(paths.size()));
+		std::printf("info: loudness scan %d files, threads=%d, jobs=%d, kernels=%s\n", int(paths.size()),
+			pool->get_thread_count(), jobs, get_loudness_kernels().name);
+		auto wall_begin = std::chrono::steady_clock::now();
+		std::vector<std::unique_ptr<loudness_scan_job>> scan_jobs;
+		for (int i = 0; i < jobs; ++i)
+		{
+			scan_jobs.emplace_back(DBG_NEW loudness_scan_job(pool, state));
+			scan_jobs.back()->start();
+		}
+		{
+			std::unique_lock<std::mutex> lock(state.mutex);
+			state.done_cv.wait(lock, [&] { return state.finished_jobs == jobs; });
+		}
+		for (auto& job : scan_jobs)
+			pool->wait_idle(job->get_task());
+		scan_jobs.clear();
+		destroy_audio_worker_pool(pool);
+		double wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_begin).count();
+
+		// 专辑：各曲目的块合并后门限，峰值取最大值
+		std::map<std::string, loudness_result> albums;
+		if (config.album_by_directory)
+		{
+			std::map<std::string, std::vector<const loudness_track*>> album_tracks;
+			for (const auto& track : state.tracks)
+			{
+				if (track.ok)
+					album_tracks[track.album_key].push_back(&track);
+			}
+			for (const auto& item : album_tracks)
+			{
+				std::vector<const std::vector<double>*> sub_blocks;
+				loudness_result& album = albums[item.first];
+				for (const auto* track : item.second)
+				{
+					sub_blocks.push_back(&track->sub_blocks);
+					album.true_peak = std::max(album.true_peak, track->result.true_peak);
+					album.duration_seconds += track->result.duration_seconds;
+				}
+				compute_loudness(sub_blocks, album);
+				std::printf("info: album %.2f LUFS, range %.2f LU, true peak %.2f dBTP, gain %+.2f dB, %d tracks: %s\n",
+					album.integrated_lufs, album.range_lu, 20.0 * std::log10(std::max(album.true_peak, 1e-10)),
+					get_replay_gain_db(album), int(item.second.size()), item.first.empty() ? "." : item.first.c_str());
+			}
+		}
+
+		int failed = 0;
+		double audio_seconds = 0;
+		for (const auto& track : state.tracks)
+		{
+			if (!track.ok)
+			{
+				failed++;
+				continue;
+			}
+			audio_seconds += track.result.duration_seconds;
+			if (!config.write_sidecar)
+				continue;
+			loudness_info info;
+			info.track = track.result;
+			auto album = albums.find(track.album_key);
+			if (album != albums.end())
+			{
+				info.album = album->second;
+				info.has_album = true;
+			}
+			save_loudness_sidecar(track.path, info);
+		}
+		double wall = wall_seconds > 0 ? wall_seconds : 1e-9;
+		std::printf("info: loudness scan finished: %d files, %d failed, %.2fs audio in %.3fs, %.1fx realtime\n",
+			int(paths.size()), failed, audio_seconds, wall_seconds, audio_seconds / wall);
+		return failed;
+	}
+}
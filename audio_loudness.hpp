@@ -0,0 +1,160 @@
+﻿#if !defined(AUDIO_LOUDNESS_HPP_)
+#define AUDIO_LOUDNESS_HPP_
+#include "audio_play_interface.hpp"
+#include <cmath>
+#include <string>
+#include <vector>
+
+namespace audio
+{
+	// 响度测量（ITU-R BS.1770-4 / EBU R128）：K计权后按400ms块（75%重叠）双重门限计算integrated loudness，
+	// 按3秒短时响度计算loudness range（EBU Tech 3342），4倍过采样计算true peak
+	constexpr int loudness_max_channels = 8;
+	// true peak过采样滤波器（BS.1770-4 Annex 2，48抽头、4相）每相的抽头数
+	constexpr int true_peak_taps = 12;
+	// 回放增益的参考响度（ReplayGain 2.0）
+	constexpr double replay_gain_reference_lufs = -18.0;
+
+	// coefficients[tap][phase]：第phase相的输出为 sum(x[n - tap] * coefficients[tap][phase])
+	extern const float true_peak_coefficients[true_peak_taps][4];
+
+	// 两级biquad（高架 + 高通）的系数，按采样率由模拟原型计算，a0归一化为1
+	struct k_weight_coefficients
+	{
+		double b[2][3];
+		double a[2][2];
+	};
+
+	// 每个声道的滤波器状态（Direct Form II transposed）：z[0..1]为第一级，z[2..3]为第二级
+	// 同一状态的各声道相邻存放，SIMD实现一次载入相邻的几个声道
+	struct k_weight_state
+	{
+		double z[4][loudness_max_channels] = {};
+	};
+
+	// 单个声道的标量实现，SIMD实现也用它处理凑不满一个向量的声道
+	inline void k_weight_channel(const float* src, int frames, int channels, int ch,
+		const k_weight_coefficients& c, k_weight_state& state, double* sums)
+	{
+		double z0 = state.z[0][ch], z1 = state.z[1][ch], z2 = state.z[2][ch], z3 = state.z[3][ch];
+		double sum = 0;
+		for (int i = 0; i < frames; ++i)
+		{
+			double x = src[i * channels + ch];
+			double y1 = c.b[0][0] * x + z0;
+			z0 = c.b[0][1] * x - c.a[0][0] * y1 + z1;
+			z1 = c.b[0][2] * x - c.a[0][1] * y1;
+			double y2 = c.b[1][0] * y1 + z2;
+			z2 = c.b[1][1] * y1 - c.a[1][0] * y2 + z3;
+			z3 = c.b[1][2] * y1 - c.a[1][1] * y2;
+			sum += y2 * y2;
+		}
+		state.z[0][ch] = z0;
+		state.z[1][ch] = z1;
+		state.z[2][ch] = z2;
+		state.z[3][ch] = z3;
+		sums[ch] += sum;
+	}
+
+	// 一组响度内核，src均为交错存储的float；SIMD实现在通道方向并行（K计权为每个向量一组相邻的声道，
+	// true peak为每个向量4个相位），运算顺序与标量实现一致
+	struct loudness_kernels
+	{
+		const char* name;
+		// K计权，每个声道滤波后的平方和累加到sums[channel]
+		void (*k_weight)(const float* src, int frames, int channels, const k_weight_coefficients& coefficients,
+			k_weight_state& state, double* sums);
+		// 4倍过采样后所有声道的绝对值的最大值；src之前须有true_peak_taps - 1帧数据
+		float (*true_peak)(const float* src, int frames, int channels);
+	};
+
+	const loudness_kernels& get_scalar_loudness_kernels();
+	// 未编译对应实现时返回nullptr，不检查cpu是否支持
+	const loudness_kernels* get_sse2_loudness_kernels();
+	const loudness_kernels* get_avx2_loudness_kernels();
+	const loudness_kernels* get_neon_loudness_kernels();
+	// 当前cpu上可运行的实现，按从慢到快的顺序写入kernels，返回个数
+	int get_available_loudness_kernels(const loudness_kernels** kernels, int max_count);
+	// 当前cpu上最快的实现，第一次调用时检测
+	const loudness_kernels& get_loudness_kernels();
+
+	void compute_k_weight_coefficients(int sample_rate, k_weight_coefficients& coefficients);
+
+	struct loudness_result
+	{
+		// 没有超过绝对门限的块（静音或短于400ms）时为-HUGE_VAL
+		double integrated_lufs = -HUGE_VAL;
+		double range_lu = 0;
+		// 线性值，1.0为满幅
+		double true_peak = 0;
+		double duration_seconds = 0;
+	};
+
+	// ReplayGain 2.0的增益（dB），没有有效的响度时为0
+	inline double get_replay_gain_db(const loudness_result& result)
+	{
+		return std::isfinite(result.integrated_lufs) ? replay_gain_reference_lufs - result.integrated_lufs : 0.0;
+	}
+
+	// 一首曲目的测量状态：K计权后按100ms子块记录声道加权的均方值，块、门限与LRA在最后计算
+	class loudness_meter
+	{
+	public:
+		// 声道数超过loudness_max_channels时返回-1；kernels为nullptr时使用当前cpu上最快的实现
+		int initialize(int sample_rate, const AVChannelLayout& layout, const loudness_kernels* kernels = nullptr);
+		// src之前须有true_peak_taps - 1帧数据（第一次调用时为静音）
+		void process(const float* src, int frames);
+		// 100ms子块，不包括最后不足100ms的部分
+		const std::vector<double>& get_sub_blocks() const { return sub_blocks; }
+		float get_true_peak() const { return true_peak; }
+		double get_duration_seconds() const { return double(total_frames) / sample_rate; }
+
+	private:
+		const loudness_kernels* kernels = nullptr;
+		k_weight_coefficients coefficients = {};
+		k_weight_state state;
+		int sample_rate = 0;
+		int channels = 0;
+		// 96kHz及以上不过采样，取样本峰值
+		bool oversample = true;
+		double weights[loudness_max_channels] = {};
+		double sums[loudness_max_channels] = {};
+		int sub_block_frames = 0;
+		int sub_block_filled = 0;
+		std::vector<double> sub_blocks;
+		float true_peak = 0.0f;
+		uint64_t total_frames = 0;
+	};
+
+	// 按各曲目的100ms子块计算integrated loudness与loudness range；多个曲目时为专辑，块不跨越曲目
+	// true_peak与duration_seconds由调用者填写
+	void compute_loudness(const std::vector<const std::vector<double>*>& tracks, loudness_result& result);
+
+	struct loudness_scan_config
+	{
+		audio_input_config input;
+		// 线程池的线程数，0为cpu核心数
+		int threads = 0;
+		// 同时扫描的曲目数，0为线程池的线程数
+		int jobs = 0;
+		// 同一目录下的曲目作为一张专辑
+		bool album_by_directory = true;
+		// 结果写入文件旁的<文件名>.loudness，播放时据此调整增益
+		bool write_sidecar = true;
+	};
+
+	// 解码（不经过输出端）并测量所有文件，报告每个曲目与专辑的结果；返回失败的文件数
+	int run_loudness_scan(const std::vector<std::string>& paths, const loudness_scan_config& config);
+
+	struct audio_decoder_context;
+	// 曲目的回放增益（线性）：优先使用loudness sidecar，其次为文件中的REPLAYGAIN_*或R128_*标签，都没有时为1.0
+	// album模式下没有专辑的值时取曲目的值；已知峰值时增益不超过1/peak（防止削波）
+	double get_replay_gain(const audio_decoder_context* decoder, audio_replay_gain_mode mode, double preamp_db);
+
+	// 逐个实现与标量实现对比，并用已知响度与峰值的信号检查测量结果；返回非0表示存在失败
+	int run_loudness_selftest();
+	// 测量每个实现扫描立体声48kHz的速度（实时的倍数）
+	void run_loudness_benchmark();
+}
+
+#endif // AUDIO_LOUDNESS_HPP_
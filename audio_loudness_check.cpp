@@ -0,0 +1,194 @@
+﻿#include "audio_loudness.hpp"
+#include "kernel_check.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+namespace audio
+{
+	constexpr int loudness_history_frames = true_peak_taps - 1;
+
+	// 交错存储的正弦波，前面留出true peak所需的静音历史；每段为(秒数, 幅度)
+	struct sine_segment
+	{
+		double seconds;
+		double amplitude;
+	};
+
+	static std::vector<float> make_sine(int sample_rate, int channels, double frequency, double phase,
+		const std::vector<sine_segment>& segments, int& frames)
+	{
+		constexpr double pi = 3.14159265358979323846;
+		frames = 0;
+		for (const auto& segment : segments)
+			frames += int(segment.seconds * sample_rate);
+		std::vector<float> samples(size_t(loudness_history_frames + frames) * channels, 0.0f);
+		float* out = samples.data() + size_t(loudness_history_frames) * channels;
+		int index = 0;
+		for (const auto& segment : segments)
+		{
+			int count = int(segment.seconds * sample_rate);
+			for (int i = 0; i < count; ++i, ++index)
+			{
+				float value = float(segment.amplitude * std::sin(2 * pi * frequency * index / sample_rate + phase));
+				for (int ch = 0; ch < channels; ++ch)
+					out[size_t(index) * channels + ch] = value;
+			}
+		}
+		return samples;
+	}
+
+	// 按1024帧一次送入测量，覆盖子块的拼接
+	static void measure(const std::vector<float>& samples, int frames, int sample_rate, int channels,
+		const loudness_kernels& kernels, loudness_result& result)
+	{
+		AVChannelLayout layout = {};
+		av_channel_layout_default(&layout, channels);
+		loudness_meter meter;
+		meter.initialize(sample_rate, layout, &kernels);
+		av_channel_layout_uninit(&layout);
+		const float* src = samples.data() + size_t(loudness_history_frames) * channels;
+		for (int offset = 0; offset < frames; offset += 1024)
+		{
+			int count = std::min(1024, frames - offset);
+			meter.process(src + size_t(offset) * channels, count);
+		}
+		compute_loudness({ &meter.get_sub_blocks() }, result);
+		result.true_peak = meter.get_true_peak();
+		result.duration_seconds = meter.get_duration_seconds();
+	}
+
+	int run_loudness_selftest()
+	{
+		const loudness_kernels* kernels[4];
+		int kernel_count = get_available_loudness_kernels(kernels, 4);
+		const loudness_kernels& scalar = get_scalar_loudness_kernels();
+		kernel_check_report report;
+
+		// 与标量实现对比：奇数声道数覆盖凑不满向量的声道
+		k_weight_coefficients coefficients;
+		compute_k_weight_coefficients(48000, coefficients);
+		const int channel_cases[] = { 1, 2, 3, 6, 8 };
+		for (int channels : channel_cases)
+		{
+			std::vector<float> samples(size_t(loudness_history_frames + kernel_check_frames) * channels);
+			uint32_t seed = 0x1234567u + uint32_t(channels);
+			for (auto& sample : samples)
+				sample = random_check_float(seed);
+			const float* src = samples.data() + size_t(loudness_history_frames) * channels;
+			k_weight_state ref_state;
+			double ref_sums[loudness_max_channels] = {};
+			scalar.k_weight(src, kernel_check_frames, channels, coefficients, ref_state, ref_sums);
+			float ref_peak = scalar.true_peak(src, kernel_check_frames, channels);
+			for (int k = 0; k < kernel_count; ++k)
+			{
+				const loudness_kernels& current = *kernels[k];
+				k_weight_state state;
+				double sums[loudness_max_channels] = {};
+				current.k_weight(src, kernel_check_frames, channels, coefficients, state, sums);
+				double max_diff = 0;
+				for (int ch = 0; ch < channels; ++ch)
+				{
+					max_diff = std::max(max_diff, std::fabs(sums[ch] - ref_sums[ch]) / ref_sums[ch]);
+					for (int z = 0; z < 4; ++z)
+						max_diff = std::max(max_diff, std::fabs(state.z[z][ch] - ref_state.z[z][ch]));
+				}
+				report(max_diff <= 1e-9, "%-16s %dch %-6s max diff=%g", "k-weight", channels, current.name, max_diff);
+				double peak_diff = std::fabs(double(current.true_peak(src, kernel_check_frames, channels)) - ref_peak);
+				report(peak_diff <= 1e-6, "%-16s %dch %-6s max diff=%g", "true peak", channels, current.name, peak_diff);
+			}
+		}
+
+		// 已知响度的信号：997Hz正弦，立体声-20 dBFS为-20 LUFS
+		const loudness_kernels& best = get_loudness_kernels();
+		const int rate_cases[] = { 44100, 48000 };
+		for (int sample_rate : rate_cases)
+		{
+			int frames;
+			loudness_result result;
+			auto samples = make_sine(sample_rate, 2, 997.0, 0.0, { { 20.0, 0.1 } }, frames);
+			measure(samples, frames, sample_rate, 2, best, result);
+			report(std::fabs(result.integrated_lufs + 20.0) <= 0.1, "%-16s %dHz integrated %.3f LUFS (expect -20)",
+				"sine", sample_rate, result.integrated_lufs);
+		}
+		{
+			// 相对门限：-40 dBFS的部分低于门限，不计入
+			int frames;
+			loudness_result result;
+			auto samples = make_sine(48000, 2, 997.0, 0.0, { { 10.0, 0.1 }, { 10.0, 0.01 } }, frames);
+			measure(samples, frames, 48000, 2, best, result);
+			report(std::fabs(result.integrated_lufs + 20.0) <= 0.1, "%-16s integrated %.3f LUFS (expect -20)",
+				"relative gate", result.integrated_lufs);
+		}
+		{
+			// EBU Tech 3342测试信号1：-20 dBFS与-30 dBFS各20秒，LRA为10 LU（±1）
+			int frames;
+			loudness_result result;
+			auto samples = make_sine(48000, 2, 1000.0, 0.0, { { 20.0, 0.1 }, { 20.0, 0.1 / std::sqrt(10.0) } }, frames);
+			measure(samples, frames, 48000, 2, best, result);
+			report(std::fabs(result.range_lu - 10.0) <= 1.0, "%-16s range %.3f LU (expect 10)", "loudness range",
+				result.range_lu);
+		}
+		{
+			// fs/4、相位45度的正弦：样本峰值只有幅度的0.707，true peak接近幅度（BS.1770允许的误差约为0.5 dB）
+			int frames;
+			loudness_result result;
+			auto samples = make_sine(48000, 2, 12000.0, 3.14159265358979323846 / 4, { { 1.0, 0.5 } }, frames);
+			measure(samples, frames, 48000, 2, best, result);
+			double error_db = 20.0 * std::log10(result.true_peak / 0.5);
+			report(std::fabs(error_db) <= 0.5, "%-16s %.4f (expect 0.5, error %.2f dB)", "true peak", result.true_peak, error_db);
+		}
+		return report.finish("loudness");
+	}
+
+	// 立体声48kHz的10秒噪声，分别测量K计权与true peak，结果折算为实时的倍数
+	void run_loudness_benchmark()
+	{
+		constexpr int sample_rate = 48000;
+		constexpr int channels = 2;
+		constexpr int frames = sample_rate * 10;
+		const loudness_kernels* kernels[4];
+		int kernel_count = get_available_loudness_kernels(kernels, 4);
+		std::vector<float> samples(size_t(loudness_history_frames + frames) * channels);
+		uint32_t seed = 0x9E3779B9u;
+		for (auto& sample : samples)
+			sample = random_check_float(seed) * 0.5f;
+		const float* src = samples.data() + size_t(loudness_history_frames) * channels;
+		k_weight_coefficients coefficients;
+		compute_k_weight_coefficients(sample_rate, coefficients);
+
+		using clock = std::chrono::steady_clock;
+		auto measure_speed = [&](auto&& body) {
+			int runs = 0;
+			double elapsed = 0;
+			auto begin = clock::now();
+			do
+			{
+				body();
+				runs++;
+				elapsed = std::chrono::duration<double>(clock::now() - begin).count();
+			} while (elapsed < 0.5);
+			return double(frames) * runs / sample_rate / elapsed;
+		};
+		std::printf("info: loudness benchmark, stereo %dHz, realtime multiples per core\n", sample_rate);
+		std::printf("%-8s %12s %12s %12s\n", "kernels", "k-weight", "true peak", "total");
+		for (int k = 0; k < kernel_count; ++k)
+		{
+			const loudness_kernels& current = *kernels[k];
+			volatile double sink = 0;
+			double k_weight_speed = measure_speed([&] {
+				k_weight_state state;
+				double sums[loudness_max_channels] = {};
+				current.k_weight(src, frames, channels, coefficients, state, sums);
+				sink = sink + sums[0];
+			});
+			double true_peak_speed = measure_speed([&] {
+				sink = sink + current.true_peak(src, frames, channels);
+			});
+			std::printf("%-8s %11.0fx %11.0fx %11.0fx\n", current.name, k_weight_speed, true_peak_speed,
+				1.0 / (1.0 / k_weight_speed + 1.0 / true_peak_speed));
+		}
+	}
+}
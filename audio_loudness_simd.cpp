@@ -0,0 +1,278 @@
+﻿#include "audio_loudness.hpp"
+#include "sample_convert.hpp"
+#if defined(SAMPLE_CONVERT_X86)
+#include <immintrin.h>
+#endif
+#if defined(SAMPLE_CONVERT_NEON)
+#include <arm_neon.h>
+#endif
+
+// K计权：IIR在时间方向上有依赖，向量的各通道为相邻的声道（double），声道数凑不满一个向量时剩余的声道交给标量实现
+// true peak：向量的各通道为同一样本的4个相位（avx2为相邻两个样本）
+// 乘法与加法分开进行，运算顺序与标量实现一致
+
+namespace audio
+{
+#if defined(SAMPLE_CONVERT_X86)
+	// ---- SSE2 ----
+
+	// 从第ch个声道开始的两个声道
+	SSE2_TARGET static void k_weight_pair_sse2(const float* src, int frames, int channels, int ch,
+		const k_weight_coefficients& c, k_weight_state& state, double* sums)
+	{
+		const __m128d b00 = _mm_set1_pd(c.b[0][0]), b01 = _mm_set1_pd(c.b[0][1]), b02 = _mm_set1_pd(c.b[0][2]);
+		const __m128d b10 = _mm_set1_pd(c.b[1][0]), b11 = _mm_set1_pd(c.b[1][1]), b12 = _mm_set1_pd(c.b[1][2]);
+		const __m128d a00 = _mm_set1_pd(c.a[0][0]), a01 = _mm_set1_pd(c.a[0][1]);
+		const __m128d a10 = _mm_set1_pd(c.a[1][0]), a11 = _mm_set1_pd(c.a[1][1]);
+		__m128d z0 = _mm_loadu_pd(&state.z[0][ch]);
+		__m128d z1 = _mm_loadu_pd(&state.z[1][ch]);
+		__m128d z2 = _mm_loadu_pd(&state.z[2][ch]);
+		__m128d z3 = _mm_loadu_pd(&state.z[3][ch]);
+		__m128d sum = _mm_setzero_pd();
+		const float* p = src + ch;
+		for (int i = 0; i < frames; ++i, p += channels)
+		{
+			__m128d x = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))));
+			__m128d y1 = _mm_add_pd(_mm_mul_pd(b00, x), z0);
+			z0 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b01, x), _mm_mul_pd(a00, y1)), z1);
+			z1 = _mm_sub_pd(_mm_mul_pd(b02, x), _mm_mul_pd(a01, y1));
+			__m128d y2 = _mm_add_pd(_mm_mul_pd(b10, y1), z2);
+			z2 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b11, y1), _mm_mul_pd(a10, y2)), z3);
+			z3 = _mm_sub_pd(_mm_mul_pd(b12, y1), _mm_mul_pd(a11, y2));
+			sum = _mm_add_pd(sum, _mm_mul_pd(y2, y2));
+		}
+		_mm_storeu_pd(&state.z[0][ch], z0);
+		_mm_storeu_pd(&state.z[1][ch], z1);
+		_mm_storeu_pd(&state.z[2][ch], z2);
+		_mm_storeu_pd(&state.z[3][ch], z3);
+		double lanes[2];
+		_mm_storeu_pd(lanes, sum);
+		sums[ch] += lanes[0];
+		sums[ch + 1] += lanes[1];
+	}
+
+	SSE2_TARGET static void k_weight_sse2(const float* src, int frames, int channels, const k_weight_coefficients& coefficients,
+		k_weight_state& state, double* sums)
+	{
+		int ch = 0;
+		for (; ch + 2 <= channels; ch += 2)
+			k_weight_pair_sse2(src, frames, channels, ch, coefficients, state, sums);
+		for (; ch < channels; ++ch)
+			k_weight_channel(src, frames, channels, ch, coefficients, state, sums);
+	}
+
+	SSE2_TARGET static inline float horizontal_max_sse2(__m128 value)
+	{
+		value = _mm_max_ps(value, _mm_shuffle_ps(value, value, _MM_SHUFFLE(1, 0, 3, 2)));
+		value = _mm_max_ps(value, _mm_shuffle_ps(value, value, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_cvtss_f32(value);
+	}
+
+	// 一个样本的4个相位
+	SSE2_TARGET static inline __m128 true_peak_phases_sse2(const float* x, int channels, const __m128* coefficients)
+	{
+		__m128 sum = _mm_setzero_ps();
+		for (int tap = 0; tap < true_peak_taps; ++tap)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(x[-tap * channels]), coefficients[tap]));
+		return sum;
+	}
+
+	SSE2_TARGET static float true_peak_sse2(const float* src, int frames, int channels)
+	{
+		__m128 coefficients[true_peak_taps];
+		for (int tap = 0; tap < true_peak_taps; ++tap)
+			coefficients[tap] = _mm_load_ps(true_peak_coefficients[tap]);
+		const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+		__m128 peak = _mm_setzero_ps();
+		for (int ch = 0; ch < channels; ++ch)
+		{
+			const float* x = src + ch;
+			for (int i = 0; i < frames; ++i, x += channels)
+				peak = _mm_max_ps(peak, _mm_and_ps(true_peak_phases_sse2(x, channels, coefficients), abs_mask));
+		}
+		return horizontal_max_sse2(peak);
+	}
+
+	const loudness_kernels* get_sse2_loudness_kernels()
+	{
+		static const loudness_kernels kernels = {
+			"sse2",
+			k_weight_sse2,
+			true_peak_sse2
+		};
+		return &kernels;
+	}
+
+	// ---- AVX2 ----
+
+	// 从第ch个声道开始的四个声道
+	AVX2_TARGET static void k_weight_quad_avx2(const float* src, int frames, int channels, int ch,
+		const k_weight_coefficients& c, k_weight_state& state, double* sums)
+	{
+		const __m256d b00 = _mm256_set1_pd(c.b[0][0]), b01 = _mm256_set1_pd(c.b[0][1]), b02 = _mm256_set1_pd(c.b[0][2]);
+		const __m256d b10 = _mm256_set1_pd(c.b[1][0]), b11 = _mm256_set1_pd(c.b[1][1]), b12 = _mm256_set1_pd(c.b[1][2]);
+		const __m256d a00 = _mm256_set1_pd(c.a[0][0]), a01 = _mm256_set1_pd(c.a[0][1]);
+		const __m256d a10 = _mm256_set1_pd(c.a[1][0]), a11 = _mm256_set1_pd(c.a[1][1]);
+		__m256d z0 = _mm256_loadu_pd(&state.z[0][ch]);
+		__m256d z1 = _mm256_loadu_pd(&state.z[1][ch]);
+		__m256d z2 = _mm256_loadu_pd(&state.z[2][ch]);
+		__m256d z3 = _mm256_loadu_pd(&state.z[3][ch]);
+		__m256d sum = _mm256_setzero_pd();
+		const float* p = src + ch;
+		for (int i = 0; i < frames; ++i, p += channels)
+		{
+			__m256d x = _mm256_cvtps_pd(_mm_loadu_ps(p));
+			__m256d y1 = _mm256_add_pd(_mm256_mul_pd(b00, x), z0);
+			z0 = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(b01, x), _mm256_mul_pd(a00, y1)), z1);
+			z1 = _mm256_sub_pd(_mm256_mul_pd(b02, x), _mm256_mul_pd(a01, y1));
+			__m256d y2 = _mm256_add_pd(_mm256_mul_pd(b10, y1), z2);
+			z2 = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(b11, y1), _mm256_mul_pd(a10, y2)), z3);
+			z3 = _mm256_sub_pd(_mm256_mul_pd(b12, y1), _mm256_mul_pd(a11, y2));
+			sum = _mm256_add_pd(sum, _mm256_mul_pd(y2, y2));
+		}
+		_mm256_storeu_pd(&state.z[0][ch], z0);
+		_mm256_storeu_pd(&state.z[1][ch], z1);
+		_mm256_storeu_pd(&state.z[2][ch], z2);
+		_mm256_storeu_pd(&state.z[3][ch], z3);
+		double lanes[4];
+		_mm256_storeu_pd(lanes, sum);
+		for (int lane = 0; lane < 4; ++lane)
+			sums[ch + lane] += lanes[lane];
+	}
+
+	AVX2_TARGET static void k_weight_avx2(const float* src, int frames, int channels, const k_weight_coefficients& coefficients,
+		k_weight_state& state, double* sums)
+	{
+		int ch = 0;
+		for (; ch + 4 <= channels; ch += 4)
+			k_weight_quad_avx2(src, frames, channels, ch, coefficients, state, sums);
+		for (; ch + 2 <= channels; ch += 2)
+			k_weight_pair_sse2(src, frames, channels, ch, coefficients, state, sums);
+		for (; ch < channels; ++ch)
+			k_weight_channel(src, frames, channels, ch, coefficients, state, sums);
+	}
+
+	// 相邻两个样本各4个相位
+	AVX2_TARGET static float true_peak_avx2(const float* src, int frames, int channels)
+	{
+		__m128 coefficients[true_peak_taps];
+		__m256 coefficients_x2[true_peak_taps];
+		for (int tap = 0; tap < true_peak_taps; ++tap)
+		{
+			coefficients[tap] = _mm_load_ps(true_peak_coefficients[tap]);
+			coefficients_x2[tap] = _mm256_broadcast_ps(&coefficients[tap]);
+		}
+		const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+		__m256 peak = _mm256_setzero_ps();
+		__m128 tail_peak = _mm_setzero_ps();
+		for (int ch = 0; ch < channels; ++ch)
+		{
+			const float* x = src + ch;
+			int i = 0;
+			for (; i + 2 <= frames; i += 2, x += 2 * channels)
+			{
+				__m256 sum = _mm256_setzero_ps();
+				for (int tap = 0; tap < true_peak_taps; ++tap)
+				{
+					__m256 samples = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(x[-tap * channels])),
+						_mm_set1_ps(x[(1 - tap) * channels]), 1);
+					sum = _mm256_add_ps(sum, _mm256_mul_ps(samples, coefficients_x2[tap]));
+				}
+				peak = _mm256_max_ps(peak, _mm256_and_ps(sum, abs_mask));
+			}
+			if (i < frames)
+				tail_peak = _mm_max_ps(tail_peak, _mm_and_ps(true_peak_phases_sse2(x, channels, coefficients),
+					_mm256_castps256_ps128(abs_mask)));
+		}
+		__m128 result = _mm_max_ps(_mm256_castps256_ps128(peak), _mm256_extractf128_ps(peak, 1));
+		return horizontal_max_sse2(_mm_max_ps(result, tail_peak));
+	}
+
+	const loudness_kernels* get_avx2_loudness_kernels()
+	{
+		static const loudness_kernels kernels = {
+			"avx2",
+			k_weight_avx2,
+			true_peak_avx2
+		};
+		return &kernels;
+	}
+#else
+	const loudness_kernels* get_sse2_loudness_kernels() { return nullptr; }
+	const loudness_kernels* get_avx2_loudness_kernels() { return nullptr; }
+#endif // SAMPLE_CONVERT_X86
+
+#if defined(SAMPLE_CONVERT_NEON)
+	// ---- NEON ----
+
+	static void k_weight_neon(const float* src, int frames, int channels, const k_weight_coefficients& c,
+		k_weight_state& state, double* sums)
+	{
+		const float64x2_t b00 = vdupq_n_f64(c.b[0][0]), b01 = vdupq_n_f64(c.b[0][1]), b02 = vdupq_n_f64(c.b[0][2]);
+		const float64x2_t b10 = vdupq_n_f64(c.b[1][0]), b11 = vdupq_n_f64(c.b[1][1]), b12 = vdupq_n_f64(c.b[1][2]);
+		const float64x2_t a00 = vdupq_n_f64(c.a[0][0]), a01 = vdupq_n_f64(c.a[0][1]);
+		const float64x2_t a10 = vdupq_n_f64(c.a[1][0]), a11 = vdupq_n_f64(c.a[1][1]);
+		int ch = 0;
+		for (; ch + 2 <= channels; ch += 2)
+		{
+			float64x2_t z0 = vld1q_f64(&state.z[0][ch]);
+			float64x2_t z1 = vld1q_f64(&state.z[1][ch]);
+			float64x2_t z2 = vld1q_f64(&state.z[2][ch]);
+			float64x2_t z3 = vld1q_f64(&state.z[3][ch]);
+			float64x2_t sum = vdupq_n_f64(0.0);
+			const float* p = src + ch;
+			for (int i = 0; i < frames; ++i, p += channels)
+			{
+				float64x2_t x = vcvt_f64_f32(vld1_f32(p));
+				float64x2_t y1 = vaddq_f64(vmulq_f64(b00, x), z0);
+				z0 = vaddq_f64(vsubq_f64(vmulq_f64(b01, x), vmulq_f64(a00, y1)), z1);
+				z1 = vsubq_f64(vmulq_f64(b02, x), vmulq_f64(a01, y1));
+				float64x2_t y2 = vaddq_f64(vmulq_f64(b10, y1), z2);
+				z2 = vaddq_f64(vsubq_f64(vmulq_f64(b11, y1), vmulq_f64(a10, y2)), z3);
+				z3 = vsubq_f64(vmulq_f64(b12, y1), vmulq_f64(a11, y2));
+				sum = vaddq_f64(sum, vmulq_f64(y2, y2));
+			}
+			vst1q_f64(&state.z[0][ch], z0);
+			vst1q_f64(&state.z[1][ch], z1);
+			vst1q_f64(&state.z[2][ch], z2);
+			vst1q_f64(&state.z[3][ch], z3);
+			sums[ch] += vgetq_lane_f64(sum, 0);
+			sums[ch + 1] += vgetq_lane_f64(sum, 1);
+		}
+		for (; ch < channels; ++ch)
+			k_weight_channel(src, frames, channels, ch, c, state, sums);
+	}
+
+	static float true_peak_neon(const float* src, int frames, int channels)
+	{
+		float32x4_t coefficients[true_peak_taps];
+		for (int tap = 0; tap < true_peak_taps; ++tap)
+			coefficients[tap] = vld1q_f32(true_peak_coefficients[tap]);
+		float32x4_t peak = vdupq_n_f32(0.0f);
+		for (int ch = 0; ch < channels; ++ch)
+		{
+			const float* x = src + ch;
+			for (int i = 0; i < frames; ++i, x += channels)
+			{
+				float32x4_t sum = vdupq_n_f32(0.0f);
+				for (int tap = 0; tap < true_peak_taps; ++tap)
+					sum = vaddq_f32(sum, vmulq_f32(vdupq_n_f32(x[-tap * channels]), coefficients[tap]));
+				peak = vmaxq_f32(peak, vabsq_f32(sum));
+			}
+		}
+		return vmaxvq_f32(peak);
+	}
+
+	const loudness_kernels* get_neon_loudness_kernels()
+	{
+		static const loudness_kernels kernels = {
+			"neon",
+			k_weight_neon,
+			true_peak_neon
+		};
+		return &kernels;
+	}
+#else
+	const loudness_kernels* get_neon_loudness_kernels() { return nullptr; }
+#endif // SAMPLE_CONVERT_NEON
+}
@@ -0,0 +1,339 @@
+﻿#include "audio_metrics.hpp"
+#include "ffmpeg_xaudio2_internal.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdarg>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace audio
+{
+	struct metric_counter_info
+	{
+		const char* name;
+		const char* help;
+	};
+
+	static const metric_counter_info counter_infos[] = {
+		{ "packets_demuxed", "Audio packets read by the demux stage" },
+		{ "frames_decoded", "Frames produced by the decode stage" },
+		{ "buffers_submitted", "PCM buffers submitted to output sinks" },
+		{ "samples_submitted", "Samples submitted to output sinks" },
+		{ "output_underruns", "Times an output queue ran empty during playback" },
+		{ "decode_starved", "Times the decode stage waited for packets" },
+		{ "output_starved", "Times the output stage waited for frames" },
+		{ "input_reads", "Calls of the avio read callback" },
+		{ "input_bytes_read", "Bytes returned by the avio read callback" },
+		{ "buffer_pool_hits", "Output buffers taken from the preallocated pool" },
+		{ "buffer_pool_misses", "Output buffers allocated from the heap" },
+	};
+	static_assert(sizeof(counter_infos) / sizeof(counter_infos[0]) == static_cast<size_t>(metric_counter::count),
+		"counter_infos must match metric_counter");
+
+	struct metric_histogram_info
+	{
+		const char* name;
+		const char* unit;
+		// 第一个桶的上界为2^shift
+		int shift;
+		const char* help;
+	};
+
+	// 纳秒直方图从256ns开始，最后一个有上界的桶约为275s
+	static const metric_histogram_info histogram_infos[] = {
+		{ "demux_packet_ns", "ns", 8, "av_read_frame time per packet" },
+		{ "decode_frame_ns", "ns", 8, "Decode time per frame" },
+		{ "convert_ns", "ns", 8, "Sample conversion time per output buffer" },
+		{ "submit_to_play_ns", "ns", 8, "Time from submit_buffer to buffer end" },
+		{ "input_read_ns", "ns", 8, "Time per avio read callback" },
+		{ "device_queue_depth", "buffers", 0, "Buffers queued in the output sink after each submit" },
+		{ "device_queue_us", "us", 0, "Audio queued in the output sink after each submit" },
+	};
+	static_assert(sizeof(histogram_infos) / sizeof(histogram_infos[0]) == static_cast<size_t>(metric_histogram::count),
+		"histogram_infos must match metric_histogram");
+
+	// 表示value所需的位数，value为0时返回0
+	static int bit_width(uint64_t value)
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+		unsigned long index;
+		return _BitScanReverse64(&index, value) ? int(index) + 1 : 0;
+#elif defined(_MSC_VER)
+		unsigned long index;
+		if (_BitScanReverse(&index, static_cast<unsigned long>(value >> 32)))
+			return int(index) + 33;
+		return _BitScanReverse(&index, static_cast<unsigned long>(value)) ? int(index) + 1 : 0;
+#else
+		return value ? 64 - __builtin_clzll(value) : 0;
+#endif
+	}
+
+	uint64_t metric_histogram_snapshot::percentile(double p) const
+	{
+		if (!count)
+			return 0;
+		uint64_t rank = uint64_t(p * double(count));
+		if (rank >= count)
+			rank = count - 1;
+		uint64_t seen = 0;
+		for (int i = 0; i < metric_histogram_buckets; ++i)
+		{
+			seen += buckets[i];
+			if (seen > rank)
+				return i + 1 < metric_histogram_buckets && upper_bound(i) < max ? upper_bound(i) : max;
+		}
+		return max;
+	}
+
+	audio_metrics::audio_metrics()
+	{
+		reset();
+	}
+
+	void audio_metrics::record(metric_histogram which, uint64_t value)
+	{
+		histogram& target = histograms[static_cast<int>(which)];
+		int shift = histogram_infos[static_cast<int>(which)].shift;
+		// 值不超过2^(i + shift)的最小的i，即value - 1的位数减去shift
+		int bucket = value > 1 ? bit_width(value - 1) - shift : 0;
+		if (bucket < 0)
+			bucket = 0;
+		if (bucket >= metric_histogram_buckets)
+			bucket = metric_histogram_buckets - 1;
+		target.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+		target.count.fetch_add(1, std::memory_order_relaxed);
+		target.sum.fetch_add(value, std::memory_order_relaxed);
+		uint64_t current_max = target.max.load(std::memory_order_relaxed);
+		while (value > current_max
+			&& !target.max.compare_exchange_weak(current_max, value, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	void audio_metrics::snapshot(audio_metrics_snapshot& snapshot) const
+	{
+		for (int i = 0; i < static_cast<int>(metric_counter::count); ++i)
+			snapshot.counters[i] = counters[i].load(std::memory_order_relaxed);
+		for (int i = 0; i < static_cast<int>(metric_histogram::count); ++i)
+		{
+			metric_histogram_snapshot& target = snapshot.histograms[i];
+			target.name = histogram_infos[i].name;
+			target.unit = histogram_infos[i].unit;
+			target.shift = histogram_infos[i].shift;
+			target.count = histograms[i].count.load(std::memory_order_relaxed);
+			target.sum = histograms[i].sum.load(std::memory_order_relaxed);
+			target.max = histograms[i].max.load(std::memory_order_relaxed);
+			for (int j = 0; j < metric_histogram_buckets; ++j)
+				target.buckets[j] = histograms[i].buckets[j].load(std::memory_order_relaxed);
+		}
+		snapshot.uptime_seconds = double(now_ns() - start_ns.load(std::memory_order_relaxed)) / 1e9;
+	}
+
+	void audio_metrics::reset()
+	{
+		for (auto& counter : counters)
+			counter.store(0, std::memory_order_relaxed);
+		for (auto& target : histograms)
+		{
+			target.count.store(0, std::memory_order_relaxed);
+			target.sum.store(0, std::memory_order_relaxed);
+			target.max.store(0, std::memory_order_relaxed);
+			for (auto& bucket : target.buckets)
+				bucket.store(0, std::memory_order_relaxed);
+		}
+		start_ns.store(now_ns(), std::memory_order_relaxed);
+	}
+
+	audio_metrics& get_audio_metrics()
+	{
+		static audio_metrics metrics;
+		return metrics;
+	}
+
+	void append_format(std::string& out, const char* format, ...)
+	{
+		char line[512];
+		va_list args;
+		va_start(args, format);
+		int length = std::vsnprintf(line, sizeof(line), format, args);
+		va_end(args);
+		if (length > 0)
+			out.append(line, size_t(length) < sizeof(line) ? size_t(length) : sizeof(line) - 1);
+	}
+
+	static std::string format_json(const audio_metrics_snapshot& snapshot)
+	{
+		std::string out = "{\n";
+		append_format(out, "  \"uptime_seconds\": %.3f,\n  \"counters\": {\n", snapshot.uptime_seconds);
+		for (int i = 0; i < static_cast<int>(metric_counter::count); ++i)
+			append_format(out, "    \"%s\": %llu%s\n", counter_infos[i].name,
+				static_cast<unsigned long long>(snapshot.counters[i]), i + 1 < static_cast<int>(metric_counter::count) ? "," : "");
+		out += "  },\n  \"histograms\": {\n";
+		for (int i = 0; i < static_cast<int>(metric_histogram::count); ++i)
+		{
+			const metric_histogram_snapshot& histogram = snapshot.histograms[i];
+			append_format(out, "    \"%s\": {\"unit\": \"%s\", \"count\": %llu, \"sum\": %llu, \"max\": %llu, "
+				"\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"buckets\": [",
+				histogram.name, histogram.unit, static_cast<unsigned long long>(histogram.count),
+				static_cast<unsigned long long>(histogram.sum), static_cast<unsigned long long>(histogram.max),
+				static_cast<unsigned long long>(histogram.percentile(0.5)),
+				static_cast<unsigned long long>(histogram.percentile(0.9)),
+				static_cast<unsigned long long>(histogram.percentile(0.99)));
+			// 只列出非空的桶，le为桶的上界
+			bool first = true;
+			for (int j = 0; j < metric_histogram_buckets; ++j)
+			{
+				if (!histogram.buckets[j])
+					continue;
+				if (j + 1 < metric_histogram_buckets)
+					append_format(out, "%s{\"le\": %llu, \"count\": %llu}", first ? "" : ", ",
+						static_cast<unsigned long long>(histogram.upper_bound(j)),
+						static_cast<unsigned long long>(histogram.buckets[j]));
+				else
+					append_format(out, "%s{\"le\": \"+Inf\", \"count\": %llu}", first ? "" : ", ",
+						static_cast<unsigned long long>(histogram.buckets[j]));
+				first = false;
+			}
+			append_format(out, "]}%s\n", i + 1 < static_cast<int>(metric_histogram::count) ? "," : "");
+		}
+		out += "  }\n}\n";
+		return out;
+	}
+
+	// 纳秒直方图按惯例以秒为单位输出
+	static std::string format_prometheus(const audio_metrics_snapshot& snapshot)
+	{
+		std::string out;
+		for (int i = 0; i < static_cast<int>(metric_counter::count); ++i)
+		{
+			append_format(out, "# HELP audio_%s_total %s\n# TYPE audio_%s_total counter\naudio_%s_total %llu\n",
+				counter_infos[i].name, counter_infos[i].help, counter_infos[i].name, counter_infos[i].name,
+				static_cast<unsigned long long>(snapshot.counters[i]));
+		}
+		for (int i = 0; i < static_cast<int>(metric_histogram::count); ++i)
+		{
+			const metric_histogram_snapshot& histogram = snapshot.histograms[i];
+			// 时间按prometheus的惯例换算为秒
+			std::string unit = histogram.unit;
+			std::string name = histogram.name;
+			double scale = unit == "ns" ? 1e-9 : (unit == "us" ? 1e-6 : 1);
+			if (scale != 1)
+				name = name.substr(0, name.size() - 3) + "_seconds";
+			append_format(out, "# HELP audio_%s %s\n# TYPE audio_%s histogram\n",
+				name.c_str(), histogram_infos[i].help, name.c_str());
+			uint64_t cumulative = 0;
+			for (int j = 0; j + 1 < metric_histogram_buckets; ++j)
+			{
+				cumulative += histogram.buckets[j];
+				append_format(out, "audio_%s_bucket{le=\"%.9g\"} %llu\n", name.c_str(),
+					double(histogram.upper_bound(j)) * scale, static_cast<unsigned long long>(cumulative));
+			}
+			append_format(out, "audio_%s_bucket{le=\"+Inf\"} %llu\naudio_%s_sum %.9g\naudio_%s_count %llu\n",
+				name.c_str(), static_cast<unsigned long long>(histogram.count),
+				name.c_str(), double(histogram.sum) * scale,
+				name.c_str(), static_cast<unsigned long long>(histogram.count));
+		}
+		return out;
+	}
+
+	std::string format_audio_metrics(const audio_metrics_snapshot& snapshot, metrics_format format)
+	{
+		return format == metrics_format::json ? format_json(snapshot) : format_prometheus(snapshot);
+	}
+
+	int dump_audio_metrics(metrics_format format, const char* path)
+	{
+		audio_metrics_snapshot snapshot;
+		get_audio_metrics().snapshot(snapshot);
+		std::string text = format_audio_metrics(snapshot, format);
+		if (!path)
+		{
+			std::fwrite(text.data(), 1, text.size(), stdout);
+			std::fflush(stdout);
+			return 0;
+		}
+		std::string temp_path = std::string(path) + ".tmp";
+		std::FILE* file = std::fopen(temp_path.c_str(), "wb");
+		if (!file)
+		{
+			std::printf("err: open metrics file %s failed\n", temp_path.c_str());
+			return -1;
+		}
+		bool written = std::fwrite(text.data(), 1, text.size(), file) == text.size();
+		written = std::fclose(file) == 0 && written;
+#if defined(_WIN32)
+		// windows上rename不会覆盖已有的文件
+		std::remove(path);
+#endif
+		if (!written || std::rename(temp_path.c_str(), path) != 0)
+		{
+			std::printf("err: write metrics file %s failed\n", path);
+			std::remove(temp_path.c_str());
+			return -1;
+		}
+		return 0;
+	}
+
+	namespace
+	{
+		struct metrics_reporter
+		{
+			std::thread thread;
+			std::mutex mutex;
+			std::condition_variable cv;
+			bool exit = false;
+			bool running = false;
+			metrics_format format = metrics_format::json;
+			std::string path;
+			bool to_stdout = true;
+		};
+
+		metrics_reporter& get_reporter()
+		{
+			static metrics_reporter reporter;
+			return reporter;
+		}
+	}
+
+	void start_audio_metrics_reporter(metrics_format format, const char* path, int interval_ms)
+	{
+		stop_audio_metrics_reporter();
+		metrics_reporter& reporter = get_reporter();
+		std::lock_guard<std::mutex> lock(reporter.mutex);
+		reporter.format = format;
+		reporter.to_stdout = path == nullptr;
+		reporter.path = path ? path : "";
+		reporter.exit = false;
+		reporter.running = true;
+		if (interval_ms <= 0)
+			return;
+		reporter.thread = std::thread([&reporter, interval_ms] {
+			std::unique_lock<std::mutex> lock(reporter.mutex);
+			while (!reporter.cv.wait_for(lock, std::chrono::milliseconds(interval_ms), [&reporter] { return reporter.exit; }))
+			{
+				lock.unlock();
+				dump_audio_metrics(reporter.format, reporter.to_stdout ? nullptr : reporter.path.c_str());
+				lock.lock();
+			}
+			});
+	}
+
+	void stop_audio_metrics_reporter()
+	{
+		metrics_reporter& reporter = get_reporter();
+		{
+			std::lock_guard<std::mutex> lock(reporter.mutex);
+			if (!reporter.running)
+				return;
+			reporter.exit = true;
+			reporter.running = false;
+		}
+		reporter.cv.notify_all();
+		if (reporter.thread.joinable())
+			reporter.thread.join();
+		dump_audio_metrics(reporter.format, reporter.to_stdout ? nullptr : reporter.path.c_str());
+	}
+}
@@ -0,0 +1,120 @@
+﻿#if !defined(AUDIO_METRICS_HPP_)
+#define AUDIO_METRICS_HPP_
+#include "audio_play_interface.hpp"
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace audio
+{
+	// 进程内所有播放器共用的性能指标：计数器与固定分桶的直方图均为原子变量（relaxed），
+	// 热路径上每次记录只有几次原子加法，不加锁、不分配内存
+	enum class metric_counter
+	{
+		packets_demuxed,
+		frames_decoded,
+		buffers_submitted,
+		samples_submitted,
+		// 播放过程中输出端队列被耗尽的次数
+		output_underruns,
+		// decode/output阶段因上游没有数据而等待的次数
+		decode_starved,
+		output_starved,
+		// read_func的调用次数与读取的字节数
+		input_reads,
+		input_bytes_read,
+		// 输出缓冲区池：直接取得块的次数与转而从堆上分配的次数
+		buffer_pool_hits,
+		buffer_pool_misses,
+		count
+	};
+
+	enum class metric_histogram
+	{
+		demux_packet_ns,    // 每个packet的av_read_frame耗时
+		decode_frame_ns,    // 每帧的解码耗时（送入packet与取出该帧）
+		convert_ns,         // 每个输出缓冲区的swr_convert/样本转换耗时
+		submit_to_play_ns,  // 缓冲区从submit_buffer到播放完毕回调的时间
+		input_read_ns,      // 每次read_func的耗时
+		device_queue_depth, // 每次提交后输出端排队的缓冲区数
+		device_queue_us,    // 每次提交后输出端排队的音频时长
+		count
+	};
+
+	// 第i个桶的上界为2^(i + shift)，最后一个桶没有上界
+	constexpr int metric_histogram_buckets = 32;
+
+	struct metric_histogram_snapshot
+	{
+		const char* name = nullptr;
+		const char* unit = nullptr;
+		int shift = 0;
+		uint64_t count = 0;
+		uint64_t sum = 0;
+		uint64_t max = 0;
+		uint64_t buckets[metric_histogram_buckets] = {};
+
+		// 第i个桶的上界，最后一个桶返回UINT64_MAX
+		uint64_t upper_bound(int i) const
+		{
+			return i + 1 < metric_histogram_buckets ? uint64_t(1) << (i + shift) : UINT64_MAX;
+		}
+		// 按桶估计分位数（取所在桶的上界，不超过max），p在[0, 1]之间
+		uint64_t percentile(double p) const;
+	};
+
+	struct audio_metrics_snapshot
+	{
+		uint64_t counters[static_cast<int>(metric_counter::count)] = {};
+		metric_histogram_snapshot histograms[static_cast<int>(metric_histogram::count)];
+		double uptime_seconds = 0;
+	};
+
+	class audio_metrics
+	{
+	public:
+		audio_metrics();
+		audio_metrics(const audio_metrics&) = delete;
+		audio_metrics& operator=(const audio_metrics&) = delete;
+
+		void add(metric_counter counter, uint64_t value = 1)
+		{
+			counters[static_cast<int>(counter)].fetch_add(value, std::memory_order_relaxed);
+		}
+		void record(metric_histogram histogram, uint64_t value);
+
+		// 各项分别原子地读取，快照内的数值之间不保证严格一致
+		void snapshot(audio_metrics_snapshot& snapshot) const;
+		void reset();
+
+	private:
+		struct histogram
+		{
+			std::atomic<uint64_t> count{ 0 };
+			std::atomic<uint64_t> sum{ 0 };
+			std::atomic<uint64_t> max{ 0 };
+			std::atomic<uint64_t> buckets[metric_histogram_buckets];
+		};
+
+		std::atomic<uint64_t> counters[static_cast<int>(metric_counter::count)];
+		histogram histograms[static_cast<int>(metric_histogram::count)];
+		std::atomic<int64_t> start_ns{ 0 };
+	};
+
+	audio_metrics& get_audio_metrics();
+
+	enum class metrics_format
+	{
+		json,
+		prometheus // text exposition format 0.0.4
+	};
+
+	std::string format_audio_metrics(const audio_metrics_snapshot& snapshot, metrics_format format);
+	// 输出到path（nullptr时为标准输出）；写入文件时先写临时文件再改名，读取方不会看到写了一半的内容
+	int dump_audio_metrics(metrics_format format, const char* path);
+	// interval_ms > 0时在后台线程中定时输出；stop时再输出一次
+	void start_audio_metrics_reporter(metrics_format format, const char* path, int interval_ms);
+	void stop_audio_metrics_reporter();
+}
+
+#endif // AUDIO_METRICS_HPP_
@@ -0,0 +1,702 @@
+﻿#include "audio_mixer.hpp"
+#include "audio_worker_pool.hpp"
+#include "audio_trace.hpp"
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace audio
+{
+	// ---- 标量内核 ----
+
+	static void mix_f32_scalar(float* acc, const float* src, int frames, int channels, const mix_gain_ramp& gain)
+	{
+		if (channels == 2)
+		{
+			for (int i = 0; i < frames; ++i)
+			{
+				float index = float(i);
+				acc[2 * i] += src[2 * i] * (gain.left + gain.left_step * index);
+				acc[2 * i + 1] += src[2 * i + 1] * (gain.right + gain.right_step * index);
+			}
+			return;
+		}
+		for (int i = 0; i < frames; ++i)
+		{
+			float value = gain.left + gain.left_step * float(i);
+			for (int ch = 0; ch < channels; ++ch)
+				acc[i * channels + ch] += src[i * channels + ch] * value;
+		}
+	}
+
+	static void mix_s16_scalar(int32_t* acc, const int16_t* src, int frames, int channels, const mix_gain_ramp& gain)
+	{
+		mix_s16_q28(acc, src, frames, channels, mix_gain_to_q28(gain.left), mix_gain_to_q28(gain.right),
+			mix_step_to_q28(gain.left_step), mix_step_to_q28(gain.right_step));
+	}
+
+	static float peak_f32_scalar(const float* src, int samples)
+	{
+		float peak = 0.0f;
+		for (int i = 0; i < samples; ++i)
+			peak = std::max(peak, std::fabs(src[i]));
+		return peak;
+	}
+
+	static void scale_clamp_f32_scalar(float* dest, const float* src, int frames, int channels, float gain, float step)
+	{
+		for (int i = 0; i < frames; ++i)
+		{
+			float value = gain + step * float(i);
+			for (int ch = 0; ch < channels; ++ch)
+			{
+				float sample = src[i * channels + ch] * value;
+				dest[i * channels + ch] = sample < -1.0f ? -1.0f : (sample > 1.0f ? 1.0f : sample);
+			}
+		}
+	}
+
+	static void saturate_s16_scalar(int16_t* dest, const int32_t* src, int samples)
+	{
+		for (int i = 0; i < samples; ++i)
+			dest[i] = static_cast<int16_t>(src[i] < -32768 ? -32768 : (src[i] > 32767 ? 32767 : src[i]));
+	}
+
+	const mix_kernels& get_scalar_mix_kernels()
+	{
+		static const mix_kernels kernels = {
+			"scalar",
+			mix_f32_scalar,
+			mix_s16_scalar,
+			peak_f32_scalar,
+			scale_clamp_f32_scalar,
+			saturate_s16_scalar
+		};
+		return kernels;
+	}
+
+	int get_available_mix_kernels(const mix_kernels** kernels, int max_count)
+	{
+		int count = 0;
+		auto add = [&](const mix_kernels* candidate) {
+			if (candidate && count < max_count)
+				kernels[count++] = candidate;
+		};
+		add(&get_scalar_mix_kernels());
+#if defined(SAMPLE_CONVERT_X86)
+		if (cpu_has_sse2())
+			add(get_sse2_mix_kernels());
+		if (cpu_has_avx2())
+			add(get_avx2_mix_kernels());
+#endif
+#if defined(SAMPLE_CONVERT_NEON)
+		add(get_neon_mix_kernels());
+#endif
+		return count;
+	}
+
+	const mix_kernels& get_mix_kernels()
+	{
+		static const mix_kernels* best = [] {
+			const mix_kernels* kernels[4];
+			int count = get_available_mix_kernels(kernels, 4);
+			return kernels[count - 1];
+		}();
+		return *best;
+	}
+
+	// ---- 音源 ----
+
+	class mix_memory_source : public audio_mix_source
+	{
+	public:
+		mix_memory_source(const void* data, int frames, int block_align, bool loop)
+			: data(static_cast<const uint8_t*>(data)), frames(frames), block_align(block_align), loop(loop) {}
+
+		int read(const void*& out, int max_frames) override
+		{
+			if (position >= frames)
+			{
+				if (!loop || frames == 0)
+					return 0;
+				position = 0;
+			}
+			int count = std::min(max_frames, frames - position);
+			out = data + size_t(position) * block_align;
+			position += count;
+			return count;
+		}
+
+		bool is_finished() const override { return !loop && position >= frames; }
+
+	private:
+		const uint8_t* data;
+		int frames;
+		int block_align;
+		bool loop;
+		int position = 0;
+	};
+
+	audio_mix_source* create_mix_memory_source(const void* data, int frames, const audio_output_format& format, bool loop)
+	{
+		return DBG_NEW mix_memory_source(data, frames, format.block_align(), loop);
+	}
+
+	// 以帧为单位的环形缓冲区；read返回的区域在下一次read时才归还给生产者
+	class mix_queue_source : public audio_mix_queue_source
+	{
+	public:
+		mix_queue_source(int capacity, int block_align, std::function<void()> on_consumed)
+			: capacity(capacity), block_align(block_align), on_consumed(std::move(on_consumed))
+		{
+			buffer = static_cast<uint8_t*>(av_malloc(size_t(capacity) * block_align));
+		}
+		~mix_queue_source() override { av_free(buffer); }
+
+		bool is_valid() const { return buffer != nullptr; }
+
+		int push(const void* data, int frames) override
+		{
+			uint64_t current_tail = tail.load(std::memory_order_relaxed);
+			uint64_t current_head = head.load(std::memory_order_acquire);
+			frames = std::min(frames, capacity - int(current_tail - current_head));
+			const uint8_t* src = static_cast<const uint8_t*>(data);
+			for (int written = 0; written < frames;)
+			{
+				int offset = int((current_tail + written) % capacity);
+				int count = std::min(frames - written, capacity - offset);
+				std::memcpy(buffer + size_t(offset) * block_align, src + size_t(written) * block_align,
+					size_t(count) * block_align);
+				written += count;
+			}
+			tail.store(current_tail + frames, std::memory_order_release);
+			return frames;
+		}
+
+		int get_free_frames() const override
+		{
+			return capacity - int(tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire));
+		}
+
+		void end_of_stream() override { ended.store(true, std::memory_order_release); }
+
+		int read(const void*& out, int max_frames) override
+		{
+			release_consumed();
+			uint64_t current_head = head.load(std::memory_order_relaxed);
+			int available = int(tail.load(std::memory_order_acquire) - current_head);
+			int offset = int(current_head % capacity);
+			int count = std::min(std::min(available, max_frames), capacity - offset);
+			out = buffer + size_t(offset) * block_align;
+			consumed = count;
+			return count;
+		}
+
+		bool is_finished() const override
+		{
+			// 先读ended：之后读到的tail包含end_of_stream之前的全部数据
+			bool stream_ended = ended.load(std::memory_order_acquire);
+			return stream_ended && head.load(std::memory_order_relaxed) + consumed == tail.load(std::memory_order_acquire);
+		}
+
+		void on_mix_end() override { release_consumed(); }
+
+	private:
+		void release_consumed()
+		{
+			if (!consumed)
+				return;
+			head.store(head.load(std::memory_order_relaxed) + consumed, std::memory_order_release);
+			consumed = 0;
+			if (on_consumed)
+				on_consumed();
+		}
+
+		uint8_t* buffer = nullptr;
+		const int capacity;
+		const int block_align;
+		std::function<void()> on_consumed;
+		std::atomic<bool> ended{ false };
+		// 消费者独占：上一次read返回、尚未归还的帧数
+		alignas(64) std::atomic<uint64_t> head{ 0 };
+		int consumed = 0;
+		alignas(64) std::atomic<uint64_t> tail{ 0 };
+	};
+
+	audio_mix_queue_source* create_mix_queue_source(const audio_output_format& format, int capacity_frames,
+		std::function<void()> on_consumed)
+	{
+		auto source = DBG_NEW mix_queue_source(std::max(capacity_frames, 1), format.block_align(), std::move(on_consumed));
+		if (!source->is_valid())
+		{
+			delete source;
+			return nullptr;
+		}
+		return source;
+	}
+
+	// ---- 混音器 ----
+
+	// 等功率声像
+	static void pan_gains(float gain, float pan, float& left, float& right)
+	{
+		pan = pan < -1.0f ? -1.0f : (pan > 1.0f ? 1.0f : pan);
+		double angle = (double(pan) + 1.0) * 0.78539816339744830962;
+		left = float(gain * std::cos(angle));
+		right = float(gain * std::sin(angle));
+	}
+
+	class audio_mixer_impl : public audio_mixer
+	{
+	public:
+		~audio_mixer_impl() override;
+
+		int initialize(const audio_mixer_config& config, const mix_kernels* kernels);
+
+		int add_source(audio_mix_source* source, float gain, float pan) override;
+		void set_source_gain(int id, float gain, float pan) override;
+		void remove_source(int id) override;
+		void mix_period(void* output) override;
+
+		int get_period_frames() const override { return period_frames; }
+		const audio_output_format& get_format() const override { return format; }
+		void get_stats(audio_mixer_stats& stats) override;
+
+	private:
+		enum class command_type { add, gain, remove };
+		struct mix_command
+		{
+			command_type type;
+			int id;
+			audio_mix_source* source;
+			float left;
+			float right;
+		};
+
+		// 只由混音线程访问
+		struct mix_slot
+		{
+			int id;
+			audio_mix_source* source;
+			float left;
+			float right;
+			float target_left;
+			float target_right;
+			float left_step;
+			float right_step;
+			int ramp_remaining;
+			bool removing;
+		};
+
+		void apply_commands();
+		void start_ramp(mix_slot& slot, float left, float right);
+		void advance_ramp(mix_slot& slot, int frames);
+		// 把count帧混合到累加缓冲区的第offset帧处
+		void mix_frames(mix_slot& slot, const void* data, int offset, int count);
+
+		audio_output_format format;
+		const mix_kernels* kernels = nullptr;
+		int period_frames = 0;
+		int ramp_frames = 0;
+		int samples_per_period = 0;
+		bool limiter = true;
+		float limiter_threshold = 0.98f;
+		float release_coefficient = 0;
+		float limiter_gain = 1.0f;
+		// float或int32，每个样本4字节
+		void* accumulator = nullptr;
+
+		std::vector<mix_slot> slots;
+		std::vector<mix_command> command_buffer;
+
+		// 保护commands、next_id与stats
+		std::mutex mutex;
+		std::vector<mix_command> commands;
+		int next_id = 0;
+		audio_mixer_stats stats;
+	};
+
+	audio_mixer_impl::~audio_mixer_impl()
+	{
+		for (auto& slot : slots)
+			slot.source->on_mix_end();
+		for (auto& command : commands)
+		{
+			if (command.type == command_type::add)
+				command.source->on_mix_end();
+		}
+		av_free(accumulator);
+	}
+
+	int audio_mixer_impl::initialize(const audio_mixer_config& config, const mix_kernels* mixer_kernels)
+	{
+		format = config.format;
+		bool float_format = format.is_float && format.bits_per_sample == 32;
+		bool s16_format = !format.is_float && format.bits_per_sample == 16;
+		if ((!float_format && !s16_format) || format.channels <= 0 || format.sample_rate <= 0)
+		{
+			std::printf("err: mixer supports 16-bit and 32-bit float output, got %d-bit%s\n",
+				format.bits_per_sample, format.is_float ? " float" : "");
+			return -1;
+		}
+		kernels = mixer_kernels ? mixer_kernels : &get_mix_kernels();
+		period_frames = config.period_frames > 0 ? config.period_frames : std::max(format.sample_rate / 100, 1);
+		ramp_frames = config.ramp_frames > 0 ? config.ramp_frames : period_frames;
+		samples_per_period = period_frames * format.channels;
+		limiter = config.limiter;
+		limiter_threshold = config.limiter_threshold > 0 ? config.limiter_threshold : 1.0f;
+		double period_ms = 1000.0 * period_frames / format.sample_rate;
+		release_coefficient = config.limiter_release_ms > 0
+			? float(1.0 - std::exp(-period_ms / config.limiter_release_ms)) : 1.0f;
+		accumulator = av_malloc(size_t(samples_per_period) * 4);
+		if (!accumulator)
+			return -1;
+		return 0;
+	}
+
+	int audio_mixer_impl::add_source(audio_mix_source* source, float gain, float pan)
+	{
+		if (!source)
+			return -1;
+		mix_command command = { command_type::add, 0, source, 0, 0 };
+		pan_gains(gain, pan, command.left, command.right);
+		std::lock_guard<std::mutex> lock(mutex);
+		command.id = next_id++;
+		commands.push_back(command);
+		return command.id;
+	}
+
+	void audio_mixer_impl::set_source_gain(int id, float gain, float pan)
+	{
+		mix_command command = { command_type::gain, id, nullptr, 0, 0 };
+		pan_gains(gain, pan, command.left, command.right);
+		std::lock_guard<std::mutex> lock(mutex);
+		commands.push_back(command);
+	}
+
+	void audio_mixer_impl::remove_source(int id)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		commands.push_back({ command_type::remove, id, nullptr, 0, 0 });
+	}
+
+	void audio_mixer_impl::start_ramp(mix_slot& slot, float left, float right)
+	{
+		slot.target_left = left;
+		slot.target_right = right;
+		slot.ramp_remaining = ramp_frames;
+		slot.left_step = (left - slot.left) / float(ramp_frames);
+		slot.right_step = (right - slot.right) / float(ramp_frames);
+	}
+
+	void audio_mixer_impl::advance_ramp(mix_slot& slot, int frames)
+	{
+		if (slot.ramp_remaining <= 0)
+			return;
+		frames = std::min(frames, slot.ramp_remaining);
+		slot.ramp_remaining -= frames;
+		if (slot.ramp_remaining == 0)
+		{
+			// 消除累积误差
+			slot.left = slot.target_left;
+			slot.right = slot.target_right;
+			slot.left_step = 0;
+			slot.right_step = 0;
+			return;
+		}
+		slot.left += slot.left_step * float(frames);
+		slot.right += slot.right_step * float(frames);
+	}
+
+	void audio_mixer_impl::apply_commands()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			command_buffer.swap(commands);
+		}
+		for (const auto& command : command_buffer)
+		{
+			if (command.type == command_type::add)
+			{
+				// 从第一帧起即为设定的增益，不淡入
+				slots.push_back({ command.id, command.source, command.left, command.right,
+					command.left, command.right, 0, 0, 0, false });
+				continue;
+			}
+			auto slot = std::find_if(slots.begin(), slots.end(), [&](const mix_slot& s) { return s.id == command.id; });
+			if (slot == slots.end() || slot->removing)
+				continue;
+			if (command.type == command_type::gain)
+				start_ramp(*slot, command.left, command.right);
+			else
+			{
+				start_ramp(*slot, 0, 0);
+				slot->removing = true;
+			}
+		}
+		command_buffer.clear();
+	}
+
+	void audio_mixer_impl::mix_frames(mix_slot& slot, const void* data, int offset, int count)
+	{
+		int channels = format.channels;
+		int ramp = std::min(count, slot.ramp_remaining);
+		for (int part = 0; part < 2; ++part)
+		{
+			int frames = part == 0 ? ramp : count - ramp;
+			if (frames <= 0)
+				continue;
+			mix_gain_ramp gain;
+			gain.left = slot.left;
+			gain.right = slot.right;
+			gain.left_step = part == 0 ? slot.left_step : 0.0f;
+			gain.right_step = part == 0 ? slot.right_step : 0.0f;
+			// 静音的音源只消耗数据
+			bool silent = gain.left == 0 && gain.right == 0 && gain.left_step == 0 && gain.right_step == 0;
+			if (!silent)
+			{
+				if (format.is_float)
+					kernels->mix_f32(static_cast<float*>(accumulator) + size_t(offset) * channels,
+						static_cast<const float*>(data), frames, channels, gain);
+				else
+					kernels->mix_s16(static_cast<int32_t*>(accumulator) + size_t(offset) * channels,
+						static_cast<const int16_t*>(data), frames, channels, gain);
+			}
+			if (part == 0)
+				advance_ramp(slot, frames);
+			offset += frames;
+			data = static_cast<const uint8_t*>(data) + size_t(frames) * format.block_align();
+		}
+	}
+
+	void audio_mixer_impl::mix_period(void* output)
+	{
+		AUDIO_TRACE_SCOPE(mix, "mix period");
+		auto begin = std::chrono::steady_clock::now();
+		apply_commands();
+		std::memset(accumulator, 0, size_t(samples_per_period) * 4);
+
+		uint64_t underruns = 0;
+		for (size_t i = 0; i < slots.size();)
+		{
+			mix_slot& slot = slots[i];
+			int mixed = 0;
+			while (mixed < period_frames)
+			{
+				const void* data = nullptr;
+				int count = slot.source->read(data, period_frames - mixed);
+				if (count <= 0)
+					break;
+				mix_frames(slot, data, mixed, count);
+				mixed += count;
+			}
+			bool finished = slot.source->is_finished();
+			if (mixed < period_frames)
+			{
+				if (!finished)
+					underruns++;
+				// 渐变按时间推进，数据不足的部分同样计入
+				advance_ramp(slot, period_frames - mixed);
+			}
+			if (finished || (slot.removing && slot.ramp_remaining == 0))
+			{
+				slot.source->on_mix_end();
+				slots[i] = slots.back();
+				slots.pop_back();
+				continue;
+			}
+			++i;
+		}
+
+		bool limited = false;
+		if (format.is_float)
+		{
+			const float* acc = static_cast<const float*>(accumulator);
+			float gain = 1.0f;
+			float step = 0.0f;
+			if (limiter)
+			{
+				float peak = kernels->peak_f32(acc, samples_per_period);
+				if (peak * limiter_gain > limiter_threshold)
+				{
+					// 起音立即生效，本周期内不超过阈值
+					limiter_gain = limiter_threshold / peak;
+					limited = true;
+				}
+				else if (limiter_gain < 1.0f)
+				{
+					// 释放：在本周期内渐变到新的增益，同样不超过阈值
+					float target = std::min(limiter_gain + (1.0f - limiter_gain) * release_coefficient, 1.0f);
+					if (peak > 0)
+						target = std::min(target, limiter_threshold / peak);
+					step = (target - limiter_gain) / float(period_frames);
+					gain = limiter_gain;
+					limiter_gain = target;
+				}
+				if (step == 0.0f)
+					gain = limiter_gain;
+			}
+			kernels->scale_clamp_f32(static_cast<float*>(output), acc, period_frames, format.channels, gain, step);
+		}
+		else
+			kernels->saturate_s16(static_cast<int16_t*>(output), static_cast<const int32_t*>(accumulator), samples_per_period);
+
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		std::lock_guard<std::mutex> lock(mutex);
+		stats.periods++;
+		stats.active_sources = static_cast<uint32_t>(slots.size());
+		stats.max_active_sources = std::max(stats.max_active_sources, stats.active_sources);
+		stats.underruns += underruns;
+		if (limited)
+			stats.limited_periods++;
+		stats.limiter_gain = limiter_gain;
+		stats.mix_seconds += elapsed;
+		AUDIO_TRACE_COUNTER(mix, "mixed sources", int64_t(slots.size()));
+	}
+
+	void audio_mixer_impl::get_stats(audio_mixer_stats& out)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		out = stats;
+	}
+
+	audio_mixer* create_audio_mixer(const audio_mixer_config& config, const mix_kernels* kernels)
+	{
+		auto mixer = DBG_NEW audio_mixer_impl();
+		if (mixer->initialize(config, kernels))
+		{
+			delete mixer;
+			return nullptr;
+		}
+		return mixer;
+	}
+
+	// ---- 输出 ----
+
+	class audio_mix_output_impl : public audio_mix_output, public audio_output_sink_callback
+	{
+	public:
+		~audio_mix_output_impl() override;
+
+		int initialize(audio_mixer* mixer, const audio_sink_config& sink_config, audio_worker_pool* pool, int buffer_count);
+
+		int start() override;
+		void stop() override;
+		const char* get_sink_name() const override { return sink->get_name(); }
+
+		// 可能在输出端的线程中或submit_buffer内同步调用
+		void on_buffer_end(void*) override
+		{
+			queued.fetch_sub(1, std::memory_order_acq_rel);
+			if (running.load(std::memory_order_acquire))
+				task->schedule();
+		}
+		void on_stream_end() override {}
+
+	private:
+		// 线程池中运行：补足排队的周期
+		void run();
+
+		audio_mixer* mixer = nullptr;
+		audio_output_sink* sink = nullptr;
+		audio_worker_pool* pool = nullptr;
+		std::unique_ptr<pool_task> task;
+		uint8_t* buffers = nullptr;
+		uint32_t period_bytes = 0;
+		int buffer_count = 0;
+		uint64_t submitted = 0;
+		std::atomic<int> queued{ 0 };
+		std::atomic<bool> running{ false };
+	};
+
+	audio_mix_output_impl::~audio_mix_output_impl()
+	{
+		stop();
+		if (sink)
+		{
+			sink->close();
+			delete sink;
+		}
+		av_free(buffers);
+	}
+
+	int audio_mix_output_impl::initialize(audio_mixer* mix, const audio_sink_config& sink_config,
+		audio_worker_pool* worker_pool, int count)
+	{
+		mixer = mix;
+		pool = worker_pool ? worker_pool : get_default_audio_worker_pool();
+		buffer_count = std::max(count, 2);
+		period_bytes = uint32_t(mixer->get_period_frames() * mixer->get_format().block_align());
+		buffers = static_cast<uint8_t*>(av_malloc(size_t(period_bytes) * buffer_count));
+		task.reset(DBG_NEW pool_task(pool, [this] { run(); }));
+		sink = create_output_sink(sink_config);
+		if (!buffers || !sink)
+			return -1;
+		sink->set_callback(this);
+		if (sink->open(mixer->get_format()))
+		{
+			std::printf("err: open output sink for mixer failed\n");
+			delete sink;
+			sink = nullptr;
+			return -1;
+		}
+		return 0;
+	}
+
+	int audio_mix_output_impl::start()
+	{
+		if (running.exchange(true))
+			return 0;
+		task->schedule();
+		return sink->start();
+	}
+
+	void audio_mix_output_impl::stop()
+	{
+		if (!running.exchange(false))
+			return;
+		pool->wait_idle(*task);
+		// 被丢弃的缓冲区同样经on_buffer_end归还
+		sink->stop();
+		sink->flush();
+	}
+
+	void audio_mix_output_impl::run()
+	{
+		// 缓冲区按提交顺序播放完毕，排队数小于缓冲区数时下一个位置必然空闲
+		while (running.load(std::memory_order_acquire) && queued.load(std::memory_order_acquire) < buffer_count)
+		{
+			uint8_t* buffer = buffers + size_t(submitted % uint64_t(buffer_count)) * period_bytes;
+			mixer->mix_period(buffer);
+			submitted++;
+			queued.fetch_add(1, std::memory_order_acq_rel);
+			if (sink->submit_buffer(buffer, period_bytes, nullptr))
+			{
+				queued.fetch_sub(1, std::memory_order_acq_rel);
+				std::printf("err: submit mixer period failed\n");
+				running = false;
+				return;
+			}
+		}
+	}
+
+	audio_mix_output* create_mix_output(audio_mixer* mixer, const audio_sink_config& sink_config,
+		audio_worker_pool* pool, int buffer_count)
+	{
+		if (!mixer)
+			return nullptr;
+		auto output = DBG_NEW audio_mix_output_impl();
+		if (output->initialize(mixer, sink_config, pool, buffer_count))
+		{
+			delete output;
+			return nullptr;
+		}
+		return output;
+	}
+}
@@ -0,0 +1,186 @@
+﻿#if !defined(AUDIO_MIXER_HPP_)
+#define AUDIO_MIXER_HPP_
+#include "audio_play_interface.hpp"
+#include "audio_output_sink.hpp"
+#include "sample_convert.hpp"
+
+namespace audio
+{
+	class audio_worker_pool;
+
+	// 一个音源在一段连续的帧上的增益，逐帧线性渐变：第i帧为 left + left_step * i（右声道同理）
+	// 立体声之外的声道数只使用left
+	struct mix_gain_ramp
+	{
+		float left = 1.0f;
+		float right = 1.0f;
+		float left_step = 0.0f;
+		float right_step = 0.0f;
+	};
+
+	// 一组混音内核，数据均为交错存储；声道数为1或2时使用SIMD，其余声道数以及不足一个向量的尾部交给标量实现
+	struct mix_kernels
+	{
+		const char* name;
+		// acc += src * gain
+		void (*mix_f32)(float* acc, const float* src, int frames, int channels, const mix_gain_ramp& gain);
+		// 16-bit：增益在内核中转换为Q28定点逐帧渐变，与src相乘时取Q14（增益不超过2.0），acc为int32
+		void (*mix_s16)(int32_t* acc, const int16_t* src, int frames, int channels, const mix_gain_ramp& gain);
+		// 样本绝对值的最大值
+		float (*peak_f32)(const float* src, int samples);
+		// dest = clamp(src * (gain + step * i), -1, 1)，i为帧序号
+		void (*scale_clamp_f32)(float* dest, const float* src, int frames, int channels, float gain, float step);
+		// int32饱和为16-bit
+		void (*saturate_s16)(int16_t* dest, const int32_t* src, int samples);
+	};
+
+	// 16-bit内核共用的定点运算，各实现的结果逐位一致：增益限制在[0, 2)并转换为Q28，
+	// 第i帧的增益为 gain + step * i，取高14位（Q14）与样本相乘后右移14位累加
+	inline int32_t mix_gain_to_q28(float gain)
+	{
+		gain = gain < 0.0f ? 0.0f : (gain > 1.999f ? 1.999f : gain);
+		return static_cast<int32_t>(gain * 268435456.0f + 0.5f);
+	}
+
+	inline int32_t mix_step_to_q28(float step)
+	{
+		float scaled = step * 268435456.0f;
+		return static_cast<int32_t>(scaled < 0 ? scaled - 0.5f : scaled + 0.5f);
+	}
+
+	// SIMD实现也用它处理尾部
+	inline void mix_s16_q28(int32_t* acc, const int16_t* src, int frames, int channels,
+		int32_t left, int32_t right, int32_t left_step, int32_t right_step)
+	{
+		for (int i = 0; i < frames; ++i)
+		{
+			int32_t left_q14 = (left + left_step * i) >> 14;
+			if (channels == 2)
+			{
+				int32_t right_q14 = (right + right_step * i) >> 14;
+				acc[2 * i] += (int32_t(src[2 * i]) * left_q14) >> 14;
+				acc[2 * i + 1] += (int32_t(src[2 * i + 1]) * right_q14) >> 14;
+				continue;
+			}
+			for (int ch = 0; ch < channels; ++ch)
+				acc[i * channels + ch] += (int32_t(src[i * channels + ch]) * left_q14) >> 14;
+		}
+	}
+
+	const mix_kernels& get_scalar_mix_kernels();
+	// 未编译对应实现时返回nullptr，不检查cpu是否支持
+	const mix_kernels* get_sse2_mix_kernels();
+	const mix_kernels* get_avx2_mix_kernels();
+	const mix_kernels* get_neon_mix_kernels();
+	// 当前cpu上可运行的实现，按从慢到快的顺序写入kernels，返回个数
+	int get_available_mix_kernels(const mix_kernels** kernels, int max_count);
+	// 当前cpu上最快的实现，第一次调用时检测
+	const mix_kernels& get_mix_kernels();
+
+	// 混音器的一个输入
+	class audio_mix_source
+	{
+	public:
+		virtual ~audio_mix_source() = default;
+
+		// 取得接下来至多max_frames帧连续的数据（混音器的样本格式与声道数），返回帧数，数据在下一次调用之前有效
+		// 返回0且is_finished()为false时视为数据不足，本周期余下的部分为静音，计为一次underrun
+		virtual int read(const void*& data, int max_frames) = 0;
+		virtual bool is_finished() const = 0;
+		// 离开混音（播放完毕或被移除）后由混音线程调用一次，之后混音器不再访问该音源
+		virtual void on_mix_end() {}
+	};
+
+	// 环形队列音源：生产者线程push，混音线程read，单生产者单消费者，不加锁
+	class audio_mix_queue_source : public audio_mix_source
+	{
+	public:
+		// 返回写入的帧数，队列满时少于frames
+		virtual int push(const void* data, int frames) = 0;
+		virtual int get_free_frames() const = 0;
+		// 不会再push，队列中的数据混合完毕后is_finished为true
+		virtual void end_of_stream() = 0;
+	};
+
+	// capacity_frames为队列的容量；on_consumed在混音线程中取走数据后调用（例如调度生产者），不应阻塞
+	audio_mix_queue_source* create_mix_queue_source(const audio_output_format& format, int capacity_frames,
+		std::function<void()> on_consumed = nullptr);
+	// 内存中的pcm，不复制；loop为true时循环播放，直到被移除
+	audio_mix_source* create_mix_memory_source(const void* data, int frames, const audio_output_format& format, bool loop);
+
+	struct audio_mixer_config
+	{
+		// 16-bit或32-bit float；声道数任意，声像只对立体声有效
+		audio_output_format format;
+		// 每个周期的帧数，0为10ms
+		int period_frames = 0;
+		// 增益与声像改变、移除音源时的渐变长度，0为一个周期
+		int ramp_frames = 0;
+		// float输出：混合结果超过阈值时降低总增益（立即生效），之后按release_ms逐渐恢复，最后再饱和到[-1, 1]
+		// 16-bit输出在int32上累加，只饱和
+		bool limiter = true;
+		float limiter_threshold = 0.98f;
+		int limiter_release_ms = 200;
+	};
+
+	struct audio_mixer_stats
+	{
+		uint64_t periods = 0;
+		uint32_t active_sources = 0;
+		uint32_t max_active_sources = 0;
+		// 音源数据不足的次数
+		uint64_t underruns = 0;
+		// 限幅器降低了增益的周期数与当前的限幅增益
+		uint64_t limited_periods = 0;
+		float limiter_gain = 1.0f;
+		// mix_period的累计耗时
+		double mix_seconds = 0;
+	};
+
+	// 软件混音总线：每次按固定的周期从每个音源拉取数据，按各自的增益与声像相加为一路输出
+	// 音源的增减与增益设置可以在任意线程中进行，在下一个周期开始时生效
+	class audio_mixer
+	{
+	public:
+		virtual ~audio_mixer() = default;
+
+		// 音源在on_mix_end之前必须有效（销毁混音器时仍在混音中的音源同样回调on_mix_end）；返回音源编号，失败时返回-1
+		// pan为-1（左）到1（右），等功率声像
+		virtual int add_source(audio_mix_source* source, float gain = 1.0f, float pan = 0.0f) = 0;
+		virtual void set_source_gain(int id, float gain, float pan) = 0;
+		// 淡出ramp_frames帧后移除
+		virtual void remove_source(int id) = 0;
+		// 由混音线程调用：混合一个周期（get_period_frames帧）写入output
+		virtual void mix_period(void* output) = 0;
+
+		virtual int get_period_frames() const = 0;
+		virtual const audio_output_format& get_format() const = 0;
+		virtual void get_stats(audio_mixer_stats& stats) = 0;
+	};
+
+	// kernels为nullptr时使用当前cpu上最快的实现；格式不受支持时返回nullptr
+	audio_mixer* create_audio_mixer(const audio_mixer_config& config, const mix_kernels* kernels = nullptr);
+
+	// 把混音器接到一个输出端：以输出端的缓冲区完成回调为周期时钟，
+	// 每播放完一个周期即在线程池中混合下一个周期并提交，输出端中始终排队buffer_count个周期
+	class audio_mix_output
+	{
+	public:
+		virtual ~audio_mix_output() = default;
+		virtual int start() = 0;
+		// 返回时混音任务已结束，输出端中的缓冲区被丢弃
+		virtual void stop() = 0;
+		virtual const char* get_sink_name() const = 0;
+	};
+
+	// 打开输出端失败时返回nullptr；pool为nullptr时使用进程内共享的默认线程池
+	audio_mix_output* create_mix_output(audio_mixer* mixer, const audio_sink_config& sink_config,
+		audio_worker_pool* pool = nullptr, int buffer_count = 3);
+
+	// 逐个实现与标量实现对比输出：16-bit要求一致，float要求误差在1e-5以内；返回非0表示存在超出误差的实现
+	int run_mix_selftest();
+	// 每个实现下，16-bit与float立体声混音在单核上实时可以承载的音源数
+	void run_mix_benchmark();
+}
+
+#endif // AUDIO_MIXER_HPP_
@@ -0,0 +1,172 @@
+﻿#include "audio_mixer.hpp"
+#include "kernel_check.hpp"
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <vector>
+
+namespace audio
+{
+	// [-1.2, 1.2]上的float，覆盖饱和
+	static float random_float(uint32_t& seed)
+	{
+		return random_check_float(seed) * 1.2f;
+	}
+
+	template <typename T>
+	static double max_difference(const T* a, const T* b, size_t count)
+	{
+		double max_diff = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			double diff = std::fabs(double(a[i]) - double(b[i]));
+			if (diff > max_diff)
+				max_diff = diff;
+		}
+		return max_diff;
+	}
+
+	int run_mix_selftest()
+	{
+		const mix_kernels* kernels[4];
+		int kernel_count = get_available_mix_kernels(kernels, 4);
+		const mix_kernels& scalar = get_scalar_mix_kernels();
+		kernel_check_report check_report;
+		auto report = [&](const char* name, int channels, const mix_kernels& k, double diff, double tolerance) {
+			check_report(diff <= tolerance, "%-16s %dch %-6s max diff=%g", name, channels, k.name, diff);
+		};
+
+		// 累加之前acc中已有数据，增益从0.3渐变到约1.5
+		mix_gain_ramp gain;
+		gain.left = 0.3f;
+		gain.right = 1.1f;
+		gain.left_step = 1.2f / kernel_check_frames;
+		gain.right_step = -0.9f / kernel_check_frames;
+		const int channel_cases[] = { 1, 2, 6 };
+		for (int channels : channel_cases)
+		{
+			size_t count = size_t(kernel_check_frames) * channels;
+			std::vector<float> float_src(count), float_acc(count), float_ref(count), float_out(count);
+			std::vector<int16_t> s16_src(count), s16_ref(count), s16_out(count);
+			std::vector<int32_t> s32_acc(count), s32_ref(count), s32_out(count);
+			uint32_t seed = 0x2468ACE0u + uint32_t(channels);
+			for (size_t i = 0; i < count; ++i)
+			{
+				float_src[i] = random_float(seed);
+				float_acc[i] = random_float(seed);
+				s16_src[i] = int16_t(next_check_random(seed) >> 16);
+				// 覆盖16-bit饱和
+				s32_acc[i] = int32_t(next_check_random(seed) >> 14) - (1 << 17);
+			}
+
+			float_ref = float_acc;
+			scalar.mix_f32(float_ref.data(), float_src.data(), kernel_check_frames, channels, gain);
+			s32_ref = s32_acc;
+			scalar.mix_s16(s32_ref.data(), s16_src.data(), kernel_check_frames, channels, gain);
+			float peak_ref = scalar.peak_f32(float_src.data(), int(count));
+			std::vector<float> clamp_ref(count);
+			scalar.scale_clamp_f32(clamp_ref.data(), float_src.data(), kernel_check_frames, channels, 0.9f, 0.2f / kernel_check_frames);
+			scalar.saturate_s16(s16_ref.data(), s32_acc.data(), int(count));
+
+			for (int k = 0; k < kernel_count; ++k)
+			{
+				const mix_kernels& current = *kernels[k];
+				float_out = float_acc;
+				current.mix_f32(float_out.data(), float_src.data(), kernel_check_frames, channels, gain);
+				report("mix float", channels, current, max_difference(float_ref.data(), float_out.data(), count), 1e-5);
+				s32_out = s32_acc;
+				current.mix_s16(s32_out.data(), s16_src.data(), kernel_check_frames, channels, gain);
+				report("mix s16", channels, current, max_difference(s32_ref.data(), s32_out.data(), count), 0);
+				report("peak float", channels, current, std::fabs(double(current.peak_f32(float_src.data(), int(count))) - peak_ref), 0);
+				current.scale_clamp_f32(float_out.data(), float_src.data(), kernel_check_frames, channels, 0.9f, 0.2f / kernel_check_frames);
+				report("scale clamp", channels, current, max_difference(clamp_ref.data(), float_out.data(), count), 1e-5);
+				current.saturate_s16(s16_out.data(), s32_acc.data(), int(count));
+				report("saturate s16", channels, current, max_difference(s16_ref.data(), s16_out.data(), count), 0);
+			}
+		}
+		return check_report.finish("mixer");
+	}
+
+	// 立体声48kHz、10ms周期，音源各自从一段10秒的噪声中的随机位置开始循环播放，
+	// 每个周期有1/16的音源改变增益与声像（渐变），测得的每周期耗时折算为单核实时可承载的音源数
+	constexpr int bench_sample_rate = 48000;
+	constexpr int bench_clip_frames = bench_sample_rate * 10;
+	constexpr int bench_voices = 256;
+
+	static void run_mix_benchmark_case(const mix_kernels& kernels, bool is_float, const void* clip)
+	{
+		audio_mixer_config config;
+		config.format.sample_rate = bench_sample_rate;
+		config.format.channels = 2;
+		config.format.bits_per_sample = is_float ? 32 : 16;
+		config.format.is_float = is_float;
+		audio_mixer* mixer = create_audio_mixer(config, &kernels);
+		if (!mixer)
+			return;
+		int block_align = config.format.block_align();
+		uint32_t seed = 0x13579BDFu;
+		std::vector<audio_mix_source*> sources;
+		std::vector<int> ids;
+		for (int i = 0; i < bench_voices; ++i)
+		{
+			int offset = int(next_check_random(seed) % uint32_t(bench_clip_frames / 2));
+			audio_mix_source* source = create_mix_memory_source(static_cast<const uint8_t*>(clip) + size_t(offset) * block_align,
+				bench_clip_frames - offset, config.format, true);
+			sources.push_back(source);
+			// 总增益约为1，float输出不频繁触发限幅
+			ids.push_back(mixer->add_source(source, 4.0f / bench_voices, random_check_float(seed)));
+		}
+		int period_frames = mixer->get_period_frames();
+		std::vector<uint8_t> output(size_t(period_frames) * block_align);
+		mixer->mix_period(output.data()); // 预热
+
+		using clock = std::chrono::steady_clock;
+		uint64_t periods = 0;
+		auto begin = clock::now();
+		double elapsed = 0;
+		do
+		{
+			for (int p = 0; p < 16; ++p)
+			{
+				for (int v = 0; v < bench_voices / 16; ++v)
+					mixer->set_source_gain(ids[next_check_random(seed) % bench_voices], 4.0f / bench_voices, random_check_float(seed));
+				mixer->mix_period(output.data());
+			}
+			periods += 16;
+			elapsed = std::chrono::duration<double>(clock::now() - begin).count();
+		} while (elapsed < 0.5);
+
+		double period_seconds = double(period_frames) / bench_sample_rate;
+		double seconds_per_period = elapsed / double(periods);
+		double voice_ns = seconds_per_period / bench_voices * 1e9;
+		std::printf("%-8s %-6s %16.1f %15.0f %16.0f\n", kernels.name, is_float ? "float" : "s16",
+			voice_ns, voice_ns * 1e3 / period_frames,
+			bench_voices * period_seconds / seconds_per_period);
+		delete mixer;
+		for (auto source : sources)
+			delete source;
+	}
+
+	void run_mix_benchmark()
+	{
+		const mix_kernels* kernels[4];
+		int kernel_count = get_available_mix_kernels(kernels, 4);
+		std::vector<int16_t> clip_s16(size_t(bench_clip_frames) * 2);
+		std::vector<float> clip_float(size_t(bench_clip_frames) * 2);
+		uint32_t seed = 0x9E3779B9u;
+		for (size_t i = 0; i < clip_s16.size(); ++i)
+		{
+			clip_float[i] = random_check_float(seed);
+			clip_s16[i] = int16_t(next_check_random(seed) >> 16);
+		}
+		std::printf("info: mixer benchmark, %d stereo voices at %dHz, 10ms periods, 1/16 of the voices ramping per period\n",
+			bench_voices, bench_sample_rate);
+		std::printf("%-8s %-6s %16s %15s %16s\n", "kernels", "format", "ns/voice/period", "ps/voice/frame", "voices per core");
+		for (int k = 0; k < kernel_count; ++k)
+		{
+			run_mix_benchmark_case(*kernels[k], false, clip_s16.data());
+			run_mix_benchmark_case(*kernels[k], true, clip_float.data());
+		}
+	}
+}
@@ -0,0 +1,476 @@
+﻿#include "audio_mixer.hpp"
+#if defined(SAMPLE_CONVERT_X86)
+#include <immintrin.h>
+#endif
+#if defined(SAMPLE_CONVERT_NEON)
+#include <arm_neon.h>
+#endif
+
+// 单声道与立体声使用SIMD，其余声道数以及不足一个向量的尾部交给标量实现
+// float的逐帧增益按 gain + step * i 计算，与标量实现的运算顺序一致；16-bit与标量实现逐位一致
+
+namespace audio
+{
+	// 从第offset帧开始，用标量实现处理剩余的帧
+	static inline void mix_f32_tail(float* acc, const float* src, int offset, int frames, int channels, const mix_gain_ramp& gain)
+	{
+		if (offset >= frames)
+			return;
+		mix_gain_ramp tail = gain;
+		tail.left = gain.left + gain.left_step * float(offset);
+		tail.right = gain.right + gain.right_step * float(offset);
+		get_scalar_mix_kernels().mix_f32(acc + offset * channels, src + offset * channels, frames - offset, channels, tail);
+	}
+
+	static inline void scale_clamp_f32_tail(float* dest, const float* src, int offset, int frames, int channels,
+		float gain, float step)
+	{
+		if (offset < frames)
+			get_scalar_mix_kernels().scale_clamp_f32(dest + offset * channels, src + offset * channels, frames - offset,
+				channels, gain + step * float(offset), step);
+	}
+
+	// 16-bit的尾部：Q28增益从第offset帧继续，与标量实现逐位一致
+	static inline void mix_s16_tail(int32_t* acc, const int16_t* src, int offset, int frames, int channels,
+		int32_t left, int32_t right, int32_t left_step, int32_t right_step)
+	{
+		if (offset < frames)
+			mix_s16_q28(acc + offset * channels, src + offset * channels, frames - offset, channels,
+				left + left_step * offset, right + right_step * offset, left_step, right_step);
+	}
+
+#if defined(SAMPLE_CONVERT_X86)
+	// ---- SSE2 ----
+
+	SSE2_TARGET static void mix_f32_sse2(float* acc, const float* src, int frames, int channels, const mix_gain_ramp& gain)
+	{
+		if (channels > 2)
+		{
+			get_scalar_mix_kernels().mix_f32(acc, src, frames, channels, gain);
+			return;
+		}
+		// 每个向量4个样本：立体声为2帧，单声道为4帧
+		int frames_per_vector = 4 / channels;
+		__m128 base, step, index, index_step;
+		if (channels == 2)
+		{
+			base = _mm_setr_ps(gain.left, gain.right, gain.left, gain.right);
+			step = _mm_setr_ps(gain.left_step, gain.right_step, gain.left_step, gain.right_step);
+			index = _mm_setr_ps(0.0f, 0.0f, 1.0f, 1.0f);
+		}
+		else
+		{
+			base = _mm_set1_ps(gain.left);
+			step = _mm_set1_ps(gain.left_step);
+			index = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+		}
+		index_step = _mm_set1_ps(float(frames_per_vector));
+		int i = 0;
+		for (; i + frames_per_vector <= frames; i += frames_per_vector)
+		{
+			__m128 value = _mm_add_ps(base, _mm_mul_ps(step, index));
+			float* a = acc + i * channels;
+			_mm_storeu_ps(a, _mm_add_ps(_mm_loadu_ps(a), _mm_mul_ps(_mm_loadu_ps(src + i * channels), value)));
+			index = _mm_add_ps(index, index_step);
+		}
+		mix_f32_tail(acc, src, i, frames, channels, gain);
+	}
+
+	SSE2_TARGET static void mix_s16_sse2(int32_t* acc, const int16_t* src, int frames, int channels, const mix_gain_ramp& gain)
+	{
+		int32_t left = mix_gain_to_q28(gain.left);
+		int32_t right = mix_gain_to_q28(gain.right);
+		int32_t left_step = mix_step_to_q28(gain.left_step);
+		int32_t right_step = mix_step_to_q28(gain.right_step);
+		if (channels > 2)
+		{
+			mix_s16_q28(acc, src, frames, channels, left, right, left_step, right_step);
+			return;
+		}
+		// 每次8个样本：立体声为4帧，单声道为8帧；g0、g1为8个样本的Q28增益
+		int frames_per_iteration = 8 / channels;
+		__m128i g0, g1, increment;
+		if (channels == 2)
+		{
+			g0 = _mm_setr_epi32(left, right, left + left_step, right + right_step);
+			g1 = _mm_add_epi32(g0, _mm_setr_epi32(2 * left_step, 2 * right_step, 2 * left_step, 2 * right_step));
+			increment = _mm_setr_epi32(4 * left_step, 4 * right_step, 4 * left_step, 4 * right_step);
+		}
+		else
+		{
+			g0 = _mm_setr_epi32(left, left + left_step, left + 2 * left_step, left + 3 * left_step);
+			g1 = _mm_add_epi32(g0, _mm_set1_epi32(4 * left_step));
+			increment = _mm_set1_epi32(8 * left_step);
+		}
+		int i = 0;
+		for (; i + frames_per_iteration <= frames; i += frames_per_iteration)
+		{
+			// Q14增益不超过32767，packs不会饱和
+			__m128i q14 = _mm_packs_epi32(_mm_srai_epi32(g0, 14), _mm_srai_epi32(g1, 14));
+			__m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * channels));
+			__m128i low = _mm_mullo_epi16(samples, q14);
+			__m128i high = _mm_mulhi_epi16(samples, q14);
+			__m128i p0 = _mm_srai_epi32(_mm_unpacklo_epi16(low, high), 14);
+			__m128i p1 = _mm_srai_epi32(_mm_unpackhi_epi16(low, high), 14);
+			__m128i* a = reinterpret_cast<__m128i*>(acc + i * channels);
+			_mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), p0));
+			_mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), p1));
+			g0 = _mm_add_epi32(g0, increment);
+			g1 = _mm_add_epi32(g1, increment);
+		}
+		mix_s16_tail(acc, src, i, frames, channels, left, right, left_step, right_step);
+	}
+
+	SSE2_TARGET static float peak_f32_sse2(const float* src, int samples)
+	{
+		const __m128 sign = _mm_set1_ps(-0.0f);
+		__m128 peak = _mm_setzero_ps();
+		int i = 0;
+		for (; i + 4 <= samples; i += 4)
+			peak = _mm_max_ps(peak, _mm_andnot_ps(sign, _mm_loadu_ps(src + i)));
+		peak = _mm_max_ps(peak, _mm_shuffle_ps(peak, peak, _MM_SHUFFLE(1, 0, 3, 2)));
+		peak = _mm_max_ps(peak, _mm_shuffle_ps(peak, peak, _MM_SHUFFLE(2, 3, 0, 1)));
+		float result = _mm_cvtss_f32(peak);
+		float tail = get_scalar_mix_kernels().peak_f32(src + i, samples - i);
+		return tail > result ? tail : result;
+	}
+
+	SSE2_TARGET static void scale_clamp_f32_sse2(float* dest, const float* src, int frames, int channels, float gain, float step)
+	{
+		if (channels > 2)
+		{
+			get_scalar_mix_kernels().scale_clamp_f32(dest, src, frames, channels, gain, step);
+			return;
+		}
+		const __m128 min_value = _mm_set1_ps(-1.0f);
+		const __m128 max_value = _mm_set1_ps(1.0f);
+		int frames_per_vector = 4 / channels;
+		__m128 base = _mm_set1_ps(gain);
+		__m128 step_vector = _mm_set1_ps(step);
+		__m128 index = channels == 2 ? _mm_setr_ps(0.0f, 0.0f, 1.0f, 1.0f) : _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+		__m128 index_step = _mm_set1_ps(float(frames_per_vector));
+		int i = 0;
+		for (; i + frames_per_vector <= frames; i += frames_per_vector)
+		{
+			__m128 value = _mm_mul_ps(_mm_loadu_ps(src + i * channels), _mm_add_ps(base, _mm_mul_ps(step_vector, index)));
+			_mm_storeu_ps(dest + i * channels, _mm_min_ps(_mm_max_ps(value, min_value), max_value));
+			index = _mm_add_ps(index, index_step);
+		}
+		scale_clamp_f32_tail(dest, src, i, frames, channels, gain, step);
+	}
+
+	SSE2_TARGET static void saturate_s16_sse2(int16_t* dest, const int32_t* src, int samples)
+	{
+		int i = 0;
+		for (; i + 8 <= samples; i += 8)
+		{
+			__m128i x0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+			__m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 4));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), _mm_packs_epi32(x0, x1));
+		}
+		if (i < samples)
+			get_scalar_mix_kernels().saturate_s16(dest + i, src + i, samples - i);
+	}
+
+	const mix_kernels* get_sse2_mix_kernels()
+	{
+		static const mix_kernels kernels = {
+			"sse2",
+			mix_f32_sse2,
+			mix_s16_sse2,
+			peak_f32_sse2,
+			scale_clamp_f32_sse2,
+			saturate_s16_sse2
+		};
+		return &kernels;
+	}
+
+	// ---- AVX2 ----
+
+	AVX2_TARGET static void mix_f32_avx2(float* acc, const float* src, int frames, int channels, const mix_gain_ramp& gain)
+	{
+		if (channels > 2)
+		{
+			get_scalar_mix_kernels().mix_f32(acc, src, frames, channels, gain);
+			return;
+		}
+		// 每个向量8个样本：立体声为4帧，单声道为8帧
+		int frames_per_vector = 8 / channels;
+		__m256 base, step, index;
+		if (channels == 2)
+		{
+			base = _mm256_setr_ps(gain.left, gain.right, gain.left, gain.right, gain.left, gain.right, gain.left, gain.right);
+			step = _mm256_setr_ps(gain.left_step, gain.right_step, gain.left_step, gain.right_step,
+				gain.left_step, gain.right_step, gain.left_step, gain.right_step);
+			index = _mm256_setr_ps(0.0f, 0.0f, 1.0f, 1.0f, 2.0f, 2.0f, 3.0f, 3.0f);
+		}
+		else
+		{
+			base = _mm256_set1_ps(gain.left);
+			step = _mm256_set1_ps(gain.left_step);
+			index = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+		}
+		__m256 index_step = _mm256_set1_ps(float(frames_per_vector));
+		int i = 0;
+		for (; i + frames_per_vector <= frames; i += frames_per_vector)
+		{
+			// 不使用fma，与标量实现的舍入一致
+			__m256 value = _mm256_add_ps(base, _mm256_mul_ps(step, index));
+			float* a = acc + i * channels;
+			_mm256_storeu_ps(a, _mm256_add_ps(_mm256_loadu_ps(a), _mm256_mul_ps(_mm256_loadu_ps(src + i * channels), value)));
+			index = _mm256_add_ps(index, index_step);
+		}
+		mix_f32_tail(acc, src, i, frames, channels, gain);
+	}
+
+	AVX2_TARGET static void mix_s16_avx2(int32_t* acc, const int16_t* src, int frames, int channels, const mix_gain_ramp& gain)
+	{
+		int32_t left = mix_gain_to_q28(gain.left);
+		int32_t right = mix_gain_to_q28(gain.right);
+		int32_t left_step = mix_step_to_q28(gain.left_step);
+		int32_t right_step = mix_step_to_q28(gain.right_step);
+		if (channels > 2)
+		{
+			mix_s16_q28(acc, src, frames, channels, left, right, left_step, right_step);
+			return;
+		}
+		// 每次8个样本，样本扩展为int32后直接与Q14增益相乘
+		int frames_per_iteration = 8 / channels;
+		__m256i g, increment;
+		if (channels == 2)
+		{
+			g = _mm256_setr_epi32(left, right, left + left_step, right + right_step,
+				left + 2 * left_step, right + 2 * right_step, left + 3 * left_step, right + 3 * right_step);
+			increment = _mm256_setr_epi32(4 * left_step, 4 * right_step, 4 * left_step, 4 * right_step,
+				4 * left_step, 4 * right_step, 4 * left_step, 4 * right_step);
+		}
+		else
+		{
+			g = _mm256_setr_epi32(left, left + left_step, left + 2 * left_step, left + 3 * left_step,
+				left + 4 * left_step, left + 5 * left_step, left + 6 * left_step, left + 7 * left_step);
+			increment = _mm256_set1_epi32(8 * left_step);
+		}
+		int i = 0;
+		for (; i + frames_per_iteration <= frames; i += frames_per_iteration)
+		{
+			__m256i samples = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * channels)));
+			__m256i product = _mm256_srai_epi32(_mm256_mullo_epi32(samples, _mm256_srai_epi32(g, 14)), 14);
+			__m256i* a = reinterpret_cast<__m256i*>(acc + i * channels);
+			_mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a), product));
+			g = _mm256_add_epi32(g, increment);
+		}
+		mix_s16_tail(acc, src, i, frames, channels, left, right, left_step, right_step);
+	}
+
+	AVX2_TARGET static float peak_f32_avx2(const float* src, int samples)
+	{
+		const __m256 sign = _mm256_set1_ps(-0.0f);
+		__m256 peak = _mm256_setzero_ps();
+		int i = 0;
+		for (; i + 8 <= samples; i += 8)
+			peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, _mm256_loadu_ps(src + i)));
+		__m128 half = _mm_max_ps(_mm256_castps256_ps128(peak), _mm256_extractf128_ps(peak, 1));
+		half = _mm_max_ps(half, _mm_shuffle_ps(half, half, _MM_SHUFFLE(1, 0, 3, 2)));
+		half = _mm_max_ps(half, _mm_shuffle_ps(half, half, _MM_SHUFFLE(2, 3, 0, 1)));
+		float result = _mm_cvtss_f32(half);
+		float tail = get_scalar_mix_kernels().peak_f32(src + i, samples - i);
+		return tail > result ? tail : result;
+	}
+
+	AVX2_TARGET static void scale_clamp_f32_avx2(float* dest, const float* src, int frames, int channels, float gain, float step)
+	{
+		if (channels > 2)
+		{
+			get_scalar_mix_kernels().scale_clamp_f32(dest, src, frames, channels, gain, step);
+			return;
+		}
+		const __m256 min_value = _mm256_set1_ps(-1.0f);
+		const __m256 max_value = _mm256_set1_ps(1.0f);
+		int frames_per_vector = 8 / channels;
+		__m256 base = _mm256_set1_ps(gain);
+		__m256 step_vector = _mm256_set1_ps(step);
+		__m256 index = channels == 2 ? _mm256_setr_ps(0.0f, 0.0f, 1.0f, 1.0f, 2.0f, 2.0f, 3.0f, 3.0f)
+			: _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+		__m256 index_step = _mm256_set1_ps(float(frames_per_vector));
+		int i = 0;
+		for (; i + frames_per_vector <= frames; i += frames_per_vector)
+		{
+			__m256 value = _mm256_mul_ps(_mm256_loadu_ps(src + i * channels),
+				_mm256_add_ps(base, _mm256_mul_ps(step_vector, index)));
+			_mm256_storeu_ps(dest + i * channels, _mm256_min_ps(_mm256_max_ps(value, min_value), max_value));
+			index = _mm256_add_ps(index, index_step);
+		}
+		scale_clamp_f32_tail(dest, src, i, frames, channels, gain, step);
+	}
+
+	AVX2_TARGET static void saturate_s16_avx2(int16_t* dest, const int32_t* src, int samples)
+	{
+		int i = 0;
+		for (; i + 16 <= samples; i += 16)
+		{
+			__m256i x0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+			__m256i x1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 8));
+			// packs在每个128位通道内交错，按64位重排回原来的顺序
+			__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(x0, x1), _MM_SHUFFLE(3, 1, 2, 0));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i), packed);
+		}
+		if (i < samples)
+			get_scalar_mix_kernels().saturate_s16(dest + i, src + i, samples - i);
+	}
+
+	const mix_kernels* get_avx2_mix_kernels()
+	{
+		static const mix_kernels kernels = {
+			"avx2",
+			mix_f32_avx2,
+			mix_s16_avx2,
+			peak_f32_avx2,
+			scale_clamp_f32_avx2,
+			saturate_s16_avx2
+		};
+		return &kernels;
+	}
+#else
+	const mix_kernels* get_sse2_mix_kernels() { return nullptr; }
+	const mix_kernels* get_avx2_mix_kernels() { return nullptr; }
+#endif // SAMPLE_CONVERT_X86
+
+#if defined(SAMPLE_CONVERT_NEON)
+	// ---- NEON ----
+
+	static void mix_f32_neon(float* acc, const float* src, int frames, int channels, const mix_gain_ramp& gain)
+	{
+		if (channels > 2)
+		{
+			get_scalar_mix_kernels().mix_f32(acc, src, frames, channels, gain);
+			return;
+		}
+		int frames_per_vector = 4 / channels;
+		float base_values[4], step_values[4], index_values[4];
+		for (int k = 0; k < 4; ++k)
+		{
+			bool right_channel = channels == 2 && (k & 1);
+			base_values[k] = right_channel ? gain.right : gain.left;
+			step_values[k] = right_channel ? gain.right_step : gain.left_step;
+			index_values[k] = float(k / channels);
+		}
+		float32x4_t base = vld1q_f32(base_values);
+		float32x4_t step = vld1q_f32(step_values);
+		float32x4_t index = vld1q_f32(index_values);
+		float32x4_t index_step = vdupq_n_f32(float(frames_per_vector));
+		int i = 0;
+		for (; i + frames_per_vector <= frames; i += frames_per_vector)
+		{
+			// 分开乘与加，不融合为fma，与标量实现的舍入一致
+			float32x4_t value = vaddq_f32(base, vmulq_f32(step, index));
+			float* a = acc + i * channels;
+			vst1q_f32(a, vaddq_f32(vld1q_f32(a), vmulq_f32(vld1q_f32(src + i * channels), value)));
+			index = vaddq_f32(index, index_step);
+		}
+		mix_f32_tail(acc, src, i, frames, channels, gain);
+	}
+
+	static void mix_s16_neon(int32_t* acc, const int16_t* src, int frames, int channels, const mix_gain_ramp& gain)
+	{
+		int32_t left = mix_gain_to_q28(gain.left);
+		int32_t right = mix_gain_to_q28(gain.right);
+		int32_t left_step = mix_step_to_q28(gain.left_step);
+		int32_t right_step = mix_step_to_q28(gain.right_step);
+		if (channels > 2)
+		{
+			mix_s16_q28(acc, src, frames, channels, left, right, left_step, right_step);
+			return;
+		}
+		// 每次8个样本，g0、g1为8个样本的Q28增益
+		int frames_per_iteration = 8 / channels;
+		int32_t gain_values[8];
+		for (int k = 0; k < 8; ++k)
+		{
+			bool right_channel = channels == 2 && (k & 1);
+			int frame = k / channels;
+			gain_values[k] = right_channel ? right + right_step * frame : left + left_step * frame;
+		}
+		int32x4_t g0 = vld1q_s32(gain_values);
+		int32x4_t g1 = vld1q_s32(gain_values + 4);
+		int32_t increment_values[4];
+		for (int k = 0; k < 4; ++k)
+			increment_values[k] = (channels == 2 && (k & 1) ? right_step : left_step) * frames_per_iteration;
+		int32x4_t increment = vld1q_s32(increment_values);
+		int i = 0;
+		for (; i + frames_per_iteration <= frames; i += frames_per_iteration)
+		{
+			int16x8_t samples = vld1q_s16(src + i * channels);
+			int32x4_t p0 = vshrq_n_s32(vmulq_s32(vmovl_s16(vget_low_s16(samples)), vshrq_n_s32(g0, 14)), 14);
+			int32x4_t p1 = vshrq_n_s32(vmulq_s32(vmovl_s16(vget_high_s16(samples)), vshrq_n_s32(g1, 14)), 14);
+			int32_t* a = acc + i * channels;
+			vst1q_s32(a, vaddq_s32(vld1q_s32(a), p0));
+			vst1q_s32(a + 4, vaddq_s32(vld1q_s32(a + 4), p1));
+			g0 = vaddq_s32(g0, increment);
+			g1 = vaddq_s32(g1, increment);
+		}
+		mix_s16_tail(acc, src, i, frames, channels, left, right, left_step, right_step);
+	}
+
+	static float peak_f32_neon(const float* src, int samples)
+	{
+		float32x4_t peak = vdupq_n_f32(0.0f);
+		int i = 0;
+		for (; i + 4 <= samples; i += 4)
+			peak = vmaxq_f32(peak, vabsq_f32(vld1q_f32(src + i)));
+		float result = vmaxvq_f32(peak);
+		float tail = get_scalar_mix_kernels().peak_f32(src + i, samples - i);
+		return tail > result ? tail : result;
+	}
+
+	static void scale_clamp_f32_neon(float* dest, const float* src, int frames, int channels, float gain, float step)
+	{
+		if (channels > 2)
+		{
+			get_scalar_mix_kernels().scale_clamp_f32(dest, src, frames, channels, gain, step);
+			return;
+		}
+		const float32x4_t min_value = vdupq_n_f32(-1.0f);
+		const float32x4_t max_value = vdupq_n_f32(1.0f);
+		int frames_per_vector = 4 / channels;
+		float index_values[4];
+		for (int k = 0; k < 4; ++k)
+			index_values[k] = float(k / channels);
+		float32x4_t base = vdupq_n_f32(gain);
+		float32x4_t step_vector = vdupq_n_f32(step);
+		float32x4_t index = vld1q_f32(index_values);
+		float32x4_t index_step = vdupq_n_f32(float(frames_per_vector));
+		int i = 0;
+		for (; i + frames_per_vector <= frames; i += frames_per_vector)
+		{
+			float32x4_t value = vmulq_f32(vld1q_f32(src + i * channels), vaddq_f32(base, vmulq_f32(step_vector, index)));
+			vst1q_f32(dest + i * channels, vminq_f32(vmaxq_f32(value, min_value), max_value));
+			index = vaddq_f32(index, index_step);
+		}
+		scale_clamp_f32_tail(dest, src, i, frames, channels, gain, step);
+	}
+
+	static void saturate_s16_neon(int16_t* dest, const int32_t* src, int samples)
+	{
+		int i = 0;
+		for (; i + 8 <= samples; i += 8)
+			vst1q_s16(dest + i, vcombine_s16(vqmovn_s32(vld1q_s32(src + i)), vqmovn_s32(vld1q_s32(src + i + 4))));
+		if (i < samples)
+			get_scalar_mix_kernels().saturate_s16(dest + i, src + i, samples - i);
+	}
+
+	const mix_kernels* get_neon_mix_kernels()
+	{
+		static const mix_kernels kernels = {
+			"neon",
+			mix_f32_neon,
+			mix_s16_neon,
+			peak_f32_neon,
+			scale_clamp_f32_neon,
+			saturate_s16_neon
+		};
+		return &kernels;
+	}
+#else
+	const mix_kernels* get_neon_mix_kernels() { return nullptr; }
+#endif // SAMPLE_CONVERT_NEON
+}
@@ -0,0 +1,108 @@
+﻿#if !defined(AUDIO_OUTPUT_SINK_HPP_)
+#define AUDIO_OUTPUT_SINK_HPP_
+#include "audio_play_interface.hpp"
+
+namespace audio
+{
+	// 按声道数取常用的声道掩码（与WAVEFORMATEXTENSIBLE的SPEAKER_*一致）
+	inline uint32_t default_channel_mask(int channels)
+	{
+		switch (channels)
+		{
+		case 1: return 0x4;   // FC
+		case 2: return 0x3;   // FL FR
+		case 3: return 0x7;   // FL FR FC
+		case 4: return 0x33;  // FL FR BL BR
+		case 5: return 0x37;  // FL FR FC BL BR
+		case 6: return 0x3F;  // 5.1
+		case 7: return 0x13F; // 6.1
+		case 8: return 0x63F; // 7.1
+		default: return 0;
+		}
+	}
+
+	// 输出端接受的pcm格式（交错存储）
+	struct audio_output_format
+	{
+		int sample_rate = 44100;
+		int channels = 2;
+		int bits_per_sample = 16;
+		bool is_float = false;
+		// 声道掩码（WAVEFORMATEXTENSIBLE的dwChannelMask），0表示按声道数取默认值
+		uint32_t channel_mask = 0;
+
+		// 一个样本（所有声道）的字节数
+		int block_align() const { return (bits_per_sample / 8) * channels; }
+		uint32_t effective_channel_mask() const { return channel_mask ? channel_mask : default_channel_mask(channels); }
+		// 超过2声道、超过16-bit或浮点时需要WAVEFORMATEXTENSIBLE
+		bool needs_extensible() const { return channels > 2 || bits_per_sample > 16 || is_float; }
+	};
+
+	// 对应XAUDIO2_VOICE_STATE中用到的字段
+	struct audio_sink_state
+	{
+		// 已提交但尚未播放完毕的缓冲区数量
+		uint32_t buffers_queued = 0;
+		// 自start以来已播放完毕的样本数
+		uint64_t samples_played = 0;
+	};
+
+	// 输出端的完成通知，语义与IXAudio2VoiceCallback一致
+	// 回调可能在输出端内部的线程中调用，也可能在submit_buffer/flush/end_of_stream内同步调用，实现中不应阻塞
+	class audio_output_sink_callback
+	{
+	public:
+		virtual ~audio_output_sink_callback() = default;
+		// 一个缓冲区播放完毕或被flush丢弃，buffer_context为submit_buffer时传入的值
+		virtual void on_buffer_end(void* buffer_context) = 0;
+		// end_of_stream之前提交的缓冲区全部播放完毕
+		virtual void on_stream_end() = 0;
+	};
+
+	// 输出端抽象接口，语义与IXAudio2SourceVoice一致：
+	// submit_buffer只保存指针，数据在该缓冲区播放完毕之前必须保持有效；缓冲区按提交顺序播放
+	class audio_output_sink
+	{
+	public:
+		virtual ~audio_output_sink() = default;
+
+		// 须在open之前设置
+		void set_callback(audio_output_sink_callback* sink_callback) { callback = sink_callback; }
+
+		virtual int open(const audio_output_format& format) = 0;
+		virtual void close() = 0;
+
+		virtual int start() = 0;
+		virtual void stop() = 0;
+		// 丢弃所有尚未播放的缓冲区
+		virtual void flush() = 0;
+
+		virtual int submit_buffer(const uint8_t* data, uint32_t bytes, void* buffer_context) = 0;
+		// 通知输出端不会再提交新的缓冲区，已提交的缓冲区播放完毕后回调on_stream_end
+		virtual void end_of_stream() = 0;
+		virtual void get_state(audio_sink_state& state) = 0;
+
+		virtual const char* get_name() const = 0;
+
+	protected:
+		audio_output_sink_callback* callback = nullptr;
+	};
+
+	audio_output_sink* create_output_sink(const audio_sink_config& config);
+	// 输出端按设备时钟消耗缓冲区；headless输出不模拟时钟时提交即播放完毕，没有排队与underrun
+	inline bool is_clocked_output_sink(const audio_sink_config& config)
+	{
+#if defined(_WIN32)
+		if (config.type == audio_sink_type::platform_default)
+			return true;
+#endif
+		return config.type == audio_sink_type::xaudio2 || config.clock_speed > 0;
+	}
+#if defined(_WIN32)
+	audio_output_sink* create_xaudio2_output_sink();
+#endif
+	audio_output_sink* create_null_output_sink(double clock_speed);
+	audio_output_sink* create_file_output_sink(const char* output_path, bool write_wav_header, double clock_speed);
+}
+
+#endif // AUDIO_OUTPUT_SINK_HPP_
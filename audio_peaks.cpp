@@ -0,0 +1,433 @@
+﻿#include "audio_peaks.hpp"
+#include "ffmpeg_xaudio2_internal.hpp"
+#include "audio_input_source.hpp"
+#include "sample_convert.hpp"
+#include "audio_trace.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace audio
+{
+	// 文件头：magic、版本、媒体文件的大小与修改时间、采样率、声道数、总帧数、第0级每项的帧数、级数，
+	// 之后为每级的(每项帧数, 项数, 数据偏移)，各级数据从8字节对齐的偏移开始，每项为channels个peak_sample
+	constexpr char peaks_magic[4] = { 'F', 'X', 'P', 'K' };
+	constexpr uint32_t peaks_version = 1;
+	constexpr size_t peaks_header_size = 48;
+	constexpr size_t peaks_level_entry_size = 24;
+	static_assert(sizeof(peak_sample) == 6, "peak_sample is stored as-is in the peaks file");
+
+	// ---- 标量内核 ----
+
+	static void reduce_f32_scalar(const float* src, int frames, int channels, float* min, float* max,
+		float* sum_squares)
+	{
+		reduce_peak_frames(src, frames, channels, min, max, sum_squares);
+	}
+
+	const peak_kernels& get_scalar_peak_kernels()
+	{
+		static const peak_kernels kernels = {
+			"scalar",
+			reduce_f32_scalar
+		};
+		return kernels;
+	}
+
+	int get_available_peak_kernels(const peak_kernels** kernels, int max_count)
+	{
+		int count = 0;
+		auto add = [&](const peak_kernels* candidate) {
+			if (candidate && count < max_count)
+				kernels[count++] = candidate;
+		};
+		add(&get_scalar_peak_kernels());
+#if defined(SAMPLE_CONVERT_X86)
+		if (cpu_has_sse2())
+			add(get_sse2_peak_kernels());
+		if (cpu_has_avx2())
+			add(get_avx2_peak_kernels());
+#endif
+#if defined(SAMPLE_CONVERT_NEON)
+		add(get_neon_peak_kernels());
+#endif
+		return count;
+	}
+
+	const peak_kernels& get_peak_kernels()
+	{
+		static const peak_kernels* best = [] {
+			const peak_kernels* kernels[4];
+			int count = get_available_peak_kernels(kernels, 4);
+			return kernels[count - 1];
+		}();
+		return *best;
+	}
+
+	// 非float格式的一段样本转换为float，src与dest均为count个连续的样本
+	static void convert_to_float(const uint8_t* src, AVSampleFormat packed_format, int count, float* dest)
+	{
+		switch (packed_format)
+		{
+		case AV_SAMPLE_FMT_U8:
+			for (int i = 0; i < count; ++i)
+				dest[i] = float(int(src[i]) - 128) * (1.0f / 128);
+			break;
+		case AV_SAMPLE_FMT_S16:
+		{
+			const int16_t* samples = reinterpret_cast<const int16_t*>(src);
+			for (int i = 0; i < count; ++i)
+				dest[i] = float(samples[i]) * (1.0f / 32768);
+			break;
+		}
+		case AV_SAMPLE_FMT_S32:
+		{
+			const int32_t* samples = reinterpret_cast<const int32_t*>(src);
+			for (int i = 0; i < count; ++i)
+				dest[i] = float(samples[i]) * (1.0f / 2147483648.0f);
+			break;
+		}
+		case AV_SAMPLE_FMT_S64:
+		{
+			const int64_t* samples = reinterpret_cast<const int64_t*>(src);
+			for (int i = 0; i < count; ++i)
+				dest[i] = float(double(samples[i]) * (1.0 / 9223372036854775808.0));
+			break;
+		}
+		case AV_SAMPLE_FMT_DBL:
+		{
+			const double* samples = reinterpret_cast<const double*>(src);
+			for (int i = 0; i < count; ++i)
+				dest[i] = float(samples[i]);
+			break;
+		}
+		default:
+			std::memset(dest, 0, sizeof(float) * size_t(count));
+			break;
+		}
+	}
+
+	audio_peak_builder::audio_peak_builder(int sample_rate, int channels, const peak_kernels* kernels)
+		: kernels(kernels ? kernels : &get_peak_kernels()), sample_rate(sample_rate), channels(channels)
+	{
+		valid = channels >= 1 && channels <= peak_max_channels && sample_rate > 0;
+		for (int ch = 0; ch < peak_max_channels; ++ch)
+		{
+			block_min[ch] = HUGE_VALF;
+			block_max[ch] = -HUGE_VALF;
+			block_sum_squares[ch] = 0.0f;
+		}
+	}
+
+	void audio_peak_builder::reduce(const float* const* planes, bool planar, int frames)
+	{
+		if (planar)
+		{
+			for (int ch = 0; ch < channels; ++ch)
+				kernels->reduce_f32(planes[ch], frames, 1, block_min + ch, block_max + ch, block_sum_squares + ch);
+		}
+		else
+			kernels->reduce_f32(planes[0], frames, channels, block_min, block_max, block_sum_squares);
+		block_filled += frames;
+		total_frames += uint64_t(frames);
+		if (block_filled == peak_base_frames)
+			finish_block();
+	}
+
+	void audio_peak_builder::finish_block()
+	{
+		for (int ch = 0; ch < channels; ++ch)
+		{
+			blocks.push_back(block_value{ block_min[ch], block_max[ch], double(block_sum_squares[ch]) });
+			block_min[ch] = HUGE_VALF;
+			block_max[ch] = -HUGE_VALF;
+			block_sum_squares[ch] = 0.0f;
+		}
+		block_filled = 0;
+	}
+
+	void audio_peak_builder::add(const AVFrame* frame)
+	{
+		if (!valid || finished || frame->nb_samples <= 0)
+			return;
+		if (frame->ch_layout.nb_channels != channels)
+		{
+			std::printf("warn: channel count changed, peaks not recorded\n");
+			valid = false;
+			return;
+		}
+		AUDIO_TRACE_SCOPE(decode, "peaks");
+		AVSampleFormat format = static_cast<AVSampleFormat>(frame->format);
+		AVSampleFormat packed_format = av_get_packed_sample_fmt(format);
+		bool planar = av_sample_fmt_is_planar(format) != 0;
+		int bytes_per_sample = av_get_bytes_per_sample(format);
+		const float* planes[peak_max_channels];
+		if (packed_format != AV_SAMPLE_FMT_FLT && scratch.size() < size_t(peak_base_frames) * channels)
+			scratch.resize(size_t(peak_base_frames) * channels);
+		for (int offset = 0; offset < frame->nb_samples;)
+		{
+			int frames = std::min(frame->nb_samples - offset, peak_base_frames - block_filled);
+			int plane_count = planar ? channels : 1;
+			int samples_per_plane = planar ? frames : frames * channels;
+			size_t byte_offset = size_t(offset) * bytes_per_sample * (planar ? 1 : channels);
+			for (int i = 0; i < plane_count; ++i)
+			{
+				const uint8_t* src = frame->extended_data[i] + byte_offset;
+				if (packed_format == AV_SAMPLE_FMT_FLT)
+					planes[i] = reinterpret_cast<const float*>(src);
+				else
+				{
+					// 转换到缓冲区中第i个声道的位置，每次不超过一块
+					float* dest = scratch.data() + size_t(i) * peak_base_frames;
+					convert_to_float(src, packed_format, samples_per_plane, dest);
+					planes[i] = dest;
+				}
+			}
+			reduce(planes, planar, frames);
+			offset += frames;
+		}
+	}
+
+	// 样本按满幅32767量化
+	static int16_t quantize_peak(float value, bool round_up)
+	{
+		double scaled = double(value) * 32767.0;
+		scaled = round_up ? std::ceil(scaled) : std::floor(scaled);
+		return int16_t(std::max(-32768.0, std::min(32767.0, scaled)));
+	}
+
+	int audio_peak_builder::save(const char* peaks_path, uint64_t file_size, int64_t file_mtime)
+	{
+		if (!valid)
+			return -1;
+		if (!finished)
+		{
+			if (block_filled > 0)
+				finish_block();
+			finished = true;
+		}
+		if (blocks.empty())
+		{
+			std::printf("warn: no audio decoded, peaks not written: %s\n", peaks_path);
+			return -1;
+		}
+
+		// 逐级合并相邻两项，最后一项可能不足一块，RMS按实际帧数计算
+		std::vector<std::vector<block_value>> levels;
+		levels.push_back(blocks);
+		while (levels.back().size() > size_t(channels) && levels.size() < size_t(peak_max_levels))
+		{
+			const std::vector<block_value>& lower = levels.back();
+			size_t lower_count = lower.size() / channels;
+			std::vector<block_value> upper;
+			upper.reserve((lower_count + 1) / 2 * channels);
+			for (size_t entry = 0; entry < lower_count; entry += 2)
+			{
+				for (int ch = 0; ch < channels; ++ch)
+				{
+					block_value value = lower[entry * channels + ch];
+					if (entry + 1 < lower_count)
+					{
+						const block_value& next = lower[(entry + 1) * channels + ch];
+						value.min = std::min(value.min, next.min);
+						value.max = std::max(value.max, next.max);
+						value.sum_squares += next.sum_squares;
+					}
+					upper.push_back(value);
+				}
+			}
+			levels.push_back(std::move(upper));
+		}
+
+		std::string out;
+		out.append(peaks_magic, sizeof(peaks_magic));
+		write_field(out, peaks_version);
+		write_field(out, file_size);
+		write_field(out, file_mtime);
+		write_field(out, uint32_t(sample_rate));
+		write_field(out, uint32_t(channels));
+		write_field(out, total_frames);
+		write_field(out, uint32_t(peak_base_frames));
+		write_field(out, uint32_t(levels.size()));
+		size_t offset = peaks_header_size + peaks_level_entry_size * levels.size();
+		auto get_level_bytes = [&](size_t n) { return (levels[n].size() * sizeof(peak_sample) + 7) & ~size_t(7); };
+		for (size_t n = 0; n < levels.size(); ++n)
+		{
+			write_field(out, uint64_t(peak_base_frames) << n);
+			write_field(out, uint64_t(levels[n].size() / channels));
+			write_field(out, uint64_t(offset));
+			offset += get_level_bytes(n);
+		}
+		for (size_t n = 0; n < levels.size(); ++n)
+		{
+			const std::vector<block_value>& level = levels[n];
+			uint64_t frames_per_entry = uint64_t(peak_base_frames) << n;
+			for (size_t i = 0; i < level.size(); ++i)
+			{
+				const block_value& value = level[i];
+				uint64_t entry_begin = uint64_t(i / channels) * frames_per_entry;
+				uint64_t frames = std::min(frames_per_entry, total_frames - entry_begin);
+				double rms = std::sqrt(value.sum_squares / double(frames)) * 32767.0;
+				write_field(out, quantize_peak(value.min, false));
+				write_field(out, quantize_peak(value.max, true));
+				write_field(out, uint16_t(std::min(65535.0, rms + 0.5)));
+			}
+			out.append(get_level_bytes(n) - level.size() * sizeof(peak_sample), '\0');
+		}
+
+		if (!write_file_replace(peaks_path, out))
+		{
+			std::printf("warn: write peaks %s failed\n", peaks_path);
+			return -1;
+		}
+		return 0;
+	}
+
+	int audio_peak_file::open(const char* peaks_path, uint64_t file_size, int64_t file_mtime)
+	{
+		close();
+		source = create_mmap_input_source(peaks_path);
+		if (!source)
+			return -1;
+		const uint8_t* begin = source->get_data();
+		int64_t length = source->seek(0, AVSEEK_SIZE);
+		const uint8_t* data = begin;
+		const uint8_t* end = begin + length;
+		uint32_t version = 0, stored_rate = 0, stored_channels = 0, base_frames = 0, level_count = 0;
+		uint64_t stored_size = 0;
+		int64_t stored_mtime = 0;
+		bool ok = begin && length >= int64_t(peaks_header_size)
+			&& std::memcmp(data, peaks_magic, sizeof(peaks_magic)) == 0;
+		data += sizeof(peaks_magic);
+		ok = ok && read_field(data, end, version) && version == peaks_version
+			&& read_field(data, end, stored_size) && stored_size == file_size
+			&& read_field(data, end, stored_mtime) && stored_mtime == file_mtime
+			&& read_field(data, end, stored_rate) && read_field(data, end, stored_channels)
+			&& read_field(data, end, total_frames) && read_field(data, end, base_frames)
+			&& read_field(data, end, level_count)
+			&& stored_channels >= 1 && stored_channels <= uint32_t(peak_max_channels)
+			&& level_count >= 1 && level_count <= uint32_t(peak_max_levels);
+		for (uint32_t i = 0; ok && i < level_count; ++i)
+		{
+			level item;
+			uint64_t offset = 0;
+			ok = read_field(data, end, item.frames_per_entry) && read_field(data, end, item.entry_count)
+				&& read_field(data, end, offset);
+			// 项数不可能超过文件长度，先检查再相乘，避免溢出
+			ok = ok && offset % 8 == 0 && offset <= uint64_t(length) && item.entry_count <= uint64_t(length)
+				&& item.entry_count * stored_channels * sizeof(peak_sample) <= uint64_t(length) - offset;
+			if (!ok)
+				break;
+			item.samples = reinterpret_cast<const peak_sample*>(begin + offset);
+			levels.push_back(item);
+		}
+		if (!ok)
+		{
+			close();
+			return -1;
+		}
+		sample_rate = int(stored_rate);
+		channels = int(stored_channels);
+		return 0;
+	}
+
+	void audio_peak_file::close()
+	{
+		delete source;
+		source = nullptr;
+		levels.clear();
+		sample_rate = 0;
+		channels = 0;
+		total_frames = 0;
+	}
+
+	int audio_peak_file::find_level(double frames_per_pixel) const
+	{
+		int result = 0;
+		for (int i = 0; i < int(levels.size()); ++i)
+		{
+			if (double(levels[size_t(i)].frames_per_entry) <= frames_per_pixel)
+				result = i;
+		}
+		return result;
+	}
+
+	void open_peak_builder(audio_decoder_context* decoder, const audio_input_config& config)
+	{
+		if (!config.generate_peaks)
+			return;
+		// 调用者提供的输入没有对应的文件，摘要无处存放
+		if (is_caller_provided_input(config))
+		{
+			std::printf("warn: peaks need a file input, skipped: %s\n", decoder->path.c_str());
+			return;
+		}
+		const AVCodecContext* context = decoder->codec_context;
+		auto builder = DBG_NEW audio_peak_builder(context->sample_rate, context->ch_layout.nb_channels);
+		if (!builder->is_valid())
+		{
+			std::printf("warn: peaks support up to %d channels, skipped: %s\n", peak_max_channels, decoder->path.c_str());
+			delete builder;
+			return;
+		}
+		decoder->peak_builder = builder;
+	}
+
+	void save_peak_summary(audio_decoder_context* decoder)
+	{
+		audio_peak_builder* builder = decoder->peak_builder;
+		if (!builder)
+			return;
+		uint64_t file_size;
+		int64_t file_mtime;
+		std::string peaks_path = get_peaks_path(decoder->path);
+		if (!builder->is_valid())
+			std::printf("info: track not decoded contiguously, peaks not written: %s\n", peaks_path.c_str());
+		else if (!get_file_info(decoder->path.c_str(), file_size, file_mtime))
+			std::printf("warn: not a regular file, peaks not written: %s\n", decoder->path.c_str());
+		else if (!builder->save(peaks_path.c_str(), file_size, file_mtime))
+			std::printf("info: peaks written, %llu frames: %s\n",
+				static_cast<unsigned long long>(builder->get_total_frames()), peaks_path.c_str());
+		// 每首曲目只写入一次，之后seek回来重新播放不再记录
+		delete builder;
+		decoder->peak_builder = nullptr;
+	}
+
+	void close_peak_builder(audio_decoder_context* decoder)
+	{
+		delete decoder->peak_builder;
+		decoder->peak_builder = nullptr;
+	}
+
+	int print_peak_summary(const char* media_path)
+	{
+		uint64_t file_size;
+		int64_t file_mtime;
+		std::string peaks_path = get_peaks_path(media_path);
+		audio_peak_file file;
+		if (!get_file_info(media_path, file_size, file_mtime) || file.open(peaks_path.c_str(), file_size, file_mtime))
+		{
+			std::printf("err: no valid peaks for %s\n", media_path);
+			return -1;
+		}
+		std::printf("info: peaks %s: %dHz, %d channels, %llu frames, %d levels\n", peaks_path.c_str(),
+			file.get_sample_rate(), file.get_channels(), static_cast<unsigned long long>(file.get_total_frames()),
+			file.get_level_count());
+		for (int n = 0; n < file.get_level_count(); ++n)
+		{
+			const audio_peak_file::level& level = file.get_level(n);
+			std::printf("info:   level %2d: %8llu frames per entry, %8llu entries\n", n,
+				static_cast<unsigned long long>(level.frames_per_entry), static_cast<unsigned long long>(level.entry_count));
+		}
+		// 最粗一级只有一项，即整个曲目
+		const audio_peak_file::level& top = file.get_level(file.get_level_count() - 1);
+		for (int ch = 0; ch < file.get_channels(); ++ch)
+		{
+			const peak_sample& value = top.samples[ch];
+			std::printf("info:   ch%d: min %.4f, max %.4f, rms %.4f\n", ch, value.min / 32767.0, value.max / 32767.0,
+				value.rms / 32767.0);
+		}
+		return 0;
+	}
+}
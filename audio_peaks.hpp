@@ -0,0 +1,165 @@
+﻿#if !defined(AUDIO_PEAKS_HPP_)
+#define AUDIO_PEAKS_HPP_
+#include "audio_play_interface.hpp"
+#include <string>
+#include <vector>
+
+namespace audio
+{
+	// 波形摘要：每个声道按固定帧数分块记录最小值、最大值与RMS，逐级合并相邻两块得到更粗的级别（mipmap），
+	// 第n级每项覆盖peak_base_frames << n帧，直到只剩一项；界面按缩放比例选择级别，不必再解码
+	constexpr int peak_max_channels = 8;
+	constexpr int peak_base_frames = 256;
+	constexpr int peak_max_levels = 40;
+
+	// 单个声道的标量实现，SIMD实现也用它处理不足一组的尾部帧
+	inline void reduce_peak_frames(const float* src, int frames, int channels, float* min, float* max,
+		float* sum_squares)
+	{
+		for (int i = 0; i < frames; ++i)
+		{
+			for (int ch = 0; ch < channels; ++ch)
+			{
+				float x = src[i * channels + ch];
+				min[ch] = x < min[ch] ? x : min[ch];
+				max[ch] = x > max[ch] ? x : max[ch];
+				sum_squares[ch] += x * x;
+			}
+		}
+	}
+
+	// 一组波形摘要内核；src为交错存储的float，平面格式按声道以channels = 1调用
+	// SIMD实现每次处理若干个向量宽度的帧，各向量中的通道对应固定的声道，最后按声道合并
+	struct peak_kernels
+	{
+		const char* name;
+		// 更新每个声道的min/max，并把平方和累加到sum_squares；channels不超过peak_max_channels
+		void (*reduce_f32)(const float* src, int frames, int channels, float* min, float* max, float* sum_squares);
+	};
+
+	const peak_kernels& get_scalar_peak_kernels();
+	// 未编译对应实现时返回nullptr，不检查cpu是否支持
+	const peak_kernels* get_sse2_peak_kernels();
+	const peak_kernels* get_avx2_peak_kernels();
+	const peak_kernels* get_neon_peak_kernels();
+	// 当前cpu上可运行的实现，按从慢到快的顺序写入kernels，返回个数
+	int get_available_peak_kernels(const peak_kernels** kernels, int max_count);
+	// 当前cpu上最快的实现，第一次调用时检测
+	const peak_kernels& get_peak_kernels();
+
+	// 文件中每个声道的一项：样本按满幅32767量化，min向下、max向上取整，rms四舍五入
+	struct peak_sample
+	{
+		int16_t min;
+		int16_t max;
+		uint16_t rms;
+	};
+
+	// 解码时逐帧建立波形摘要，只由decode阶段访问
+	// 摘要只在从头连续解码到结尾时有效：seek或声道数改变后不再记录，也不写入文件
+	class audio_peak_builder
+	{
+	public:
+		// 声道数超过peak_max_channels时is_valid返回false
+		audio_peak_builder(int sample_rate, int channels, const peak_kernels* kernels = nullptr);
+		audio_peak_builder(const audio_peak_builder&) = delete;
+		audio_peak_builder& operator=(const audio_peak_builder&) = delete;
+
+		// 任意样本格式的解码帧；非float格式先转换到内部的缓冲区
+		void add(const AVFrame* frame);
+		void invalidate() { valid = false; }
+		bool is_valid() const { return valid; }
+		uint64_t get_total_frames() const { return total_frames; }
+		// 最后不足一块的部分作为第0级的最后一项，之后不再接受帧；file_size与file_mtime用于判断是否失效
+		int save(const char* peaks_path, uint64_t file_size, int64_t file_mtime);
+
+	private:
+		// 第0级的一项，平方和在合并各级时使用
+		struct block_value
+		{
+			float min;
+			float max;
+			double sum_squares;
+		};
+
+		// planes为各声道（平面格式）或全部声道（交错格式）的float数据，frames不超过当前块剩余的帧数
+		void reduce(const float* const* planes, bool planar, int frames);
+		void finish_block();
+
+		const peak_kernels* kernels;
+		int sample_rate;
+		int channels;
+		bool valid = true;
+		bool finished = false;
+		uint64_t total_frames = 0;
+		// 当前块已累积的帧数，平面格式的各声道依次送入同一段帧
+		int block_filled = 0;
+		float block_min[peak_max_channels];
+		float block_max[peak_max_channels];
+		float block_sum_squares[peak_max_channels];
+		// [entry][channel]
+		std::vector<block_value> blocks;
+		std::vector<float> scratch;
+	};
+
+	class audio_input_source;
+
+	// 内存映射的波形摘要文件，只读；各级数据按8字节对齐存放，直接返回映射中的指针
+	// 文件为小端，与x86/arm的主机字节序一致
+	class audio_peak_file
+	{
+	public:
+		struct level
+		{
+			uint64_t frames_per_entry;
+			uint64_t entry_count;
+			// [entry][channel]
+			const peak_sample* samples;
+		};
+
+		audio_peak_file() = default;
+		~audio_peak_file() { close(); }
+		audio_peak_file(const audio_peak_file&) = delete;
+		audio_peak_file& operator=(const audio_peak_file&) = delete;
+
+		// 格式不符，或文件大小、修改时间与媒体文件不一致时返回-1
+		int open(const char* peaks_path, uint64_t file_size, int64_t file_mtime);
+		void close();
+		int get_sample_rate() const { return sample_rate; }
+		int get_channels() const { return channels; }
+		uint64_t get_total_frames() const { return total_frames; }
+		int get_level_count() const { return int(levels.size()); }
+		const level& get_level(int index) const { return levels[size_t(index)]; }
+		// 每像素frames_per_pixel帧时使用的级别：每项覆盖的帧数不超过每像素帧数的最粗一级
+		int find_level(double frames_per_pixel) const;
+
+	private:
+		audio_input_source* source = nullptr;
+		int sample_rate = 0;
+		int channels = 0;
+		uint64_t total_frames = 0;
+		std::vector<level> levels;
+	};
+
+	// 媒体文件旁的<文件名>.peaks
+	inline std::string get_peaks_path(const std::string& media_path)
+	{
+		return media_path + ".peaks";
+	}
+
+	struct audio_decoder_context;
+	// 解码器打开后调用：config.generate_peaks为true且输入是普通文件时建立波形摘要
+	void open_peak_builder(audio_decoder_context* decoder, const audio_input_config& config);
+	// 曲目解码完毕时由decode阶段调用：摘要有效时写入文件
+	void save_peak_summary(audio_decoder_context* decoder);
+	void close_peak_builder(audio_decoder_context* decoder);
+	// 打印媒体文件的波形摘要：各级每项的帧数与项数，以及整个曲目的峰值与RMS；没有有效的摘要时返回-1
+	int print_peak_summary(const char* media_path);
+
+	// 逐个实现与标量实现对比，并检查写入、映射读取后各级的一致性；返回非0表示存在失败
+	int run_peak_selftest();
+	// 测量每个实现处理立体声48kHz的速度（实时的倍数）
+	void run_peak_benchmark();
+}
+
+#endif // AUDIO_PEAKS_HPP_
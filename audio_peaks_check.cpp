@@ -0,0 +1,241 @@
+﻿#include "audio_peaks.hpp"
+#include "kernel_check.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+namespace audio
+{
+	constexpr const char* peak_check_path = "peaks_selftest.tmp";
+
+	// 与解码器输出相同的帧：frames帧、channels个声道的正弦，起始于第first帧
+	static AVFrame* make_sine_frame(AVSampleFormat format, int channels, int frames, int64_t first, int sample_rate,
+		double frequency, double amplitude)
+	{
+		constexpr double pi = 3.14159265358979323846;
+		AVFrame* frame = av_frame_alloc();
+		frame->format = format;
+		frame->nb_samples = frames;
+		av_channel_layout_default(&frame->ch_layout, channels);
+		if (av_frame_get_buffer(frame, 0) < 0)
+		{
+			av_frame_free(&frame);
+			return nullptr;
+		}
+		bool planar = av_sample_fmt_is_planar(format) != 0;
+		for (int i = 0; i < frames; ++i)
+		{
+			double value = amplitude * std::sin(2 * pi * frequency * double(first + i) / sample_rate);
+			for (int ch = 0; ch < channels; ++ch)
+			{
+				// 各声道的幅度依次减半，检查声道没有错位
+				double scaled = value / double(1 << ch);
+				int plane = planar ? ch : 0;
+				size_t index = planar ? size_t(i) : size_t(i) * channels + ch;
+				if (format == AV_SAMPLE_FMT_S16 || format == AV_SAMPLE_FMT_S16P)
+					reinterpret_cast<int16_t*>(frame->extended_data[plane])[index] = int16_t(std::lrint(scaled * 32767));
+				else
+					reinterpret_cast<float*>(frame->extended_data[plane])[index] = float(scaled);
+			}
+		}
+		return frame;
+	}
+
+	// 按不等长的帧送入，覆盖块的拼接
+	static int build_sine_peaks(AVSampleFormat format, int channels, int total_frames, int sample_rate,
+		double amplitude)
+	{
+		audio_peak_builder builder(sample_rate, channels);
+		const int frame_sizes[] = { 1152, 1024, 333, 4096, 17 };
+		int64_t position = 0;
+		for (int k = 0; position < total_frames; ++k)
+		{
+			int frames = int(std::min<int64_t>(frame_sizes[k % 5], total_frames - position));
+			AVFrame* frame = make_sine_frame(format, channels, frames, position, sample_rate, 1000.0, amplitude);
+			if (!frame)
+				return -1;
+			builder.add(frame);
+			av_frame_free(&frame);
+			position += frames;
+		}
+		return builder.save(peak_check_path, uint64_t(total_frames), 1234);
+	}
+
+	int run_peak_selftest()
+	{
+		const peak_kernels* kernels[4];
+		int kernel_count = get_available_peak_kernels(kernels, 4);
+		const peak_kernels& scalar = get_scalar_peak_kernels();
+		kernel_check_report report;
+
+		// 与标量实现对比：min/max逐位一致，平方和只有累加顺序不同
+		const int frame_cases[] = { 3, kernel_check_frames };
+		for (int channels = 1; channels <= peak_max_channels; ++channels)
+		{
+			for (int frames : frame_cases)
+			{
+				std::vector<float> samples(size_t(frames) * channels);
+				uint32_t seed = 0x1234567u + uint32_t(channels);
+				for (auto& sample : samples)
+					sample = random_check_float(seed);
+				float ref_min[peak_max_channels], ref_max[peak_max_channels], ref_sum[peak_max_channels];
+				std::fill_n(ref_min, peak_max_channels, HUGE_VALF);
+				std::fill_n(ref_max, peak_max_channels, -HUGE_VALF);
+				std::fill_n(ref_sum, peak_max_channels, 0.0f);
+				scalar.reduce_f32(samples.data(), frames, channels, ref_min, ref_max, ref_sum);
+				for (int k = 0; k < kernel_count; ++k)
+				{
+					const peak_kernels& current = *kernels[k];
+					float min[peak_max_channels], max[peak_max_channels], sum[peak_max_channels];
+					std::fill_n(min, peak_max_channels, HUGE_VALF);
+					std::fill_n(max, peak_max_channels, -HUGE_VALF);
+					std::fill_n(sum, peak_max_channels, 0.0f);
+					current.reduce_f32(samples.data(), frames, channels, min, max, sum);
+					bool exact = true;
+					double sum_diff = 0;
+					for (int ch = 0; ch < channels; ++ch)
+					{
+						exact = exact && min[ch] == ref_min[ch] && max[ch] == ref_max[ch];
+						sum_diff = std::max(sum_diff, std::fabs(double(sum[ch]) - ref_sum[ch]) / ref_sum[ch]);
+					}
+					report(exact && sum_diff <= 1e-5, "%-10s %dch %4d frames %-6s min/max %s, sum diff=%g", "reduce",
+						channels, frames, current.name, exact ? "exact" : "differ", sum_diff);
+				}
+			}
+		}
+
+		// 写入、映射读取：正弦的峰值与RMS，各级与下一级一致
+		constexpr int sample_rate = 48000;
+		constexpr int total_frames = sample_rate * 10 + 123;
+		constexpr double amplitude = 0.5;
+		const AVSampleFormat format_cases[] = { AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16 };
+		for (AVSampleFormat format : format_cases)
+		{
+			const char* format_name = av_get_sample_fmt_name(format);
+			if (build_sine_peaks(format, 2, total_frames, sample_rate, amplitude))
+			{
+				report(false, "%-10s %s build failed", "peaks", format_name);
+				continue;
+			}
+			audio_peak_file file;
+			report(file.open(peak_check_path, uint64_t(total_frames), 1235) < 0, "%-10s %s stale mtime rejected",
+				"peaks", format_name);
+			if (file.open(peak_check_path, uint64_t(total_frames), 1234))
+			{
+				report(false, "%-10s %s open failed", "peaks", format_name);
+				continue;
+			}
+			int channels = file.get_channels();
+			uint64_t base_count = (uint64_t(total_frames) + peak_base_frames - 1) / peak_base_frames;
+			const audio_peak_file::level& top = file.get_level(file.get_level_count() - 1);
+			report(file.get_total_frames() == uint64_t(total_frames) && channels == 2
+				&& file.get_level(0).entry_count == base_count && top.entry_count == 1,
+				"%-10s %s %d levels, %llu base entries, top %llu frames per entry", "peaks", format_name,
+				file.get_level_count(), static_cast<unsigned long long>(file.get_level(0).entry_count),
+				static_cast<unsigned long long>(top.frames_per_entry));
+			bool consistent = true;
+			for (int n = 1; n < file.get_level_count(); ++n)
+			{
+				const audio_peak_file::level& lower = file.get_level(n - 1);
+				const audio_peak_file::level& upper = file.get_level(n);
+				for (uint64_t e = 0; e < upper.entry_count; ++e)
+				{
+					for (int ch = 0; ch < channels; ++ch)
+					{
+						const peak_sample& left = lower.samples[2 * e * channels + ch];
+						const peak_sample* right = 2 * e + 1 < lower.entry_count ? &lower.samples[(2 * e + 1) * channels + ch] : nullptr;
+						const peak_sample& value = upper.samples[e * channels + ch];
+						consistent = consistent && value.min == (right ? std::min(left.min, right->min) : left.min)
+							&& value.max == (right ? std::max(left.max, right->max) : left.max);
+					}
+				}
+			}
+			report(consistent, "%-10s %s levels consistent", "peaks", format_name);
+			// 顶层覆盖整个曲目；第二个声道的幅度为一半
+			for (int ch = 0; ch < channels; ++ch)
+			{
+				double expect_peak = amplitude / double(1 << ch) * 32767;
+				double expect_rms = expect_peak / std::sqrt(2.0);
+				const peak_sample& value = top.samples[ch];
+				report(std::fabs(value.max - expect_peak) <= 2 && std::fabs(value.min + expect_peak) <= 2
+					&& std::fabs(value.rms - expect_rms) <= expect_rms * 0.001,
+					"%-10s %s ch%d min %d max %d rms %u (expect +-%.0f, %.0f)", "peaks", format_name, ch,
+					value.min, value.max, unsigned(value.rms), expect_peak, expect_rms);
+			}
+			report(file.get_level(file.find_level(1000)).frames_per_entry == 512, "%-10s %s 1000 frames per pixel -> "
+				"%llu frames per entry", "peaks", format_name,
+				static_cast<unsigned long long>(file.get_level(file.find_level(1000)).frames_per_entry));
+		}
+		std::remove(peak_check_path);
+		return report.finish("peaks");
+	}
+
+	// 立体声48kHz的10秒噪声：内核处理交错样本，以及按1024帧的平面float帧送入完整的摘要建立过程
+	void run_peak_benchmark()
+	{
+		constexpr int sample_rate = 48000;
+		constexpr int channels = 2;
+		constexpr int frames = sample_rate * 10;
+		constexpr int frame_size = 1024;
+		const peak_kernels* kernels[4];
+		int kernel_count = get_available_peak_kernels(kernels, 4);
+		std::vector<float> samples(size_t(frames) * channels);
+		uint32_t seed = 0x9E3779B9u;
+		for (auto& sample : samples)
+			sample = random_check_float(seed) * 0.5f;
+		AVFrame* frame = av_frame_alloc();
+		frame->format = AV_SAMPLE_FMT_FLTP;
+		frame->nb_samples = frame_size;
+		av_channel_layout_default(&frame->ch_layout, channels);
+		if (av_frame_get_buffer(frame, 0) < 0)
+		{
+			std::printf("err: allocate benchmark frame failed\n");
+			av_frame_free(&frame);
+			return;
+		}
+		for (int ch = 0; ch < channels; ++ch)
+		{
+			for (int i = 0; i < frame_size; ++i)
+				reinterpret_cast<float*>(frame->extended_data[ch])[i] = samples[size_t(i) * channels + ch];
+		}
+
+		using clock = std::chrono::steady_clock;
+		auto measure_speed = [&](auto&& body) {
+			int runs = 0;
+			double elapsed = 0;
+			auto begin = clock::now();
+			do
+			{
+				body();
+				runs++;
+				elapsed = std::chrono::duration<double>(clock::now() - begin).count();
+			} while (elapsed < 0.5);
+			return double(frames) * runs / sample_rate / elapsed;
+		};
+		std::printf("info: peaks benchmark, stereo %dHz, realtime multiples per core\n", sample_rate);
+		std::printf("%-8s %12s %12s\n", "kernels", "interleaved", "planar frame");
+		for (int k = 0; k < kernel_count; ++k)
+		{
+			const peak_kernels& current = *kernels[k];
+			volatile float sink = 0;
+			double reduce_speed = measure_speed([&] {
+				float min[channels] = { HUGE_VALF, HUGE_VALF }, max[channels] = { -HUGE_VALF, -HUGE_VALF };
+				float sum[channels] = {};
+				for (int offset = 0; offset < frames; offset += peak_base_frames)
+					current.reduce_f32(samples.data() + size_t(offset) * channels,
+						std::min(peak_base_frames, frames - offset), channels, min, max, sum);
+				sink = sink + max[0] + sum[1];
+			});
+			double builder_speed = measure_speed([&] {
+				audio_peak_builder builder(sample_rate, channels, &current);
+				for (int offset = 0; offset < frames; offset += frame_size)
+					builder.add(frame);
+				sink = sink + float(builder.get_total_frames());
+			});
+			std::printf("%-8s %11.0fx %11.0fx\n", current.name, reduce_speed, builder_speed);
+		}
+		av_frame_free(&frame);
+	}
+}
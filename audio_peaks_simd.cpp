@@ -0,0 +1,236 @@
+﻿#include "audio_peaks.hpp"
+#include "sample_convert.hpp"
+#include <algorithm>
+#include <cmath>
+#if defined(SAMPLE_CONVERT_X86)
+#include <immintrin.h>
+#endif
+#if defined(SAMPLE_CONVERT_NEON)
+#include <arm_neon.h>
+#endif
+
+// 交错存储的样本不做声道拆分：每组取unroll个向量宽度的帧，共channels * unroll个向量，
+// 第j个向量的第k个通道固定为第(j * 宽度 + k) % channels个声道，组内各向量分别累积，最后按声道合并各通道
+// 声道数较少时展开多个向量，避免平方和的累加受加法延迟限制；平方和的累加顺序与标量实现不同，误差在float精度内
+
+namespace audio
+{
+	// 每组向量的个数：至少4个
+	template <int channels>
+	struct peak_group
+	{
+		static constexpr int unroll = channels >= 4 ? 1 : 4 / channels;
+		static constexpr int vectors = channels * unroll;
+	};
+
+	// 各向量通道的结果按声道合并，lanes为每组的向量数 * 向量宽度个元素
+	static void merge_peak_lanes(const float* lane_min, const float* lane_max, const float* lane_sum, int lanes,
+		int channels, float* min, float* max, float* sum_squares)
+	{
+		for (int e = 0; e < lanes; ++e)
+		{
+			int ch = e % channels;
+			min[ch] = std::min(min[ch], lane_min[e]);
+			max[ch] = std::max(max[ch], lane_max[e]);
+			sum_squares[ch] += lane_sum[e];
+		}
+	}
+
+#if defined(SAMPLE_CONVERT_X86)
+	// ---- SSE2 ----
+
+	template <int channels>
+	SSE2_TARGET static void reduce_f32_sse2_n(const float* src, int frames, float* min, float* max, float* sum_squares)
+	{
+		constexpr int vectors = peak_group<channels>::vectors;
+		constexpr int group_frames = 4 * peak_group<channels>::unroll;
+		__m128 vmin[vectors], vmax[vectors], vsum[vectors];
+		for (int j = 0; j < vectors; ++j)
+		{
+			vmin[j] = _mm_set1_ps(HUGE_VALF);
+			vmax[j] = _mm_set1_ps(-HUGE_VALF);
+			vsum[j] = _mm_setzero_ps();
+		}
+		int i = 0;
+		for (; i + group_frames <= frames; i += group_frames)
+		{
+			const float* p = src + i * channels;
+			for (int j = 0; j < vectors; ++j)
+			{
+				__m128 x = _mm_loadu_ps(p + 4 * j);
+				vmin[j] = _mm_min_ps(vmin[j], x);
+				vmax[j] = _mm_max_ps(vmax[j], x);
+				vsum[j] = _mm_add_ps(vsum[j], _mm_mul_ps(x, x));
+			}
+		}
+		alignas(16) float lane_min[4 * vectors], lane_max[4 * vectors], lane_sum[4 * vectors];
+		for (int j = 0; j < vectors; ++j)
+		{
+			_mm_store_ps(lane_min + 4 * j, vmin[j]);
+			_mm_store_ps(lane_max + 4 * j, vmax[j]);
+			_mm_store_ps(lane_sum + 4 * j, vsum[j]);
+		}
+		merge_peak_lanes(lane_min, lane_max, lane_sum, 4 * vectors, channels, min, max, sum_squares);
+		reduce_peak_frames(src + i * channels, frames - i, channels, min, max, sum_squares);
+	}
+
+	SSE2_TARGET static void reduce_f32_sse2(const float* src, int frames, int channels, float* min, float* max,
+		float* sum_squares)
+	{
+		switch (channels)
+		{
+		case 1: reduce_f32_sse2_n<1>(src, frames, min, max, sum_squares); break;
+		case 2: reduce_f32_sse2_n<2>(src, frames, min, max, sum_squares); break;
+		case 3: reduce_f32_sse2_n<3>(src, frames, min, max, sum_squares); break;
+		case 4: reduce_f32_sse2_n<4>(src, frames, min, max, sum_squares); break;
+		case 5: reduce_f32_sse2_n<5>(src, frames, min, max, sum_squares); break;
+		case 6: reduce_f32_sse2_n<6>(src, frames, min, max, sum_squares); break;
+		case 7: reduce_f32_sse2_n<7>(src, frames, min, max, sum_squares); break;
+		case 8: reduce_f32_sse2_n<8>(src, frames, min, max, sum_squares); break;
+		default: reduce_peak_frames(src, frames, channels, min, max, sum_squares); break;
+		}
+	}
+
+	const peak_kernels* get_sse2_peak_kernels()
+	{
+		static const peak_kernels kernels = {
+			"sse2",
+			reduce_f32_sse2
+		};
+		return &kernels;
+	}
+
+	// ---- AVX2 ----
+
+	template <int channels>
+	AVX2_TARGET static void reduce_f32_avx2_n(const float* src, int frames, float* min, float* max, float* sum_squares)
+	{
+		constexpr int vectors = peak_group<channels>::vectors;
+		constexpr int group_frames = 8 * peak_group<channels>::unroll;
+		__m256 vmin[vectors], vmax[vectors], vsum[vectors];
+		for (int j = 0; j < vectors; ++j)
+		{
+			vmin[j] = _mm256_set1_ps(HUGE_VALF);
+			vmax[j] = _mm256_set1_ps(-HUGE_VALF);
+			vsum[j] = _mm256_setzero_ps();
+		}
+		int i = 0;
+		for (; i + group_frames <= frames; i += group_frames)
+		{
+			const float* p = src + i * channels;
+			for (int j = 0; j < vectors; ++j)
+			{
+				__m256 x = _mm256_loadu_ps(p + 8 * j);
+				vmin[j] = _mm256_min_ps(vmin[j], x);
+				vmax[j] = _mm256_max_ps(vmax[j], x);
+				vsum[j] = _mm256_add_ps(vsum[j], _mm256_mul_ps(x, x));
+			}
+		}
+		alignas(32) float lane_min[8 * vectors], lane_max[8 * vectors], lane_sum[8 * vectors];
+		for (int j = 0; j < vectors; ++j)
+		{
+			_mm256_store_ps(lane_min + 8 * j, vmin[j]);
+			_mm256_store_ps(lane_max + 8 * j, vmax[j]);
+			_mm256_store_ps(lane_sum + 8 * j, vsum[j]);
+		}
+		merge_peak_lanes(lane_min, lane_max, lane_sum, 8 * vectors, channels, min, max, sum_squares);
+		reduce_peak_frames(src + i * channels, frames - i, channels, min, max, sum_squares);
+	}
+
+	AVX2_TARGET static void reduce_f32_avx2(const float* src, int frames, int channels, float* min, float* max,
+		float* sum_squares)
+	{
+		switch (channels)
+		{
+		case 1: reduce_f32_avx2_n<1>(src, frames, min, max, sum_squares); break;
+		case 2: reduce_f32_avx2_n<2>(src, frames, min, max, sum_squares); break;
+		case 3: reduce_f32_avx2_n<3>(src, frames, min, max, sum_squares); break;
+		case 4: reduce_f32_avx2_n<4>(src, frames, min, max, sum_squares); break;
+		case 5: reduce_f32_avx2_n<5>(src, frames, min, max, sum_squares); break;
+		case 6: reduce_f32_avx2_n<6>(src, frames, min, max, sum_squares); break;
+		case 7: reduce_f32_avx2_n<7>(src, frames, min, max, sum_squares); break;
+		case 8: reduce_f32_avx2_n<8>(src, frames, min, max, sum_squares); break;
+		default: reduce_peak_frames(src, frames, channels, min, max, sum_squares); break;
+		}
+	}
+
+	const peak_kernels* get_avx2_peak_kernels()
+	{
+		static const peak_kernels kernels = {
+			"avx2",
+			reduce_f32_avx2
+		};
+		return &kernels;
+	}
+#else
+	const peak_kernels* get_sse2_peak_kernels() { return nullptr; }
+	const peak_kernels* get_avx2_peak_kernels() { return nullptr; }
+#endif // SAMPLE_CONVERT_X86
+
+#if defined(SAMPLE_CONVERT_NEON)
+	// ---- NEON ----
+
+	template <int channels>
+	static void reduce_f32_neon_n(const float* src, int frames, float* min, float* max, float* sum_squares)
+	{
+		constexpr int vectors = peak_group<channels>::vectors;
+		constexpr int group_frames = 4 * peak_group<channels>::unroll;
+		float32x4_t vmin[vectors], vmax[vectors], vsum[vectors];
+		for (int j = 0; j < vectors; ++j)
+		{
+			vmin[j] = vdupq_n_f32(HUGE_VALF);
+			vmax[j] = vdupq_n_f32(-HUGE_VALF);
+			vsum[j] = vdupq_n_f32(0.0f);
+		}
+		int i = 0;
+		for (; i + group_frames <= frames; i += group_frames)
+		{
+			const float* p = src + i * channels;
+			for (int j = 0; j < vectors; ++j)
+			{
+				float32x4_t x = vld1q_f32(p + 4 * j);
+				vmin[j] = vminq_f32(vmin[j], x);
+				vmax[j] = vmaxq_f32(vmax[j], x);
+				vsum[j] = vaddq_f32(vsum[j], vmulq_f32(x, x));
+			}
+		}
+		float lane_min[4 * vectors], lane_max[4 * vectors], lane_sum[4 * vectors];
+		for (int j = 0; j < vectors; ++j)
+		{
+			vst1q_f32(lane_min + 4 * j, vmin[j]);
+			vst1q_f32(lane_max + 4 * j, vmax[j]);
+			vst1q_f32(lane_sum + 4 * j, vsum[j]);
+		}
+		merge_peak_lanes(lane_min, lane_max, lane_sum, 4 * vectors, channels, min, max, sum_squares);
+		reduce_peak_frames(src + i * channels, frames - i, channels, min, max, sum_squares);
+	}
+
+	static void reduce_f32_neon(const float* src, int frames, int channels, float* min, float* max,
+		float* sum_squares)
+	{
+		switch (channels)
+		{
+		case 1: reduce_f32_neon_n<1>(src, frames, min, max, sum_squares); break;
+		case 2: reduce_f32_neon_n<2>(src, frames, min, max, sum_squares); break;
+		case 3: reduce_f32_neon_n<3>(src, frames, min, max, sum_squares); break;
+		case 4: reduce_f32_neon_n<4>(src, frames, min, max, sum_squares); break;
+		case 5: reduce_f32_neon_n<5>(src, frames, min, max, sum_squares); break;
+		case 6: reduce_f32_neon_n<6>(src, frames, min, max, sum_squares); break;
+		case 7: reduce_f32_neon_n<7>(src, frames, min, max, sum_squares); break;
+		case 8: reduce_f32_neon_n<8>(src, frames, min, max, sum_squares); break;
+		default: reduce_peak_frames(src, frames, channels, min, max, sum_squares); break;
+		}
+	}
+
+	const peak_kernels* get_neon_peak_kernels()
+	{
+		static const peak_kernels kernels = {
+			"neon",
+			reduce_f32_neon
+		};
+		return &kernels;
+	}
+#else
+	const peak_kernels* get_neon_peak_kernels() { return nullptr; }
+#endif // SAMPLE_CONVERT_NEON
+}
@@ -6,7 +6,7 @@
 #endif
 
 #define _CRTDBG_MAP_ALLOC
-#ifdef _DEBUG
+#if defined(_MSC_VER) && defined(_DEBUG)
 #define DBG_NEW new ( _NORMAL_BLOCK , __FILE__ , __LINE__ )
 // Replace _NORMAL_BLOCK with _CLIENT_BLOCK if you want the
 // allocations to be of _CLIENT_BLOCK type
@@ -14,7 +14,11 @@
 #define DBG_NEW new
 #endif
 #include <cstdlib>
+#include <cstdint>
+#include <functional>
+#if defined(_MSC_VER)
 #include <crtdbg.h>
+#endif
 
 #if defined(_WIN32) || defined(WIN32) || defined(__cplusplus)
 extern "C" {
@@ -33,13 +37,229 @@ namespace audio
 	{
 		init, playing, paused, stopped
 	};
-	int load_audio_context(const char*);
+
+	// 输出端类型：xaudio2为声卡输出，其余均为无设备(headless)输出，可在linux上运行
+	enum class audio_sink_type
+	{
+		platform_default, // windows上为xaudio2，其他平台为null
+		xaudio2,
+		null,             // 丢弃pcm数据
+		wav_file,         // 写入wav文件
+		raw_pcm_file      // 写入不带文件头的pcm文件
+	};
+
+	// 输出格式的选择方式
+	enum class audio_output_format_mode
+	{
+		native,     // 按解码器的采样率/声道/样本格式输出，格式一致时跳过重采样
+		compatible  // 固定为44100Hz/立体声/16-bit
+	};
+
+	// 音量标准化（ReplayGain）的增益来源
+	enum class audio_replay_gain_mode
+	{
+		off,
+		track, // 按曲目的响度
+		album  // 按专辑的响度，同一专辑中曲目之间的响度差异保持不变
+	};
+
+	struct audio_sink_config
+	{
+		audio_sink_type type = audio_sink_type::platform_default;
+		// 输出端不接受native格式时退回compatible
+		audio_output_format_mode format_mode = audio_output_format_mode::native;
+		// wav_file/raw_pcm_file的输出路径
+		const char* output_path = nullptr;
+		// 模拟设备时钟的速度，仅对headless输出有效
+		// 0: 不模拟时钟，提交即播放完毕，以最快速度跑通decode->resample->submit
+		// 1.0: 按实时速度消耗缓冲区，用于测试延迟；其他正数为实时速度的倍数
+		double clock_speed = 0.0;
+		// 将多声道下混为立体声输出（compatible总是立体声）
+		bool downmix_to_stereo = false;
+		// 转换为16-bit时加入TPDF抖动
+		bool dither = false;
+		// 输出端中排队的目标时长（毫秒），0为默认值：200ms，低延迟模式为30ms
+		// 播放中出现underrun或上游停顿时自动增大，稳定一段时间后逐步回到设定值
+		int target_latency_ms = 0;
+		// 低延迟模式：目标为数十毫秒，提交的缓冲区相应地更小，seek与stop更快生效
+		bool low_latency = false;
+		// 音量标准化：增益来自loudness扫描的sidecar或文件中的标签，打开曲目时确定，
+		// 合并到样本转换中（重采样矩阵或下混系数），播放时不增加处理
+		audio_replay_gain_mode replay_gain = audio_replay_gain_mode::off;
+		// 在回放增益之上另加的增益（dB）
+		double replay_gain_preamp_db = 0;
+	};
+
+	// 输入方式（path为"-"时总是从标准输入读取）
+	enum class audio_input_mode
+	{
+		automatic,   // 普通文件使用mmap，其余（管道、设备文件等）使用文件流
+		mmap,        // 内存映射整个文件
+		file_stream  // std::ifstream
+	};
+
+	// 拉取回调：读取至多buf_size字节，返回读取的字节数，0为输入结束，负数为出错
+	using audio_read_callback = std::function<int(uint8_t* buf, int buf_size)>;
+
+	// 定位索引的使用方式
+	enum class audio_seek_index_mode
+	{
+		disabled,
+		memory,  // 播放过程中建立，只在打开期间有效
+		sidecar  // 同时保存为文件旁的<文件名>.seekidx，之后打开时直接载入
+	};
+
+	struct audio_input_config
+	{
+		audio_input_mode mode = audio_input_mode::automatic;
+		// 交给ffmpeg的AVIO缓冲区大小，较大的缓冲区可以减少read回调的次数
+		size_t avio_buffer_size = 8192;
+		// 预读：在独立的i/o线程中提前读取，慢速读取不再直接阻塞解码
+		// 窗口取两者中较大的一方，均为0时不启用预读；按毫秒计算的窗口在探测出码率后生效
+		size_t read_ahead_bytes = 0;
+		int read_ahead_ms = 0;
+		// 测试用：将输入的读取速度限制为每秒若干字节，0为不限制
+		size_t throttle_bytes_per_second = 0;
+		// 定位索引：demux时按固定间隔记录packet的时间戳与字节偏移，seek时按字节定位到目标之前最近的位置，
+		// 再解码并丢弃到目标样本；只用于没有完整原生索引的格式（无TOC的mp3、无SEEKTABLE的flac、ADTS aac等）
+		audio_seek_index_mode seek_index = audio_seek_index_mode::memory;
+		// 打开后在线程池中扫描整个文件（只读取packet，不解码），不必等播放经过就能快速定位
+		bool seek_index_scan = false;
+		// 解码器的线程数（帧/切片多线程，仅对支持的解码器有效），1为单线程，0为由ffmpeg按cpu核心数决定
+		// 帧多线程会使解码器多缓存thread_count帧，增加开始播放与seek的延迟
+		int decoder_threads = 1;
+		// 快速打开：限制探测读取的数据量与时长，容器头部已给出解码所需的参数时跳过avformat_find_stream_info
+		bool fast_open = false;
+		// 波形摘要：解码时按曲目计算多级的min/max/RMS，从头连续解码到结尾后写入文件旁的<文件名>.peaks，
+		// 界面之后直接映射该文件，不必再解码；seek过的曲目不写入，调用者提供的输入不适用
+		bool generate_peaks = false;
+		// 流信息缓存文件，按文件路径、大小与修改时间记录选中的流、解码参数与时长，命中时不再探测；nullptr为不使用
+		const char* stream_info_cache = nullptr;
+		// 调用者提供的输入，设置时不打开path（path只用于日志），mode、定位索引的sidecar/扫描与流信息缓存均不适用
+		// 内存中的完整文件：不复制，read直接从中复制到AVIO的缓冲区，可以定位；数据在曲目关闭之前必须有效
+		const uint8_t* memory_data = nullptr;
+		size_t memory_size = 0;
+		// 拉取回调：不可定位，每次read调用一次；回调在曲目关闭之前必须有效，由demux阶段所在的线程调用
+		audio_read_callback read_callback;
+	};
+
+	// 流信息的来源
+	enum class audio_stream_info_source
+	{
+		probed, // avformat_find_stream_info
+		header, // 快速打开，容器头部已足够
+		cached  // 流信息缓存
+	};
+
+	// 打开一首曲目的耗时分解，单位为微秒
+	struct audio_open_stats
+	{
+		double input_us = 0;        // 打开输入（文件、mmap、预读线程）
+		double open_input_us = 0;   // avformat_open_input：探测格式并解析头部
+		double stream_info_us = 0;  // avformat_find_stream_info或应用缓存
+		double codec_open_us = 0;   // avcodec_open2
+		double seek_index_us = 0;   // 定位索引（包括载入sidecar）
+		double total_us = 0;
+		// 打开期间read回调的次数与读取的字节数
+		uint64_t read_calls = 0;
+		uint64_t bytes_read = 0;
+		audio_stream_info_source stream_info = audio_stream_info_source::probed;
+		// start到第一个缓冲区提交给输出端的时间，尚未提交时为-1
+		double first_sample_us = -1;
+	};
+
+	// pcm缓冲区池的统计数据
+	struct buffer_pool_stats
+	{
+		uint32_t block_size = 0;
+		uint32_t block_count = 0;
+		// 直接从池中取得块的次数
+		uint64_t hits = 0;
+		// 池中无空闲块或块大小不足，转而从堆上分配的次数
+		uint64_t misses = 0;
+		uint32_t blocks_in_use = 0;
+		// 同时使用中的块数的最大值
+		uint32_t high_water_mark = 0;
+	};
+
+	// 播放流水线中一个阶段的统计数据
+	// starved为等待上游数据的时间，blocked为等待下游空间（包括输出端播放）的时间，
+	// busy为其余时间；busy占比最高的阶段即为瓶颈
+	struct pipeline_stage_stats
+	{
+		const char* name = nullptr;
+		uint64_t items = 0;
+		double busy_seconds = 0;
+		double starved_seconds = 0;
+		double blocked_seconds = 0;
+		double elapsed_seconds = 0;
+	};
+
+	// 多个播放器共享的工作线程池：每个播放器的demux/decode/output阶段作为任务在池中运行，
+	// 阶段等待数据或空间时不占用线程，一个进程中可以同时运行大量播放器
+	class audio_worker_pool;
+	// thread_count为0时取cpu核心数
+	audio_worker_pool* create_audio_worker_pool(int thread_count = 0);
+	// 须在使用该线程池的所有播放器销毁之后调用
+	void destroy_audio_worker_pool(audio_worker_pool* pool);
+
+	// 一个独立的播放会话：曲目与播放列表、输出端、样本转换与流水线状态均属于该对象，
+	// 不同的播放器之间互不影响，可以在任意线程中同时使用
+	class audio_player
+	{
+	public:
+		virtual ~audio_player() = default;
+
+		// 打开第一首曲目，输出格式按该曲目确定；同时清空播放列表
+		virtual int load(const char* path, const audio_input_config& config = audio_input_config()) = 0;
+		// 关闭所有曲目，须在uninitialize之后调用
+		virtual void release() = 0;
+		// 播放列表：将曲目排在已加载的曲目之后，在前一首播放期间提前打开、解析并准备好重采样器，
+		// 曲目之间无缝衔接，输出端不重新打开；无法打开的曲目被跳过
+		virtual int enqueue(const char* path, const audio_input_config& config = audio_input_config()) = 0;
+		// 移除尚未开始播放的曲目
+		virtual void clear_playlist() = 0;
+
+		virtual int initialize(const audio_sink_config& config = audio_sink_config()) = 0;
+		virtual void uninitialize() = 0;
+		virtual void start() = 0;
+		// 立即停止，不等待已提交的缓冲区播放完毕；返回时流水线的所有任务均已结束
+		virtual void stop() = 0;
+		// 阻塞直到播放结束（播放完毕、出错或stop）
+		virtual void wait() = 0;
+		// 跳转到指定的秒数，播放未开始或已结束时返回-1
+		// 作用于正在读取的曲目：曲目切换时下一首可能已开始读取，此时跳转到下一首中的位置
+		virtual int seek(double seconds) = 0;
+		virtual audio_playback_state get_state() const = 0;
+		virtual void get_output_buffer_pool_stats(buffer_pool_stats& stats) = 0;
+		// 已提交给输出端的音频时长，须在播放结束之后、uninitialize之前读取
+		virtual double get_output_seconds() = 0;
+		// 返回写入的阶段数
+		virtual int get_pipeline_stage_stats(pipeline_stage_stats* stats, int max_count) = 0;
+		// 第一首曲目（load打开的曲目）的打开耗时，以及开始播放到第一个缓冲区提交的时间
+		virtual void get_open_stats(audio_open_stats& stats) = 0;
+		virtual const char* get_backend_name() const = 0;
+	};
+
+	// pool为nullptr时使用进程内共享的默认线程池；销毁播放器时自动停止播放并释放所有曲目
+	audio_player* create_audio_player(audio_worker_pool* pool = nullptr);
+
+	// 以下函数操作进程内的默认播放器，第一次调用时创建
+	int load_audio_context(const char*, const audio_input_config& config = audio_input_config());
+	// 同时销毁默认播放器
 	void release_audio_context();
+	int enqueue_audio_file(const char* path, const audio_input_config& config = audio_input_config());
+	void clear_audio_playlist();
 
-	int initialize_audio_engine();
+	int initialize_audio_engine(const audio_sink_config& config = audio_sink_config());
 	void uninitialize_audio_engine();
-	void audio_playback_worker_thread();
 	void start_audio_playback(); 
+	// 阻塞直到播放结束（文件播放完毕或出错）
+	void wait_audio_playback();
+	int seek_audio_playback(double seconds);
+	void get_output_buffer_pool_stats(buffer_pool_stats& stats);
+	int get_pipeline_stage_stats(pipeline_stage_stats* stats, int max_count);
+	void get_audio_open_stats(audio_open_stats& stats);
 	const char* get_backend_implement_version();
 }
 
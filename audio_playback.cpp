@@ -0,0 +1,1770 @@
+﻿#include "ffmpeg_xaudio2_internal.hpp"
+#include "audio_output_sink.hpp"
+#include "spsc_ring.hpp"
+#include "pcm_buffer_pool.hpp"
+#include "pipeline_queue.hpp"
+#include "sample_convert.hpp"
+#include "audio_seek_index.hpp"
+#include "audio_metrics.hpp"
+#include "audio_trace.hpp"
+#include "audio_loudness.hpp"
+#include "audio_peaks.hpp"
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <bitset>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#pragma comment(lib, "swresample.lib")
+
+namespace audio
+{
+	// 一个提交给输出端的pcm缓冲区（一个period）
+	struct audio_output_buffer
+	{
+		// 从output_buffer_pool中取得的块
+		uint8_t* data;
+		uint32_t bytes;
+		// 提交时刻，用于统计submit_to_play
+		int64_t submit_ns;
+	};
+
+	// 流水线中传递的元素类型
+	enum class pipeline_item_type
+	{
+		data,          // 携带一个packet/frame
+		flush,         // seek后的第一个元素，下游丢弃内部缓存的数据
+		end_of_stream, // 文件读取完毕，下游取出内部缓存的数据
+		track_change   // 播放列表切换到decoder，之后的元素属于下一首；不因seek丢弃
+	};
+
+	// serial在每次seek时递增，serial与当前值不同的元素属于seek之前，下游直接丢弃
+	struct packet_item
+	{
+		pipeline_item_type type;
+		uint32_t serial;
+		AVPacket* packet;
+		// 仅对track_change有效
+		audio_decoder_context* decoder = nullptr;
+		// 仅对flush有效：seek目标与定位处的时间戳（流的time_base），后者为AV_NOPTS_VALUE时取之后第一个packet的时间戳
+		int64_t seek_target_pts = AV_NOPTS_VALUE;
+		int64_t seek_base_pts = AV_NOPTS_VALUE;
+	};
+
+	struct frame_item
+	{
+		pipeline_item_type type;
+		uint32_t serial;
+		AVFrame* frame;
+		audio_decoder_context* decoder = nullptr;
+	};
+
+	// 阶段任务因等待而返回的原因
+	enum class stage_wait
+	{
+		starved, // 等待上游数据
+		blocked  // 等待下游空间（包括输出端播放）
+	};
+
+	// 流水线阶段的计时，单位为纳秒
+	// 阶段任务等待时直接返回：返回时记下开始等待的时间，下次运行时计入starved/blocked
+	struct pipeline_stage_counter
+	{
+		const char* name;
+		std::atomic<uint64_t> items{ 0 };
+		std::atomic<uint64_t> starved_ns{ 0 };
+		std::atomic<uint64_t> blocked_ns{ 0 };
+		std::atomic<int64_t> start_ns{ 0 };
+		std::atomic<int64_t> end_ns{ 0 };
+		std::atomic<stage_wait> wait_reason{ stage_wait::starved };
+		// 0表示未在等待
+		std::atomic<int64_t> wait_begin_ns{ 0 };
+
+		void reset()
+		{
+			items = 0;
+			starved_ns = 0;
+			blocked_ns = 0;
+			start_ns = now_ns();
+			end_ns = 0;
+			wait_begin_ns = 0;
+		}
+
+		void begin_wait(stage_wait reason)
+		{
+			wait_reason.store(reason, std::memory_order_relaxed);
+			wait_begin_ns.store(now_ns(), std::memory_order_release);
+		}
+
+		void end_wait()
+		{
+			int64_t begin = wait_begin_ns.exchange(0, std::memory_order_acq_rel);
+			if (!begin)
+				return;
+			auto& wait_ns = wait_reason.load(std::memory_order_relaxed) == stage_wait::starved ? starved_ns : blocked_ns;
+			wait_ns.fetch_add(uint64_t(now_ns() - begin), std::memory_order_relaxed);
+		}
+	};
+
+	// 同时在输出端排队的最大缓冲区数量，必须为2的幂；排队的时长另由output_latency_controller限制
+	constexpr size_t output_queue_depth = 64;
+	// 输出端排队的默认目标时长与低延迟模式的目标时长
+	constexpr int default_target_latency_ms = 200;
+	constexpr int low_latency_target_latency_ms = 30;
+	// 解码器的帧按目标时长的1/4切分后提交，队列中始终有几个缓冲区，一个播放完毕时还有时间补充
+	constexpr int latency_periods_per_target = 4;
+	// 自适应目标的上限为设定值的倍数（即队列中至多约32个period，不超过output_queue_depth）
+	constexpr int max_latency_target_factor = 8;
+	// 连续播放这么长时间的音频没有underrun时缩小目标
+	constexpr int latency_stable_window_ms = 5000;
+	// 解码器帧长可变（frame_size为0）时，按此样本数估计一个缓冲区的大小
+	constexpr int default_period_samples = 4096;
+	// demux -> decode与decode -> resample/output之间的队列深度
+	constexpr size_t packet_queue_depth = 32;
+	constexpr size_t frame_queue_depth = 8;
+	// decode阶段为裁剪尾部填充最多暂缓送出的帧数
+	constexpr size_t max_held_frames = 8;
+	// 阶段任务每次运行最多处理的元素数，之后重新排队，避免一个播放器长时间占用工作线程
+	constexpr int stage_batch_size = 16;
+	// 输出端可接受的采样率与声道数范围（与xaudio2一致），超出时重采样/混音
+	constexpr int min_output_sample_rate = 1000;
+	constexpr int max_output_sample_rate = 200000;
+	constexpr int max_output_channels = 8;
+
+	// 解码器输出到输出格式的转换方式
+	// 采样率相同时使用sample_convert中的SIMD内核，其余情况经过swresample
+	enum class sample_conversion
+	{
+		passthrough,  // 格式完全一致，直接复制
+		interleave,   // 只需将平面(planar)存储交错排列
+		float_to_s16, // float -> 16-bit
+		s32_to_s16,   // 32-bit -> 16-bit
+		downmix,      // 5.1/7.1 float -> 立体声
+		resample      // 采样率、声道或样本格式不同，经过swresample
+	};
+	// 每首曲目一个，随audio_decoder_context释放
+	struct sample_converter
+	{
+		sample_conversion conversion = sample_conversion::resample;
+		bool input_planar = false;
+		int input_channels = 0;
+		downmix_coefficients downmix;
+		// 回放增益（线性），打开曲目时确定：下混时乘到下混系数上，其余情况由swresample在混音矩阵中完成
+		double gain = 1.0;
+		// 仅在conversion为resample时有效
+		SwrContext* swr_ctx = nullptr;
+		// 创建时播放器的output_generation，输出端重新初始化后需要重建
+		uint32_t generation = 0;
+	};
+
+	void free_sample_converter(sample_converter* converter)
+	{
+		if (!converter)
+			return;
+		if (converter->swr_ctx)
+		{
+			swr_close(converter->swr_ctx);
+			swr_free(&converter->swr_ctx);
+		}
+		delete converter;
+	}
+
+	static const char* get_conversion_name(const sample_converter& converter)
+	{
+		static const char* const conversion_names[] = {
+			"passthrough", "interleave", "float to s16", "s32 to s16", "downmix", "resample"
+		};
+		return conversion_names[static_cast<int>(converter.conversion)];
+	}
+
+	// 按解码器的输出确定输出格式：采样率与声道数不变，样本格式取对应的交错格式
+	// 输出端不支持的样本格式（8-bit、64-bit）与声道数转换为最接近的支持格式
+	void negotiate_output_format(const AVCodecContext* context, bool downmix_to_stereo,
+		audio_output_format& format, AVSampleFormat& sample_fmt)
+	{
+		format = audio_output_format();
+		sample_fmt = AV_SAMPLE_FMT_S16;
+		if (context->sample_rate >= min_output_sample_rate && context->sample_rate <= max_output_sample_rate)
+			format.sample_rate = context->sample_rate;
+		switch (av_get_packed_sample_fmt(context->sample_fmt))
+		{
+		case AV_SAMPLE_FMT_S32:
+		case AV_SAMPLE_FMT_S64:
+			sample_fmt = AV_SAMPLE_FMT_S32;
+			format.bits_per_sample = 32;
+			break;
+		case AV_SAMPLE_FMT_FLT:
+		case AV_SAMPLE_FMT_DBL:
+			sample_fmt = AV_SAMPLE_FMT_FLT;
+			format.bits_per_sample = 32;
+			format.is_float = true;
+			break;
+		default:
+			break;
+		}
+
+		const AVChannelLayout& layout = context->ch_layout;
+		if (downmix_to_stereo)
+			return;
+		if (layout.nb_channels >= 1 && layout.nb_channels <= max_output_channels)
+		{
+			format.channels = layout.nb_channels;
+			// AV_CH_*的低18位与SPEAKER_*一致，其余布局按声道数取默认掩码
+			if (layout.order == AV_CHANNEL_ORDER_NATIVE && (layout.u.mask & ~uint64_t(0x3FFFF)) == 0
+				&& int(std::bitset<64>(layout.u.mask).count()) == layout.nb_channels)
+				format.channel_mask = uint32_t(layout.u.mask);
+		}
+	}
+
+	// 输出端排队时长的控制，单位为输出采样率下的样本数，只由输出阶段访问
+	// 出现underrun时目标增大一半；上游（demux/decode）的停顿超过目标时增大到停顿时长的1.5倍；
+	// 连续latency_stable_window_ms没有underrun时缩小1/8，但不低于设定值与近期停顿的1.5倍
+	struct output_latency_controller
+	{
+		int64_t base_samples = 0;
+		int64_t max_samples = 0;
+		int64_t target_samples = 0;
+		// 近期上游停顿的峰值，每个稳定窗口衰减1/4
+		int64_t stall_samples = 0;
+		int64_t stable_window_samples = 0;
+		uint64_t seen_underruns = 0;
+		// 上一次调整或开始稳定窗口时已播放完毕的样本数
+		uint64_t window_begin_samples = 0;
+		uint32_t increases = 0;
+		uint32_t decreases = 0;
+
+		void reset(int64_t base, int sample_rate)
+		{
+			base_samples = std::max<int64_t>(base, 1);
+			max_samples = base_samples * max_latency_target_factor;
+			target_samples = base_samples;
+			stall_samples = 0;
+			stable_window_samples = int64_t(sample_rate) * latency_stable_window_ms / 1000;
+			seen_underruns = 0;
+			window_begin_samples = 0;
+			increases = 0;
+			decreases = 0;
+		}
+
+		// 每次输出阶段运行时调用；返回true表示目标改变
+		bool update(uint64_t underruns, uint64_t released_samples)
+		{
+			if (underruns != seen_underruns)
+			{
+				seen_underruns = underruns;
+				window_begin_samples = released_samples;
+				return raise(target_samples + target_samples / 2);
+			}
+			if (released_samples - window_begin_samples < uint64_t(stable_window_samples))
+				return false;
+			window_begin_samples = released_samples;
+			stall_samples -= stall_samples / 4;
+			int64_t floor = std::max(base_samples, stall_samples + stall_samples / 2);
+			if (target_samples <= floor)
+				return false;
+			target_samples = std::max(floor, target_samples - target_samples / 8);
+			decreases++;
+			return true;
+		}
+
+		// 输出阶段等待上游数据的时长
+		bool on_upstream_stall(int64_t samples)
+		{
+			stall_samples = std::max(stall_samples, samples);
+			return raise(samples + samples / 2);
+		}
+
+	private:
+		bool raise(int64_t samples)
+		{
+			samples = std::min(samples, max_samples);
+			if (samples <= target_samples)
+				return false;
+			target_samples = samples;
+			increases++;
+			return true;
+		}
+	};
+
+	// 一个播放会话，此前的全局播放状态均为其成员
+	// 流水线：demux -> packet_queue -> decode -> frame_queue -> resample/output -> 输出端
+	// 每个阶段是线程池上的一个pool_task：输入为空或输出已满时记下等待原因后返回，不占用线程，
+	// 由相邻阶段或输出端回调在状态变化时重新调度；队列有界，下游处理不及时上游即停止，逐级形成反压
+	class audio_player_impl : public audio_player, private audio_output_sink_callback
+	{
+	public:
+		explicit audio_player_impl(audio_worker_pool* pool)
+			: pool(pool),
+			demux_task(pool, [this] { run_demux_stage(); }),
+			decode_task(pool, [this] { run_decode_stage(); }),
+			output_task(pool, [this] { run_output_stage(); }),
+			playlist(pool, [this](audio_decoder_context* decoder) { return prepare_track_output(decoder); },
+				[this] { demux_task.schedule(); })
+		{
+		}
+
+		~audio_player_impl() override
+		{
+			uninitialize();
+			playlist.release();
+			// 预读任务结束时可能调度了demux阶段
+			wait_for_tasks();
+		}
+
+		int load(const char* path, const audio_input_config& config) override
+		{
+			audio_decoder_context* decoder = open_audio_decoder(path, config, pool);
+			open_stats = decoder ? decoder->open_stats : audio_open_stats();
+			playlist.set_current(decoder);
+			return decoder ? 0 : -1;
+		}
+
+		void release() override
+		{
+			playlist.release();
+		}
+
+		int enqueue(const char* path, const audio_input_config& config) override
+		{
+			return playlist.enqueue(path, config);
+		}
+
+		void clear_playlist() override
+		{
+			playlist.clear();
+		}
+
+		int initialize(const audio_sink_config& config) override;
+		void uninitialize() override;
+		void start() override;
+
+		void stop() override
+		{
+			stop_requested = true;
+			output_task.schedule();
+			wait();
+		}
+
+		void wait() override
+		{
+			{
+				std::unique_lock<std::mutex> lock(done_mutex);
+				done_cv.wait(lock, [this] { return !pipeline_active; });
+			}
+			wait_for_tasks();
+		}
+
+		int seek(double seconds) override;
+
+		audio_playback_state get_state() const override
+		{
+			return playback_state;
+		}
+
+		void get_output_buffer_pool_stats(buffer_pool_stats& stats) override
+		{
+			output_buffer_pool.get_stats(stats);
+		}
+
+		double get_output_seconds() override
+		{
+			return output_format.sample_rate > 0 ? double(submitted_samples_count) / output_format.sample_rate : 0;
+		}
+
+		int get_pipeline_stage_stats(pipeline_stage_stats* stats, int max_count) override;
+
+		void get_open_stats(audio_open_stats& stats) override
+		{
+			stats = open_stats;
+			int64_t start = playback_start_ns, first = first_submit_ns;
+			if (start && first >= start)
+				stats.first_sample_us = (first - start) / 1e3;
+		}
+
+		const char* get_backend_name() const override
+		{
+			if (output_sink)
+				return output_sink->get_name();
+#if defined(_WIN32)
+			return "xaudio2";
+#else
+			return "null";
+#endif
+		}
+
+	private:
+		// 输出端回调：缓冲区播放完毕后立即归还槽位与缓冲区，O(1)
+		void on_buffer_end(void* buffer_context) override
+		{
+			audio_output_buffer* played_buffer = output_ring->consumer_slot();
+			assert(played_buffer && played_buffer == buffer_context);
+			(void)buffer_context;
+			AUDIO_TRACE_VERBOSE_INSTANT(output, "buffer end", played_buffer->bytes);
+			audio_metrics& metrics = get_audio_metrics();
+			// seek后被丢弃的缓冲区没有播放，不计入
+			if (!output_flushing)
+				metrics.record(metric_histogram::submit_to_play_ns, uint64_t(now_ns() - played_buffer->submit_ns));
+			released_samples_count.fetch_add(played_buffer->bytes / uint32_t(output_format.block_align()),
+				std::memory_order_acq_rel);
+			output_buffer_pool.release(played_buffer->data);
+			played_buffer->data = nullptr;
+			output_ring->commit_pop();
+			if (output_ring->empty() && output_clocked && !output_draining && !output_flushing && !stop_requested
+				&& playback_state == audio_playback_state::playing)
+			{
+				output_underrun_count++;
+				metrics.add(metric_counter::output_underruns);
+				AUDIO_TRACE_INSTANT(output, "underrun", 0);
+			}
+			output_task.schedule();
+		}
+
+		void on_stream_end() override
+		{
+			output_stream_ended = true;
+			output_task.schedule();
+		}
+
+		int prepare_track_output(audio_decoder_context* decoder);
+		bool select_sample_convert_kernel(sample_converter& converter, const AVCodecContext* context);
+		sample_converter* create_sample_converter(const audio_decoder_context* decoder);
+		void copy_samples(uint8_t* dest, const uint8_t* const* in, int samples);
+		int convert_and_submit(const uint8_t** in, int in_samples);
+		int submit_frame(AVFrame* frame);
+		void start_output(bool force);
+		void update_output_latency(bool upstream_stalled, int64_t stall_ns);
+		int64_t get_output_queued_samples() const
+		{
+			return int64_t(submitted_samples_count - released_samples_count.load(std::memory_order_acquire));
+		}
+		void flush_output();
+		void free_pipeline();
+		void free_output_buffers();
+
+		void wait_for_tasks()
+		{
+			pool->wait_idle(demux_task);
+			pool->wait_idle(decode_task);
+			pool->wait_idle(output_task);
+		}
+
+		void release_packet(AVPacket* packet)
+		{
+			if (!packet)
+				return;
+			av_packet_unref(packet);
+			// 容量等于packet总数，不会失败
+			free_packets->push(packet);
+			demux_task.schedule();
+		}
+
+		void release_frame(AVFrame* frame)
+		{
+			if (!frame)
+				return;
+			av_frame_unref(frame);
+			free_frames->push(frame);
+			decode_task.schedule();
+		}
+
+		void run_demux_stage();
+		void post_packet(const packet_item& item);
+
+		void run_decode_stage();
+		void handle_packet_item(const packet_item& item);
+		bool flush_decode_outbox();
+		void post_decoded_frame(AVFrame* frame);
+		void queue_decoded_frame(AVFrame* frame);
+		void queue_held_frames();
+		void discard_held_frames();
+		void finish_decoder_drain();
+
+		void run_output_stage();
+		int switch_output_track(audio_decoder_context* next, bool drain_previous);
+		void finish_playback();
+
+		audio_worker_pool* pool;
+
+		audio_output_sink* output_sink = nullptr;
+		// 输出格式由第一首曲目确定，播放列表中之后的曲目转换为同一格式，切换曲目时输出端不重新打开
+		audio_output_format output_format = {};
+		AVSampleFormat output_sample_fmt = AV_SAMPLE_FMT_S16;
+		// 输出阶段正在使用的转换状态，属于当前曲目
+		sample_converter* active_converter = nullptr;
+		// 下混后还需转为16-bit时的中间缓冲区
+		std::vector<float> downmix_buffer;
+		tpdf_dither output_dither;
+		bool output_dither_enabled = false;
+		audio_replay_gain_mode output_replay_gain = audio_replay_gain_mode::off;
+		double output_replay_gain_preamp_db = 0;
+		// 保护输出格式：预读任务按输出格式为下一首创建转换状态，可能与initialize同时执行
+		std::mutex output_format_mutex;
+		bool output_ready = false;
+		uint32_t output_generation = 0;
+		std::atomic<audio_playback_state> playback_state{ audio_playback_state::stopped };
+		// 立即停止，不等待已提交的缓冲区播放完毕
+		std::atomic<bool> stop_requested{ false };
+		std::atomic<bool> output_stream_ended{ false };
+		std::atomic<bool> output_draining{ false };
+		// 播放过程中输出端队列被耗尽（解码跟不上播放）的次数
+		std::atomic<uint64_t> output_underrun_count{ 0 };
+
+		// 已提交给输出端、尚未播放完毕的缓冲区
+		// 生产者为输出阶段，消费者为输出端的完成回调；输出端按提交顺序播放，
+		// 因此槽位按FIFO顺序归还
+		spsc_ring<audio_output_buffer>* output_ring = nullptr;
+		pcm_buffer_pool output_buffer_pool;
+		uint64_t submitted_samples_count = 0;
+		// 输出端已播放完毕（或被flush丢弃）的样本数，由完成回调累加，与submitted_samples_count之差为排队中的样本数
+		std::atomic<uint64_t> released_samples_count{ 0 };
+		// sample size = output_format.block_align()
+		// 输出端按设备时钟播放；headless输出不模拟时钟时没有排队，不统计underrun，也不调整目标
+		bool output_clocked = false;
+		// 输出端排队的目标时长的设定值
+		int output_latency_ms = 0;
+		// 提交给输出端的缓冲区的最大样本数（输出采样率）
+		int output_period_samples = 0;
+		output_latency_controller output_latency;
+		// load打开的曲目的打开耗时；start与其后第一次提交的时间，用于计算开始播放的延迟
+		audio_open_stats open_stats;
+		std::atomic<int64_t> playback_start_ns{ 0 };
+		std::atomic<int64_t> first_submit_ns{ 0 };
+		// seek后输出端丢弃缓冲区期间不计入underrun，提交下一个缓冲区后清除
+		std::atomic<bool> output_flushing{ false };
+
+		pipeline_queue<packet_item>* packet_queue = nullptr;
+		pipeline_queue<frame_item>* frame_queue = nullptr;
+		// 空闲的packet/frame，数量为队列深度加上两端各持有的一个（frame另加decode阶段暂缓送出的帧），播放过程中不再分配
+		pipeline_queue<AVPacket*>* free_packets = nullptr;
+		pipeline_queue<AVFrame*>* free_frames = nullptr;
+		std::vector<AVPacket*> packet_pool;
+		std::vector<AVFrame*> frame_pool;
+		std::atomic<uint32_t> pipeline_serial{ 0 };
+		// seek请求由demux阶段执行
+		std::mutex seek_mutex;
+		bool seek_pending = false;
+		int64_t seek_target = 0; // AV_TIME_BASE
+		pipeline_stage_counter demux_counter{ "demux" };
+		pipeline_stage_counter decode_counter{ "decode" };
+		pipeline_stage_counter output_counter{ "resample/output" };
+		// 从start到播放结束；结束后阶段任务即使被调度也直接返回
+		std::atomic<bool> pipeline_active{ false };
+		std::mutex done_mutex;
+		std::condition_variable done_cv;
+
+		// 以下仅由demux阶段访问
+		audio_decoder_context* demux_decoder = nullptr;
+		uint32_t demux_serial = 0;
+		bool demux_reached_end = false;
+		// packet_queue已满时暂存的元素，下次运行时先送出
+		bool demux_has_pending = false;
+		packet_item demux_pending = {};
+
+		// 以下仅由decode阶段访问
+		audio_decoder_context* decode_decoder = nullptr;
+		uint32_t decode_serial = 0;
+		// 送入packet后取出帧，直到解码器需要更多输入
+		bool decode_receiving = false;
+		// 送入空packet后取出全部帧，完成后处理decode_drain_item（end_of_stream或track_change）
+		bool decode_draining = false;
+		packet_item decode_drain_item = {};
+		// seek后第一个packet到达时，按其与目标的距离计算需要解码后丢弃的样本数
+		bool decode_seek_pending = false;
+		int64_t decode_seek_target_pts = AV_NOPTS_VALUE;
+		int64_t decode_seek_base_pts = AV_NOPTS_VALUE;
+		// 上一帧取出之后送入packet与尝试取帧的耗时
+		int64_t decode_pending_ns = 0;
+		// 已产生、等待放入frame_queue的元素
+		std::deque<frame_item> decode_outbox;
+		// 为裁剪尾部填充而暂缓送出的帧：解码到结尾之前无法知道哪些样本属于填充，
+		// 因此至少保留trailing_padding个样本
+		std::deque<AVFrame*> held_frames;
+		int64_t held_samples = 0;
+
+		// 以下仅由输出阶段访问
+		// 输出端队列已满时暂存的元素，output_frame_offset为该帧中已提交的样本数
+		bool output_has_pending = false;
+		frame_item output_pending = {};
+		int output_frame_offset = 0;
+		// 切分帧时指向各平面中偏移处的指针
+		std::vector<const uint8_t*> output_planes;
+		// 开始等待上游数据的时刻，0表示未在等待；seek之后第一个缓冲区提交之前的等待不计入停顿
+		int64_t output_starved_ns = 0;
+		bool output_seek_settling = false;
+		// end_of_stream之后等待已提交的缓冲区播放完毕
+		bool output_drain_pending = false;
+		uint32_t output_drain_serial = 0;
+
+		// 阶段任务在playlist之前构造、之后析构：预读任务结束时会调度demux阶段
+		pool_task demux_task;
+		pool_task decode_task;
+		pool_task output_task;
+		audio_playlist playlist;
+	};
+
+	// 采样率相同时选择可以代替swresample的转换内核，没有对应的内核时返回false
+	bool audio_player_impl::select_sample_convert_kernel(sample_converter& converter, const AVCodecContext* context)
+	{
+		if (output_format.sample_rate != context->sample_rate)
+			return false;
+		AVSampleFormat in_packed_fmt = av_get_packed_sample_fmt(context->sample_fmt);
+		converter.input_planar = av_sample_fmt_is_planar(context->sample_fmt) != 0;
+		if (output_format.channels == converter.input_channels)
+		{
+			// 转换内核不能调整增益
+			if (converter.gain != 1.0)
+				return false;
+			if (output_sample_fmt == in_packed_fmt)
+				// 只是存储方式不同（或完全相同）
+				converter.conversion = converter.input_planar && output_format.channels > 1
+					? sample_conversion::interleave : sample_conversion::passthrough;
+			else if (in_packed_fmt == AV_SAMPLE_FMT_FLT && output_sample_fmt == AV_SAMPLE_FMT_S16)
+				converter.conversion = sample_conversion::float_to_s16;
+			else if (in_packed_fmt == AV_SAMPLE_FMT_S32 && output_sample_fmt == AV_SAMPLE_FMT_S16)
+				converter.conversion = sample_conversion::s32_to_s16;
+			else
+				return false;
+			return true;
+		}
+		if (output_format.channels == 2 && context->sample_fmt == AV_SAMPLE_FMT_FLTP
+			&& is_stereo_downmix_layout(context->ch_layout)
+			&& (output_sample_fmt == AV_SAMPLE_FMT_FLT || output_sample_fmt == AV_SAMPLE_FMT_S16))
+		{
+			converter.conversion = sample_conversion::downmix;
+			downmix_coefficients& downmix = converter.downmix;
+			downmix = downmix_coefficients();
+			if (output_sample_fmt == AV_SAMPLE_FMT_S16)
+			{
+				// 与swresample输出整数时一致：按每行系数之和归一化，避免削波
+				float sum = downmix.front + downmix.center + downmix.surround * ((converter.input_channels - 4) / 2);
+				downmix.front /= sum;
+				downmix.center /= sum;
+				downmix.surround /= sum;
+			}
+			downmix.front = float(downmix.front * converter.gain);
+			downmix.center = float(downmix.center * converter.gain);
+			downmix.surround = float(downmix.surround * converter.gain);
+			return true;
+		}
+		return false;
+	}
+
+	// 按当前输出格式确定解码器输出的转换方式，需要重采样时初始化swr_ctx；失败时返回nullptr
+	sample_converter* audio_player_impl::create_sample_converter(const audio_decoder_context* decoder)
+	{
+		const AVCodecContext* context = decoder->codec_context;
+		auto converter = DBG_NEW sample_converter();
+		converter->input_channels = context->ch_layout.nb_channels;
+		converter->generation = output_generation;
+		converter->gain = get_replay_gain(decoder, output_replay_gain, output_replay_gain_preamp_db);
+		if (select_sample_convert_kernel(*converter, context))
+			return converter;
+
+		AVChannelLayout out_layout = {};
+		if (output_format.channels == context->ch_layout.nb_channels)
+			// 声道数相同时沿用输入的布局，避免swresample按布局标签重新混音
+			av_channel_layout_copy(&out_layout, &context->ch_layout);
+		else
+			av_channel_layout_default(&out_layout, output_format.channels);
+
+		// 初始化swscale
+		converter->conversion = sample_conversion::resample;
+		swr_alloc_set_opts2(
+			&converter->swr_ctx,
+			&out_layout,
+			output_sample_fmt,
+			output_format.sample_rate,
+			&context->ch_layout,
+			context->sample_fmt,
+			context->sample_rate,
+			0, nullptr
+		);
+		av_channel_layout_uninit(&out_layout);
+		if (output_dither_enabled)
+			av_opt_set(converter->swr_ctx, "dither_method", "triangular", 0);
+		if (converter->gain != 1.0)
+		{
+			if (output_format.channels == converter->input_channels)
+			{
+				// 声道不变时以对角矩阵作为自定义混音矩阵，增益与样本格式转换在同一遍中完成
+				double matrix[max_output_channels * max_output_channels] = {};
+				for (int ch = 0; ch < output_format.channels; ++ch)
+					matrix[ch * output_format.channels + ch] = converter->gain;
+				swr_set_matrix(converter->swr_ctx, matrix, output_format.channels);
+			}
+			else
+			{
+				av_opt_set_double(converter->swr_ctx, "rematrix_volume", converter->gain, 0);
+				// 整数输出时swresample把矩阵归一化到rematrix_maxval（默认为1），增益大于1时不会生效
+				if (!output_format.is_float)
+					av_opt_set_double(converter->swr_ctx, "rematrix_maxval", converter->gain, 0);
+			}
+		}
+		auto res = swr_init(converter->swr_ctx);
+		if (res < 0) {
+			char* buf = new char[1024];
+			memset(buf, 0, 1024);
+			av_strerror(res, buf, 1024);
+			std::printf("err: swr_init failed, reason=%s\n", buf);
+			delete[] buf;
+			free_sample_converter(converter);
+			return nullptr;
+		}
+		return converter;
+	}
+
+	// 预读任务中调用：按当前输出格式为曲目创建转换状态，输出端尚未初始化时由输出阶段在切换时创建
+	int audio_player_impl::prepare_track_output(audio_decoder_context* decoder)
+	{
+		std::lock_guard<std::mutex> lock(output_format_mutex);
+		if (!output_ready)
+			return -1;
+		free_sample_converter(decoder->converter);
+		decoder->converter = create_sample_converter(decoder);
+		return decoder->converter ? 0 : -1;
+	}
+
+	int audio_player_impl::initialize(const audio_sink_config& config)
+	{
+		audio_decoder_context* current_decoder = playlist.current();
+		if (!current_decoder)
+		{
+			std::printf("err: no audio context loaded\n");
+			return -1;
+		}
+		std::unique_lock<std::mutex> format_lock(output_format_mutex);
+		output_ready = false;
+		output_generation++;
+		const AVCodecContext* codec_context = current_decoder->codec_context;
+		output_sample_fmt = AV_SAMPLE_FMT_S16;
+		if (config.format_mode == audio_output_format_mode::native)
+			negotiate_output_format(codec_context, config.downmix_to_stereo, output_format, output_sample_fmt);
+		else
+			// 输出格式：44100Hz，立体声，16-bit
+			output_format = audio_output_format();
+
+		// 创建输出端
+		output_sink = create_output_sink(config);
+		if (!output_sink)
+		{
+			std::printf("err: create output sink failed\n");
+			format_lock.unlock();
+			uninitialize();
+			return -1;
+		}
+		output_sink->set_callback(this);
+		int res = output_sink->open(output_format);
+		if (res && config.format_mode == audio_output_format_mode::native)
+		{
+			std::printf("warn: output sink rejected native format, falling back to 44100Hz/stereo/16-bit\n");
+			output_format = audio_output_format();
+			output_sample_fmt = AV_SAMPLE_FMT_S16;
+			res = output_sink->open(output_format);
+		}
+		if (res)
+		{
+			std::printf("err: open output sink failed\n");
+			format_lock.unlock();
+			uninitialize();
+			return -1;
+		}
+		std::printf("info: output sink opened: %s\n", output_sink->get_name());
+
+		output_dither = tpdf_dither();
+		output_dither_enabled = config.dither && output_sample_fmt == AV_SAMPLE_FMT_S16;
+		output_replay_gain = config.replay_gain;
+		output_replay_gain_preamp_db = config.replay_gain_preamp_db;
+		free_sample_converter(current_decoder->converter);
+		current_decoder->converter = create_sample_converter(current_decoder);
+		if (!current_decoder->converter)
+		{
+			format_lock.unlock();
+			uninitialize();
+			return -1;
+		}
+		active_converter = current_decoder->converter;
+		output_ready = true;
+		format_lock.unlock();
+		std::printf("info: output format: %dHz, %d channels, %d-bit %s, conversion=%s (%s)%s\n",
+			output_format.sample_rate, output_format.channels, output_format.bits_per_sample,
+			output_format.is_float ? "float" : "pcm", get_conversion_name(*active_converter),
+			active_converter->conversion == sample_conversion::resample ? "swresample" : get_sample_convert_kernels().name,
+			output_dither_enabled ? ", tpdf dither" : "");
+
+		// 排队时长的目标；帧按目标的1/latency_periods_per_target切分后提交
+		output_clocked = is_clocked_output_sink(config);
+		output_latency_ms = config.target_latency_ms > 0 ? config.target_latency_ms
+			: (config.low_latency ? low_latency_target_latency_ms : default_target_latency_ms);
+		int64_t target_samples = av_rescale(output_latency_ms, output_format.sample_rate, 1000);
+		output_period_samples = static_cast<int>(std::max<int64_t>(target_samples / latency_periods_per_target, 1));
+		output_latency.reset(target_samples, output_format.sample_rate);
+		std::printf("info: output latency target: %d ms%s, period %d samples\n", output_latency_ms,
+			output_clocked ? "" : " (unclocked sink, not applied)", output_period_samples);
+
+		// 按解码器的帧长（不超过一个period）与队列深度一次性分配所有pcm缓冲区
+		int period_samples = codec_context->frame_size > 0 ? codec_context->frame_size : default_period_samples;
+		int max_out_samples = std::min(period_samples, output_period_samples);
+		if (active_converter->conversion == sample_conversion::resample)
+		{
+			int in_period_samples = static_cast<int>(std::max<int64_t>(
+				av_rescale(output_period_samples, codec_context->sample_rate, output_format.sample_rate), 1));
+			in_period_samples = std::min(period_samples, in_period_samples);
+			max_out_samples = std::max(swr_get_out_samples(active_converter->swr_ctx, in_period_samples), max_out_samples);
+		}
+		// 重采样器内部缓存的样本与帧长的波动会使单帧输出略多于估计值，预留余量避免池miss
+		max_out_samples += max_out_samples / 4;
+		output_ring = new spsc_ring<audio_output_buffer>(output_queue_depth);
+		if (output_buffer_pool.initialize(static_cast<uint32_t>(max_out_samples * output_format.block_align()), output_queue_depth))
+		{
+			uninitialize();
+			return -1;
+		}
+
+		// 队列与空闲packet/frame一次性分配
+		packet_queue = DBG_NEW pipeline_queue<packet_item>(packet_queue_depth);
+		frame_queue = DBG_NEW pipeline_queue<frame_item>(frame_queue_depth);
+		free_packets = DBG_NEW pipeline_queue<AVPacket*>(packet_queue_depth + 2);
+		free_frames = DBG_NEW pipeline_queue<AVFrame*>(frame_queue_depth + 2 + max_held_frames);
+		for (size_t i = 0; i < free_packets->capacity(); ++i)
+			packet_pool.push_back(av_packet_alloc());
+		for (size_t i = 0; i < free_frames->capacity(); ++i)
+			frame_pool.push_back(av_frame_alloc());
+
+		return 0;
+	}
+
+	void audio_player_impl::uninitialize()
+	{
+		// 等待流水线的所有任务结束
+		stop();
+		{
+			// 转换状态随曲目释放，再次初始化时按新的输出格式重建
+			std::lock_guard<std::mutex> lock(output_format_mutex);
+			output_ready = false;
+			active_converter = nullptr;
+		}
+		if (output_sink)
+		{
+			output_sink->close();
+			delete output_sink;
+			output_sink = nullptr;
+		}
+		// 关闭输出端时的回调可能调度了输出阶段
+		wait_for_tasks();
+		free_pipeline();
+		free_output_buffers();
+		std::vector<float>().swap(downmix_buffer);
+	}
+
+	void audio_player_impl::free_pipeline()
+	{
+		delete packet_queue; packet_queue = nullptr;
+		delete frame_queue; frame_queue = nullptr;
+		delete free_packets; free_packets = nullptr;
+		delete free_frames; free_frames = nullptr;
+		for (auto& packet : packet_pool)
+			av_packet_free(&packet);
+		packet_pool.clear();
+		for (auto& frame : frame_pool)
+			av_frame_free(&frame);
+		frame_pool.clear();
+		decode_outbox.clear();
+		held_frames.clear();
+		held_samples = 0;
+	}
+
+	void audio_player_impl::free_output_buffers()
+	{
+		if (output_ring)
+		{
+			audio_output_buffer* buffer;
+			while ((buffer = output_ring->consumer_slot()) != nullptr)
+			{
+				output_buffer_pool.release(buffer->data);
+				output_ring->commit_pop();
+			}
+			delete output_ring;
+			output_ring = nullptr;
+		}
+		output_buffer_pool.uninitialize();
+		submitted_samples_count = 0;
+		released_samples_count = 0;
+	}
+
+	// 不经过swresample，用转换内核将解码器输出的样本写入dest
+	void audio_player_impl::copy_samples(uint8_t* dest, const uint8_t* const* in, int samples)
+	{
+		const sample_convert_kernels& kernels = get_sample_convert_kernels();
+		const sample_converter& converter = *active_converter;
+		tpdf_dither* dither = output_dither_enabled ? &output_dither : nullptr;
+		// 交错存储的输入等同于samples * channels个样本的单个平面
+		int channels = converter.input_planar ? output_format.channels : 1;
+		int plane_samples = converter.input_planar ? samples : samples * output_format.channels;
+		switch (converter.conversion)
+		{
+		case sample_conversion::passthrough:
+			std::memcpy(dest, in[0], size_t(samples) * output_format.block_align());
+			break;
+		case sample_conversion::interleave:
+			if (output_format.bits_per_sample == 16)
+				kernels.interleave_16(reinterpret_cast<int16_t*>(dest), reinterpret_cast<const int16_t* const*>(in), channels, samples);
+			else
+				kernels.interleave_32(reinterpret_cast<int32_t*>(dest), reinterpret_cast<const int32_t* const*>(in), channels, samples);
+			break;
+		case sample_conversion::float_to_s16:
+			kernels.float_to_s16(reinterpret_cast<int16_t*>(dest), reinterpret_cast<const float* const*>(in),
+				channels, plane_samples, dither);
+			break;
+		case sample_conversion::s32_to_s16:
+			kernels.s32_to_s16(reinterpret_cast<int16_t*>(dest), reinterpret_cast<const int32_t* const*>(in), channels, plane_samples);
+			break;
+		case sample_conversion::downmix:
+			if (output_format.is_float)
+			{
+				kernels.downmix_to_stereo(reinterpret_cast<float*>(dest), reinterpret_cast<const float* const*>(in),
+					converter.input_channels, samples, converter.downmix);
+				break;
+			}
+			if (downmix_buffer.size() < size_t(samples) * 2)
+				downmix_buffer.resize(size_t(samples) * 2);
+			kernels.downmix_to_stereo(downmix_buffer.data(), reinterpret_cast<const float* const*>(in),
+				converter.input_channels, samples, converter.downmix);
+			{
+				const float* stereo = downmix_buffer.data();
+				kernels.float_to_s16(reinterpret_cast<int16_t*>(dest), &stereo, 1, samples * 2, dither);
+			}
+			break;
+		case sample_conversion::resample:
+			break;
+		}
+	}
+
+	// 将in_samples个输入样本直接转换到即将提交的缓冲区中并提交，in为nullptr时取出重采样器中剩余的样本
+	// 返回1表示输出端队列已满、尚未处理任何样本，缓冲区播放完毕后重试；返回-1表示出错
+	int audio_player_impl::convert_and_submit(const uint8_t** in, int in_samples)
+	{
+		const int block_align = output_format.block_align();
+		// 按重采样器给出的上限取得缓冲区
+		SwrContext* swr_ctx = active_converter->swr_ctx;
+		int max_out_samples = swr_ctx ? swr_get_out_samples(swr_ctx, in_samples) : (in ? in_samples : 0);
+		if (max_out_samples <= 0)
+			return 0;
+		// 排队时长已达到目标，或槽位用完
+		if (output_clocked && get_output_queued_samples() >= output_latency.target_samples)
+			return 1;
+		audio_output_buffer* buffer = output_ring->producer_slot();
+		if (!buffer)
+			return 1;
+		buffer->bytes = static_cast<uint32_t>(max_out_samples * block_align);
+		buffer->data = output_buffer_pool.acquire(buffer->bytes);
+		if (!buffer->data) {
+			std::printf("err: allocate output buffer failed\n");
+			return -1;
+		}
+
+		audio_metrics& metrics = get_audio_metrics();
+		int64_t convert_begin = now_ns();
+		int out_samples = max_out_samples;
+		{
+			AUDIO_TRACE_SCOPE(convert, "convert");
+			if (swr_ctx)
+				out_samples = swr_convert(swr_ctx, &buffer->data, max_out_samples, in, in_samples);
+			else
+				copy_samples(buffer->data, in, in_samples);
+		}
+		metrics.record(metric_histogram::convert_ns, uint64_t(now_ns() - convert_begin));
+		if (out_samples <= 0) {
+			// 槽位尚未发布，直接归还缓冲区即可
+			output_buffer_pool.release(buffer->data);
+			buffer->data = nullptr;
+			if (out_samples < 0) {
+				std::printf("err: swr_convert failed\n");
+				return -1;
+			}
+			return 0;
+		}
+		buffer->bytes = out_samples * block_align;
+		submitted_samples_count += out_samples;
+
+		// 先发布槽位再提交：输出端可能在submit_buffer返回之前就回调on_buffer_end
+		buffer->submit_ns = now_ns();
+		output_ring->commit_push();
+		output_flushing = false;
+		// 槽位与输出端中排队的缓冲区一一对应，不必查询输出端（xaudio2的GetState）
+		metrics.record(metric_histogram::device_queue_depth, output_ring->size());
+		metrics.record(metric_histogram::device_queue_us,
+			uint64_t(std::max<int64_t>(get_output_queued_samples(), 0)) * 1000000 / uint64_t(output_format.sample_rate));
+		AUDIO_TRACE_COUNTER(submit, "output queue depth", int64_t(output_ring->size()));
+		{
+			AUDIO_TRACE_SCOPE(submit, "submit_buffer");
+			if (output_sink->submit_buffer(buffer->data, buffer->bytes, buffer)) {
+				// 该槽位不会再有完成回调，不能等待其播放完毕，由uninitialize统一释放
+				return -1;
+			}
+		}
+		metrics.add(metric_counter::buffers_submitted);
+		metrics.add(metric_counter::samples_submitted, uint64_t(out_samples));
+		if (!first_submit_ns.load(std::memory_order_relaxed))
+			first_submit_ns.store(buffer->submit_ns, std::memory_order_relaxed);
+		output_seek_settling = false;
+		start_output(false);
+		return 0;
+	}
+
+	// 排队达到目标时开始播放（预先填满队列，开始时不会立即underrun）；force为true时只要有数据就开始
+	void audio_player_impl::start_output(bool force)
+	{
+		if (playback_state != audio_playback_state::init)
+			return;
+		if (!force && output_clocked && get_output_queued_samples() < output_latency.target_samples)
+			return;
+		playback_state = audio_playback_state::playing;
+		output_sink->start();
+	}
+
+	// 按output_period_samples切分帧后逐个提交；返回1时output_frame_offset记下已提交的样本数，之后从该处继续
+	int audio_player_impl::submit_frame(AVFrame* frame)
+	{
+		int frame_rate = frame->sample_rate > 0 ? frame->sample_rate : output_format.sample_rate;
+		int in_period_samples = output_period_samples;
+		if (active_converter->swr_ctx)
+			in_period_samples = static_cast<int>(std::max<int64_t>(
+				av_rescale(output_period_samples, frame_rate, output_format.sample_rate), 1));
+		AVSampleFormat sample_fmt = static_cast<AVSampleFormat>(frame->format);
+		bool planar = av_sample_fmt_is_planar(sample_fmt) != 0;
+		int channels = frame->ch_layout.nb_channels;
+		size_t sample_stride = size_t(av_get_bytes_per_sample(sample_fmt)) * (planar ? 1 : channels);
+		while (output_frame_offset < frame->nb_samples) {
+			int samples = std::min(in_period_samples, frame->nb_samples - output_frame_offset);
+			const uint8_t** in = const_cast<const uint8_t**>(frame->extended_data);
+			if (samples < frame->nb_samples) {
+				output_planes.resize(planar ? size_t(channels) : 1);
+				for (size_t plane = 0; plane < output_planes.size(); ++plane)
+					output_planes[plane] = frame->extended_data[plane] + size_t(output_frame_offset) * sample_stride;
+				in = output_planes.data();
+			}
+			int res = convert_and_submit(in, samples);
+			if (res)
+				return res;
+			output_frame_offset += samples;
+		}
+		output_frame_offset = 0;
+		return 0;
+	}
+
+	// 输出阶段每次运行时调用：按underrun与上游停顿调整排队时长的目标
+	void audio_player_impl::update_output_latency(bool upstream_stalled, int64_t stall_ns)
+	{
+		if (!output_clocked || playback_state != audio_playback_state::playing)
+			return;
+		int64_t old_target = output_latency.target_samples;
+		bool changed = output_latency.update(output_underrun_count.load(std::memory_order_relaxed),
+			released_samples_count.load(std::memory_order_acquire));
+		if (upstream_stalled)
+			changed = output_latency.on_upstream_stall(av_rescale(stall_ns, output_format.sample_rate, 1000000000)) || changed;
+		if (!changed)
+			return;
+		AUDIO_TRACE_COUNTER(output, "output latency target ms",
+			av_rescale(output_latency.target_samples, 1000, output_format.sample_rate));
+		std::printf("info: output latency target %lld ms -> %lld ms\n",
+			static_cast<long long>(av_rescale(old_target, 1000, output_format.sample_rate)),
+			static_cast<long long>(av_rescale(output_latency.target_samples, 1000, output_format.sample_rate)));
+	}
+
+	// seek后丢弃输出端与重采样器中的数据
+	void audio_player_impl::flush_output()
+	{
+		output_flushing = true;
+		output_sink->flush();
+		output_draining = false;
+		output_frame_offset = 0;
+		output_starved_ns = 0;
+		output_seek_settling = true;
+		output_stream_ended = false;
+		// 重新初始化以丢弃重采样器内部缓存的样本
+		if (active_converter && active_converter->swr_ctx)
+			swr_init(active_converter->swr_ctx);
+	}
+
+	// 放入packet_queue，队列已满时暂存，下次运行时先送出
+	void audio_player_impl::post_packet(const packet_item& item)
+	{
+		if (packet_queue->try_push(item)) {
+			decode_task.schedule();
+			return;
+		}
+		demux_pending = item;
+		demux_has_pending = true;
+	}
+
+	// demux阶段：读取packet，执行seek；读取完毕时切换到播放列表中的下一首
+	void audio_player_impl::run_demux_stage()
+	{
+		if (!pipeline_active)
+			return;
+		AUDIO_TRACE_SCOPE(demux, "demux stage");
+		demux_counter.end_wait();
+		for (int budget = stage_batch_size; budget > 0; --budget) {
+			if (stop_requested)
+				return;
+			if (demux_has_pending) {
+				if (!packet_queue->try_push(demux_pending)) {
+					demux_counter.begin_wait(stage_wait::blocked);
+					return;
+				}
+				demux_has_pending = false;
+				decode_task.schedule();
+			}
+			{
+				std::unique_lock<std::mutex> lock(seek_mutex);
+				if (seek_pending) {
+					seek_pending = false;
+					demux_serial = pipeline_serial;
+					int64_t target = seek_target;
+					lock.unlock();
+					// 有定位索引时从目标之前最近的索引项开始读取，decode阶段解码并丢弃到目标样本
+					packet_item flush_item{ pipeline_item_type::flush, demux_serial, nullptr };
+					flush_item.seek_base_pts = seek_audio_decoder(demux_decoder, target, flush_item.seek_target_pts);
+					demux_reached_end = false;
+					post_packet(flush_item);
+					continue;
+				}
+			}
+			if (demux_reached_end) {
+				// 读取完毕，等待seek或停止
+				demux_counter.begin_wait(stage_wait::starved);
+				return;
+			}
+
+			AVPacket* packet;
+			if (!free_packets->try_pop(packet)) {
+				demux_counter.begin_wait(stage_wait::blocked);
+				return;
+			}
+			int64_t read_begin = now_ns();
+			int read_res;
+			{
+				AUDIO_TRACE_SCOPE(demux, "av_read_frame");
+				read_res = av_read_frame(demux_decoder->format_context, packet);
+			}
+			get_audio_metrics().record(metric_histogram::demux_packet_ns, uint64_t(now_ns() - read_begin));
+			if (read_res < 0) {
+				free_packets->push(packet);
+				if (demux_decoder->seek_index && demux_decoder->seek_index_contiguous)
+					demux_decoder->seek_index->mark_complete();
+				// 下一首通常已由预读任务打开；尚未打开完毕时返回，打开完毕后由预读任务重新调度
+				bool next_pending = false;
+				audio_decoder_context* next = playlist.take_next(next_pending);
+				if (next) {
+					demux_decoder = next;
+					post_packet(packet_item{ pipeline_item_type::track_change, demux_serial, nullptr, next });
+					continue;
+				}
+				if (next_pending) {
+					demux_counter.begin_wait(stage_wait::starved);
+					return;
+				}
+				demux_reached_end = true;
+				post_packet(packet_item{ pipeline_item_type::end_of_stream, demux_serial, nullptr });
+				continue;
+			}
+			if (packet->stream_index != static_cast<int>(demux_decoder->audio_stream_index)) {
+				av_packet_unref(packet);
+				free_packets->push(packet);
+				continue;
+			}
+			if (demux_decoder->seek_index && demux_decoder->seek_index_recording
+				&& packet->pos >= 0 && packet->pts != AV_NOPTS_VALUE)
+				demux_decoder->seek_index->add(packet->pts, packet->pos);
+			demux_counter.items.fetch_add(1, std::memory_order_relaxed);
+			get_audio_metrics().add(metric_counter::packets_demuxed);
+			post_packet(packet_item{ pipeline_item_type::data, demux_serial, packet });
+		}
+		// 用完本次的处理量，重新排队以免占用工作线程
+		demux_task.schedule();
+	}
+
+	// 送往输出阶段；同时计入波形摘要，摘要与播放的样本一致（已裁掉编码器延迟与填充）
+	void audio_player_impl::post_decoded_frame(AVFrame* frame)
+	{
+		if (decode_decoder->peak_builder)
+			decode_decoder->peak_builder->add(frame);
+		decode_outbox.push_back(frame_item{ pipeline_item_type::data, decode_serial, frame });
+	}
+
+	// 有尾部填充时暂缓送出最后的帧，保证到达结尾时可以裁掉trailing_padding个样本
+	void audio_player_impl::queue_decoded_frame(AVFrame* frame)
+	{
+		if (decode_decoder->trailing_padding <= 0) {
+			post_decoded_frame(frame);
+			return;
+		}
+		held_frames.push_back(frame);
+		held_samples += frame->nb_samples;
+		// 除去最早的一帧后仍保留了足够的样本时，最早的一帧不可能属于尾部填充
+		while (!held_frames.empty() && (held_samples - held_frames.front()->nb_samples >= decode_decoder->trailing_padding
+			|| held_frames.size() > max_held_frames)) {
+			AVFrame* front = held_frames.front();
+			held_frames.pop_front();
+			held_samples -= front->nb_samples;
+			post_decoded_frame(front);
+		}
+	}
+
+	void audio_player_impl::discard_held_frames()
+	{
+		for (auto frame : held_frames) {
+			av_frame_unref(frame);
+			free_frames->push(frame);
+		}
+		held_frames.clear();
+		held_samples = 0;
+	}
+
+	// 曲目解码完毕：从暂缓的帧末尾裁掉尾部填充后全部送出；容器已给出结尾的裁剪信息时不再重复裁剪
+	void audio_player_impl::queue_held_frames()
+	{
+		int64_t padding = decode_decoder->discard_padding_seen ? 0 : decode_decoder->trailing_padding;
+		for (auto it = held_frames.rbegin(); it != held_frames.rend() && padding > 0; ++it) {
+			int samples = static_cast<int>(std::min<int64_t>(padding, (*it)->nb_samples));
+			(*it)->nb_samples -= samples;
+			padding -= samples;
+		}
+		for (auto frame : held_frames) {
+			if (frame->nb_samples > 0) {
+				post_decoded_frame(frame);
+				continue;
+			}
+			av_frame_unref(frame);
+			free_frames->push(frame);
+		}
+		held_frames.clear();
+		held_samples = 0;
+	}
+
+	// 依次放入frame_queue，队列已满时返回false
+	bool audio_player_impl::flush_decode_outbox()
+	{
+		while (!decode_outbox.empty()) {
+			if (!frame_queue->try_push(decode_outbox.front()))
+				return false;
+			decode_outbox.pop_front();
+			output_task.schedule();
+		}
+		return true;
+	}
+
+	// 解码器中缓存的帧已全部取出：送出暂缓的帧，再送出引起draining的元素
+	void audio_player_impl::finish_decoder_drain()
+	{
+		queue_held_frames();
+		save_peak_summary(decode_decoder);
+		const packet_item& item = decode_drain_item;
+		if (item.type == pipeline_item_type::end_of_stream) {
+			// 解码器进入draining状态后不再接受packet，重置后seek回来才能继续解码
+			avcodec_flush_buffers(decode_decoder->codec_context);
+			decode_outbox.push_back(frame_item{ pipeline_item_type::end_of_stream, item.serial, nullptr });
+			return;
+		}
+		decode_decoder = item.decoder;
+		decode_outbox.push_back(frame_item{ pipeline_item_type::track_change, item.serial, nullptr, item.decoder });
+	}
+
+	void audio_player_impl::handle_packet_item(const packet_item& item)
+	{
+		bool stale = item.serial != pipeline_serial;
+		if (item.type == pipeline_item_type::track_change && stale) {
+			// seek之前的曲目切换同样需要执行，之后的元素都属于下一首
+			discard_held_frames();
+			decode_decoder = item.decoder;
+			decode_outbox.push_back(frame_item{ pipeline_item_type::track_change, item.serial, nullptr, item.decoder });
+			return;
+		}
+		if (stale) {
+			release_packet(item.packet);
+			return;
+		}
+		switch (item.type)
+		{
+		case pipeline_item_type::data:
+		{
+			if (decode_seek_pending) {
+				decode_seek_pending = false;
+				int64_t base = decode_seek_base_pts != AV_NOPTS_VALUE ? decode_seek_base_pts : item.packet->pts;
+				AVCodecContext* codec_context = decode_decoder->codec_context;
+				AVRational time_base = decode_decoder->format_context->streams[decode_decoder->audio_stream_index]->time_base;
+				if (base != AV_NOPTS_VALUE && decode_seek_target_pts > base)
+					decode_decoder->skip_remaining = av_rescale_q(decode_seek_target_pts - base, time_base,
+						AVRational{ 1, codec_context->sample_rate });
+				// seek后不再按initial_padding裁剪
+				decode_decoder->first_frame_pending = false;
+			}
+			int64_t send_begin = now_ns();
+			int res;
+			{
+				AUDIO_TRACE_SCOPE(decode, "avcodec_send_packet");
+				res = avcodec_send_packet(decode_decoder->codec_context, item.packet);
+			}
+			decode_pending_ns += now_ns() - send_begin;
+			release_packet(item.packet);
+			if (res < 0)
+				break; // 跳过无法解码的packet
+			decode_serial = item.serial;
+			decode_receiving = true;
+			break;
+		}
+		case pipeline_item_type::flush:
+			discard_held_frames();
+			avcodec_flush_buffers(decode_decoder->codec_context);
+			decode_decoder->skip_remaining = 0;
+			// 跳过或重复的部分使波形摘要不再完整
+			if (decode_decoder->peak_builder)
+				decode_decoder->peak_builder->invalidate();
+			decode_seek_pending = item.seek_target_pts != AV_NOPTS_VALUE;
+			decode_seek_target_pts = item.seek_target_pts;
+			decode_seek_base_pts = item.seek_base_pts;
+			decode_outbox.push_back(frame_item{ pipeline_item_type::flush, item.serial, nullptr });
+			break;
+		case pipeline_item_type::end_of_stream:
+		case pipeline_item_type::track_change:
+			// 送入空packet，取出解码器中缓存的帧
+			avcodec_send_packet(decode_decoder->codec_context, nullptr);
+			decode_serial = item.serial;
+			decode_draining = true;
+			decode_drain_item = item;
+			break;
+		}
+	}
+
+	// decode阶段：packet -> frame
+	void audio_player_impl::run_decode_stage()
+	{
+		if (!pipeline_active)
+			return;
+		AUDIO_TRACE_SCOPE(decode, "decode stage");
+		decode_counter.end_wait();
+		for (int budget = stage_batch_size; budget > 0; --budget) {
+			if (stop_requested)
+				return;
+			if (!flush_decode_outbox()) {
+				decode_counter.begin_wait(stage_wait::blocked);
+				return;
+			}
+			if (decode_receiving || decode_draining) {
+				AVFrame* frame;
+				if (!free_frames->try_pop(frame)) {
+					decode_counter.begin_wait(stage_wait::blocked);
+					return;
+				}
+				int64_t receive_begin = now_ns();
+				int res;
+				{
+					AUDIO_TRACE_SCOPE(decode, "avcodec_receive_frame");
+					res = avcodec_receive_frame(decode_decoder->codec_context, frame);
+				}
+				decode_pending_ns += now_ns() - receive_begin;
+				if (res >= 0) {
+					// 多数音频解码器在送入packet时完成解码，计入此后取出的第一帧
+					get_audio_metrics().record(metric_histogram::decode_frame_ns, uint64_t(decode_pending_ns));
+					get_audio_metrics().add(metric_counter::frames_decoded);
+					decode_pending_ns = 0;
+					if (trim_decoded_frame(decode_decoder, frame)) {
+						decode_counter.items.fetch_add(1, std::memory_order_relaxed);
+						queue_decoded_frame(frame);
+					}
+					else {
+						av_frame_unref(frame);
+						free_frames->push(frame);
+					}
+					continue;
+				}
+				free_frames->push(frame);
+				if (res != AVERROR(EAGAIN) && res != AVERROR_EOF)
+					std::printf("err: avcodec_receive_frame failed\n");
+				// 没有更多帧
+				decode_receiving = false;
+				if (decode_draining) {
+					decode_draining = false;
+					finish_decoder_drain();
+				}
+				continue;
+			}
+
+			packet_item item;
+			if (!packet_queue->try_pop(item)) {
+				decode_counter.begin_wait(stage_wait::starved);
+				get_audio_metrics().add(metric_counter::decode_starved);
+				return;
+			}
+			demux_task.schedule();
+			handle_packet_item(item);
+		}
+		decode_task.schedule();
+	}
+
+	// 输出阶段切换到下一首：先取出上一首重采样器中缓存的尾部样本，再改用下一首的转换状态
+	// 输出端不停止、不重新打开，下一首的第一个缓冲区紧接着上一首的最后一个缓冲区播放
+	int audio_player_impl::switch_output_track(audio_decoder_context* next, bool drain_previous)
+	{
+		if (drain_previous) {
+			int res = convert_and_submit(nullptr, 0);
+			if (res)
+				return res;
+		}
+		if (!next->converter || next->converter->generation != output_generation) {
+			// 预读时输出端尚未初始化
+			free_sample_converter(next->converter);
+			next->converter = create_sample_converter(next);
+			if (!next->converter)
+				return -1;
+		}
+		active_converter = next->converter;
+		audio_decoder_context* previous = playlist.advance();
+		assert(playlist.current() == next);
+		close_audio_decoder(previous);
+		std::printf("info: track changed, conversion=%s: %s\n", get_conversion_name(*active_converter), next->path.c_str());
+		return 0;
+	}
+
+	// resample/output阶段：frame -> 输出端
+	void audio_player_impl::run_output_stage()
+	{
+		if (!pipeline_active)
+			return;
+		AUDIO_TRACE_SCOPE(output, "output stage");
+		output_counter.end_wait();
+		update_output_latency(false, 0);
+		for (int budget = stage_batch_size; budget > 0; --budget) {
+			if (stop_requested) {
+				// 立即停止：丢弃输出端中排队的缓冲区，不等待其播放完毕
+				if (playback_state == audio_playback_state::playing) {
+					output_flushing = true;
+					output_sink->stop();
+					output_sink->flush();
+				}
+				finish_playback();
+				return;
+			}
+			if (output_drain_pending) {
+				// 等待期间发生seek时继续处理seek之后的数据
+				if (pipeline_serial != output_drain_serial)
+					output_drain_pending = false;
+				else if (output_stream_ended || output_ring->empty()) {
+					finish_playback();
+					return;
+				}
+				else {
+					output_counter.begin_wait(stage_wait::blocked);
+					return;
+				}
+			}
+
+			frame_item item;
+			if (output_has_pending) {
+				item = output_pending;
+				output_has_pending = false;
+			}
+			else if (frame_queue->try_pop(item)) {
+				decode_task.schedule();
+				if (output_starved_ns) {
+					// 上游的停顿：队列须能覆盖这段时间，seek之后重新填充队列的等待除外
+					if (!output_seek_settling)
+						update_output_latency(true, now_ns() - output_starved_ns);
+					output_starved_ns = 0;
+				}
+			}
+			else {
+				if (!output_starved_ns)
+					output_starved_ns = now_ns();
+				output_counter.begin_wait(stage_wait::starved);
+				get_audio_metrics().add(metric_counter::output_starved);
+				return;
+			}
+			bool stale = item.serial != pipeline_serial;
+			if (stale && item.type != pipeline_item_type::track_change) {
+				output_frame_offset = 0;
+				release_frame(item.frame);
+				continue;
+			}
+
+			int res = 0;
+			switch (item.type)
+			{
+			case pipeline_item_type::data:
+				res = submit_frame(item.frame);
+				if (res == 0) {
+					output_counter.items.fetch_add(1, std::memory_order_relaxed);
+					release_frame(item.frame);
+				}
+				break;
+			case pipeline_item_type::flush:
+				flush_output();
+				break;
+			case pipeline_item_type::track_change:
+				res = switch_output_track(item.decoder, !stale);
+				break;
+			case pipeline_item_type::end_of_stream:
+				// 取出重采样器中缓存的尾部样本
+				res = convert_and_submit(nullptr, 0);
+				if (res == 0) {
+					// 等待输出端播放完已提交的缓冲区
+					AUDIO_TRACE_INSTANT(output, "end of stream", 0);
+					// 曲目短于排队目标时队列不会填满
+					start_output(true);
+					output_draining = true;
+					output_sink->end_of_stream();
+					output_drain_pending = true;
+					output_drain_serial = item.serial;
+				}
+				break;
+			}
+			if (res > 0) {
+				// 输出端队列已满，缓冲区播放完毕的回调重新调度后再处理该元素
+				start_output(true);
+				output_pending = item;
+				output_has_pending = true;
+				output_counter.begin_wait(stage_wait::blocked);
+				return;
+			}
+			if (res < 0) {
+				output_frame_offset = 0;
+				if (item.type == pipeline_item_type::data)
+					release_frame(item.frame);
+				finish_playback();
+				return;
+			}
+		}
+		output_task.schedule();
+	}
+
+	// 由输出阶段调用：播放完毕、出错或stop；demux与decode阶段之后即使被调度也直接返回
+	void audio_player_impl::finish_playback()
+	{
+		stop_requested = true;
+		playback_state = audio_playback_state::stopped;
+		int64_t end = now_ns();
+		for (auto counter : { &demux_counter, &decode_counter, &output_counter })
+		{
+			counter->end_wait();
+			if (!counter->end_ns)
+				counter->end_ns = end;
+		}
+
+		buffer_pool_stats pool_stats;
+		output_buffer_pool.get_stats(pool_stats);
+		std::printf("info: output buffer pool hits=%llu, misses=%llu, high water mark=%u/%u\n",
+			static_cast<unsigned long long>(pool_stats.hits), static_cast<unsigned long long>(pool_stats.misses),
+			pool_stats.high_water_mark, pool_stats.block_count);
+		std::printf("info: output underruns=%llu\n", static_cast<unsigned long long>(output_underrun_count.load()));
+		if (output_clocked)
+			std::printf("info: output latency target=%lld ms (set %d ms), raised %u times, lowered %u times\n",
+				static_cast<long long>(av_rescale(output_latency.target_samples, 1000, output_format.sample_rate)),
+				output_latency_ms, output_latency.increases, output_latency.decreases);
+		pipeline_stage_stats stage_stats[3];
+		int stage_count = get_pipeline_stage_stats(stage_stats, 3);
+		for (int i = 0; i < stage_count; ++i) {
+			double elapsed = stage_stats[i].elapsed_seconds > 0 ? stage_stats[i].elapsed_seconds : 1;
+			std::printf("info: stage %s: items=%llu, busy=%.1f%%, starved=%.1f%%, blocked=%.1f%%\n",
+				stage_stats[i].name, static_cast<unsigned long long>(stage_stats[i].items),
+				stage_stats[i].busy_seconds * 100 / elapsed, stage_stats[i].starved_seconds * 100 / elapsed,
+				stage_stats[i].blocked_seconds * 100 / elapsed);
+		}
+		std::printf("info: playback finished\n");
+
+		{
+			std::lock_guard<std::mutex> lock(done_mutex);
+			pipeline_active = false;
+		}
+		done_cv.notify_all();
+	}
+
+	void audio_player_impl::start()
+	{
+		if (!packet_queue || pipeline_active)
+			return;
+		// 上一次播放的任务可能仍被回调调度
+		wait_for_tasks();
+		playback_start_ns = now_ns();
+		first_submit_ns = 0;
+		stop_requested = false;
+		output_stream_ended = false;
+		output_draining = false;
+		output_underrun_count = 0;
+		output_flushing = false;
+		seek_pending = false;
+		// 上一次播放停止时仍在队列中或被各阶段持有的packet/frame一并回收
+		packet_queue->reset();
+		frame_queue->reset();
+		free_packets->reset();
+		free_frames->reset();
+		for (auto packet : packet_pool)
+		{
+			av_packet_unref(packet);
+			free_packets->push(packet);
+		}
+		for (auto frame : frame_pool)
+		{
+			av_frame_unref(frame);
+			free_frames->push(frame);
+		}
+		for (auto counter : { &demux_counter, &decode_counter, &output_counter })
+			counter->reset();
+
+		demux_decoder = decode_decoder = playlist.current();
+		demux_serial = decode_serial = pipeline_serial;
+		demux_reached_end = false;
+		demux_has_pending = false;
+		decode_receiving = false;
+		decode_draining = false;
+		decode_seek_pending = false;
+		decode_pending_ns = 0;
+		decode_outbox.clear();
+		held_frames.clear();
+		held_samples = 0;
+		output_has_pending = false;
+		output_drain_pending = false;
+		output_frame_offset = 0;
+		output_starved_ns = 0;
+		output_seek_settling = false;
+		output_latency.reset(av_rescale(output_latency_ms, output_format.sample_rate, 1000), output_format.sample_rate);
+		output_latency.window_begin_samples = released_samples_count;
+
+		playback_state = audio_playback_state::init;
+		pipeline_active = true;
+		demux_task.schedule();
+		decode_task.schedule();
+		output_task.schedule();
+	}
+
+	int audio_player_impl::seek(double seconds)
+	{
+		if (!pipeline_active || stop_requested)
+			return -1;
+		if (seconds < 0)
+			seconds = 0;
+		{
+			std::lock_guard<std::mutex> lock(seek_mutex);
+			seek_target = static_cast<int64_t>(seconds * AV_TIME_BASE);
+			seek_pending = true;
+			pipeline_serial++;
+		}
+		demux_task.schedule();
+		// 输出阶段可能正在等待播放完毕
+		output_task.schedule();
+		return 0;
+	}
+
+	int audio_player_impl::get_pipeline_stage_stats(pipeline_stage_stats* stats, int max_count)
+	{
+		const pipeline_stage_counter* counters[] = { &demux_counter, &decode_counter, &output_counter };
+		int count = 0;
+		for (auto counter : counters)
+		{
+			if (count >= max_count)
+				break;
+			pipeline_stage_stats& stage = stats[count++];
+			int64_t start = counter->start_ns, end = counter->end_ns;
+			if (start && !end)
+				end = now_ns();
+			stage.name = counter->name;
+			stage.items = counter->items;
+			stage.elapsed_seconds = start ? (end - start) / 1e9 : 0;
+			stage.starved_seconds = counter->starved_ns / 1e9;
+			stage.blocked_seconds = counter->blocked_ns / 1e9;
+			stage.busy_seconds = std::max(0.0, stage.elapsed_seconds - stage.starved_seconds - stage.blocked_seconds);
+		}
+		return count;
+	}
+
+	audio_player* create_audio_player(audio_worker_pool* pool)
+	{
+		return DBG_NEW audio_player_impl(pool ? pool : get_default_audio_worker_pool());
+	}
+
+	// 以下为默认播放器的包装，供只需要一个播放会话的调用者使用
+	static audio_player* default_player = nullptr;
+
+	static audio_player& get_default_player()
+	{
+		if (!default_player)
+			default_player = create_audio_player();
+		return *default_player;
+	}
+
+	int load_audio_context(const char* audio_filename, const audio_input_config& config)
+	{
+		return get_default_player().load(audio_filename, config);
+	}
+
+	void release_audio_context()
+	{
+		delete default_player;
+		default_player = nullptr;
+	}
+
+	int enqueue_audio_file(const char* path, const audio_input_config& config)
+	{
+		return get_default_player().enqueue(path, config);
+	}
+
+	void clear_audio_playlist()
+	{
+		get_default_player().clear_playlist();
+	}
+
+	int initialize_audio_engine(const audio_sink_config& config)
+	{
+		return get_default_player().initialize(config);
+	}
+
+	void uninitialize_audio_engine()
+	{
+		if (default_player)
+			default_player->uninitialize();
+	}
+
+	void start_audio_playback()
+	{
+		get_default_player().start();
+	}
+
+	void wait_audio_playback()
+	{
+		if (default_player)
+			default_player->wait();
+	}
+
+	int seek_audio_playback(double seconds)
+	{
+		return default_player ? default_player->seek(seconds) : -1;
+	}
+
+	void get_output_buffer_pool_stats(buffer_pool_stats& stats)
+	{
+		if (default_player)
+			default_player->get_output_buffer_pool_stats(stats);
+	}
+
+	int get_pipeline_stage_stats(pipeline_stage_stats* stats, int max_count)
+	{
+		return default_player ? default_player->get_pipeline_stage_stats(stats, max_count) : 0;
+	}
+
+	void get_audio_open_stats(audio_open_stats& stats)
+	{
+		if (default_player)
+			default_player->get_open_stats(stats);
+		else
+			stats = audio_open_stats();
+	}
+
+	const char* get_backend_implement_version()
+	{
+		return get_default_player().get_backend_name();
+	}
+}
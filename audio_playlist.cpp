@@ -0,0 +1,137 @@
+﻿#include "ffmpeg_xaudio2_internal.hpp"
+#include <chrono>
+#include <cstdio>
+
+namespace audio
+{
+	audio_playlist::audio_playlist(audio_worker_pool* pool, std::function<int(audio_decoder_context*)> prepare,
+		std::function<void()> on_ready)
+		: pool(pool), prepare(std::move(prepare)), on_ready(std::move(on_ready)),
+		preroll_task(pool, [this] { preroll_proc(); })
+	{
+	}
+
+	audio_playlist::~audio_playlist()
+	{
+		release();
+	}
+
+	// 每次运行打开一首，下一首被取走后由take_next再次调度
+	void audio_playlist::preroll_proc()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (prerolled_track || pending_tracks.empty())
+			return;
+		pending_track track = std::move(pending_tracks.front());
+		pending_tracks.pop_front();
+		preroll_in_progress = true;
+		uint32_t track_generation = generation;
+		lock.unlock();
+
+		auto begin = std::chrono::steady_clock::now();
+		audio_decoder_context* decoder = open_audio_decoder(track.path.c_str(), track.config, pool);
+		if (decoder)
+			prepare(decoder);
+		double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+		lock.lock();
+		preroll_in_progress = false;
+		if (!decoder)
+		{
+			std::printf("warn: skipped unplayable track %s\n", track.path.c_str());
+			// 继续打开下一首
+			if (!pending_tracks.empty())
+				preroll_task.schedule();
+		}
+		else if (track_generation != generation)
+		{
+			lock.unlock();
+			close_audio_decoder(decoder);
+			lock.lock();
+			if (!pending_tracks.empty())
+				preroll_task.schedule();
+		}
+		else
+		{
+			std::printf("info: prerolled next track in %.1fms: %s\n", elapsed_ms, track.path.c_str());
+			prerolled_track = decoder;
+		}
+		lock.unlock();
+		// 打开失败时同样通知，demux阶段据此判断播放列表是否已结束
+		on_ready();
+	}
+
+	int audio_playlist::enqueue(const char* path, const audio_input_config& config)
+	{
+		if (!path || !path[0])
+			return -1;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending_tracks.push_back(pending_track{ path, config });
+		}
+		preroll_task.schedule();
+		return 0;
+	}
+
+	void audio_playlist::clear()
+	{
+		audio_decoder_context* track;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending_tracks.clear();
+			generation++;
+			track = prerolled_track;
+			prerolled_track = nullptr;
+		}
+		close_audio_decoder(track);
+	}
+
+	void audio_playlist::set_current(audio_decoder_context* decoder)
+	{
+		release();
+		current_decoder = decoder;
+	}
+
+	audio_decoder_context* audio_playlist::take_next(bool& pending)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		audio_decoder_context* next = prerolled_track;
+		prerolled_track = nullptr;
+		pending = !next && (preroll_in_progress || !pending_tracks.empty());
+		if (next)
+			upcoming_tracks.push_back(next);
+		lock.unlock();
+		// 开始打开再下一首
+		preroll_task.schedule();
+		return next;
+	}
+
+	audio_decoder_context* audio_playlist::advance()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		audio_decoder_context* previous = current_decoder;
+		if (!upcoming_tracks.empty())
+		{
+			current_decoder = upcoming_tracks.front();
+			upcoming_tracks.pop_front();
+		}
+		return previous;
+	}
+
+	void audio_playlist::release()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending_tracks.clear();
+			generation++;
+		}
+		// 正在打开的曲目打开完毕后因generation不同而被关闭
+		pool->wait_idle(preroll_task);
+		clear();
+		for (auto track : upcoming_tracks)
+			close_audio_decoder(track);
+		upcoming_tracks.clear();
+		close_audio_decoder(current_decoder);
+		current_decoder = nullptr;
+	}
+}
@@ -0,0 +1,412 @@
+﻿#include "audio_seek_index.hpp"
+#include "ffmpeg_xaudio2_internal.hpp"
+#include "audio_input_source.hpp"
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+namespace audio
+{
+	// 索引项的最小间隔，seek时最多需要解码并丢弃约这么长的音频（另加预滚动）
+	constexpr int seek_index_interval_ms = 250;
+	// 目标之前最近的索引项超过此距离时（索引尚未覆盖该区域）改用ffmpeg定位
+	constexpr int max_index_gap_ms = 10000;
+	// 解码器没有给出seek_preroll时的预滚动：从目标之前这么长的位置开始解码，使mp3比特池、aac重叠相加等状态恢复
+	constexpr int default_seek_preroll_ms = 100;
+	// 后台扫描任务每次运行读取的packet数
+	constexpr int scan_batch_packets = 256;
+
+	constexpr char seek_index_magic[4] = { 'F', 'X', 'S', 'I' };
+	constexpr uint32_t seek_index_version = 1;
+
+	void audio_seek_index::add(int64_t pts, int64_t pos)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (entries.empty() || pts > entries.back().pts)
+		{
+			if (!entries.empty() && pts - entries.back().pts < min_interval)
+				return;
+			entries.push_back(entry{ pts, pos });
+			dirty = true;
+			return;
+		}
+		// seek之后或后台扫描写入的区域
+		auto it = std::lower_bound(entries.begin(), entries.end(), pts,
+			[](const entry& item, int64_t value) { return item.pts < value; });
+		if (it != entries.end() && it->pts - pts < min_interval)
+			return;
+		if (it != entries.begin() && pts - (it - 1)->pts < min_interval)
+			return;
+		entries.insert(it, entry{ pts, pos });
+		dirty = true;
+	}
+
+	bool audio_seek_index::find(int64_t pts, entry& result) const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = std::upper_bound(entries.begin(), entries.end(), pts,
+			[](int64_t value, const entry& item) { return value < item.pts; });
+		if (it == entries.begin())
+			return false;
+		result = *(it - 1);
+		return true;
+	}
+
+	void audio_seek_index::mark_complete()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!complete)
+			dirty = true;
+		complete = true;
+	}
+
+	bool audio_seek_index::is_complete() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return complete;
+	}
+
+	size_t audio_seek_index::size() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return entries.size();
+	}
+
+	// sidecar中的项按与前一项的差值以zigzag varint存储，通常每项3-5字节
+	static void write_varint(std::string& out, int64_t value)
+	{
+		uint64_t zigzag = (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+		while (zigzag >= 0x80)
+		{
+			out.push_back(char(uint8_t(zigzag) | 0x80));
+			zigzag >>= 7;
+		}
+		out.push_back(char(zigzag));
+	}
+
+	static bool read_varint(const uint8_t*& data, const uint8_t* end, int64_t& value)
+	{
+		uint64_t zigzag = 0;
+		for (int shift = 0; shift < 64 && data < end; shift += 7)
+		{
+			uint8_t byte = *data++;
+			zigzag |= uint64_t(byte & 0x7F) << shift;
+			if (!(byte & 0x80))
+			{
+				value = int64_t(zigzag >> 1) ^ -int64_t(zigzag & 1);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	int audio_seek_index::load(const char* index_path, uint64_t file_size, int64_t file_mtime)
+	{
+		std::ifstream file(index_path, std::ios::binary);
+		if (!file)
+			return -1;
+		std::vector<uint8_t> content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		const uint8_t* data = content.data();
+		const uint8_t* end = data + content.size();
+
+		uint32_t version = 0, flags = 0, count = 0;
+		uint64_t indexed_size = 0;
+		int64_t indexed_mtime = 0, interval = 0;
+		int32_t time_base_num = 0, time_base_den = 0;
+		if (content.size() < sizeof(seek_index_magic) || std::memcmp(data, seek_index_magic, sizeof(seek_index_magic)))
+			return -1;
+		data += sizeof(seek_index_magic);
+		if (!read_field(data, end, version) || version != seek_index_version
+			|| !read_field(data, end, indexed_size) || !read_field(data, end, indexed_mtime)
+			|| !read_field(data, end, time_base_num) || !read_field(data, end, time_base_den)
+			|| !read_field(data, end, interval) || !read_field(data, end, flags) || !read_field(data, end, count))
+			return -1;
+		if (indexed_size != file_size || indexed_mtime != file_mtime
+			|| time_base_num != time_base.num || time_base_den != time_base.den)
+			return -1;
+
+		std::vector<entry> loaded;
+		loaded.reserve(count);
+		entry last = { 0, 0 };
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			int64_t pts_delta, pos_delta;
+			if (!read_varint(data, end, pts_delta) || !read_varint(data, end, pos_delta))
+				return -1;
+			last.pts += pts_delta;
+			last.pos += pos_delta;
+			loaded.push_back(last);
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		entries.swap(loaded);
+		complete = (flags & 1) != 0;
+		dirty = false;
+		return 0;
+	}
+
+	int audio_seek_index::save(const char* index_path, uint64_t file_size, int64_t file_mtime)
+	{
+		std::string out;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!dirty)
+				return 0;
+			out.append(seek_index_magic, sizeof(seek_index_magic));
+			write_field(out, seek_index_version);
+			write_field(out, file_size);
+			write_field(out, file_mtime);
+			write_field(out, int32_t(time_base.num));
+			write_field(out, int32_t(time_base.den));
+			write_field(out, min_interval);
+			write_field(out, uint32_t(complete ? 1 : 0));
+			write_field(out, uint32_t(entries.size()));
+			entry last = { 0, 0 };
+			for (const auto& item : entries)
+			{
+				write_varint(out, item.pts - last.pts);
+				write_varint(out, item.pos - last.pos);
+				last = item;
+			}
+			dirty = false;
+		}
+		if (!write_file_replace(index_path, out))
+		{
+			std::printf("warn: write seek index %s failed\n", index_path);
+			return -1;
+		}
+		return 0;
+	}
+
+	// 只读取packet、不解码，在线程池中分批运行，不长时间占用工作线程
+	struct seek_index_scanner
+	{
+		seek_index_scanner(audio_worker_pool* pool) : pool(pool), task(pool, [this] { run(); }) {}
+
+		// 用ffmpeg自己的文件协议另外打开一次，与播放的读取位置互不影响；
+		// 探测流信息可能读取较多数据，在线程池中进行，不阻塞打开文件的线程
+		bool probe()
+		{
+			if (avformat_open_input(&format_context, path.c_str(), nullptr, nullptr) < 0
+				|| avformat_find_stream_info(format_context, nullptr) < 0
+				|| format_context->nb_streams != expected_streams)
+			{
+				std::printf("warn: open file for seek index scan failed\n");
+				if (format_context)
+					avformat_close_input(&format_context);
+				return false;
+			}
+			return true;
+		}
+
+		void run()
+		{
+			if (!format_context && (stop_requested || !probe()))
+				return;
+			for (int i = 0; i < scan_batch_packets; ++i)
+			{
+				if (stop_requested)
+					return;
+				int res = av_read_frame(format_context, packet);
+				if (res < 0)
+				{
+					if (res == AVERROR_EOF)
+					{
+						index->mark_complete();
+						std::printf("info: seek index scan finished, %u entries\n", unsigned(index->size()));
+					}
+					else
+						std::printf("warn: seek index scan stopped, read failed\n");
+					return;
+				}
+				if (packet->stream_index == stream_index && packet->pos >= 0 && packet->pts != AV_NOPTS_VALUE)
+					index->add(packet->pts, packet->pos);
+				av_packet_unref(packet);
+			}
+			task.schedule();
+		}
+
+		audio_worker_pool* pool;
+		std::string path;
+		unsigned int expected_streams = 0;
+		AVFormatContext* format_context = nullptr;
+		AVPacket* packet = nullptr;
+		int stream_index = -1;
+		audio_seek_index* index = nullptr;
+		std::atomic<bool> stop_requested{ false };
+		pool_task task;
+	};
+
+	static void free_seek_index_scanner(seek_index_scanner* scanner)
+	{
+		if (!scanner)
+			return;
+		scanner->stop_requested = true;
+		scanner->pool->wait_idle(scanner->task);
+		av_packet_free(&scanner->packet);
+		if (scanner->format_context)
+			avformat_close_input(&scanner->format_context);
+		delete scanner;
+	}
+
+	// 打开文件与探测流信息都在扫描任务的第一次运行中进行
+	static seek_index_scanner* start_seek_index_scan(const audio_decoder_context* decoder, audio_worker_pool& pool)
+	{
+		auto scanner = DBG_NEW seek_index_scanner(&pool);
+		scanner->index = decoder->seek_index;
+		scanner->path = decoder->path;
+		scanner->expected_streams = decoder->format_context->nb_streams;
+		scanner->stream_index = static_cast<int>(decoder->audio_stream_index);
+		scanner->packet = av_packet_alloc();
+		scanner->task.schedule();
+		return scanner;
+	}
+
+	// 原生索引覆盖了几乎整个文件（mp3 TOC、flac SEEKTABLE、mp4/mkv等容器的索引）时由ffmpeg定位
+	static bool has_native_index(AVStream* stream)
+	{
+		int count = avformat_index_get_entries_count(stream);
+		if (count < 2 || stream->duration <= 0 || stream->duration == AV_NOPTS_VALUE)
+			return false;
+		const AVIndexEntry* last = avformat_index_get_entry(stream, count - 1);
+		int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+		return last && last->timestamp - start >= stream->duration / 10 * 9;
+	}
+
+	bool get_file_info(const char* path, uint64_t& file_size, int64_t& file_mtime)
+	{
+#if defined(_WIN32)
+		struct _stat64 file_stat;
+		if (_stat64(path, &file_stat) != 0 || (file_stat.st_mode & _S_IFMT) != _S_IFREG)
+			return false;
+#else
+		struct stat file_stat;
+		if (stat(path, &file_stat) != 0 || !S_ISREG(file_stat.st_mode))
+			return false;
+#endif
+		file_size = uint64_t(file_stat.st_size);
+		file_mtime = int64_t(file_stat.st_mtime);
+		return true;
+	}
+
+	uint64_t get_file_size(const char* path)
+	{
+		std::ifstream file(path, std::ios::binary | std::ios::ate);
+		if (!file)
+			return 0;
+		std::streamoff size = file.tellg();
+		return size > 0 ? uint64_t(size) : 0;
+	}
+
+	bool write_file_replace(const std::string& path, const std::string& data)
+	{
+		std::string temp_path = path + ".tmp";
+		{
+			std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+			if (!file || !file.write(data.data(), std::streamsize(data.size())))
+			{
+				file.close();
+				std::remove(temp_path.c_str());
+				return false;
+			}
+		}
+#if defined(_WIN32)
+		// windows上rename不会覆盖已有的文件
+		std::remove(path.c_str());
+#endif
+		if (std::rename(temp_path.c_str(), path.c_str()) != 0)
+		{
+			std::remove(temp_path.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	static std::string get_sidecar_path(const audio_decoder_context* decoder)
+	{
+		return decoder->path + ".seekidx";
+	}
+
+	void open_seek_index(audio_decoder_context* decoder, const audio_input_config& config, audio_worker_pool& pool)
+	{
+		AVFormatContext* format_context = decoder->format_context;
+		AVStream* stream = format_context->streams[decoder->audio_stream_index];
+		if (config.seek_index == audio_seek_index_mode::disabled || !decoder->input_source->is_seekable()
+			|| (format_context->iformat->flags & AVFMT_NO_BYTE_SEEK) || stream->time_base.num <= 0)
+			return;
+		if (has_native_index(stream))
+		{
+			std::printf("info: using native seek index, %d entries\n", avformat_index_get_entries_count(stream));
+			return;
+		}
+
+		int64_t min_interval = av_rescale_q(seek_index_interval_ms, AVRational{ 1, 1000 }, stream->time_base);
+		decoder->seek_index = DBG_NEW audio_seek_index(stream->time_base, min_interval > 0 ? min_interval : 1);
+		decoder->seek_index_mode = config.seek_index;
+		// 调用者提供的输入没有对应的文件，sidecar与后台扫描（另外打开文件）均不适用
+		bool has_file = !is_caller_provided_input(config);
+		if (!has_file)
+			decoder->seek_index_mode = audio_seek_index_mode::memory;
+		uint64_t file_size;
+		int64_t file_mtime;
+		if (decoder->seek_index_mode == audio_seek_index_mode::sidecar)
+		{
+			if (!get_file_info(decoder->path.c_str(), file_size, file_mtime))
+				// 不是普通文件，无法确认sidecar是否失效
+				decoder->seek_index_mode = audio_seek_index_mode::memory;
+			else if (!decoder->seek_index->load(get_sidecar_path(decoder).c_str(), file_size, file_mtime))
+				std::printf("info: seek index loaded, %u entries%s\n", unsigned(decoder->seek_index->size()),
+					decoder->seek_index->is_complete() ? "" : ", partial");
+		}
+		if (config.seek_index_scan && has_file && !decoder->seek_index->is_complete())
+			decoder->seek_scanner = start_seek_index_scan(decoder, pool);
+	}
+
+	void close_seek_index(audio_decoder_context* decoder)
+	{
+		free_seek_index_scanner(decoder->seek_scanner);
+		decoder->seek_scanner = nullptr;
+		if (!decoder->seek_index)
+			return;
+		uint64_t file_size;
+		int64_t file_mtime;
+		if (decoder->seek_index_mode == audio_seek_index_mode::sidecar
+			&& get_file_info(decoder->path.c_str(), file_size, file_mtime))
+			decoder->seek_index->save(get_sidecar_path(decoder).c_str(), file_size, file_mtime);
+		delete decoder->seek_index;
+		decoder->seek_index = nullptr;
+	}
+
+	int64_t seek_audio_decoder(audio_decoder_context* decoder, int64_t target, int64_t& target_pts)
+	{
+		AVFormatContext* format_context = decoder->format_context;
+		AVStream* stream = format_context->streams[decoder->audio_stream_index];
+		target_pts = av_rescale_q(target, AVRational{ 1, AV_TIME_BASE }, stream->time_base);
+		// 从索引读取的位置开始，时间戳不一定可信，直到下一次按时间戳定位之前不再记录
+		decoder->seek_index_contiguous = false;
+		if (decoder->seek_index)
+		{
+			int sample_rate = stream->codecpar->sample_rate;
+			int64_t preroll_samples = std::max<int64_t>(stream->codecpar->seek_preroll,
+				int64_t(sample_rate) * default_seek_preroll_ms / 1000);
+			int64_t preroll = av_rescale_q(preroll_samples, AVRational{ 1, sample_rate }, stream->time_base);
+			int64_t max_gap = av_rescale_q(max_index_gap_ms, AVRational{ 1, 1000 }, stream->time_base);
+			audio_seek_index::entry entry;
+			if (decoder->seek_index->find(target_pts - preroll, entry) && target_pts - entry.pts <= max_gap
+				&& av_seek_frame(format_context, stream->index, entry.pos, AVSEEK_FLAG_BYTE) >= 0)
+			{
+				decoder->seek_index_recording = false;
+				return entry.pts;
+			}
+		}
+		if (avformat_seek_file(format_context, -1, INT64_MIN, target, target, 0) < 0)
+			std::printf("warn: seek to %.3fs failed\n", double(target) / AV_TIME_BASE);
+		decoder->seek_index_recording = true;
+		return AV_NOPTS_VALUE;
+	}
+}
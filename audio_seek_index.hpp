@@ -0,0 +1,57 @@
+﻿#if !defined(AUDIO_SEEK_INDEX_HPP_)
+#define AUDIO_SEEK_INDEX_HPP_
+#include "audio_play_interface.hpp"
+#include <mutex>
+#include <vector>
+
+namespace audio
+{
+	// 时间戳 -> 字节偏移的定位索引，按时间戳排列，相邻两项的间隔不小于min_interval
+	// demux阶段与后台扫描任务同时写入，seek时读取，内部加锁
+	class audio_seek_index
+	{
+	public:
+		struct entry
+		{
+			int64_t pts; // 流的time_base
+			int64_t pos; // packet在文件中的字节偏移
+		};
+
+		audio_seek_index(AVRational time_base, int64_t min_interval) : time_base(time_base), min_interval(min_interval) {}
+		audio_seek_index(const audio_seek_index&) = delete;
+		audio_seek_index& operator=(const audio_seek_index&) = delete;
+
+		// 与已有的项间隔不足min_interval时忽略；顺序读取时为O(1)
+		void add(int64_t pts, int64_t pos);
+		// 取时间戳不大于pts的最后一项，O(log n)；没有时返回false
+		bool find(int64_t pts, entry& result) const;
+		// 从头到尾连续读取过整个文件，之后打开时不再扫描
+		void mark_complete();
+		bool is_complete() const;
+		size_t size() const;
+
+		// sidecar文件：文件大小、修改时间或time_base与媒体文件不一致时视为失效，返回-1
+		int load(const char* index_path, uint64_t file_size, int64_t file_mtime);
+		// 没有新增内容时不写入
+		int save(const char* index_path, uint64_t file_size, int64_t file_mtime);
+
+	private:
+		mutable std::mutex mutex;
+		AVRational time_base;
+		int64_t min_interval;
+		std::vector<entry> entries;
+		bool complete = false;
+		bool dirty = false;
+	};
+
+	struct audio_decoder_context;
+	// 解码器打开后调用：格式没有完整的原生索引时建立定位索引，按config载入sidecar并在pool上启动后台扫描
+	void open_seek_index(audio_decoder_context* decoder, const audio_input_config& config, audio_worker_pool& pool);
+	// 停止后台扫描，按需保存sidecar并释放索引
+	void close_seek_index(audio_decoder_context* decoder);
+	// 由demux阶段调用：跳转到target（AV_TIME_BASE），target_pts为目标在流time_base下的时间戳
+	// 按索引定位时返回定位处packet的时间戳；按ffmpeg定位时返回AV_NOPTS_VALUE，以之后第一个packet的时间戳为准
+	int64_t seek_audio_decoder(audio_decoder_context* decoder, int64_t target, int64_t& target_pts);
+}
+
+#endif // AUDIO_SEEK_INDEX_HPP_
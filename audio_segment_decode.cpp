@@ -0,0 +1,461 @@
+﻿#include "audio_segment_decode.hpp"
+#include "ffmpeg_xaudio2_internal.hpp"
+#include "audio_output_sink.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+namespace audio
+{
+	// 每段至少包含的packet数，过短的文件不分段
+	constexpr size_t min_segment_packets = 64;
+	// 有损编码在段首之前预先解码、丢弃输出的packet数：mp3的bit reservoir最多引用之前511字节的数据，
+	// 低码率时可跨越数帧，再加上MDCT的重叠，8个packet足以覆盖；需要更长预解码的编码（opus）按seek_preroll计算
+	constexpr int lossy_preroll_packets = 8;
+	// 已解码、等待拼接的段数最多为线程数的倍数，限制内存占用
+	constexpr int max_pending_segments_factor = 2;
+
+	struct decode_segment
+	{
+		// 从preroll_begin开始解码，只保留[begin, end)中的packet产生的帧（按时间戳判断）
+		size_t preroll_begin = 0;
+		size_t begin = 0;
+		size_t end = 0;
+		int64_t begin_pts = AV_NOPTS_VALUE;
+		// 最后一段为AV_NOPTS_VALUE
+		int64_t end_pts = AV_NOPTS_VALUE;
+		std::vector<AVFrame*> frames;
+		// 帧上带有尾部填充的裁剪信息
+		bool discard_padding_seen = false;
+		bool ready = false;
+		bool failed = false;
+		double decode_seconds = 0;
+	};
+
+	// 无损编码与pcm的每一帧都可以独立解码，不需要预解码
+	static int get_preroll_packets(const AVCodecParameters* codecpar, const std::vector<AVPacket*>& packets, AVRational time_base)
+	{
+		const AVCodecDescriptor* descriptor = avcodec_descriptor_get(codecpar->codec_id);
+		if (codecpar->codec_id == AV_CODEC_ID_FLAC || codecpar->codec_id == AV_CODEC_ID_ALAC
+			|| (descriptor && std::strncmp(descriptor->name, "pcm_", 4) == 0))
+			return 0;
+		int preroll = lossy_preroll_packets;
+		if (codecpar->seek_preroll > 0 && codecpar->sample_rate > 0 && !packets.empty())
+		{
+			int64_t packet_samples = av_rescale_q(packets[0]->duration, time_base, AVRational{ 1, codecpar->sample_rate });
+			if (packet_samples > 0)
+				preroll = std::max<int>(preroll, static_cast<int>((codecpar->seek_preroll + packet_samples - 1) / packet_samples) + 1);
+		}
+		return preroll;
+	}
+
+	// 按时间戳拼接要求每个packet都有时间戳且严格递增
+	static bool has_monotonic_pts(const std::vector<AVPacket*>& packets)
+	{
+		for (size_t i = 0; i < packets.size(); ++i)
+		{
+			if (packets[i]->pts == AV_NOPTS_VALUE || (i && packets[i]->pts <= packets[i - 1]->pts))
+				return false;
+		}
+		return true;
+	}
+
+	// 大致等分，边界向后移到关键帧packet；预解码的起点向前移到关键帧packet
+	static void split_segments(const std::vector<AVPacket*>& packets, int segment_count, int preroll,
+		std::vector<decode_segment>& segments)
+	{
+		std::vector<size_t> bounds(1, 0);
+		for (int k = 1; k < segment_count; ++k)
+		{
+			size_t bound = packets.size() * size_t(k) / size_t(segment_count);
+			while (bound < packets.size() && !(packets[bound]->flags & AV_PKT_FLAG_KEY))
+				bound++;
+			if (bound > bounds.back() && bound < packets.size())
+				bounds.push_back(bound);
+		}
+		bounds.push_back(packets.size());
+		segments = std::vector<decode_segment>(bounds.size() - 1);
+		for (size_t k = 0; k < segments.size(); ++k)
+		{
+			decode_segment& segment = segments[k];
+			segment.begin = bounds[k];
+			segment.end = bounds[k + 1];
+			segment.preroll_begin = segment.begin > size_t(preroll) ? segment.begin - size_t(preroll) : 0;
+			while (segment.preroll_begin > 0 && !(packets[segment.preroll_begin]->flags & AV_PKT_FLAG_KEY))
+				segment.preroll_begin--;
+			segment.begin_pts = packets[segment.begin]->pts;
+			segment.end_pts = segment.end < packets.size() ? packets[segment.end]->pts : AV_NOPTS_VALUE;
+		}
+	}
+
+	static void free_segment_frames(decode_segment& segment)
+	{
+		for (auto& frame : segment.frames)
+			av_frame_free(&frame);
+		segment.frames.clear();
+	}
+
+	// 用独立的解码器实例解码一段；第一段按initial_padding裁剪编码器延迟，其余段只按帧上的裁剪信息裁剪
+	static int decode_segment_frames(const AVCodecParameters* codecpar, AVRational time_base, int initial_padding,
+		const std::vector<AVPacket*>& packets, bool first_segment, decode_segment& segment)
+	{
+		const AVCodec* codec = avcodec_find_decoder(codecpar->codec_id);
+		AVCodecContext* codec_context = codec ? avcodec_alloc_context3(codec) : nullptr;
+		if (!codec_context)
+			return -1;
+		avcodec_parameters_to_context(codec_context, codecpar);
+		codec_context->flags2 |= AV_CODEC_FLAG2_SKIP_MANUAL;
+		codec_context->pkt_timebase = time_base;
+		codec_context->thread_count = 1;
+		if (avcodec_open2(codec_context, codec, nullptr) < 0)
+		{
+			avcodec_free_context(&codec_context);
+			return -1;
+		}
+
+		// 只用到trim_decoded_frame所需的裁剪状态
+		audio_decoder_context trim_state;
+		trim_state.first_frame_pending = first_segment;
+		trim_state.initial_padding = first_segment ? initial_padding : 0;
+		AVFrame* frame = av_frame_alloc();
+		int res = 0;
+		auto receive_frames = [&]() {
+			int receive_res;
+			while ((receive_res = avcodec_receive_frame(codec_context, frame)) >= 0)
+			{
+				// 预解码部分与下一段的帧不保留
+				int64_t pts = frame->pts;
+				bool keep = pts != AV_NOPTS_VALUE && pts >= segment.begin_pts
+					&& (segment.end_pts == AV_NOPTS_VALUE || pts < segment.end_pts);
+				if (keep && trim_decoded_frame(&trim_state, frame))
+				{
+					AVFrame* kept = av_frame_alloc();
+					av_frame_move_ref(kept, frame);
+					segment.frames.push_back(kept);
+				}
+				av_frame_unref(frame);
+			}
+			return receive_res == AVERROR(EAGAIN) || receive_res == AVERROR_EOF ? 0 : receive_res;
+			};
+		for (size_t i = segment.preroll_begin; res >= 0 && i < segment.end; ++i)
+		{
+			res = avcodec_send_packet(codec_context, packets[i]);
+			if (res == AVERROR(EAGAIN))
+			{
+				res = receive_frames();
+				if (res >= 0)
+					res = avcodec_send_packet(codec_context, packets[i]);
+			}
+			else if (res == AVERROR_INVALIDDATA && i < segment.begin)
+				// 预解码的packet缺少之前的数据时允许出错
+				res = 0;
+			if (res >= 0)
+				res = receive_frames();
+		}
+		if (res >= 0)
+		{
+			// 取出解码器缓存的帧；之后的packet没有送入，不会产生属于下一段的帧
+			avcodec_send_packet(codec_context, nullptr);
+			res = receive_frames();
+		}
+		segment.discard_padding_seen = trim_state.discard_padding_seen;
+		av_frame_free(&frame);
+		avcodec_free_context(&codec_context);
+		return res < 0 ? -1 : 0;
+	}
+
+	// 从末尾去掉samples个样本（容器标明、帧上没有裁剪信息的尾部填充）
+	static void trim_segment_tail(decode_segment& segment, int64_t samples)
+	{
+		while (samples > 0 && !segment.frames.empty())
+		{
+			AVFrame* frame = segment.frames.back();
+			int trim = static_cast<int>(std::min<int64_t>(samples, frame->nb_samples));
+			frame->nb_samples -= trim;
+			samples -= trim;
+			if (frame->nb_samples == 0)
+			{
+				av_frame_free(&frame);
+				segment.frames.pop_back();
+			}
+		}
+	}
+
+	// 不模拟时钟的输出端在submit_buffer中同步回调，缓冲区在返回后即可重复使用
+	class segment_sink_callback : public audio_output_sink_callback
+	{
+	public:
+		void on_buffer_end(void*) override {}
+		void on_stream_end() override {}
+	};
+
+	// 按顺序转换并提交拼接后的帧，同时计算输出的FNV-1a散列
+	class segment_output
+	{
+	public:
+		~segment_output()
+		{
+			close();
+		}
+
+		int open(const AVCodecContext* context, const audio_sink_config& config)
+		{
+			audio_sink_config sink_config = config;
+			sink_config.clock_speed = 0;
+			out_fmt = AV_SAMPLE_FMT_S16;
+			if (config.format_mode == audio_output_format_mode::native)
+				negotiate_output_format(context, config.downmix_to_stereo, format, out_fmt);
+			else
+				format = audio_output_format();
+			sink = create_output_sink(sink_config);
+			if (!sink)
+				return -1;
+			sink->set_callback(&callback);
+			if (sink->open(format))
+			{
+				std::printf("err: open output sink for segment decode failed\n");
+				delete sink;
+				sink = nullptr;
+				return -1;
+			}
+			sink->start();
+
+			AVChannelLayout out_layout = {};
+			if (format.channels == context->ch_layout.nb_channels)
+				av_channel_layout_copy(&out_layout, &context->ch_layout);
+			else
+				av_channel_layout_default(&out_layout, format.channels);
+			swr_alloc_set_opts2(&swr_ctx, &out_layout, out_fmt, format.sample_rate,
+				&context->ch_layout, context->sample_fmt, context->sample_rate, 0, nullptr);
+			av_channel_layout_uninit(&out_layout);
+			if (swr_ctx && config.dither && out_fmt == AV_SAMPLE_FMT_S16)
+				av_opt_set(swr_ctx, "dither_method", "triangular", 0);
+			if (!swr_ctx || swr_init(swr_ctx) < 0)
+			{
+				std::printf("err: swr_init for segment decode failed\n");
+				return -1;
+			}
+			in_fmt = context->sample_fmt;
+			in_rate = context->sample_rate;
+			in_channels = context->ch_layout.nb_channels;
+			return 0;
+		}
+
+		// frame为nullptr时取出重采样器中剩余的样本
+		int write(const AVFrame* frame)
+		{
+			if (frame && (frame->format != in_fmt || frame->sample_rate != in_rate || frame->ch_layout.nb_channels != in_channels))
+			{
+				std::printf("err: decoder output format changed, not supported by segment decode\n");
+				return -1;
+			}
+			int in_samples = frame ? frame->nb_samples : 0;
+			int max_out_samples = swr_get_out_samples(swr_ctx, in_samples);
+			if (max_out_samples <= 0)
+				return 0;
+			buffer.resize(size_t(max_out_samples) * format.block_align());
+			uint8_t* out = buffer.data();
+			int out_samples = swr_convert(swr_ctx, &out, max_out_samples,
+				frame ? const_cast<const uint8_t**>(frame->extended_data) : nullptr, in_samples);
+			if (out_samples < 0)
+				return -1;
+			if (out_samples == 0)
+				return 0;
+			uint32_t bytes = uint32_t(out_samples) * uint32_t(format.block_align());
+			for (uint32_t i = 0; i < bytes; ++i)
+				hash = (hash ^ buffer[i]) * 0x100000001b3ull;
+			output_samples += uint64_t(out_samples);
+			return sink->submit_buffer(buffer.data(), bytes, nullptr);
+		}
+
+		void close()
+		{
+			if (sink)
+			{
+				sink->end_of_stream();
+				sink->close();
+				delete sink;
+				sink = nullptr;
+			}
+			swr_free(&swr_ctx);
+		}
+
+		audio_output_format format;
+		uint64_t output_samples = 0;
+		uint64_t hash = 0xcbf29ce484222325ull;
+
+	private:
+		audio_output_sink* sink = nullptr;
+		segment_sink_callback callback;
+		SwrContext* swr_ctx = nullptr;
+		AVSampleFormat out_fmt = AV_SAMPLE_FMT_S16;
+		int in_fmt = AV_SAMPLE_FMT_NONE;
+		int in_rate = 0;
+		int in_channels = 0;
+		std::vector<uint8_t> buffer;
+	};
+
+	// 解码已读出的packets，segment_count为1时即按顺序解码
+	// 每段是pool上的一个任务；调用线程按顺序等待各段完成并写出，已调度未写出的段不超过window
+	static int decode_packets_segmented(audio_decoder_context* decoder, const std::vector<AVPacket*>& packets,
+		int segment_count, audio_worker_pool* pool, const audio_sink_config& sink_config, segment_decode_result& result,
+		uint64_t& hash)
+	{
+		const AVStream* stream = decoder->format_context->streams[decoder->audio_stream_index];
+		const AVCodecParameters* codecpar = stream->codecpar;
+		int preroll = get_preroll_packets(codecpar, packets, stream->time_base);
+		std::vector<decode_segment> segments;
+		split_segments(packets, segment_count, preroll, segments);
+		result.segments = static_cast<int>(segments.size());
+
+		segment_output output;
+		if (output.open(decoder->codec_context, sink_config))
+			return -1;
+
+		std::mutex mutex;
+		std::condition_variable segment_ready_cv;
+		std::vector<std::unique_ptr<pool_task>> tasks;
+		for (size_t index = 0; index < segments.size(); ++index)
+		{
+			tasks.emplace_back(DBG_NEW pool_task(pool, [&, index] {
+				decode_segment& segment = segments[index];
+				auto begin = std::chrono::steady_clock::now();
+				int res = decode_segment_frames(codecpar, stream->time_base, decoder->initial_padding,
+					packets, index == 0, segment);
+				segment.decode_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					segment.failed = res != 0;
+					segment.ready = true;
+				}
+				segment_ready_cv.notify_all();
+			}));
+		}
+		size_t window = size_t(pool->get_thread_count()) * max_pending_segments_factor;
+		size_t scheduled_segments = 0;
+		// 前written_segments段写出之后，调度到窗口的末尾
+		auto schedule_segments = [&](size_t written_segments) {
+			for (; scheduled_segments < segments.size() && scheduled_segments < written_segments + window; ++scheduled_segments)
+				tasks[scheduled_segments]->schedule();
+		};
+		schedule_segments(0);
+
+		int res = 0;
+		for (size_t k = 0; k < segments.size() && res == 0; ++k)
+		{
+			decode_segment& segment = segments[k];
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				segment_ready_cv.wait(lock, [&] { return segment.ready; });
+			}
+			if (segment.failed)
+			{
+				std::printf("err: decode segment %d/%d failed\n", int(k + 1), int(segments.size()));
+				res = -1;
+				break;
+			}
+			// 帧上没有尾部填充的裁剪信息时按容器标明的尾部填充裁剪
+			if (k + 1 == segments.size() && !segment.discard_padding_seen && decoder->trailing_padding > 0)
+				trim_segment_tail(segment, decoder->trailing_padding);
+			for (const AVFrame* frame : segment.frames)
+			{
+				if (output.write(frame))
+				{
+					res = -1;
+					break;
+				}
+			}
+			result.decode_seconds += segment.decode_seconds;
+			free_segment_frames(segment);
+			schedule_segments(k + 1);
+		}
+		if (res == 0)
+			res = output.write(nullptr) ? -1 : 0;
+		// 失败时不再调度后面的段，等待已调度的段结束
+		for (size_t k = 0; k < scheduled_segments; ++k)
+			pool->wait_idle(*tasks[k]);
+		for (auto& segment : segments)
+			free_segment_frames(segment);
+		result.audio_seconds = double(output.output_samples) / output.format.sample_rate;
+		hash = output.hash;
+		output.close();
+		return res;
+	}
+
+	int decode_file_segmented(const char* path, const segment_decode_config& config, segment_decode_result& result)
+	{
+		result = segment_decode_result();
+		audio_input_config input_config = config.input;
+		input_config.seek_index = audio_seek_index_mode::disabled;
+		input_config.seek_index_scan = false;
+		// 各段分别解码，没有从头连续的样本可供建立波形摘要
+		input_config.generate_peaks = false;
+		audio_decoder_context* decoder = open_audio_decoder(path, input_config);
+		if (!decoder)
+			return -1;
+
+		// 读出所有packet（压缩数据，大小与文件相当）
+		std::vector<AVPacket*> packets;
+		AVPacket* packet = av_packet_alloc();
+		while (av_read_frame(decoder->format_context, packet) >= 0)
+		{
+			if (packet->stream_index == static_cast<int>(decoder->audio_stream_index))
+			{
+				packets.push_back(packet);
+				packet = av_packet_alloc();
+			}
+			else
+				av_packet_unref(packet);
+		}
+		av_packet_free(&packet);
+
+		audio_worker_pool* pool = config.pool ? config.pool : get_default_audio_worker_pool();
+		int segment_count = config.segments > 0 ? config.segments : pool->get_thread_count() * 2;
+		segment_count = static_cast<int>(std::min<size_t>(size_t(segment_count), packets.size() / min_segment_packets));
+		if (segment_count < 1)
+			segment_count = 1;
+		if (segment_count > 1 && !has_monotonic_pts(packets))
+		{
+			std::printf("warn: packets of %s have no monotonic timestamps, decoding without segments\n", path);
+			segment_count = 1;
+		}
+
+		uint64_t hash = 0;
+		int res = packets.empty() ? -1 : decode_packets_segmented(decoder, packets, segment_count, pool, config.sink,
+			result, hash);
+		if (res == 0)
+			std::printf("info: segment decode %s: %d segments, preroll %d packets, %.2fs audio\n", path, result.segments,
+				get_preroll_packets(decoder->format_context->streams[decoder->audio_stream_index]->codecpar, packets,
+					decoder->format_context->streams[decoder->audio_stream_index]->time_base),
+				result.audio_seconds);
+
+		if (res == 0 && config.verify && result.segments > 1)
+		{
+			// 按顺序解码一次作为参照，输出到null
+			audio_sink_config verify_sink = config.sink;
+			verify_sink.type = audio_sink_type::null;
+			segment_decode_result verify_result;
+			uint64_t verify_hash = 0;
+			if (decode_packets_segmented(decoder, packets, 1, pool, verify_sink, verify_result, verify_hash))
+				res = -1;
+			else if (verify_hash == hash)
+				std::printf("info: segment decode verify passed, output identical to sequential decode\n");
+			else
+			{
+				// 预解码之后解码器的内部状态与按顺序解码时一致即可逐位一致；opus等状态较长的编码只是收敛
+				std::printf("err: segment decode verify: output differs from sequential decode (%.6fs vs %.6fs audio)\n",
+					result.audio_seconds, verify_result.audio_seconds);
+				res = -1;
+			}
+		}
+
+		for (auto& item : packets)
+			av_packet_free(&item);
+		close_audio_decoder(decoder);
+		return res;
+	}
+}
@@ -0,0 +1,34 @@
+﻿#if !defined(AUDIO_SEGMENT_DECODE_HPP_)
+#define AUDIO_SEGMENT_DECODE_HPP_
+#include "audio_play_interface.hpp"
+
+namespace audio
+{
+	// 分段并行解码：读取整个文件的packet后，在可独立解码的位置（关键帧packet）切分为若干段，
+	// 各段作为线程池上的任务解码，再按顺序拼接；只用于离线（批量）解码，不能用于播放
+	struct segment_decode_config
+	{
+		// 不模拟时钟（clock_speed总是0）
+		audio_sink_config sink;
+		audio_input_config input;
+		// 解码各段的线程池，nullptr为默认线程池
+		audio_worker_pool* pool = nullptr;
+		// 段数，0为线程池线程数的2倍；过短的文件不分段
+		int segments = 0;
+		// 另外按顺序完整解码一次，检查拼接后的输出是否与之逐位一致
+		bool verify = false;
+	};
+
+	struct segment_decode_result
+	{
+		int segments = 0;
+		double audio_seconds = 0;
+		// 各段解码耗时之和，作为占用的cpu时间的估计
+		double decode_seconds = 0;
+	};
+
+	// 解码path并输出到config.sink（wav/raw输出到sink.output_path），失败时返回-1
+	int decode_file_segmented(const char* path, const segment_decode_config& config, segment_decode_result& result);
+}
+
+#endif // AUDIO_SEGMENT_DECODE_HPP_
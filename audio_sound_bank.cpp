@@ -0,0 +1,947 @@
+﻿#include "audio_sound_bank.hpp"
+#include "ffmpeg_xaudio2_internal.hpp"
+#include "audio_input_source.hpp"
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace audio
+{
+	// arena中每段的起始地址与大小按此对齐
+	constexpr size_t bank_arena_alignment = 64;
+	// 常驻音效按此时长切分为period提交，超过max_clip_periods个时加大period，
+	// 同一voice上被抢占与新提交的缓冲区之和不超过xaudio2的64个排队上限
+	constexpr int resident_period_ms = 20;
+	constexpr size_t max_clip_periods = 32;
+	// decode-on-demand音效在每个voice上的缓冲区数与每个缓冲区的时长
+	constexpr int stream_buffer_count = 4;
+	constexpr int stream_period_ms = 20;
+
+	static void record_latency(sound_bank_latency_stats& stats, int64_t latency_ns)
+	{
+		double latency_us = double(latency_ns) / 1e3;
+		stats.count++;
+		stats.average_us += (latency_us - stats.average_us) / double(stats.count);
+		stats.max_us = std::max(stats.max_us, latency_us);
+	}
+
+	// 一块对齐的连续内存，按first-fit分配，释放时与相邻的空闲段合并
+	class sound_bank_arena
+	{
+	public:
+		static constexpr size_t npos = static_cast<size_t>(-1);
+
+		~sound_bank_arena() { av_free(base); }
+
+		int initialize(size_t bytes)
+		{
+			capacity = bytes / bank_arena_alignment * bank_arena_alignment;
+			// av_malloc保证的对齐不低于平台SIMD要求
+			base = reinterpret_cast<uint8_t*>(av_malloc(capacity));
+			if (!base)
+				return -1;
+			free_ranges[0] = capacity;
+			return 0;
+		}
+
+		size_t allocate(size_t bytes)
+		{
+			bytes = align(bytes);
+			for (auto it = free_ranges.begin(); it != free_ranges.end(); ++it)
+			{
+				if (it->second < bytes)
+					continue;
+				size_t offset = it->first;
+				size_t remaining = it->second - bytes;
+				free_ranges.erase(it);
+				if (remaining)
+					free_ranges[offset + bytes] = remaining;
+				used += bytes;
+				return offset;
+			}
+			return npos;
+		}
+
+		void release(size_t offset, size_t bytes)
+		{
+			bytes = align(bytes);
+			used -= bytes;
+			auto next = free_ranges.lower_bound(offset);
+			if (next != free_ranges.end() && offset + bytes == next->first)
+			{
+				bytes += next->second;
+				next = free_ranges.erase(next);
+			}
+			if (next != free_ranges.begin())
+			{
+				auto prev = std::prev(next);
+				if (prev->first + prev->second == offset)
+				{
+					prev->second += bytes;
+					return;
+				}
+			}
+			free_ranges[offset] = bytes;
+		}
+
+		uint8_t* data(size_t offset) const { return base + offset; }
+		size_t get_capacity() const { return capacity; }
+		size_t get_used() const { return used; }
+		size_t get_largest_free() const
+		{
+			size_t largest = 0;
+			for (const auto& range : free_ranges)
+				largest = std::max(largest, range.second);
+			return largest;
+		}
+
+	private:
+		static size_t align(size_t bytes)
+		{
+			return (bytes + bank_arena_alignment - 1) / bank_arena_alignment * bank_arena_alignment;
+		}
+
+		uint8_t* base = nullptr;
+		size_t capacity = 0;
+		size_t used = 0;
+		// 起始偏移 -> 长度
+		std::map<size_t, size_t> free_ranges;
+	};
+
+	// 解码一个音效并经swresample转换为音效库的输出格式
+	struct clip_decoder
+	{
+		audio_decoder_context* decoder = nullptr;
+		SwrContext* swr_ctx = nullptr;
+		AVPacket* packet = nullptr;
+		AVFrame* frame = nullptr;
+		int block_align = 0;
+		bool input_ended = false;
+		bool finished = false;
+	};
+
+	static AVSampleFormat get_output_sample_fmt(const audio_output_format& format)
+	{
+		if (format.is_float)
+			return AV_SAMPLE_FMT_FLT;
+		return format.bits_per_sample == 32 ? AV_SAMPLE_FMT_S32 : AV_SAMPLE_FMT_S16;
+	}
+
+	static void close_clip_decoder(clip_decoder* state)
+	{
+		if (!state)
+			return;
+		if (state->swr_ctx)
+			swr_free(&state->swr_ctx);
+		av_packet_free(&state->packet);
+		av_frame_free(&state->frame);
+		close_audio_decoder(state->decoder);
+		delete state;
+	}
+
+	static clip_decoder* open_clip_decoder(const char* path, const audio_input_config& config,
+		const audio_output_format& format)
+	{
+		auto state = DBG_NEW clip_decoder();
+		state->decoder = open_audio_decoder(path, config);
+		if (!state->decoder)
+		{
+			delete state;
+			return nullptr;
+		}
+		const AVCodecContext* context = state->decoder->codec_context;
+		AVChannelLayout out_layout = {};
+		if (format.channels == context->ch_layout.nb_channels)
+			av_channel_layout_copy(&out_layout, &context->ch_layout);
+		else
+			av_channel_layout_default(&out_layout, format.channels);
+		swr_alloc_set_opts2(&state->swr_ctx, &out_layout, get_output_sample_fmt(format), format.sample_rate,
+			&context->ch_layout, context->sample_fmt, context->sample_rate, 0, nullptr);
+		av_channel_layout_uninit(&out_layout);
+		if (swr_init(state->swr_ctx) < 0)
+		{
+			std::printf("err: swr_init failed for sound bank clip %s\n", path);
+			close_clip_decoder(state);
+			return nullptr;
+		}
+		state->packet = av_packet_alloc();
+		state->frame = av_frame_alloc();
+		state->block_align = format.block_align();
+		return state;
+	}
+
+	// 回到开头重新解码，丢弃解码器与重采样器中缓存的样本
+	static int rewind_clip_decoder(clip_decoder* state)
+	{
+		audio_decoder_context* decoder = state->decoder;
+		if (avformat_seek_file(decoder->format_context, -1, INT64_MIN, 0, 0, 0) < 0)
+			return -1;
+		avcodec_flush_buffers(decoder->codec_context);
+		if (swr_init(state->swr_ctx) < 0)
+			return -1;
+		decoder->first_frame_pending = true;
+		decoder->discard_padding_seen = false;
+		decoder->skip_remaining = 0;
+		state->input_ended = false;
+		state->finished = false;
+		return 0;
+	}
+
+	// 转换in_samples个样本追加到out；in为nullptr时取出重采样器中缓存的样本
+	static void append_converted(clip_decoder* state, const uint8_t* const* in, int in_samples,
+		std::vector<uint8_t>& out)
+	{
+		int out_samples = swr_get_out_samples(state->swr_ctx, in_samples);
+		if (out_samples <= 0)
+			return;
+		size_t old_size = out.size();
+		out.resize(old_size + size_t(out_samples) * state->block_align);
+		uint8_t* dest = out.data() + old_size;
+		int converted = swr_convert(state->swr_ctx, &dest, out_samples, in, in_samples);
+		out.resize(old_size + size_t(std::max(converted, 0)) * state->block_align);
+	}
+
+	// 解码至少一帧并追加到out；全部解码完毕（含重采样器中的尾部）或出错时将finished置为true
+	static void decode_clip_pcm(clip_decoder* state, std::vector<uint8_t>& out)
+	{
+		audio_decoder_context* decoder = state->decoder;
+		AVFrame* frame = state->frame;
+		while (!state->finished)
+		{
+			int res = avcodec_receive_frame(decoder->codec_context, frame);
+			if (res >= 0)
+			{
+				bool keep = trim_decoded_frame(decoder, frame);
+				if (keep)
+					append_converted(state, frame->extended_data, frame->nb_samples, out);
+				av_frame_unref(frame);
+				if (keep)
+					return;
+				continue;
+			}
+			if (res != AVERROR(EAGAIN))
+			{
+				if (res != AVERROR_EOF)
+					std::printf("err: avcodec_receive_frame failed in sound bank\n");
+				append_converted(state, nullptr, 0, out);
+				state->finished = true;
+				return;
+			}
+			if (state->input_ended)
+			{
+				append_converted(state, nullptr, 0, out);
+				state->finished = true;
+				return;
+			}
+			AVPacket* packet = state->packet;
+			if (av_read_frame(decoder->format_context, packet) < 0)
+			{
+				state->input_ended = true;
+				avcodec_send_packet(decoder->codec_context, nullptr);
+				continue;
+			}
+			if (packet->stream_index == static_cast<int>(decoder->audio_stream_index))
+				avcodec_send_packet(decoder->codec_context, packet);
+			av_packet_unref(packet);
+		}
+	}
+
+	struct bank_voice;
+
+	struct bank_clip
+	{
+		std::string path;
+		audio_input_config input_config;
+		bool streamed = false;
+
+		// 常驻音效在arena中的位置，resident为false表示已被淘汰
+		bool resident = false;
+		size_t offset = 0;
+		size_t bytes = 0;
+		uint32_t period_bytes = 0;
+		// 最近一次触发的序号，淘汰时取最小者
+		uint64_t last_used = 0;
+		// 已提交、尚未播放完毕的缓冲区数，不为0时不能淘汰
+		std::atomic<int> pinned_buffers{ 0 };
+
+		// decode-on-demand音效：解码器在载入时打开，一直保留（mmap输入即为内存中的压缩数据）
+		clip_decoder* stream_decoder = nullptr;
+		uint64_t input_bytes = 0;
+		// 正在播放该音效的voice；只有一个解码器，再次触发时在同一voice上从头播放
+		bank_voice* stream_voice = nullptr;
+	};
+
+	// software_mix时voice不使用输出端：queued_buffers为该voice仍在混音器中的音源数（含正在淡出的）
+	struct bank_voice : public audio_output_sink_callback
+	{
+		// 可能在输出端的线程中或submit_buffer内同步调用，只修改原子变量并调度流式解码任务
+		void on_buffer_end(void* buffer_context) override
+		{
+			static_cast<bank_clip*>(buffer_context)->pinned_buffers.fetch_sub(1, std::memory_order_release);
+			queued_buffers.fetch_sub(1, std::memory_order_release);
+			if (stream_clip.load(std::memory_order_acquire))
+				stream_task->schedule();
+		}
+
+		void on_stream_end() override {}
+
+		int index = 0;
+		audio_output_sink* sink = nullptr;
+		std::atomic<int> queued_buffers{ 0 };
+		// 以下由音效库的mutex保护：最近一次在该voice上触发的音效与其序号，抢占时取序号最小者
+		bank_clip* clip = nullptr;
+		uint64_t trigger_serial = 0;
+
+		// decode-on-demand播放：stream_task在线程池中解码并提交，缓冲区在stream_buffers中循环使用
+		std::atomic<bank_clip*> stream_clip{ nullptr };
+		std::unique_ptr<pool_task> stream_task;
+		uint8_t* stream_buffers = nullptr;
+		uint32_t stream_period_bytes = 0;
+		uint32_t stream_submitted = 0;
+		// 已解码、尚未放入缓冲区的pcm
+		std::vector<uint8_t> stream_pending;
+		// 触发时刻，第一个缓冲区提交后清零
+		int64_t stream_trigger_ns = 0;
+
+		// software_mix：当前音源在混音器中的编号，以及decode-on-demand播放时流式解码写入的队列
+		int mix_id = -1;
+		audio_mix_queue_source* stream_queue = nullptr;
+	};
+
+	// software_mix下一次触发在混音器中的音源：常驻音效直接读取arena中的pcm，decode-on-demand音效读取流式解码写入的队列
+	// 存在期间音效保持pinned、voice计为正在播放，离开混音后释放自己
+	class bank_mix_source : public audio_mix_source
+	{
+	public:
+		bank_mix_source(bank_voice* voice, bank_clip* clip, audio_mix_source* input, int64_t trigger_ns,
+			std::mutex* stats_mutex, sound_bank_latency_stats* latency)
+			: voice(voice), clip(clip), input(input), trigger_ns(trigger_ns), stats_mutex(stats_mutex), latency(latency)
+		{
+			clip->pinned_buffers.fetch_add(1, std::memory_order_relaxed);
+			voice->queued_buffers.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		int read(const void*& data, int max_frames) override
+		{
+			int count = input->read(data, max_frames);
+			if (count > 0 && trigger_ns)
+			{
+				std::lock_guard<std::mutex> stats_lock(*stats_mutex);
+				record_latency(*latency, now_ns() - trigger_ns);
+				trigger_ns = 0;
+			}
+			return count;
+		}
+
+		bool is_finished() const override { return input->is_finished(); }
+
+		void on_mix_end() override
+		{
+			input->on_mix_end();
+			clip->pinned_buffers.fetch_sub(1, std::memory_order_release);
+			voice->queued_buffers.fetch_sub(1, std::memory_order_release);
+			delete this;
+		}
+
+	private:
+		bank_voice* voice;
+		bank_clip* clip;
+		std::unique_ptr<audio_mix_source> input;
+		// 第一次取得数据后清零
+		int64_t trigger_ns;
+		std::mutex* stats_mutex;
+		sound_bank_latency_stats* latency;
+	};
+
+	class sound_bank_impl : public audio_sound_bank
+	{
+	public:
+		~sound_bank_impl() override;
+
+		int initialize(const sound_bank_config& config);
+
+		int load(const char* path, const audio_input_config& config) override;
+		int trigger(int clip, float gain, float pan) override;
+		void stop_all() override;
+		int get_active_voices() override;
+		void get_stats(sound_bank_stats& stats) override;
+
+	private:
+		int store_resident(bank_clip* clip, const std::vector<uint8_t>& pcm);
+		bank_voice* acquire_voice();
+		void stop_voice(bank_voice* voice);
+		void run_stream(bank_voice* voice);
+		void run_mix_stream(bank_voice* voice);
+
+		audio_output_format format;
+		size_t stream_threshold = 0;
+		audio_worker_pool* pool = nullptr;
+		std::vector<std::unique_ptr<bank_voice>> voices;
+		// software_mix时所有voice共用的混音器与输出端
+		audio_mixer* mixer = nullptr;
+		audio_mix_output* mix_output = nullptr;
+
+		// 保护音效列表、arena与voice的分配
+		std::mutex mutex;
+		sound_bank_arena arena;
+		std::vector<std::unique_ptr<bank_clip>> clips;
+		uint64_t trigger_serial = 0;
+		uint64_t evictions = 0;
+		uint64_t voice_steals = 0;
+
+		// 流式解码任务同样会记录延迟
+		std::mutex stats_mutex;
+		sound_bank_latency_stats resident_latency;
+		sound_bank_latency_stats reload_latency;
+		sound_bank_latency_stats streamed_latency;
+	};
+
+	sound_bank_impl::~sound_bank_impl()
+	{
+		if (mix_output)
+			mix_output->stop();
+		for (auto& voice : voices)
+		{
+			voice->stream_clip = nullptr;
+			if (voice->sink)
+			{
+				voice->sink->stop();
+				voice->sink->flush();
+				voice->sink->close();
+			}
+			if (voice->stream_task)
+				pool->wait_idle(*voice->stream_task);
+		}
+		// 销毁混音器时对余下的音源回调on_mix_end，其中可能再次调度流式解码任务
+		delete mix_output;
+		delete mixer;
+		for (auto& voice : voices)
+		{
+			if (voice->stream_task)
+				pool->wait_idle(*voice->stream_task);
+			delete voice->sink;
+			av_free(voice->stream_buffers);
+		}
+		voices.clear();
+		for (auto& clip : clips)
+			close_clip_decoder(clip->stream_decoder);
+	}
+
+	int sound_bank_impl::initialize(const sound_bank_config& config)
+	{
+		format = config.format;
+		stream_threshold = config.stream_threshold;
+		pool = config.pool ? config.pool : get_default_audio_worker_pool();
+		if (arena.initialize(config.memory_budget))
+		{
+			std::printf("err: allocate sound bank arena of %zu bytes failed\n", config.memory_budget);
+			return -1;
+		}
+
+		int voice_count = std::max(config.voices, 1);
+		if (config.software_mix)
+		{
+			audio_mixer_config mixer_config;
+			mixer_config.format = format;
+			mixer = create_audio_mixer(mixer_config);
+			if (mixer)
+				mix_output = create_mix_output(mixer, config.sink, pool);
+			if (!mix_output)
+			{
+				std::printf("err: create sound bank mixer failed\n");
+				return -1;
+			}
+		}
+		else if ((config.sink.type == audio_sink_type::wav_file || config.sink.type == audio_sink_type::raw_pcm_file)
+			&& voice_count > 1)
+		{
+			std::printf("warn: file output supports one sound bank voice, using 1 instead of %d\n", voice_count);
+			voice_count = 1;
+		}
+		uint32_t stream_period_bytes = uint32_t(format.sample_rate * stream_period_ms / 1000 * format.block_align());
+		for (int i = 0; i < voice_count; ++i)
+		{
+			auto voice = std::unique_ptr<bank_voice>(DBG_NEW bank_voice());
+			bank_voice* voice_ptr = voice.get();
+			voice->index = i;
+			voice->stream_task.reset(DBG_NEW pool_task(pool, [this, voice_ptr] { run_stream(voice_ptr); }));
+			voice->stream_period_bytes = stream_period_bytes;
+			voices.push_back(std::move(voice));
+			// 混音时decode-on-demand播放写入混音器的队列，不需要缓冲区与输出端
+			if (mixer)
+				continue;
+			voice_ptr->stream_buffers = reinterpret_cast<uint8_t*>(av_malloc(size_t(stream_period_bytes) * stream_buffer_count));
+			voice_ptr->sink = create_output_sink(config.sink);
+			if (!voice_ptr->stream_buffers || !voice_ptr->sink)
+			{
+				std::printf("err: create sound bank voice %d failed\n", i);
+				return -1;
+			}
+			voice_ptr->sink->set_callback(voice_ptr);
+			if (voice_ptr->sink->open(format))
+			{
+				std::printf("err: open output sink for sound bank voice %d failed\n", i);
+				delete voice_ptr->sink;
+				voice_ptr->sink = nullptr;
+				return -1;
+			}
+		}
+		if (mix_output && mix_output->start())
+		{
+			std::printf("err: start sound bank mixer output failed\n");
+			return -1;
+		}
+		std::printf("info: sound bank initialized, %dHz/%dch/%d-bit%s, arena=%zu bytes, voices=%d, output=%s%s\n",
+			format.sample_rate, format.channels, format.bits_per_sample, format.is_float ? " float" : "",
+			arena.get_capacity(), voice_count, mix_output ? mix_output->get_sink_name() : voices[0]->sink->get_name(),
+			mix_output ? ", software mix" : "");
+		return 0;
+	}
+
+	// 解码余下的全部样本；容器没有标明尾部填充时按AVCodecParameters中的值裁剪
+	static void decode_whole_clip(clip_decoder* state, const audio_output_format& format, std::vector<uint8_t>& pcm)
+	{
+		while (!state->finished)
+			decode_clip_pcm(state, pcm);
+		audio_decoder_context* decoder = state->decoder;
+		if (!decoder->discard_padding_seen && decoder->trailing_padding > 0)
+		{
+			size_t padding_bytes = size_t(av_rescale(decoder->trailing_padding, format.sample_rate,
+				decoder->codec_context->sample_rate)) * format.block_align();
+			pcm.resize(pcm.size() > padding_bytes ? pcm.size() - padding_bytes : 0);
+		}
+	}
+
+	// 放入arena，空间不足时按LRU淘汰未在播放的常驻音效
+	int sound_bank_impl::store_resident(bank_clip* clip, const std::vector<uint8_t>& pcm)
+	{
+		size_t offset;
+		while ((offset = arena.allocate(pcm.size())) == sound_bank_arena::npos)
+		{
+			bank_clip* victim = nullptr;
+			for (auto& candidate : clips)
+			{
+				if (candidate.get() == clip || !candidate->resident
+					|| candidate->pinned_buffers.load(std::memory_order_acquire) > 0)
+					continue;
+				if (!victim || candidate->last_used < victim->last_used)
+					victim = candidate.get();
+			}
+			if (!victim)
+			{
+				std::printf("warn: sound bank arena full, %zu bytes needed for %s\n", pcm.size(), clip->path.c_str());
+				return -1;
+			}
+			arena.release(victim->offset, victim->bytes);
+			victim->resident = false;
+			evictions++;
+		}
+		std::memcpy(arena.data(offset), pcm.data(), pcm.size());
+		clip->offset = offset;
+		clip->bytes = pcm.size();
+		size_t block_align = size_t(format.block_align());
+		size_t period_bytes = size_t(format.sample_rate) * resident_period_ms / 1000 * block_align;
+		size_t min_period_bytes = (clip->bytes + max_clip_periods - 1) / max_clip_periods;
+		min_period_bytes = (min_period_bytes + block_align - 1) / block_align * block_align;
+		clip->period_bytes = uint32_t(std::max(period_bytes, min_period_bytes));
+		clip->resident = true;
+		return 0;
+	}
+
+	int sound_bank_impl::load(const char* path, const audio_input_config& config)
+	{
+		clip_decoder* state = open_clip_decoder(path, config, format);
+		if (!state)
+			return -1;
+		auto clip = std::unique_ptr<bank_clip>(DBG_NEW bank_clip());
+		clip->path = path;
+		clip->input_config = config;
+
+		// 按时长估计解码后的大小，明显超过阈值时不解码
+		const AVFormatContext* format_context = state->decoder->format_context;
+		size_t limit = std::min(stream_threshold, arena.get_capacity());
+		if (format_context->duration > 0 && format_context->duration != AV_NOPTS_VALUE)
+		{
+			int64_t estimated = av_rescale(format_context->duration, format.sample_rate, AV_TIME_BASE)
+				* format.block_align();
+			clip->streamed = uint64_t(estimated) > limit;
+		}
+		std::vector<uint8_t> pcm;
+		if (!clip->streamed)
+		{
+			// 解码不持有音效库的锁，不阻塞其他音效的触发
+			decode_whole_clip(state, format, pcm);
+			if (pcm.empty())
+			{
+				std::printf("err: sound bank clip %s decoded no sample\n", path);
+				close_clip_decoder(state);
+				return -1;
+			}
+			clip->streamed = pcm.size() > limit;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		// 实际大小超过阈值，或arena中的音效都在播放、放不下时，改为decode-on-demand
+		if (!clip->streamed && store_resident(clip.get(), pcm))
+			clip->streamed = true;
+		if (clip->streamed)
+		{
+			if (state->finished && rewind_clip_decoder(state))
+			{
+				std::printf("err: rewind sound bank clip %s failed\n", path);
+				close_clip_decoder(state);
+				return -1;
+			}
+			clip->stream_decoder = state;
+			clip->input_bytes = uint64_t(std::max<int64_t>(state->decoder->input_source->seek(0, AVSEEK_SIZE), 0));
+		}
+		else
+			close_clip_decoder(state);
+		std::printf("info: sound bank clip %d: %s, %s, %.1f KB\n", int(clips.size()), path,
+			clip->streamed ? "decode on demand" : "resident",
+			(clip->streamed ? clip->input_bytes : clip->bytes) / 1024.0);
+		clips.push_back(std::move(clip));
+		return static_cast<int>(clips.size() - 1);
+	}
+
+	// 优先取空闲的voice，全部占用时抢占最早触发的voice
+	bank_voice* sound_bank_impl::acquire_voice()
+	{
+		bank_voice* oldest = nullptr;
+		for (auto& voice : voices)
+		{
+			if (voice->queued_buffers.load(std::memory_order_acquire) == 0 && !voice->stream_clip.load())
+				return voice.get();
+			if (!oldest || voice->trigger_serial < oldest->trigger_serial)
+				oldest = voice.get();
+		}
+		voice_steals++;
+		return oldest;
+	}
+
+	// 停止voice上正在播放的音效，被丢弃的缓冲区同样经on_buffer_end释放
+	void sound_bank_impl::stop_voice(bank_voice* voice)
+	{
+		voice->stream_clip = nullptr;
+		pool->wait_idle(*voice->stream_task);
+		if (voice->clip && voice->clip->stream_voice == voice)
+			voice->clip->stream_voice = nullptr;
+		if (mixer)
+		{
+			// 音源淡出后由混音线程移除；流式解码已停止，队列中余下的数据照常混合
+			if (voice->mix_id >= 0)
+				mixer->remove_source(voice->mix_id);
+			voice->mix_id = -1;
+			voice->stream_queue = nullptr;
+			return;
+		}
+		voice->sink->stop();
+		voice->sink->flush();
+	}
+
+	int sound_bank_impl::trigger(int clip_index, float gain, float pan)
+	{
+		int64_t trigger_ns = now_ns();
+		std::unique_lock<std::mutex> lock(mutex);
+		if (clip_index < 0 || size_t(clip_index) >= clips.size())
+			return -1;
+		bank_clip* clip = clips[clip_index].get();
+		clip->last_used = ++trigger_serial;
+
+		if (clip->streamed)
+		{
+			bank_voice* voice = clip->stream_voice ? clip->stream_voice : acquire_voice();
+			stop_voice(voice);
+			if (rewind_clip_decoder(clip->stream_decoder))
+			{
+				std::printf("err: rewind sound bank clip %s failed\n", clip->path.c_str());
+				return -1;
+			}
+			voice->clip = clip;
+			voice->trigger_serial = trigger_serial;
+			voice->stream_pending.clear();
+			voice->stream_trigger_ns = trigger_ns;
+			clip->stream_voice = voice;
+			if (mixer)
+			{
+				int capacity = format.sample_rate * stream_period_ms / 1000 * stream_buffer_count;
+				voice->stream_queue = create_mix_queue_source(format, capacity, [voice] { voice->stream_task->schedule(); });
+				if (!voice->stream_queue)
+					return -1;
+				voice->mix_id = mixer->add_source(DBG_NEW bank_mix_source(voice, clip, voice->stream_queue, trigger_ns,
+					&stats_mutex, &streamed_latency), gain, pan);
+			}
+			else
+				voice->sink->start();
+			voice->stream_clip = clip;
+			voice->stream_task->schedule();
+			return voice->index;
+		}
+
+		bool reload = !clip->resident;
+		if (reload)
+		{
+			// 与load相同，解码不持有音效库的锁；重新加锁后音效可能已被其他触发放回arena
+			lock.unlock();
+			clip_decoder* state = open_clip_decoder(clip->path.c_str(), clip->input_config, format);
+			std::vector<uint8_t> pcm;
+			if (state)
+			{
+				decode_whole_clip(state, format, pcm);
+				close_clip_decoder(state);
+			}
+			lock.lock();
+			if (!clip->resident && (pcm.empty() || store_resident(clip, pcm)))
+				return -1;
+		}
+		bank_voice* voice = acquire_voice();
+		stop_voice(voice);
+		voice->clip = clip;
+		voice->trigger_serial = trigger_serial;
+		const uint8_t* data = arena.data(clip->offset);
+		if (mixer)
+		{
+			// 混音线程直接读取arena，音效在离开混音之前保持pinned
+			audio_mix_source* input = create_mix_memory_source(data, int(clip->bytes / format.block_align()), format, false);
+			voice->mix_id = mixer->add_source(DBG_NEW bank_mix_source(voice, clip, input, trigger_ns, &stats_mutex,
+				reload ? &reload_latency : &resident_latency), gain, pan);
+			return voice->index;
+		}
+		for (size_t offset = 0; offset < clip->bytes; offset += clip->period_bytes)
+		{
+			uint32_t bytes = uint32_t(std::min<size_t>(clip->period_bytes, clip->bytes - offset));
+			clip->pinned_buffers.fetch_add(1, std::memory_order_relaxed);
+			voice->queued_buffers.fetch_add(1, std::memory_order_relaxed);
+			if (voice->sink->submit_buffer(data + offset, bytes, clip))
+			{
+				clip->pinned_buffers.fetch_sub(1, std::memory_order_relaxed);
+				voice->queued_buffers.fetch_sub(1, std::memory_order_relaxed);
+				break;
+			}
+			if (offset == 0)
+			{
+				std::lock_guard<std::mutex> stats_lock(stats_mutex);
+				record_latency(reload ? reload_latency : resident_latency, now_ns() - trigger_ns);
+			}
+		}
+		voice->sink->start();
+		return voice->index;
+	}
+
+	// 线程池中运行：缓冲区有空位时解码下一段并提交
+	void sound_bank_impl::run_stream(bank_voice* voice)
+	{
+		if (mixer)
+		{
+			run_mix_stream(voice);
+			return;
+		}
+		bank_clip* clip = voice->stream_clip.load();
+		if (!clip)
+			return;
+		clip_decoder* state = clip->stream_decoder;
+		uint32_t period_bytes = voice->stream_period_bytes;
+		std::vector<uint8_t>& pending = voice->stream_pending;
+		// 缓冲区按提交顺序播放完毕，排队数小于缓冲区数时下一个位置必然空闲
+		while (voice->queued_buffers.load(std::memory_order_acquire) < stream_buffer_count)
+		{
+			if (voice->stream_clip.load() != clip)
+				return;
+			while (pending.size() < period_bytes && !state->finished)
+				decode_clip_pcm(state, pending);
+			if (pending.empty())
+			{
+				// 播放到结尾，已提交的缓冲区照常播放完毕
+				voice->stream_clip = nullptr;
+				return;
+			}
+			uint32_t bytes = uint32_t(std::min<size_t>(pending.size(), period_bytes));
+			uint8_t* buffer = voice->stream_buffers + size_t(voice->stream_submitted % stream_buffer_count) * period_bytes;
+			std::memcpy(buffer, pending.data(), bytes);
+			pending.erase(pending.begin(), pending.begin() + bytes);
+			voice->stream_submitted++;
+			clip->pinned_buffers.fetch_add(1, std::memory_order_relaxed);
+			voice->queued_buffers.fetch_add(1, std::memory_order_relaxed);
+			if (voice->sink->submit_buffer(buffer, bytes, clip))
+			{
+				clip->pinned_buffers.fetch_sub(1, std::memory_order_relaxed);
+				voice->queued_buffers.fetch_sub(1, std::memory_order_relaxed);
+				voice->stream_clip = nullptr;
+				return;
+			}
+			if (voice->stream_trigger_ns)
+			{
+				std::lock_guard<std::mutex> stats_lock(stats_mutex);
+				record_latency(streamed_latency, now_ns() - voice->stream_trigger_ns);
+				voice->stream_trigger_ns = 0;
+			}
+		}
+	}
+
+	// 线程池中运行：混音器的队列有空间时解码下一段并写入，混音线程取走数据后重新调度
+	void sound_bank_impl::run_mix_stream(bank_voice* voice)
+	{
+		bank_clip* clip = voice->stream_clip.load();
+		if (!clip)
+			return;
+		clip_decoder* state = clip->stream_decoder;
+		audio_mix_queue_source* queue = voice->stream_queue;
+		size_t block_align = size_t(format.block_align());
+		std::vector<uint8_t>& pending = voice->stream_pending;
+		while (queue->get_free_frames() > 0)
+		{
+			if (voice->stream_clip.load() != clip)
+				return;
+			while (pending.size() < voice->stream_period_bytes && !state->finished)
+				decode_clip_pcm(state, pending);
+			if (pending.empty())
+			{
+				// 之后混音线程可能随时释放队列，不能再访问
+				voice->stream_clip = nullptr;
+				queue->end_of_stream();
+				return;
+			}
+			int frames = queue->push(pending.data(), int(pending.size() / block_align));
+			if (frames <= 0)
+				return;
+			pending.erase(pending.begin(), pending.begin() + size_t(frames) * block_align);
+		}
+	}
+
+	void sound_bank_impl::stop_all()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto& voice : voices)
+			stop_voice(voice.get());
+	}
+
+	int sound_bank_impl::get_active_voices()
+	{
+		int active = 0;
+		for (auto& voice : voices)
+		{
+			if (voice->queued_buffers.load(std::memory_order_acquire) > 0 || voice->stream_clip.load())
+				active++;
+		}
+		return active;
+	}
+
+	void sound_bank_impl::get_stats(sound_bank_stats& stats)
+	{
+		stats = sound_bank_stats();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stats.arena_bytes = arena.get_capacity();
+			stats.arena_used_bytes = arena.get_used();
+			stats.arena_largest_free = arena.get_largest_free();
+			stats.clip_count = static_cast<uint32_t>(clips.size());
+			for (auto& clip : clips)
+			{
+				if (clip->streamed)
+				{
+					stats.streamed_clips++;
+					stats.streamed_input_bytes += clip->input_bytes;
+				}
+				else if (clip->resident)
+					stats.resident_clips++;
+			}
+			stats.triggers = trigger_serial;
+			stats.evictions = evictions;
+			stats.voice_steals = voice_steals;
+		}
+		std::lock_guard<std::mutex> stats_lock(stats_mutex);
+		stats.resident_latency = resident_latency;
+		stats.reload_latency = reload_latency;
+		stats.streamed_latency = streamed_latency;
+		stats.reloads = reload_latency.count;
+		if (mixer)
+			mixer->get_stats(stats.mixer);
+	}
+
+	audio_sound_bank* create_sound_bank(const sound_bank_config& config)
+	{
+		auto bank = DBG_NEW sound_bank_impl();
+		if (bank->initialize(config))
+		{
+			delete bank;
+			return nullptr;
+		}
+		return bank;
+	}
+
+	static void print_latency(const char* name, const sound_bank_latency_stats& stats)
+	{
+		if (stats.count)
+			std::printf("info: trigger-to-submit latency, %s: %llu triggers, avg %.1fus, max %.1fus\n",
+				name, static_cast<unsigned long long>(stats.count), stats.average_us, stats.max_us);
+	}
+
+	int run_sound_bank_test(const std::vector<std::string>& paths, const sound_bank_config& config, int triggers)
+	{
+		if (paths.empty())
+		{
+			std::printf("err: no input file for sound bank\n");
+			return -1;
+		}
+		audio_sound_bank* bank = create_sound_bank(config);
+		if (!bank)
+			return -1;
+		auto load_begin = std::chrono::steady_clock::now();
+		std::vector<int> loaded;
+		for (const auto& path : paths)
+		{
+			int clip = bank->load(path.c_str());
+			if (clip >= 0)
+				loaded.push_back(clip);
+		}
+		double load_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - load_begin).count();
+		if (loaded.empty())
+		{
+			delete bank;
+			return -1;
+		}
+		std::printf("info: sound bank loaded %d of %d clips in %.3fs\n", int(loaded.size()), int(paths.size()), load_seconds);
+
+		int failed = 0;
+		for (int i = 0; i < triggers; ++i)
+		{
+			// 混音时依次在左右之间摆放声像
+			float pan = float(i % 5 - 2) * 0.5f;
+			if (bank->trigger(loaded[size_t(i) % loaded.size()], 1.0f, pan) < 0)
+				failed++;
+		}
+		while (bank->get_active_voices() > 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		sound_bank_stats stats;
+		bank->get_stats(stats);
+		delete bank;
+		std::printf("info: sound bank: %u clips (%u resident, %u decode on demand), %llu triggers, %d failed, "
+			"%llu evictions, %llu voice steals\n",
+			stats.clip_count, stats.resident_clips, stats.streamed_clips, static_cast<unsigned long long>(stats.triggers),
+			failed, static_cast<unsigned long long>(stats.evictions), static_cast<unsigned long long>(stats.voice_steals));
+		std::printf("info: sound bank arena: %.1f KB used of %.1f KB, largest free block %.1f KB; "
+			"decode on demand input %.1f KB\n",
+			stats.arena_used_bytes / 1024.0, stats.arena_bytes / 1024.0, stats.arena_largest_free / 1024.0,
+			stats.streamed_input_bytes / 1024.0);
+		print_latency("resident", stats.resident_latency);
+		print_latency("reloaded after eviction", stats.reload_latency);
+		print_latency("decode on demand", stats.streamed_latency);
+		if (config.software_mix && stats.mixer.periods)
+		{
+			std::printf("info: sound bank mixer: %llu periods, max %u voices mixed, %llu underruns, %llu limited periods, "
+				"%.1fus per period\n",
+				static_cast<unsigned long long>(stats.mixer.periods), stats.mixer.max_active_sources,
+				static_cast<unsigned long long>(stats.mixer.underruns),
+				static_cast<unsigned long long>(stats.mixer.limited_periods),
+				stats.mixer.mix_seconds / double(stats.mixer.periods) * 1e6);
+		}
+		return failed ? -1 : 0;
+	}
+}
@@ -0,0 +1,86 @@
+﻿#if !defined(AUDIO_SOUND_BANK_HPP_)
+#define AUDIO_SOUND_BANK_HPP_
+#include "audio_play_interface.hpp"
+#include "audio_output_sink.hpp"
+#include "audio_mixer.hpp"
+#include <string>
+#include <vector>
+
+namespace audio
+{
+	// 音效库：短音效预先解码并转换为输出格式，触发时直接把现成的pcm提交给输出端，
+	// 不经过打开文件、探测、打开解码器与swr_init，也没有demux/decode流水线
+	struct sound_bank_config
+	{
+		// format_mode被忽略，所有音效转换为format
+		audio_sink_config sink;
+		audio_output_format format;
+		// 已解码音效占用的arena大小，超出时按LRU淘汰未在播放的音效，被淘汰的音效在下次触发时重新解码
+		size_t memory_budget = 32u << 20;
+		// 解码后超过此大小的音效不常驻内存，每次触发时在线程池中边解码边提交（decode-on-demand）
+		size_t stream_threshold = 2u << 20;
+		// 同时播放的音效数，每个voice是一个输出端（xaudio2上为一个source voice，software_mix时为混音器中的一个音源）；全部占用时抢占最早触发的voice
+		// wav/raw输出只能有一个voice（software_mix时不受限制）
+		int voices = 8;
+		// 所有voice经软件混音（audio_mixer）混合为一路，只打开一个输出端；format须为16-bit或32-bit float
+		// 每次触发可以指定增益与声像，抢占与停止时淡出
+		bool software_mix = false;
+		// nullptr时使用进程内共享的默认线程池
+		audio_worker_pool* pool = nullptr;
+	};
+
+	struct sound_bank_latency_stats
+	{
+		uint64_t count = 0;
+		double average_us = 0;
+		double max_us = 0;
+	};
+
+	struct sound_bank_stats
+	{
+		// arena的大小、已使用的字节数与最大的连续空闲块
+		size_t arena_bytes = 0;
+		size_t arena_used_bytes = 0;
+		size_t arena_largest_free = 0;
+		uint32_t clip_count = 0;
+		uint32_t resident_clips = 0;
+		uint32_t streamed_clips = 0;
+		// decode-on-demand音效的压缩数据（输入文件）大小之和，不计入arena
+		uint64_t streamed_input_bytes = 0;
+		uint64_t triggers = 0;
+		uint64_t evictions = 0;
+		// 触发时音效已被淘汰、需要重新解码的次数
+		uint64_t reloads = 0;
+		uint64_t voice_steals = 0;
+		// 从trigger调用到第一个缓冲区submit_buffer返回（software_mix时为第一次被混音）的时间，按音效的存放方式分开统计
+		sound_bank_latency_stats resident_latency;
+		sound_bank_latency_stats reload_latency;
+		sound_bank_latency_stats streamed_latency;
+		// software_mix时混音器的统计
+		audio_mixer_stats mixer;
+	};
+
+	class audio_sound_bank
+	{
+	public:
+		virtual ~audio_sound_bank() = default;
+
+		// 解码并放入arena（或按大小作为decode-on-demand音效），返回音效编号，失败时返回-1
+		virtual int load(const char* path, const audio_input_config& config = audio_input_config()) = 0;
+		// 在一个空闲的voice上播放，返回voice编号，失败时返回-1；可以在任意线程中调用
+		// gain与pan（-1为左，1为右）只在software_mix时生效
+		virtual int trigger(int clip, float gain = 1.0f, float pan = 0.0f) = 0;
+		virtual void stop_all() = 0;
+		// 正在播放的voice数
+		virtual int get_active_voices() = 0;
+		virtual void get_stats(sound_bank_stats& stats) = 0;
+	};
+
+	// 创建并打开所有voice的输出端，失败时返回nullptr
+	audio_sound_bank* create_sound_bank(const sound_bank_config& config);
+
+	// 命令行测试：载入所有文件，依次触发triggers次并报告触发延迟与内存使用
+	int run_sound_bank_test(const std::vector<std::string>& paths, const sound_bank_config& config, int triggers);
+}
+
+#endif // AUDIO_SOUND_BANK_HPP_
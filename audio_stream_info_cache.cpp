@@ -0,0 +1,321 @@
+﻿#include "audio_stream_info_cache.hpp"
+#include "ffmpeg_xaudio2_internal.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace audio
+{
+	constexpr char stream_info_cache_magic[4] = { 'F', 'X', 'S', 'C' };
+	constexpr uint32_t stream_info_cache_version = 1;
+	// 载入时记录数超过有效项数的这么多倍（另加常数）则重写
+	constexpr size_t stream_info_cache_compact_factor = 2;
+	constexpr size_t stream_info_cache_compact_slack = 16;
+
+	struct stream_info_cache_entry
+	{
+		uint64_t file_size = 0;
+		int64_t file_mtime = 0;
+		cached_stream_info info;
+	};
+
+	struct stream_info_cache_state
+	{
+		std::mutex mutex;
+		// 已载入的缓存文件，使用另一个缓存文件时重新载入
+		std::string cache_path;
+		std::map<std::string, stream_info_cache_entry> entries;
+	};
+
+	static stream_info_cache_state& get_stream_info_cache_state()
+	{
+		static stream_info_cache_state state;
+		return state;
+	}
+
+	// 相对路径在不同的工作目录下指向不同的文件，以绝对路径为键
+	static std::string get_cache_key(const char* media_path)
+	{
+#if defined(_WIN32)
+		char* full_path = _fullpath(nullptr, media_path, 0);
+#else
+		char* full_path = realpath(media_path, nullptr);
+#endif
+		if (!full_path)
+			return media_path;
+		std::string key = full_path;
+		std::free(full_path);
+		return key;
+	}
+
+	static void write_record(std::string& out, const std::string& key, const stream_info_cache_entry& entry)
+	{
+		const cached_stream_info& info = entry.info;
+		std::string record;
+		write_field(record, uint32_t(key.size()));
+		record.append(key);
+		write_field(record, entry.file_size);
+		write_field(record, entry.file_mtime);
+		write_field(record, info.stream_index);
+		write_field(record, info.stream_count);
+		write_field(record, info.codec_id);
+		write_field(record, info.codec_tag);
+		write_field(record, info.format);
+		write_field(record, info.bit_rate);
+		write_field(record, info.bits_per_coded_sample);
+		write_field(record, info.bits_per_raw_sample);
+		write_field(record, info.channels);
+		write_field(record, info.channel_mask);
+		write_field(record, info.sample_rate);
+		write_field(record, info.block_align);
+		write_field(record, info.frame_size);
+		write_field(record, info.initial_padding);
+		write_field(record, info.trailing_padding);
+		write_field(record, info.seek_preroll);
+		write_field(record, int32_t(info.time_base.num));
+		write_field(record, int32_t(info.time_base.den));
+		write_field(record, info.start_time);
+		write_field(record, info.duration);
+		write_field(record, info.format_start_time);
+		write_field(record, info.format_duration);
+		write_field(record, info.format_bit_rate);
+		write_field(record, uint32_t(info.extradata.size()));
+		record.append(reinterpret_cast<const char*>(info.extradata.data()), info.extradata.size());
+		// 每条记录前为其长度，读取时可以跳过无法解析的记录
+		write_field(out, uint32_t(record.size()));
+		out.append(record);
+	}
+
+	static bool read_record(const uint8_t* data, const uint8_t* end, std::string& key, stream_info_cache_entry& entry)
+	{
+		cached_stream_info& info = entry.info;
+		uint32_t key_size = 0, extradata_size = 0;
+		int32_t time_base_num = 0, time_base_den = 0;
+		if (!read_field(data, end, key_size) || size_t(end - data) < key_size)
+			return false;
+		key.assign(reinterpret_cast<const char*>(data), key_size);
+		data += key_size;
+		if (!read_field(data, end, entry.file_size) || !read_field(data, end, entry.file_mtime)
+			|| !read_field(data, end, info.stream_index) || !read_field(data, end, info.stream_count)
+			|| !read_field(data, end, info.codec_id) || !read_field(data, end, info.codec_tag)
+			|| !read_field(data, end, info.format) || !read_field(data, end, info.bit_rate)
+			|| !read_field(data, end, info.bits_per_coded_sample) || !read_field(data, end, info.bits_per_raw_sample)
+			|| !read_field(data, end, info.channels) || !read_field(data, end, info.channel_mask)
+			|| !read_field(data, end, info.sample_rate) || !read_field(data, end, info.block_align)
+			|| !read_field(data, end, info.frame_size) || !read_field(data, end, info.initial_padding)
+			|| !read_field(data, end, info.trailing_padding) || !read_field(data, end, info.seek_preroll)
+			|| !read_field(data, end, time_base_num) || !read_field(data, end, time_base_den)
+			|| !read_field(data, end, info.start_time) || !read_field(data, end, info.duration)
+			|| !read_field(data, end, info.format_start_time) || !read_field(data, end, info.format_duration)
+			|| !read_field(data, end, info.format_bit_rate) || !read_field(data, end, extradata_size)
+			|| size_t(end - data) < extradata_size)
+			return false;
+		info.time_base = AVRational{ time_base_num, time_base_den };
+		info.extradata.assign(data, data + extradata_size);
+		return true;
+	}
+
+	static std::string get_cache_header()
+	{
+		std::string header(stream_info_cache_magic, sizeof(stream_info_cache_magic));
+		write_field(header, stream_info_cache_version);
+		return header;
+	}
+
+	// 先写临时文件再改名，其他进程不会读到写了一半的缓存
+	static void rewrite_cache_file(const stream_info_cache_state& state)
+	{
+		std::string out = get_cache_header();
+		for (const auto& item : state.entries)
+			write_record(out, item.first, item.second);
+		std::string temp_path = state.cache_path + ".tmp";
+		{
+			std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+			if (!file || !file.write(out.data(), std::streamsize(out.size())))
+			{
+				std::printf("warn: write stream info cache %s failed\n", state.cache_path.c_str());
+				return;
+			}
+		}
+#if defined(_WIN32)
+		// windows上rename不会覆盖已有的文件
+		std::remove(state.cache_path.c_str());
+#endif
+		if (std::rename(temp_path.c_str(), state.cache_path.c_str()) != 0)
+		{
+			std::printf("warn: write stream info cache %s failed\n", state.cache_path.c_str());
+			std::remove(temp_path.c_str());
+		}
+	}
+
+	static void load_cache_file(stream_info_cache_state& state, const char* cache_path)
+	{
+		if (state.cache_path == cache_path)
+			return;
+		state.cache_path = cache_path;
+		state.entries.clear();
+		std::ifstream file(cache_path, std::ios::binary);
+		if (!file)
+			return;
+		std::vector<uint8_t> content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		file.close();
+		std::string header = get_cache_header();
+		if (content.size() < header.size() || std::memcmp(content.data(), header.data(), header.size()))
+		{
+			std::printf("warn: stream info cache %s has an unknown format, rewritten\n", cache_path);
+			rewrite_cache_file(state);
+			return;
+		}
+		const uint8_t* data = content.data() + header.size();
+		const uint8_t* end = content.data() + content.size();
+		size_t record_count = 0;
+		uint32_t record_size = 0;
+		// 最后一条记录可能因进程中止而不完整，忽略
+		while (read_field(data, end, record_size) && size_t(end - data) >= record_size)
+		{
+			std::string key;
+			stream_info_cache_entry entry;
+			if (read_record(data, data + record_size, key, entry))
+				state.entries[key] = std::move(entry);
+			data += record_size;
+			record_count++;
+		}
+		if (record_count > state.entries.size() * stream_info_cache_compact_factor + stream_info_cache_compact_slack
+			|| data != end)
+			rewrite_cache_file(state);
+	}
+
+	bool lookup_stream_info(const char* cache_path, const char* media_path, cached_stream_info& info)
+	{
+		uint64_t file_size;
+		int64_t file_mtime;
+		if (!get_file_info(media_path, file_size, file_mtime))
+			return false;
+		std::string key = get_cache_key(media_path);
+		stream_info_cache_state& state = get_stream_info_cache_state();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		load_cache_file(state, cache_path);
+		auto it = state.entries.find(key);
+		if (it == state.entries.end() || it->second.file_size != file_size || it->second.file_mtime != file_mtime)
+			return false;
+		info = it->second.info;
+		return true;
+	}
+
+	void store_stream_info(const char* cache_path, const char* media_path, const cached_stream_info& info)
+	{
+		stream_info_cache_entry entry;
+		if (!get_file_info(media_path, entry.file_size, entry.file_mtime))
+			return;
+		entry.info = info;
+		std::string key = get_cache_key(media_path);
+		stream_info_cache_state& state = get_stream_info_cache_state();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		load_cache_file(state, cache_path);
+		std::string out;
+		{
+			std::ifstream existing(cache_path, std::ios::binary);
+			if (!existing || existing.peek() == std::ifstream::traits_type::eof())
+				out = get_cache_header();
+		}
+		write_record(out, key, entry);
+		state.entries[key] = std::move(entry);
+		std::ofstream file(cache_path, std::ios::binary | std::ios::app);
+		if (!file || !file.write(out.data(), std::streamsize(out.size())))
+			std::printf("warn: write stream info cache %s failed\n", cache_path);
+	}
+
+	bool capture_stream_info(const AVFormatContext* format_context, unsigned stream_index, cached_stream_info& info)
+	{
+		const AVStream* stream = format_context->streams[stream_index];
+		const AVCodecParameters* codecpar = stream->codecpar;
+		if (codecpar->ch_layout.order != AV_CHANNEL_ORDER_NATIVE && codecpar->ch_layout.order != AV_CHANNEL_ORDER_UNSPEC)
+			return false;
+		info = cached_stream_info();
+		info.stream_index = stream_index;
+		info.stream_count = format_context->nb_streams;
+		info.codec_id = codecpar->codec_id;
+		info.codec_tag = codecpar->codec_tag;
+		info.format = codecpar->format;
+		info.bit_rate = codecpar->bit_rate;
+		info.bits_per_coded_sample = codecpar->bits_per_coded_sample;
+		info.bits_per_raw_sample = codecpar->bits_per_raw_sample;
+		info.channels = codecpar->ch_layout.nb_channels;
+		info.channel_mask = codecpar->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? codecpar->ch_layout.u.mask : 0;
+		info.sample_rate = codecpar->sample_rate;
+		info.block_align = codecpar->block_align;
+		info.frame_size = codecpar->frame_size;
+		info.initial_padding = codecpar->initial_padding;
+		info.trailing_padding = codecpar->trailing_padding;
+		info.seek_preroll = codecpar->seek_preroll;
+		info.time_base = stream->time_base;
+		info.start_time = stream->start_time;
+		info.duration = stream->duration;
+		info.format_start_time = format_context->start_time;
+		info.format_duration = format_context->duration;
+		info.format_bit_rate = format_context->bit_rate;
+		if (codecpar->extradata && codecpar->extradata_size > 0)
+			info.extradata.assign(codecpar->extradata, codecpar->extradata + codecpar->extradata_size);
+		return true;
+	}
+
+	bool apply_stream_info(AVFormatContext* format_context, const cached_stream_info& info)
+	{
+		if (format_context->nb_streams != info.stream_count || info.stream_index >= format_context->nb_streams)
+			return false;
+		AVStream* stream = format_context->streams[info.stream_index];
+		AVCodecParameters* codecpar = stream->codecpar;
+		if (codecpar->codec_type != AVMEDIA_TYPE_AUDIO
+			|| (codecpar->codec_id != AV_CODEC_ID_NONE && codecpar->codec_id != info.codec_id)
+			|| stream->time_base.num != info.time_base.num || stream->time_base.den != info.time_base.den)
+			return false;
+
+		if (!info.extradata.empty() && codecpar->extradata_size <= 0)
+		{
+			// 解码器要求extradata之后有填充
+			uint8_t* extradata = static_cast<uint8_t*>(av_mallocz(info.extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+			if (!extradata)
+				return false;
+			std::memcpy(extradata, info.extradata.data(), info.extradata.size());
+			av_freep(&codecpar->extradata);
+			codecpar->extradata = extradata;
+			codecpar->extradata_size = static_cast<int>(info.extradata.size());
+		}
+		codecpar->codec_id = static_cast<AVCodecID>(info.codec_id);
+		if (!codecpar->codec_tag)
+			codecpar->codec_tag = info.codec_tag;
+		codecpar->format = info.format;
+		codecpar->bit_rate = info.bit_rate;
+		codecpar->bits_per_coded_sample = info.bits_per_coded_sample;
+		codecpar->bits_per_raw_sample = info.bits_per_raw_sample;
+		av_channel_layout_uninit(&codecpar->ch_layout);
+		if (info.channel_mask)
+			av_channel_layout_from_mask(&codecpar->ch_layout, info.channel_mask);
+		else
+		{
+			codecpar->ch_layout.order = AV_CHANNEL_ORDER_UNSPEC;
+			codecpar->ch_layout.nb_channels = info.channels;
+		}
+		codecpar->sample_rate = info.sample_rate;
+		codecpar->block_align = info.block_align;
+		codecpar->frame_size = info.frame_size;
+		codecpar->initial_padding = info.initial_padding;
+		codecpar->trailing_padding = info.trailing_padding;
+		codecpar->seek_preroll = info.seek_preroll;
+		if (stream->start_time == AV_NOPTS_VALUE)
+			stream->start_time = info.start_time;
+		if (stream->duration == AV_NOPTS_VALUE)
+			stream->duration = info.duration;
+		if (format_context->start_time == AV_NOPTS_VALUE)
+			format_context->start_time = info.format_start_time;
+		if (format_context->duration == AV_NOPTS_VALUE)
+			format_context->duration = info.format_duration;
+		if (format_context->bit_rate <= 0)
+			format_context->bit_rate = info.format_bit_rate;
+		return true;
+	}
+}
@@ -0,0 +1,51 @@
+﻿#if !defined(AUDIO_STREAM_INFO_CACHE_HPP_)
+#define AUDIO_STREAM_INFO_CACHE_HPP_
+#include "audio_play_interface.hpp"
+#include <vector>
+
+namespace audio
+{
+	// avformat_find_stream_info的结果中播放所需的部分：选中的音频流、解码参数与时长
+	struct cached_stream_info
+	{
+		uint32_t stream_index = 0;
+		uint32_t stream_count = 0;
+		int32_t codec_id = 0;
+		uint32_t codec_tag = 0;
+		int32_t format = -1;
+		int64_t bit_rate = 0;
+		int32_t bits_per_coded_sample = 0;
+		int32_t bits_per_raw_sample = 0;
+		int32_t channels = 0;
+		// 0为未指定的声道顺序
+		uint64_t channel_mask = 0;
+		int32_t sample_rate = 0;
+		int32_t block_align = 0;
+		int32_t frame_size = 0;
+		int32_t initial_padding = 0;
+		int32_t trailing_padding = 0;
+		int32_t seek_preroll = 0;
+		AVRational time_base = { 0, 1 };
+		int64_t start_time = AV_NOPTS_VALUE;
+		int64_t duration = AV_NOPTS_VALUE;
+		// 以下为AVFormatContext的字段（AV_TIME_BASE）
+		int64_t format_start_time = AV_NOPTS_VALUE;
+		int64_t format_duration = AV_NOPTS_VALUE;
+		int64_t format_bit_rate = 0;
+		std::vector<uint8_t> extradata;
+	};
+
+	// 流信息缓存：按文件的绝对路径、大小与修改时间查找，文件被修改后记录自动失效
+	// 缓存文件只追加记录，同一路径以最后一条为准；载入时过期记录过多则重写整个文件
+	// 进程内所有播放器共用，内部加锁；不是普通文件时不缓存
+	bool lookup_stream_info(const char* cache_path, const char* media_path, cached_stream_info& info);
+	void store_stream_info(const char* cache_path, const char* media_path, const cached_stream_info& info);
+
+	// 从探测完毕的上下文中取出，声道顺序为自定义时返回false（不缓存）
+	bool capture_stream_info(const AVFormatContext* format_context, unsigned stream_index, cached_stream_info& info);
+	// 在avformat_open_input之后代替avformat_find_stream_info调用；
+	// 流的数量、类型、编码或time_base与缓存不一致时返回false，上下文不被修改
+	bool apply_stream_info(AVFormatContext* format_context, const cached_stream_info& info);
+}
+
+#endif // AUDIO_STREAM_INFO_CACHE_HPP_
@@ -0,0 +1,212 @@
+﻿#include "audio_trace.hpp"
+#include "ffmpeg_xaudio2_internal.hpp"
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+
+namespace audio
+{
+	namespace trace_detail
+	{
+		std::atomic<bool> enabled{ false };
+	}
+
+	static const char* const trace_category_names[] = {
+		"read", "demux", "decode", "convert", "submit", "output", "mix", "app"
+	};
+	static_assert(sizeof(trace_category_names) / sizeof(trace_category_names[0]) == size_t(trace_category::count),
+		"trace_category_names must match trace_category");
+
+	constexpr size_t trace_thread_name_size = 32;
+
+	struct trace_event
+	{
+		int64_t timestamp_ns;
+		const char* name;
+		int64_t value;
+		trace_event_type type;
+		trace_category category;
+	};
+
+	// 只由所属线程写入；position为写入的事件总数，事件写完后才发布
+	struct trace_thread_buffer
+	{
+		trace_thread_buffer(size_t capacity, uint32_t thread_id)
+			: events(DBG_NEW trace_event[capacity]), mask(capacity - 1), thread_id(thread_id) {}
+
+		std::unique_ptr<trace_event[]> events;
+		const size_t mask;
+		const uint32_t thread_id;
+		std::atomic<uint64_t> position{ 0 };
+		// 由registry_mutex保护
+		char name[trace_thread_name_size] = {};
+	};
+
+	// 线程退出后缓冲区仍然保留，导出时可以看到已结束线程的事件
+	static std::mutex registry_mutex;
+	static std::vector<std::unique_ptr<trace_thread_buffer>> registry;
+	static size_t registry_capacity = 0;
+	static std::atomic<int64_t> trace_start_ns{ 0 };
+
+	static thread_local trace_thread_buffer* current_buffer = nullptr;
+	static thread_local char current_thread_name[trace_thread_name_size] = {};
+
+	static trace_thread_buffer* register_thread()
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		if (!registry_capacity)
+			return nullptr;
+		registry.emplace_back(DBG_NEW trace_thread_buffer(registry_capacity, uint32_t(registry.size() + 1)));
+		current_buffer = registry.back().get();
+		std::memcpy(current_buffer->name, current_thread_name, sizeof(current_thread_name));
+		return current_buffer;
+	}
+
+	void trace_detail::write_event(trace_event_type type, trace_category category, const char* name, int64_t value)
+	{
+		trace_thread_buffer* buffer = current_buffer ? current_buffer : register_thread();
+		if (!buffer)
+			return;
+		uint64_t position = buffer->position.load(std::memory_order_relaxed);
+		trace_event& event = buffer->events[position & buffer->mask];
+		event.timestamp_ns = now_ns();
+		event.name = name;
+		event.value = value;
+		event.type = type;
+		event.category = category;
+		buffer->position.store(position + 1, std::memory_order_release);
+	}
+
+	void set_audio_trace_thread_name(const char* name)
+	{
+		std::snprintf(current_thread_name, sizeof(current_thread_name), "%s", name);
+		if (current_buffer)
+		{
+			std::lock_guard<std::mutex> lock(registry_mutex);
+			std::memcpy(current_buffer->name, current_thread_name, sizeof(current_thread_name));
+		}
+	}
+
+	void start_audio_trace(size_t events_per_thread)
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		if (!registry_capacity)
+		{
+			registry_capacity = 1024;
+			while (registry_capacity < events_per_thread)
+				registry_capacity <<= 1;
+		}
+		for (auto& buffer : registry)
+			buffer->position.store(0, std::memory_order_relaxed);
+		trace_start_ns = now_ns();
+		trace_detail::enabled.store(true, std::memory_order_release);
+		std::printf("info: tracing started, %zu events per thread\n", registry_capacity);
+	}
+
+	void stop_audio_trace()
+	{
+		trace_detail::enabled.store(false, std::memory_order_release);
+	}
+
+	// 线程名来自调用方，按json字符串转义
+	static void write_json_string(FILE* file, const char* text)
+	{
+		std::fputc('"', file);
+		for (; *text; ++text)
+		{
+			unsigned char c = static_cast<unsigned char>(*text);
+			if (c == '"' || c == '\\')
+				std::fprintf(file, "\\%c", c);
+			else if (c < 0x20)
+				std::fprintf(file, "\\u%04x", c);
+			else
+				std::fputc(c, file);
+		}
+		std::fputc('"', file);
+	}
+
+	int export_audio_trace(const char* path)
+	{
+		FILE* file = std::fopen(path, "w");
+		if (!file)
+		{
+			std::printf("err: open trace file %s failed\n", path);
+			return -1;
+		}
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		int64_t start_ns = trace_start_ns.load();
+		uint64_t written = 0;
+		uint64_t overwritten = 0;
+		bool first = true;
+		auto separator = [&] {
+			std::fputs(first ? "\n" : ",\n", file);
+			first = false;
+		};
+		std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+		for (auto& buffer : registry)
+		{
+			uint64_t end = buffer->position.load(std::memory_order_acquire);
+			if (!end)
+				continue;
+			separator();
+			std::fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", buffer->thread_id);
+			if (buffer->name[0])
+				write_json_string(file, buffer->name);
+			else
+				std::fprintf(file, "\"thread %u\"", buffer->thread_id);
+			std::fputs("}}", file);
+
+			uint64_t capacity = buffer->mask + 1;
+			uint64_t begin = end > capacity ? end - capacity : 0;
+			overwritten += begin;
+			// 覆盖后缓冲区开头可能是没有begin的end，按嵌套深度跳过
+			int depth = 0;
+			for (uint64_t i = begin; i < end; ++i)
+			{
+				const trace_event& event = buffer->events[i & buffer->mask];
+				if (event.type == trace_event_type::end && depth == 0)
+					continue;
+				if (event.type == trace_event_type::begin)
+					depth++;
+				else if (event.type == trace_event_type::end)
+					depth--;
+				separator();
+				double ts = double(event.timestamp_ns - start_ns) / 1e3;
+				const char* category = trace_category_names[static_cast<int>(event.category)];
+				switch (event.type)
+				{
+				case trace_event_type::begin:
+				case trace_event_type::end:
+					std::fprintf(file, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+						event.name, category, event.type == trace_event_type::begin ? "B" : "E", ts, buffer->thread_id);
+					break;
+				case trace_event_type::instant:
+					std::fprintf(file, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,"
+						"\"args\":{\"value\":%lld}}", event.name, category, ts, buffer->thread_id, static_cast<long long>(event.value));
+					break;
+				case trace_event_type::counter:
+					std::fprintf(file, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,"
+						"\"args\":{\"value\":%lld}}", event.name, category, ts, buffer->thread_id, static_cast<long long>(event.value));
+					break;
+				}
+				written++;
+			}
+		}
+		std::fputs("\n]}\n", file);
+		bool failed = std::ferror(file) != 0;
+		failed = std::fclose(file) != 0 || failed;
+		if (failed)
+		{
+			std::printf("err: write trace file %s failed\n", path);
+			return -1;
+		}
+		std::printf("info: trace written to %s, %llu events from %zu threads\n", path,
+			static_cast<unsigned long long>(written), registry.size());
+		if (overwritten)
+			std::printf("warn: %llu oldest trace events were overwritten, raise --trace-buffer to keep them\n",
+				static_cast<unsigned long long>(overwritten));
+		return 0;
+	}
+}
@@ -0,0 +1,113 @@
+﻿#if !defined(AUDIO_TRACE_HPP_)
+#define AUDIO_TRACE_HPP_
+#include "audio_play_interface.hpp"
+#include <atomic>
+
+// 编译期的记录级别：0为全部移除，1记录各阶段的事件（默认），2另外记录每次read/seek、缓冲区回调等高频事件
+#if !defined(AUDIO_TRACE_LEVEL)
+#define AUDIO_TRACE_LEVEL 1
+#endif
+
+namespace audio
+{
+	// 事件追踪：每个线程一个固定容量的环形缓冲区，只由该线程写入，不加锁、不分配内存；
+	// 缓冲区满时覆盖最早的事件（保留最近的一段）。未开始记录时每个记录点只有一次relaxed读取
+	enum class trace_category : uint8_t
+	{
+		read,
+		demux,
+		decode,
+		convert,
+		submit,
+		output,
+		mix,
+		app,
+		count
+	};
+
+	enum class trace_event_type : uint8_t
+	{
+		begin,
+		end,
+		instant,
+		counter
+	};
+
+	namespace trace_detail
+	{
+		extern std::atomic<bool> enabled;
+		// name须为静态字符串，记录的只是指针
+		void write_event(trace_event_type type, trace_category category, const char* name, int64_t value);
+	}
+
+	inline bool is_audio_trace_enabled() { return trace_detail::enabled.load(std::memory_order_relaxed); }
+
+	inline void trace_instant(trace_category category, const char* name, int64_t value = 0)
+	{
+		if (is_audio_trace_enabled())
+			trace_detail::write_event(trace_event_type::instant, category, name, value);
+	}
+
+	inline void trace_counter(trace_category category, const char* name, int64_t value)
+	{
+		if (is_audio_trace_enabled())
+			trace_detail::write_event(trace_event_type::counter, category, name, value);
+	}
+
+	// 构造时记录begin，析构时记录end；构造时未在记录则两者都不记录
+	class trace_scope
+	{
+	public:
+		trace_scope(trace_category category, const char* name)
+			: category(category), name(is_audio_trace_enabled() ? name : nullptr)
+		{
+			if (this->name)
+				trace_detail::write_event(trace_event_type::begin, category, name, 0);
+		}
+		~trace_scope()
+		{
+			if (name)
+				trace_detail::write_event(trace_event_type::end, category, name, 0);
+		}
+		trace_scope(const trace_scope&) = delete;
+		trace_scope& operator=(const trace_scope&) = delete;
+
+	private:
+		trace_category category;
+		const char* name;
+	};
+
+	// 导出时作为线程名；不在记录时只保存在线程局部变量中
+	void set_audio_trace_thread_name(const char* name);
+
+	// 开始记录，events_per_thread向上取整为2的幂；缓冲区在线程第一次记录时分配，之后重复使用
+	// （容量以第一次分配时为准），再次开始时清空之前的事件
+	void start_audio_trace(size_t events_per_thread = 65536);
+	void stop_audio_trace();
+	// 导出为Chrome trace event格式的json（chrome://tracing与Perfetto均可打开），应在stop之后调用
+	int export_audio_trace(const char* path);
+}
+
+#define AUDIO_TRACE_CONCAT_(a, b) a##b
+#define AUDIO_TRACE_CONCAT(a, b) AUDIO_TRACE_CONCAT_(a, b)
+
+#if AUDIO_TRACE_LEVEL >= 1
+#define AUDIO_TRACE_SCOPE(category, name) \
+	audio::trace_scope AUDIO_TRACE_CONCAT(trace_scope_, __LINE__)(audio::trace_category::category, name)
+#define AUDIO_TRACE_INSTANT(category, name, value) audio::trace_instant(audio::trace_category::category, name, value)
+#define AUDIO_TRACE_COUNTER(category, name, value) audio::trace_counter(audio::trace_category::category, name, value)
+#else
+#define AUDIO_TRACE_SCOPE(category, name) ((void)0)
+#define AUDIO_TRACE_INSTANT(category, name, value) ((void)0)
+#define AUDIO_TRACE_COUNTER(category, name, value) ((void)0)
+#endif
+
+#if AUDIO_TRACE_LEVEL >= 2
+#define AUDIO_TRACE_VERBOSE_SCOPE(category, name) AUDIO_TRACE_SCOPE(category, name)
+#define AUDIO_TRACE_VERBOSE_INSTANT(category, name, value) AUDIO_TRACE_INSTANT(category, name, value)
+#else
+#define AUDIO_TRACE_VERBOSE_SCOPE(category, name) ((void)0)
+#define AUDIO_TRACE_VERBOSE_INSTANT(category, name, value) ((void)0)
+#endif
+
+#endif // AUDIO_TRACE_HPP_
@@ -0,0 +1,161 @@
+﻿#include "audio_worker_pool.hpp"
+#include "audio_trace.hpp"
+#include <cstdio>
+
+namespace audio
+{
+	// 当前工作线程所属的线程池及其队列编号，用于把任务提交到本线程的队列
+	static thread_local audio_worker_pool* current_pool = nullptr;
+	static thread_local size_t current_queue = 0;
+
+	void pool_task::schedule()
+	{
+		int current = state.load(std::memory_order_acquire);
+		while (true)
+		{
+			if (current == queued || current == rerun)
+				return;
+			int target = current == idle ? queued : rerun;
+			if (state.compare_exchange_weak(current, target, std::memory_order_acq_rel))
+			{
+				if (target == queued)
+					pool->submit(this);
+				return;
+			}
+		}
+	}
+
+	void pool_task::execute()
+	{
+		// 变为idle之后任务所属的对象可能立即被释放，之后不能再访问成员
+		audio_worker_pool* owner = pool;
+		state.store(running, std::memory_order_release);
+		body();
+		int expected = running;
+		if (!state.compare_exchange_strong(expected, idle, std::memory_order_acq_rel))
+		{
+			// 运行期间被再次schedule：重新放入队列，先让出线程给队列中的其他任务
+			state.store(queued, std::memory_order_release);
+			owner->submit(this);
+			return;
+		}
+		owner->notify_idle();
+	}
+
+	audio_worker_pool::audio_worker_pool(int thread_count)
+	{
+		if (thread_count <= 0)
+			thread_count = static_cast<int>(std::thread::hardware_concurrency());
+		// demux/decode/output三个阶段至少需要两个线程才能重叠执行
+		if (thread_count < 2)
+			thread_count = 2;
+		for (int i = 0; i < thread_count; ++i)
+			queues.emplace_back(new worker_queue());
+		for (int i = 0; i < thread_count; ++i)
+			threads.emplace_back(&audio_worker_pool::worker_proc, this, size_t(i));
+	}
+
+	audio_worker_pool::~audio_worker_pool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			exit = true;
+		}
+		task_cv.notify_all();
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	void audio_worker_pool::submit(pool_task* task)
+	{
+		size_t index = current_pool == this ? current_queue : next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+		{
+			std::lock_guard<std::mutex> lock(queues[index]->mutex);
+			queues[index]->tasks.push_back(task);
+		}
+		queued_count.fetch_add(1, std::memory_order_release);
+		// 先获取一次锁，保证工作线程要么尚未检查queued_count，要么已经进入等待，避免丢失唤醒
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+		}
+		task_cv.notify_one();
+	}
+
+	pool_task* audio_worker_pool::take_task(size_t index)
+	{
+		for (size_t i = 0; i < queues.size(); ++i)
+		{
+			worker_queue& queue = *queues[(index + i) % queues.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.tasks.empty())
+				continue;
+			pool_task* task;
+			if (i == 0)
+			{
+				task = queue.tasks.front();
+				queue.tasks.pop_front();
+			}
+			else
+			{
+				task = queue.tasks.back();
+				queue.tasks.pop_back();
+			}
+			queued_count.fetch_sub(1, std::memory_order_relaxed);
+			return task;
+		}
+		return nullptr;
+	}
+
+	void audio_worker_pool::notify_idle()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (idle_waiters)
+			idle_cv.notify_all();
+	}
+
+	void audio_worker_pool::wait_idle(const pool_task& task)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		idle_waiters++;
+		idle_cv.wait(lock, [&task] { return task.is_idle(); });
+		idle_waiters--;
+	}
+
+	void audio_worker_pool::worker_proc(size_t index)
+	{
+		current_pool = this;
+		current_queue = index;
+		char name[32];
+		std::snprintf(name, sizeof(name), "audio worker %zu", index);
+		set_audio_trace_thread_name(name);
+		while (true)
+		{
+			pool_task* task = take_task(index);
+			if (task)
+			{
+				task->execute();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(mutex);
+			task_cv.wait(lock, [this] { return exit || queued_count.load(std::memory_order_acquire) > 0; });
+			if (exit && queued_count.load(std::memory_order_acquire) == 0)
+				break;
+		}
+	}
+
+	audio_worker_pool* create_audio_worker_pool(int thread_count)
+	{
+		return DBG_NEW audio_worker_pool(thread_count);
+	}
+
+	void destroy_audio_worker_pool(audio_worker_pool* pool)
+	{
+		delete pool;
+	}
+
+	audio_worker_pool* get_default_audio_worker_pool()
+	{
+		static audio_worker_pool pool(0);
+		return &pool;
+	}
+}
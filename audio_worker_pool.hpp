@@ -0,0 +1,89 @@
+﻿#if !defined(AUDIO_WORKER_POOL_HPP_)
+#define AUDIO_WORKER_POOL_HPP_
+#include "audio_play_interface.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+
+namespace audio
+{
+	class audio_worker_pool;
+
+	// 在线程池上运行的任务，同一时刻最多在一个线程上运行
+	// 运行期间再次schedule时，本次运行结束后重新放入队列，不会丢失唤醒，也不会一直占用同一个线程；
+	// 任务在等待数据或空间时直接返回，由上下游在状态变化时重新schedule，不占用线程
+	class pool_task
+	{
+	public:
+		pool_task(audio_worker_pool* pool, std::function<void()> body) : pool(pool), body(std::move(body)) {}
+		pool_task(const pool_task&) = delete;
+		pool_task& operator=(const pool_task&) = delete;
+
+		void schedule();
+		bool is_idle() const { return state.load(std::memory_order_acquire) == idle; }
+
+	private:
+		friend class audio_worker_pool;
+		enum : int { idle, queued, running, rerun };
+
+		// 由工作线程调用
+		void execute();
+
+		audio_worker_pool* pool;
+		std::function<void()> body;
+		std::atomic<int> state{ idle };
+	};
+
+	// 固定数量的工作线程，每个线程有自己的任务队列（work stealing）：
+	// 工作线程中提交的任务（通常是相邻的流水线阶段）放入本线程的队列，数据留在同一个核心的缓存中；
+	// 其他线程提交的任务轮流放入各个队列；线程的队列为空时从其他线程的队列尾部取走任务
+	class audio_worker_pool
+	{
+	public:
+		explicit audio_worker_pool(int thread_count);
+		~audio_worker_pool();
+		audio_worker_pool(const audio_worker_pool&) = delete;
+		audio_worker_pool& operator=(const audio_worker_pool&) = delete;
+
+		int get_thread_count() const { return static_cast<int>(threads.size()); }
+		// 等待任务既不在队列中也不在运行，用于释放任务所属的对象之前
+		void wait_idle(const pool_task& task);
+
+	private:
+		friend class pool_task;
+		struct worker_queue
+		{
+			std::mutex mutex;
+			std::deque<pool_task*> tasks;
+		};
+
+		void submit(pool_task* task);
+		void notify_idle();
+		// 先取本线程队列的头部，再依次从其他队列的尾部窃取，没有任务时返回nullptr
+		pool_task* take_task(size_t index);
+		void worker_proc(size_t index);
+
+		std::vector<std::unique_ptr<worker_queue>> queues;
+		// 所有队列中的任务数，工作线程据此决定是否休眠
+		std::atomic<size_t> queued_count{ 0 };
+		// 外部线程提交任务时轮流选择的队列
+		std::atomic<size_t> next_queue{ 0 };
+		// 保护休眠、退出与wait_idle
+		std::mutex mutex;
+		std::condition_variable task_cv;
+		std::condition_variable idle_cv;
+		std::vector<std::thread> threads;
+		int idle_waiters = 0;
+		bool exit = false;
+	};
+
+	// 进程内共享的默认线程池，线程数为cpu核心数，第一次调用时创建
+	audio_worker_pool* get_default_audio_worker_pool();
+}
+
+#endif // AUDIO_WORKER_POOL_HPP_
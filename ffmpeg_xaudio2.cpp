@@ -1,29 +1,470 @@
 ﻿// ffmpeg_xaudio2.cpp : 此文件包含 "main" 函数。程序执行将在此处开始并结束。
 //
 #include "audio_play_interface.hpp"
+#include "sample_convert.hpp"
+#include "audio_batch.hpp"
+#include "audio_sound_bank.hpp"
+#include "audio_mixer.hpp"
+#include "audio_metrics.hpp"
+#include "audio_benchmark.hpp"
+#include "audio_loudness.hpp"
+#include "audio_peaks.hpp"
+#include "audio_trace.hpp"
 #include <cstdio>
 #include <cstring>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <thread>
 
 #if !defined(UNREFERENCED_PARAMETER)
 #define UNREFERENCED_PARAMETER(P) (P)
 #endif
 
-int main()
+static void print_usage()
+{
+	std::printf("usage: ffmpeg_xaudio2 [options] [audio file...]\n");
+	std::printf("  multiple files are played as a gapless playlist, \"-\" reads the first file from stdin\n");
+	std::printf("  --sink=xaudio2|null|wav|raw  select output sink (default: xaudio2 on windows, null elsewhere)\n");
+	std::printf("  --output=<path>              output file for wav/raw sink\n");
+	std::printf("  --clock=<speed>              headless sink clock, 0 = as fast as possible, 1 = realtime\n");
+	std::printf("  --output-format=native|compat  native: keep source rate/channels/sample format (default)\n");
+	std::printf("                               compat: always 44100Hz, stereo, 16-bit\n");
+	std::printf("  --downmix                    downmix multichannel sources to stereo\n");
+	std::printf("  --dither                     add tpdf dither when converting to 16-bit\n");
+	std::printf("  --replay-gain=off|track|album  apply replay gain from <file>.loudness or replaygain/r128 tags\n");
+	std::printf("  --replay-gain-preamp=<dB>    extra gain added to the replay gain (default: 0)\n");
+	std::printf("  --latency=<ms>               target audio queued in the output sink, adapted on underruns\n");
+	std::printf("                               (default: 200, or 30 with --low-latency)\n");
+	std::printf("  --low-latency                small output buffers and a tens-of-milliseconds queue target\n");
+	std::printf("  --convert-selftest           compare sample conversion kernels against swresample and exit\n");
+	std::printf("  --convert-bench              measure sample conversion kernel throughput and exit\n");
+	std::printf("  --mix-selftest               compare software mixer kernels against the scalar ones and exit\n");
+	std::printf("  --mix-bench                  measure software mixer voices per core for s16 and float and exit\n");
+	std::printf("  --loudness-selftest          compare loudness kernels against the scalar ones, check reference\n");
+	std::printf("                               signals and exit\n");
+	std::printf("  --loudness-bench             measure k-weighting and true peak throughput and exit\n");
+	std::printf("  --peaks-selftest             compare peak kernels against the scalar one, check a written peaks\n");
+	std::printf("                               file and exit\n");
+	std::printf("  --peaks-bench                measure peak summary throughput and exit\n");
+	std::printf("  --seek-test=<n>              headless: seek n times to random positions while the sink clock is\n");
+	std::printf("                               running, then check all output buffers came back (clock at least 1)\n");
+	std::printf("  --input=auto|mmap|stream|memory|callback  select input method (default: mmap for regular files)\n");
+	std::printf("                               memory/callback: the cli reads the first file itself and hands the\n");
+	std::printf("                               bytes over as a memory buffer or a pull callback\n");
+	std::printf("  --avio-buffer=<bytes>        avio buffer size handed to ffmpeg (default: 8192)\n");
+	std::printf("  --read-ahead=<bytes>         read input ahead on an i/o thread, window in bytes\n");
+	std::printf("  --read-ahead-ms=<ms>         read ahead window in milliseconds of audio\n");
+	std::printf("  --throttle-input=<bytes/s>   limit input read speed, for testing slow storage\n");
+	std::printf("  --seek-index=off|memory|sidecar  seek index for formats without a complete native index\n");
+	std::printf("                               sidecar: keep it in <file>.seekidx across runs (default: memory)\n");
+	std::printf("  --seek-index-scan            build the seek index in the background after open\n");
+	std::printf("  --peaks                      build min/max/rms waveform peaks while decoding, written to\n");
+	std::printf("                               <file>.peaks when a track is decoded from start to end\n");
+	std::printf("  --peaks-info=<file>          print the levels of <file>.peaks and exit\n");
+	std::printf("  --fast-open                  small probe limits, skip stream info probing when the header\n");
+	std::printf("                               is enough\n");
+	std::printf("  --stream-info-cache=<path>   cache stream info by path, size and mtime; hits skip probing\n");
+	std::printf("  --batch                      decode all files (globs allowed) as fast as possible on all cores\n");
+	std::printf("                               and report per-file and total throughput; uses --sink=null|wav|raw\n");
+	std::printf("  --batch-list=<file>          batch decode the paths listed in a file, one per line\n");
+	std::printf("  --output-dir=<dir>           batch output directory for wav/raw sink\n");
+	std::printf("  --threads=<n>                batch worker threads (default: cpu cores)\n");
+	std::printf("  --jobs=<n>                   files decoded at the same time in batch mode (default: threads)\n");
+	std::printf("  --decoder-threads=<n>        ffmpeg frame/slice threads per decoder, 0 = auto (default: 1)\n");
+	std::printf("  --segment-parallel[=<n>]     batch decode each file in n segments on all threads, stitched in\n");
+	std::printf("                               order (default: 2 x threads); for a few long files\n");
+	std::printf("  --segment-verify             also decode sequentially, a file fails if the stitched output differs\n");
+	std::printf("  --loudness-scan              measure ebu r128 loudness, range and true peak of all files (globs\n");
+	std::printf("                               allowed) on all cores, files in one directory form an album;\n");
+	std::printf("                               results are kept in <file>.loudness for --replay-gain\n");
+	std::printf("  --loudness-no-sidecar        report loudness only, do not write <file>.loudness\n");
+	std::printf("  --sound-bank                 preload all files into a sound bank, trigger them and report\n");
+	std::printf("                               trigger-to-submit latency and arena memory use\n");
+	std::printf("  --bank-budget=<bytes>        sound bank arena size, lru eviction beyond it (default: 32 MB)\n");
+	std::printf("  --bank-stream-threshold=<bytes>  clips decoding to more pcm are decoded on demand (default: 2 MB)\n");
+	std::printf("  --bank-voices=<n>            sound bank voices playing at the same time (default: 8)\n");
+	std::printf("  --bank-triggers=<n>          triggers issued round robin over the clips (default: 100)\n");
+	std::printf("  --bank-mix                   mix all sound bank voices in software into one output sink,\n");
+	std::printf("                               with per-trigger gain and pan; lifts the one voice file limit\n");
+	std::printf("  --metrics=json|prometheus    dump timing histograms and counters at exit\n");
+	std::printf("  --metrics-file=<path>        write metrics to a file instead of stdout\n");
+	std::printf("  --metrics-interval=<ms>      also dump metrics periodically\n");
+	std::printf("  --trace=<path.json>          record per-stage trace events and write a chrome trace at exit\n");
+	std::printf("                               (open in chrome://tracing or perfetto)\n");
+	std::printf("  --trace-buffer=<events>      trace ring buffer size per thread, oldest events are dropped\n");
+	std::printf("                               beyond it (default: 65536)\n");
+	std::printf("  --bench                      generate a test corpus and measure open latency, decode, swr_convert\n");
+	std::printf("                               and end-to-end throughput; uses --threads for the worker pool\n");
+	std::printf("  --bench-dir=<dir>            benchmark corpus directory, reused if present (default: bench_corpus)\n");
+	std::printf("  --bench-output=<path>        benchmark json results (default: bench_results.json)\n");
+	std::printf("  --bench-seconds=<s>          length of each corpus file (default: 10)\n");
+	std::printf("  --bench-repeat=<n>           runs per measurement, median and best are reported (default: 5)\n");
+}
+
+// 停止记录并导出，未指定--trace时什么也不做
+static void finish_trace(const char* trace_path)
+{
+	if (!trace_path)
+		return;
+	audio::stop_audio_trace();
+	audio::export_audio_trace(trace_path);
+}
+
+int main(int argc, char* argv[])
 {
 	char s[3000], s_1[3000]; int dummy_return_value;
 	memset(s, 0, sizeof(s));
 	memset(s_1, 0, sizeof(s_1));
+	audio::audio_sink_config sink_config;
+	audio::audio_input_config input_config;
+	bool memory_input = false;
+	bool callback_input = false;
+	bool interactive = true;
+	bool batch = false;
+	audio::batch_decode_config batch_config;
+	std::vector<std::string> batch_paths;
+	bool loudness_scan = false;
+	audio::loudness_scan_config loudness_config;
+	bool sound_bank = false;
+	audio::sound_bank_config bank_config;
+	int bank_triggers = 100;
+	bool metrics = false;
+	audio::metrics_format metrics_format = audio::metrics_format::json;
+	const char* metrics_path = nullptr;
+	int metrics_interval_ms = 0;
+	const char* trace_path = nullptr;
+	size_t trace_buffer_events = 65536;
+	bool bench = false;
+	audio::benchmark_config bench_config;
+	int seek_test_count = 0;
+	// 第一个文件之后的文件，加入播放列表
+	int playlist_begin = 0, playlist_end = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		const char* arg = argv[i];
+		if (std::strncmp(arg, "--sink=", 7) == 0)
+		{
+			const char* sink_name = arg + 7;
+			if (std::strcmp(sink_name, "xaudio2") == 0)
+				sink_config.type = audio::audio_sink_type::xaudio2;
+			else if (std::strcmp(sink_name, "null") == 0)
+				sink_config.type = audio::audio_sink_type::null;
+			else if (std::strcmp(sink_name, "wav") == 0)
+				sink_config.type = audio::audio_sink_type::wav_file;
+			else if (std::strcmp(sink_name, "raw") == 0)
+				sink_config.type = audio::audio_sink_type::raw_pcm_file;
+			else
+			{
+				print_usage();
+				return -1;
+			}
+		}
+		else if (std::strncmp(arg, "--output=", 9) == 0)
+			sink_config.output_path = arg + 9;
+		else if (std::strncmp(arg, "--clock=", 8) == 0)
+			sink_config.clock_speed = std::atof(arg + 8);
+		else if (std::strncmp(arg, "--output-format=", 16) == 0)
+		{
+			const char* format_name = arg + 16;
+			if (std::strcmp(format_name, "native") == 0)
+				sink_config.format_mode = audio::audio_output_format_mode::native;
+			else if (std::strcmp(format_name, "compat") == 0)
+				sink_config.format_mode = audio::audio_output_format_mode::compatible;
+			else
+			{
+				print_usage();
+				return -1;
+			}
+		}
+		else if (std::strcmp(arg, "--downmix") == 0)
+			sink_config.downmix_to_stereo = true;
+		else if (std::strcmp(arg, "--dither") == 0)
+			sink_config.dither = true;
+		else if (std::strncmp(arg, "--replay-gain=", 14) == 0)
+		{
+			const char* mode_name = arg + 14;
+			if (std::strcmp(mode_name, "off") == 0)
+				sink_config.replay_gain = audio::audio_replay_gain_mode::off;
+			else if (std::strcmp(mode_name, "track") == 0)
+				sink_config.replay_gain = audio::audio_replay_gain_mode::track;
+			else if (std::strcmp(mode_name, "album") == 0)
+				sink_config.replay_gain = audio::audio_replay_gain_mode::album;
+			else
+			{
+				print_usage();
+				return -1;
+			}
+		}
+		else if (std::strncmp(arg, "--replay-gain-preamp=", 21) == 0)
+			sink_config.replay_gain_preamp_db = std::atof(arg + 21);
+		else if (std::strncmp(arg, "--latency=", 10) == 0)
+			sink_config.target_latency_ms = std::atoi(arg + 10);
+		else if (std::strcmp(arg, "--low-latency") == 0)
+			sink_config.low_latency = true;
+		else if (std::strcmp(arg, "--convert-selftest") == 0)
+			return audio::run_sample_convert_selftest();
+		else if (std::strcmp(arg, "--convert-bench") == 0)
+		{
+			audio::run_sample_convert_benchmark();
+			return 0;
+		}
+		else if (std::strcmp(arg, "--mix-selftest") == 0)
+			return audio::run_mix_selftest();
+		else if (std::strcmp(arg, "--mix-bench") == 0)
+		{
+			audio::run_mix_benchmark();
+			return 0;
+		}
+		else if (std::strcmp(arg, "--peaks-selftest") == 0)
+			return audio::run_peak_selftest();
+		else if (std::strcmp(arg, "--peaks-bench") == 0)
+		{
+			audio::run_peak_benchmark();
+			return 0;
+		}
+		else if (std::strncmp(arg, "--peaks-info=", 13) == 0)
+			return audio::print_peak_summary(arg + 13);
+		else if (std::strncmp(arg, "--seek-test=", 12) == 0)
+			seek_test_count = std::atoi(arg + 12);
+		else if (std::strcmp(arg, "--peaks") == 0)
+			input_config.generate_peaks = true;
+		else if (std::strcmp(arg, "--loudness-selftest") == 0)
+			return audio::run_loudness_selftest();
+		else if (std::strcmp(arg, "--loudness-bench") == 0)
+		{
+			audio::run_loudness_benchmark();
+			return 0;
+		}
+		else if (std::strncmp(arg, "--input=", 8) == 0)
+		{
+			const char* input_name = arg + 8;
+			if (std::strcmp(input_name, "auto") == 0)
+				input_config.mode = audio::audio_input_mode::automatic;
+			else if (std::strcmp(input_name, "mmap") == 0)
+				input_config.mode = audio::audio_input_mode::mmap;
+			else if (std::strcmp(input_name, "stream") == 0)
+				input_config.mode = audio::audio_input_mode::file_stream;
+			else if (std::strcmp(input_name, "memory") == 0)
+				memory_input = true;
+			else if (std::strcmp(input_name, "callback") == 0)
+				callback_input = true;
+			else
+			{
+				print_usage();
+				return -1;
+			}
+		}
+		else if (std::strncmp(arg, "--avio-buffer=", 14) == 0)
+			input_config.avio_buffer_size = std::strtoul(arg + 14, nullptr, 10);
+		else if (std::strncmp(arg, "--read-ahead=", 13) == 0)
+			input_config.read_ahead_bytes = std::strtoul(arg + 13, nullptr, 10);
+		else if (std::strncmp(arg, "--read-ahead-ms=", 16) == 0)
+			input_config.read_ahead_ms = std::atoi(arg + 16);
+		else if (std::strncmp(arg, "--throttle-input=", 17) == 0)
+			input_config.throttle_bytes_per_second = std::strtoul(arg + 17, nullptr, 10);
+		else if (std::strncmp(arg, "--seek-index=", 13) == 0)
+		{
+			const char* index_name = arg + 13;
+			if (std::strcmp(index_name, "off") == 0)
+				input_config.seek_index = audio::audio_seek_index_mode::disabled;
+			else if (std::strcmp(index_name, "memory") == 0)
+				input_config.seek_index = audio::audio_seek_index_mode::memory;
+			else if (std::strcmp(index_name, "sidecar") == 0)
+				input_config.seek_index = audio::audio_seek_index_mode::sidecar;
+			else
+			{
+				print_usage();
+				return -1;
+			}
+		}
+		else if (std::strcmp(arg, "--seek-index-scan") == 0)
+			input_config.seek_index_scan = true;
+		else if (std::strcmp(arg, "--fast-open") == 0)
+			input_config.fast_open = true;
+		else if (std::strncmp(arg, "--stream-info-cache=", 20) == 0)
+			input_config.stream_info_cache = arg + 20;
+		else if (std::strcmp(arg, "--batch") == 0)
+			batch = true;
+		else if (std::strncmp(arg, "--batch-list=", 13) == 0)
+		{
+			batch = true;
+			if (audio::read_batch_list(arg + 13, batch_paths) < 0)
+				return -1;
+		}
+		else if (std::strncmp(arg, "--output-dir=", 13) == 0)
+			batch_config.output_dir = arg + 13;
+		else if (std::strncmp(arg, "--threads=", 10) == 0)
+			batch_config.threads = std::atoi(arg + 10);
+		else if (std::strncmp(arg, "--jobs=", 7) == 0)
+			batch_config.jobs = std::atoi(arg + 7);
+		else if (std::strncmp(arg, "--decoder-threads=", 18) == 0)
+			input_config.decoder_threads = std::atoi(arg + 18);
+		else if (std::strcmp(arg, "--segment-parallel") == 0 || std::strncmp(arg, "--segment-parallel=", 19) == 0)
+		{
+			batch = true;
+			batch_config.segment_parallel = true;
+			if (arg[18] == '=')
+				batch_config.segments = std::atoi(arg + 19);
+		}
+		else if (std::strcmp(arg, "--segment-verify") == 0)
+			batch_config.segment_verify = true;
+		else if (std::strcmp(arg, "--loudness-scan") == 0)
+			loudness_scan = true;
+		else if (std::strcmp(arg, "--loudness-no-sidecar") == 0)
+			loudness_config.write_sidecar = false;
+		else if (std::strcmp(arg, "--sound-bank") == 0)
+			sound_bank = true;
+		else if (std::strncmp(arg, "--bank-budget=", 14) == 0)
+			bank_config.memory_budget = std::strtoul(arg + 14, nullptr, 10);
+		else if (std::strncmp(arg, "--bank-stream-threshold=", 24) == 0)
+			bank_config.stream_threshold = std::strtoul(arg + 24, nullptr, 10);
+		else if (std::strncmp(arg, "--bank-voices=", 14) == 0)
+			bank_config.voices = std::atoi(arg + 14);
+		else if (std::strncmp(arg, "--bank-triggers=", 16) == 0)
+			bank_triggers = std::atoi(arg + 16);
+		else if (std::strcmp(arg, "--bank-mix") == 0)
+			bank_config.software_mix = true;
+		else if (std::strncmp(arg, "--metrics=", 10) == 0)
+		{
+			metrics = true;
+			if (std::strcmp(arg + 10, "json") == 0)
+				metrics_format = audio::metrics_format::json;
+			else if (std::strcmp(arg + 10, "prometheus") == 0)
+				metrics_format = audio::metrics_format::prometheus;
+			else
+			{
+				print_usage();
+				return -1;
+			}
+		}
+		else if (std::strncmp(arg, "--metrics-file=", 15) == 0)
+			metrics_path = arg + 15;
+		else if (std::strncmp(arg, "--metrics-interval=", 19) == 0)
+			metrics_interval_ms = std::atoi(arg + 19);
+		else if (std::strncmp(arg, "--trace=", 8) == 0)
+			trace_path = arg + 8;
+		else if (std::strncmp(arg, "--trace-buffer=", 15) == 0)
+			trace_buffer_events = std::strtoul(arg + 15, nullptr, 10);
+		else if (std::strcmp(arg, "--bench") == 0)
+			bench = true;
+		else if (std::strncmp(arg, "--bench-dir=", 12) == 0)
+			bench_config.corpus_dir = arg + 12;
+		else if (std::strncmp(arg, "--bench-output=", 15) == 0)
+			bench_config.output_path = arg + 15;
+		else if (std::strncmp(arg, "--bench-seconds=", 16) == 0)
+			bench_config.corpus_seconds = std::atof(arg + 16);
+		else if (std::strncmp(arg, "--bench-repeat=", 15) == 0)
+			bench_config.repeat = std::atoi(arg + 15);
+		else if (arg[0] == '-' && arg[1] == '-')
+		{
+			print_usage();
+			return -1;
+		}
+		else if (interactive)
+		{
+			std::strncpy(s, arg, sizeof(s) - 1);
+			interactive = false;
+			playlist_begin = playlist_end = i + 1;
+		}
+		else
+			playlist_end = i + 1;
+	}
+	if (trace_path)
+	{
+		audio::set_audio_trace_thread_name("main");
+		audio::start_audio_trace(trace_buffer_events);
+	}
+	if (bench)
+	{
+		if (bench_config.corpus_seconds <= 0)
+		{
+			print_usage();
+			return -1;
+		}
+		bench_config.threads = batch_config.threads;
+		int res = audio::run_audio_benchmark(bench_config);
+		finish_trace(trace_path);
+		return res;
+	}
+	if (metrics)
+		audio::start_audio_metrics_reporter(metrics_format, metrics_path, metrics_interval_ms);
+	if (batch)
+	{
+		for (int i = playlist_begin - 1; i > 0 && i < playlist_end; ++i)
+		{
+			if (argv[i][0] != '-' || argv[i][1] != '-')
+				audio::expand_batch_pattern(argv[i], batch_paths);
+		}
+		batch_config.sink = sink_config;
+		batch_config.input = input_config;
+		int res = audio::run_batch_decode(batch_paths, batch_config) ? -1 : 0;
+		audio::stop_audio_metrics_reporter();
+		finish_trace(trace_path);
+		return res;
+	}
+	if (loudness_scan)
+	{
+		std::vector<std::string> loudness_paths;
+		for (int i = playlist_begin - 1; i > 0 && i < playlist_end; ++i)
+		{
+			if (argv[i][0] != '-' || argv[i][1] != '-')
+				audio::expand_batch_pattern(argv[i], loudness_paths);
+		}
+		loudness_config.input = input_config;
+		loudness_config.threads = batch_config.threads;
+		loudness_config.jobs = batch_config.jobs;
+		int res = audio::run_loudness_scan(loudness_paths, loudness_config) ? -1 : 0;
+		audio::stop_audio_metrics_reporter();
+		finish_trace(trace_path);
+		return res;
+	}
+	if (sound_bank)
+	{
+		std::vector<std::string> bank_paths;
+		for (int i = playlist_begin - 1; i > 0 && i < playlist_end; ++i)
+		{
+			if (argv[i][0] != '-' || argv[i][1] != '-')
+				bank_paths.push_back(argv[i]);
+		}
+		bank_config.sink = sink_config;
+		int res = audio::run_sound_bank_test(bank_paths, bank_config, bank_triggers);
+		audio::stop_audio_metrics_reporter();
+		finish_trace(trace_path);
+		return res;
+	}
+	// headless输出没有声卡可听，播放完毕后自动退出
+	bool headless = sink_config.type == audio::audio_sink_type::null
+		|| sink_config.type == audio::audio_sink_type::wav_file
+		|| sink_config.type == audio::audio_sink_type::raw_pcm_file;
+#if !defined(_WIN32)
+	headless = headless || sink_config.type == audio::audio_sink_type::platform_default;
+#endif
+
 	std::printf("info: audio decode/playback cli\n");
 	std::printf("info: decode frontend: avformat version %d, avcodec version %d, avutil version %d, swresample version %d\n",
 		avformat_version(),
 		avcodec_version(),
 		avutil_version(),
 		swresample_version());
-	std::printf("info: playback backend: xaudio2, version %s\n", audio::get_backend_implement_version());
-	std::printf("info: drag audio file into the console, or enter audio file path.\n");
-	::gets_s(s, 3000);
+	if (interactive)
+	{
+		std::printf("info: drag audio file into the console, or enter audio file path.\n");
+#if defined(_MSC_VER)
+		::gets_s(s, 3000);
+#else
+		if (!std::fgets(s, sizeof(s), stdin))
+			s[0] = '\0';
+		s[std::strcspn(s, "\r\n")] = '\0';
+#endif
+	}
 	size_t s_len = std::strlen(s);
-	if (s_len < 5)
+	if (std::strcmp(s, "-") == 0)
+		// 标准输入用于传输音频数据，不能再读取按键，播放完毕后自动退出
+		headless = true;
+	else if (s_len < 5)
 	{
 		std::printf("warn: not valid filename, playing test.flac by default\n");
 		strcpy(s, "test.flac");
@@ -34,31 +475,114 @@ int main()
 		s_1[s_len - 2] = '\0';
 		strcpy(s, s_1);
 	}
-	if (audio::load_audio_context(s))
+	// seek测试需要设备时钟在运行，flush与设备线程的回调才会交错
+	if (seek_test_count > 0 && headless && sink_config.clock_speed <= 0)
+		sink_config.clock_speed = 1.0;
+	// 由调用方读取文件，再以内存或回调的形式交给播放器，只用于第一首
+	audio::audio_input_config load_config = input_config;
+	std::vector<uint8_t> memory_input_data;
+	if (memory_input)
+	{
+		std::ifstream file(s, std::ios::binary);
+		memory_input_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		load_config.memory_data = memory_input_data.data();
+		load_config.memory_size = memory_input_data.size();
+	}
+	else if (callback_input)
+	{
+		auto file = std::make_shared<std::ifstream>(s, std::ios::binary);
+		if (*file)
+		{
+			load_config.read_callback = [file](uint8_t* buf, int buf_size) {
+				file->read(reinterpret_cast<char*>(buf), buf_size);
+				return static_cast<int>(file->gcount());
+				};
+		}
+	}
+	if (audio::load_audio_context(s, load_config))
 	{
 		std::printf("err: load_audio_context failed!\n");
+		audio::stop_audio_metrics_reporter();
+		finish_trace(trace_path);
 		return -1;
 	}
-	if (audio::initialize_audio_engine())
+	if (audio::initialize_audio_engine(sink_config))
 	{
 		std::printf("err: audio engine initialize failed!\n");
+		audio::release_audio_context();
+		audio::stop_audio_metrics_reporter();
+		finish_trace(trace_path);
 		return -1;
 	}
+	std::printf("info: playback backend: %s\n", audio::get_backend_implement_version());
+	// 输出格式确定之后再加入播放列表，预读线程可以同时准备好重采样器
+	for (int i = playlist_begin; i < playlist_end; ++i)
+	{
+		if (argv[i][0] != '-' || argv[i][1] != '-')
+			audio::enqueue_audio_file(argv[i], input_config);
+	}
 
-	std::printf("info: press enter to start playback.\n");
-	std::printf("info: during playback, press enter to stop playback.\n");
-	dummy_return_value = std::getchar();
+	int seek_test_result = 0;
+	if (headless && seek_test_count > 0)
+	{
+		// 每次seek都会flush输出，已提交的缓冲区须按顺序、恰好一次归还
+		audio::start_audio_playback();
+		uint32_t seed = 0x1234567u;
+		int seeks = 0;
+		for (; seeks < seek_test_count; ++seeks)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			double position = double(seed >> 8) / double(1 << 24) * 5.0;
+			if (audio::seek_audio_playback(position))
+				break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1 + seed % 7));
+		}
+		audio::wait_audio_playback();
+		audio::buffer_pool_stats pool_stats;
+		audio::get_output_buffer_pool_stats(pool_stats);
+		bool passed = seeks == seek_test_count && pool_stats.blocks_in_use == 0;
+		std::printf("%s: seek test %d/%d seeks, %u output buffer(s) still in use\n", passed ? "info" : "err",
+			seeks, seek_test_count, pool_stats.blocks_in_use);
+		seek_test_result = passed ? 0 : -1;
+	}
+	else if (headless)
+	{
+		audio::start_audio_playback();
+		audio::wait_audio_playback();
+	}
+	else
+	{
+		std::printf("info: press enter to start playback.\n");
+		std::printf("info: during playback, press enter to stop playback, or enter \"seek <seconds>\" to seek.\n");
+		dummy_return_value = std::getchar();
+		UNREFERENCED_PARAMETER(dummy_return_value);
 
-	audio::start_audio_playback();
-	dummy_return_value = std::getchar();
-	UNREFERENCED_PARAMETER(dummy_return_value);
+		audio::start_audio_playback();
+		while (std::fgets(s_1, sizeof(s_1), stdin))
+		{
+			double seek_seconds;
+			if (std::sscanf(s_1, "seek %lf", &seek_seconds) != 1)
+				break;
+			if (audio::seek_audio_playback(seek_seconds))
+				std::printf("warn: seek failed, playback is not running\n");
+		}
+	}
+	audio::audio_open_stats open_stats;
+	audio::get_audio_open_stats(open_stats);
+	if (open_stats.first_sample_us >= 0)
+		std::printf("info: time to first sample: open %.2fms, start to first submit %.2fms\n",
+			open_stats.total_us / 1000, open_stats.first_sample_us / 1000);
 	audio::uninitialize_audio_engine();
 	audio::release_audio_context();
+	audio::stop_audio_metrics_reporter();
+	finish_trace(trace_path);
 
+#if defined(_MSC_VER)
 	// check mem leak
 	_CrtSetReportMode(_CRT_WARN, _CRTDBG_MODE_DEBUG);
 	_CrtDumpMemoryLeaks();
-	return 0;
+#endif
+	return seek_test_result;
 }
 
 
@@ -1,14 +1,173 @@
+﻿#if !defined(FFMPEG_XAUDIO2_INTERNAL_HPP_)
+#define FFMPEG_XAUDIO2_INTERNAL_HPP_
 #include "audio_play_interface.hpp"
+#include "audio_worker_pool.hpp"
+#include <chrono>
+#include <string>
+#include <mutex>
+#include <deque>
+#include <functional>
 
 namespace audio
 {
-	extern AVFormatContext* format_context;
-	extern AVCodec* codec;
-	extern AVCodecContext* codec_context;
-	extern AVPacket* packet;
-	extern AVFrame* frame;
-	extern unsigned audio_stream_index;
-	extern AVIOContext* avio_context;
-	extern unsigned char* buffer;
-	extern bool file_stream_end;
-}
\ No newline at end of file
+	class audio_input_source;
+	// 解码器输出到输出格式的转换状态，由播放端创建与释放
+	struct sample_converter;
+	class audio_seek_index;
+	struct seek_index_scanner;
+	class audio_peak_builder;
+	struct audio_output_format;
+
+	// 一首曲目的输入、解析与解码状态
+	// 播放列表中的下一首在预读任务中打开，与当前曲目同时存在
+	struct audio_decoder_context
+	{
+		std::string path;
+		audio_input_source* input_source = nullptr;
+		AVIOContext* avio_context = nullptr;
+		// 流文件解析上下文
+		AVFormatContext* format_context = nullptr;
+		// 针对该文件，找到的解码器类型
+		AVCodec* codec = nullptr;
+		// 使用的解码器实例
+		AVCodecContext* codec_context = nullptr;
+		// 音频流编号
+		unsigned audio_stream_index = static_cast<unsigned>(-1); // inf
+		// 编码器延迟与尾部填充，单位为解码器采样率下的样本数（取自AVCodecParameters）
+		int initial_padding = 0;
+		int trailing_padding = 0;
+		sample_converter* converter = nullptr;
+		// read回调的次数与读取的字节数，只由正在使用avio的线程（打开时为打开者，之后为demux阶段）访问
+		uint64_t read_calls = 0;
+		uint64_t bytes_read = 0;
+		audio_open_stats open_stats;
+
+		// 以下仅由decode阶段访问：去除编码器延迟与填充的进度
+		// 解码器以AV_CODEC_FLAG2_SKIP_MANUAL打开，ffmpeg不自行裁剪，而是将需要裁剪的样本数附在帧上；
+		// 帧上没有裁剪信息时按initial_padding/trailing_padding裁剪
+		bool first_frame_pending = true;
+		bool discard_padding_seen = false;
+		int64_t skip_remaining = 0;
+		// 波形摘要，未启用时为nullptr；曲目解码完毕时写入文件并释放
+		audio_peak_builder* peak_builder = nullptr;
+
+		// 定位索引，格式自带完整索引或输入不可定位时为nullptr
+		audio_seek_index* seek_index = nullptr;
+		seek_index_scanner* seek_scanner = nullptr;
+		audio_seek_index_mode seek_index_mode = audio_seek_index_mode::disabled;
+		// 以下仅由demux阶段访问：按索引定位后packet的时间戳与位置不再记录，直到下一次按时间戳定位；
+		// 从头连续读到文件结束时索引才是完整的
+		bool seek_index_recording = true;
+		bool seek_index_contiguous = true;
+	};
+
+	// 打开、解析文件并打开解码器，失败时返回nullptr
+	// 定位索引的后台扫描在pool上运行，nullptr为默认线程池
+	audio_decoder_context* open_audio_decoder(const char* audio_filename, const audio_input_config& config,
+		audio_worker_pool* pool = nullptr);
+	// 同时释放其sample_converter
+	void close_audio_decoder(audio_decoder_context* decoder);
+	// 按帧上的AV_FRAME_DATA_SKIP_SAMPLES或initial_padding裁剪编码器延迟与容器标明的尾部样本，
+	// 返回false表示整帧都被裁掉；只移动数据指针，不复制
+	bool trim_decoded_frame(audio_decoder_context* decoder, AVFrame* frame);
+	void free_sample_converter(sample_converter* converter);
+	// 按解码器的输出确定native输出格式（输出端不支持的样本格式与声道数取最接近的支持格式）
+	void negotiate_output_format(const AVCodecContext* context, bool downmix_to_stereo,
+		audio_output_format& format, AVSampleFormat& sample_fmt);
+	// 普通文件的大小与修改时间，用于判断sidecar与缓存是否失效；不是普通文件时返回false
+	bool get_file_info(const char* path, uint64_t& file_size, int64_t& file_mtime);
+	// 文件大小，无法打开时返回0；管道等不能定位的文件也返回0
+	uint64_t get_file_size(const char* path);
+	// 先写path.tmp再改名替换path，其他进程不会读到写了一半的文件；失败时返回false并删除临时文件
+	bool write_file_replace(const std::string& path, const std::string& data);
+
+	// steady_clock的纳秒数，只用于计算时间差
+	inline int64_t now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// 按printf格式追加到out，单次最多511个字符
+	void append_format(std::string& out, const char* format, ...)
+#if defined(__GNUC__)
+		__attribute__((format(printf, 2, 3)))
+#endif
+		;
+
+	// sidecar与缓存文件中的定长字段，小端
+	template <typename T>
+	void write_field(std::string& out, T value)
+	{
+		for (size_t i = 0; i < sizeof(T); ++i)
+			out.push_back(char(uint8_t(uint64_t(value) >> (i * 8))));
+	}
+
+	template <typename T>
+	bool read_field(const uint8_t*& data, const uint8_t* end, T& value)
+	{
+		if (size_t(end - data) < sizeof(T))
+			return false;
+		uint64_t result = 0;
+		for (size_t i = 0; i < sizeof(T); ++i)
+			result |= uint64_t(data[i]) << (i * 8);
+		data += sizeof(T);
+		value = T(result);
+		return true;
+	}
+
+	// 一个播放器的播放列表：当前曲目播放期间，预读任务在线程池中打开、解析下一首并创建其转换状态，
+	// demux阶段读取完当前曲目后立即切换，曲目切换不再包含打开文件、avformat_find_stream_info与swr_init的耗时
+	class audio_playlist
+	{
+	public:
+		// prepare：按播放器的输出格式为曲目创建转换状态；on_ready：下一首打开完毕，在预读任务中调用
+		audio_playlist(audio_worker_pool* pool, std::function<int(audio_decoder_context*)> prepare,
+			std::function<void()> on_ready);
+		~audio_playlist();
+		audio_playlist(const audio_playlist&) = delete;
+		audio_playlist& operator=(const audio_playlist&) = delete;
+
+		int enqueue(const char* path, const audio_input_config& config);
+		// 移除尚未开始播放的曲目
+		void clear();
+		// 第一首曲目，输出格式按该曲目确定；替换并关闭此前的所有曲目
+		void set_current(audio_decoder_context* decoder);
+		// 当前在输出端播放的曲目
+		audio_decoder_context* current() const { return current_decoder; }
+		// 不阻塞：取出下一首已打开的曲目，取出的曲目进入待播放队列，直到输出阶段切换到该曲目
+		// 下一首仍在打开中时返回nullptr且pending为true，打开完毕后调用on_ready
+		audio_decoder_context* take_next(bool& pending);
+		// 输出阶段切换到待播放队列中的第一首，返回切换前的曲目，由调用者关闭
+		audio_decoder_context* advance();
+		// 等待预读任务结束并关闭所有曲目（包括当前曲目）
+		void release();
+
+	private:
+		struct pending_track
+		{
+			std::string path;
+			audio_input_config config;
+		};
+
+		void preroll_proc();
+
+		audio_worker_pool* pool;
+		std::function<int(audio_decoder_context*)> prepare;
+		std::function<void()> on_ready;
+		std::mutex mutex;
+		std::deque<pending_track> pending_tracks;
+		// 已打开、等待demux阶段取走的下一首，同一时刻最多一首
+		audio_decoder_context* prerolled_track = nullptr;
+		bool preroll_in_progress = false;
+		// clear时递增，丢弃清空之前开始打开的曲目
+		uint32_t generation = 0;
+		// demux阶段已切换到、输出阶段尚未播放到的曲目，按播放顺序排列
+		std::deque<audio_decoder_context*> upcoming_tracks;
+		// 只由输出阶段（或播放停止时）修改
+		audio_decoder_context* current_decoder = nullptr;
+		pool_task preroll_task;
+	};
+}
+
+#endif // FFMPEG_XAUDIO2_INTERNAL_HPP_
@@ -0,0 +1,414 @@
+﻿#include "audio_output_sink.hpp"
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+
+namespace audio
+{
+	// 无设备输出端的公共部分：模拟设备时钟
+	// clock_speed <= 0时不模拟时钟，submit_buffer中直接消耗数据，缓冲区立即播放完毕；
+	// 否则由模拟设备线程按 采样率*clock_speed 的速度逐个消耗缓冲区
+	class headless_output_sink : public audio_output_sink
+	{
+	public:
+		explicit headless_output_sink(double clock_speed) : clock_speed(clock_speed) {}
+
+		int open(const audio_output_format& format) override
+		{
+			this->format = format;
+			if (clock_speed > 0)
+			{
+				device_thread_exit = false;
+				device_thread = std::thread(&headless_output_sink::device_thread_proc, this);
+			}
+			return 0;
+		}
+
+		void close() override
+		{
+			if (device_thread.joinable())
+			{
+				{
+					std::lock_guard<std::mutex> lock(device_mutex);
+					device_thread_exit = true;
+				}
+				device_cv.notify_all();
+				callback_cv.notify_all();
+				device_thread.join();
+			}
+			pending_buffers.clear();
+			stream_end_pending = false;
+		}
+
+		int start() override
+		{
+			{
+				std::lock_guard<std::mutex> lock(device_mutex);
+				running = true;
+			}
+			device_cv.notify_all();
+			return 0;
+		}
+
+		void stop() override
+		{
+			std::lock_guard<std::mutex> lock(device_mutex);
+			running = false;
+		}
+
+		void flush() override
+		{
+			std::deque<pending_buffer> flushed_buffers;
+			{
+				std::unique_lock<std::mutex> lock(device_mutex);
+				flushed_buffers.swap(pending_buffers);
+				stream_end_pending = false;
+				flush_count++;
+				device_cv.notify_all();
+				// 模拟设备线程可能正在回调刚播放完的缓冲区，等其返回后再回调被丢弃的缓冲区，
+				// 回调不会在两个线程上同时执行，顺序与提交顺序一致；
+				// 也可能正在写出被丢弃的第一个缓冲区，回调之后该缓冲区即被重用，须等写出完成
+				callback_cv.wait(lock, [this] { return !callback_active && !consuming; });
+				callback_active = true;
+			}
+			// 与xaudio2一致，被丢弃的缓冲区同样回调on_buffer_end
+			if (callback)
+			{
+				for (auto& buffer : flushed_buffers)
+					callback->on_buffer_end(buffer.context);
+			}
+			{
+				std::lock_guard<std::mutex> lock(device_mutex);
+				callback_active = false;
+			}
+			callback_cv.notify_all();
+		}
+
+		int submit_buffer(const uint8_t* data, uint32_t bytes, void* buffer_context) override
+		{
+			if (clock_speed <= 0)
+			{
+				// 不模拟时钟：提交即播放完毕
+				if (consume_buffer(data, bytes))
+					return -1;
+				{
+					std::lock_guard<std::mutex> lock(device_mutex);
+					samples_played += bytes / format.block_align();
+				}
+				if (callback)
+					callback->on_buffer_end(buffer_context);
+				return 0;
+			}
+			{
+				std::lock_guard<std::mutex> lock(device_mutex);
+				pending_buffers.push_back({ data, bytes, buffer_context });
+			}
+			device_cv.notify_all();
+			return 0;
+		}
+
+		void end_of_stream() override
+		{
+			{
+				std::lock_guard<std::mutex> lock(device_mutex);
+				if (!pending_buffers.empty())
+				{
+					// 由模拟设备线程在队列耗尽时回调
+					stream_end_pending = true;
+					return;
+				}
+			}
+			if (callback)
+				callback->on_stream_end();
+		}
+
+		void get_state(audio_sink_state& state) override
+		{
+			std::lock_guard<std::mutex> lock(device_mutex);
+			state.buffers_queued = static_cast<uint32_t>(pending_buffers.size());
+			state.samples_played = samples_played;
+		}
+
+	protected:
+		// 设备“播放”一个缓冲区：写文件或直接丢弃
+		virtual int consume_buffer(const uint8_t* data, uint32_t bytes) = 0;
+
+		audio_output_format format;
+		double clock_speed;
+
+	private:
+		struct pending_buffer
+		{
+			const uint8_t* data;
+			uint32_t bytes;
+			void* context;
+		};
+
+		void device_thread_proc()
+		{
+			using clock = std::chrono::steady_clock;
+			std::unique_lock<std::mutex> lock(device_mutex);
+			// 下一个缓冲区开始播放的时间点，按缓冲区时长累加，避免误差累积
+			clock::time_point next_deadline = clock::now();
+			bool starved = true;
+			while (true)
+			{
+				device_cv.wait(lock, [this] {
+					return device_thread_exit || (running && !pending_buffers.empty());
+					});
+				if (device_thread_exit)
+					break;
+
+				// 缓冲区曾被耗尽（或刚开始播放），从当前时刻重新计时
+				if (starved)
+				{
+					next_deadline = clock::now();
+					starved = false;
+				}
+
+				pending_buffer current = pending_buffers.front();
+				uint64_t current_flush_count = flush_count;
+				uint32_t frames = current.bytes / format.block_align();
+				next_deadline += std::chrono::duration_cast<clock::duration>(
+					std::chrono::duration<double>(frames / (format.sample_rate * clock_speed)));
+
+				consuming = true;
+				lock.unlock();
+				consume_buffer(current.data, current.bytes);
+				lock.lock();
+				consuming = false;
+				callback_cv.notify_all();
+
+				// 等到该缓冲区“播放”完毕；期间可能被stop/flush/close打断
+				device_cv.wait_until(lock, next_deadline, [this, current_flush_count] {
+					return device_thread_exit || flush_count != current_flush_count;
+					});
+				if (device_thread_exit)
+					break;
+				// flush正在回调被丢弃的缓冲区时，等其完成后再判断current是否已被丢弃；
+				// 此后直到设置callback_active一直持有锁，flush不会插入到两者之间
+				callback_cv.wait(lock, [this] { return device_thread_exit || !callback_active; });
+				if (device_thread_exit)
+					break;
+				if (flush_count != current_flush_count)
+				{
+					// 已被flush丢弃，flush中已回调
+					if (pending_buffers.empty())
+						starved = true;
+					continue;
+				}
+				pending_buffers.pop_front();
+				samples_played += frames;
+				bool stream_ended = false;
+				if (pending_buffers.empty())
+				{
+					starved = true;
+					stream_ended = stream_end_pending;
+					stream_end_pending = false;
+				}
+
+				callback_active = true;
+				// 回调中可能提交新的缓冲区，不能持有锁
+				lock.unlock();
+				if (callback)
+				{
+					callback->on_buffer_end(current.context);
+					if (stream_ended)
+						callback->on_stream_end();
+				}
+				lock.lock();
+				callback_active = false;
+				callback_cv.notify_all();
+			}
+		}
+
+		std::thread device_thread;
+		std::mutex device_mutex;
+		std::condition_variable device_cv;
+		// 回调on_buffer_end/on_stream_end期间为true，模拟设备线程与flush依次回调
+		std::condition_variable callback_cv;
+		bool callback_active = false;
+		// consume_buffer期间为true，flush等其完成后才能回调（归还）该缓冲区
+		bool consuming = false;
+		std::deque<pending_buffer> pending_buffers;
+		uint64_t samples_played = 0;
+		uint64_t flush_count = 0;
+		bool running = false;
+		bool stream_end_pending = false;
+		bool device_thread_exit = false;
+	};
+
+	class null_output_sink : public headless_output_sink
+	{
+	public:
+		explicit null_output_sink(double clock_speed) : headless_output_sink(clock_speed) {}
+		~null_output_sink() override { close(); }
+
+		const char* get_name() const override
+		{
+			return clock_speed > 0 ? "null, simulated clock" : "null, free running";
+		}
+
+	protected:
+		int consume_buffer(const uint8_t*, uint32_t) override
+		{
+			return 0;
+		}
+	};
+
+	// 将pcm写入文件，可选写入wav文件头
+	class file_output_sink : public headless_output_sink
+	{
+	public:
+		file_output_sink(const char* output_path, bool write_wav_header, double clock_speed)
+			: headless_output_sink(clock_speed), output_path(output_path), write_wav_header(write_wav_header) {}
+		~file_output_sink() override { close(); }
+
+		int open(const audio_output_format& format) override
+		{
+			if (!output_path)
+			{
+				std::printf("err: no output path specified for file output\n");
+				return -1;
+			}
+			output_file = std::fopen(output_path, "wb");
+			if (!output_file)
+			{
+				std::printf("err: open output file %s failed\n", output_path);
+				return -1;
+			}
+			this->format = format;
+			if (write_wav_header)
+				write_header(0);
+			return headless_output_sink::open(format);
+		}
+
+		void close() override
+		{
+			headless_output_sink::close();
+			if (output_file)
+			{
+				if (write_wav_header)
+				{
+					// 回填文件头中的数据长度
+					std::fseek(output_file, 0, SEEK_SET);
+					write_header(data_bytes);
+				}
+				std::fclose(output_file);
+				output_file = nullptr;
+			}
+		}
+
+		const char* get_name() const override
+		{
+			if (write_wav_header)
+				return clock_speed > 0 ? "wav file, simulated clock" : "wav file, free running";
+			return clock_speed > 0 ? "raw pcm file, simulated clock" : "raw pcm file, free running";
+		}
+
+	protected:
+		int consume_buffer(const uint8_t* data, uint32_t bytes) override
+		{
+			if (std::fwrite(data, 1, bytes, output_file) != bytes)
+			{
+				std::printf("err: write output file failed\n");
+				return -1;
+			}
+			data_bytes += bytes;
+			return 0;
+		}
+
+	private:
+		void write_u16(uint16_t value)
+		{
+			uint8_t bytes[2] = { uint8_t(value), uint8_t(value >> 8) };
+			std::fwrite(bytes, 1, sizeof(bytes), output_file);
+		}
+
+		void write_u32(uint32_t value)
+		{
+			uint8_t bytes[4] = { uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16), uint8_t(value >> 24) };
+			std::fwrite(bytes, 1, sizeof(bytes), output_file);
+		}
+
+		void write_header(uint64_t data_size)
+		{
+			bool extensible = format.needs_extensible();
+			uint32_t fmt_size = extensible ? 40 : 16;
+			// riff的长度字段只有32位，超出部分截断
+			uint32_t data_size_32 = data_size > 0xFFFFFFFFull - 64 ? 0xFFFFFFFFu - 64 : uint32_t(data_size);
+
+			std::fwrite("RIFF", 1, 4, output_file);
+			write_u32(4 + (8 + fmt_size) + 8 + data_size_32);
+			std::fwrite("WAVE", 1, 4, output_file);
+			std::fwrite("fmt ", 1, 4, output_file);
+			write_u32(fmt_size);
+			write_u16(extensible ? 0xFFFE : (format.is_float ? 3 : 1));
+			write_u16(uint16_t(format.channels));
+			write_u32(uint32_t(format.sample_rate));
+			write_u32(uint32_t(format.sample_rate * format.block_align()));
+			write_u16(uint16_t(format.block_align()));
+			write_u16(uint16_t(format.bits_per_sample));
+			if (extensible)
+			{
+				write_u16(22);
+				write_u16(uint16_t(format.bits_per_sample));
+				write_u32(format.effective_channel_mask());
+				// KSDATAFORMAT_SUBTYPE_PCM / KSDATAFORMAT_SUBTYPE_IEEE_FLOAT
+				static const uint8_t subformat_tail[14] = {
+					0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+				};
+				write_u16(format.is_float ? 3 : 1);
+				std::fwrite(subformat_tail, 1, sizeof(subformat_tail), output_file);
+			}
+			std::fwrite("data", 1, 4, output_file);
+			write_u32(data_size_32);
+		}
+
+		const char* output_path;
+		bool write_wav_header;
+		std::FILE* output_file = nullptr;
+		uint64_t data_bytes = 0;
+	};
+
+	audio_output_sink* create_null_output_sink(double clock_speed)
+	{
+		return DBG_NEW null_output_sink(clock_speed);
+	}
+
+	audio_output_sink* create_file_output_sink(const char* output_path, bool write_wav_header, double clock_speed)
+	{
+		return DBG_NEW file_output_sink(output_path, write_wav_header, clock_speed);
+	}
+
+	audio_output_sink* create_output_sink(const audio_sink_config& config)
+	{
+		switch (config.type)
+		{
+		case audio_sink_type::platform_default:
+#if defined(_WIN32)
+			return create_xaudio2_output_sink();
+#else
+			return create_null_output_sink(config.clock_speed);
+#endif
+		case audio_sink_type::xaudio2:
+#if defined(_WIN32)
+			return create_xaudio2_output_sink();
+#else
+			std::printf("err: xaudio2 output is only available on windows\n");
+			return nullptr;
+#endif
+		case audio_sink_type::null:
+			return create_null_output_sink(config.clock_speed);
+		case audio_sink_type::wav_file:
+			return create_file_output_sink(config.output_path, true, config.clock_speed);
+		case audio_sink_type::raw_pcm_file:
+			return create_file_output_sink(config.output_path, false, config.clock_speed);
+		}
+		return nullptr;
+	}
+}
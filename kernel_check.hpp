@@ -0,0 +1,51 @@
+﻿#if !defined(KERNEL_CHECK_HPP_)
+#define KERNEL_CHECK_HPP_
+#include <cstdint>
+#include <cstdio>
+
+// 各模块SIMD内核自检共用的测试数据与结果统计，只由*_check.cpp包含
+namespace audio
+{
+	// 奇数长度，覆盖各实现的尾部处理
+	constexpr int kernel_check_frames = 4099;
+
+	// 线性同余，同一种子在各平台上生成相同的测试数据
+	inline uint32_t next_check_random(uint32_t& seed)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		return seed;
+	}
+
+	// [-1, 1)上的float，取高24位
+	inline float random_check_float(uint32_t& seed)
+	{
+		return float(next_check_random(seed) >> 8) / float(1 << 24) * 2.0f - 1.0f;
+	}
+
+	// 逐项打印info/err并统计失败数，finish打印汇总
+	class kernel_check_report
+	{
+	public:
+		template <typename... Args>
+		void operator()(bool passed, const char* format, Args... args)
+		{
+			std::printf("%s: ", passed ? "info" : "err");
+			std::printf(format, args...);
+			std::printf("\n");
+			if (!passed)
+				failures++;
+		}
+
+		// 返回非0表示存在失败
+		int finish(const char* name) const
+		{
+			std::printf("info: %s selftest %s, %d failure(s)\n", name, failures ? "failed" : "passed", failures);
+			return failures ? -1 : 0;
+		}
+
+	private:
+		int failures = 0;
+	};
+}
+
+#endif // KERNEL_CHECK_HPP_
@@ -0,0 +1,100 @@
+﻿#include "pcm_buffer_pool.hpp"
+#include "audio_metrics.hpp"
+#include "audio_trace.hpp"
+#include <cstdio>
+
+namespace audio
+{
+	int pcm_buffer_pool::initialize(uint32_t block_size, uint32_t block_count)
+	{
+		uninitialize();
+		if (block_size == 0 || block_count == 0)
+			return -1;
+
+		uint32_t rounded_count = 1;
+		while (rounded_count < block_count)
+			rounded_count <<= 1;
+		this->block_size = (block_size + block_alignment - 1) / block_alignment * block_alignment;
+		this->block_count = rounded_count;
+
+		// av_malloc保证的对齐不低于平台SIMD要求
+		arena = reinterpret_cast<uint8_t*>(av_malloc(size_t(this->block_size) * this->block_count));
+		if (!arena)
+		{
+			std::printf("err: allocate pcm buffer pool failed, block_size=%u, block_count=%u\n",
+				this->block_size, this->block_count);
+			this->block_size = 0;
+			this->block_count = 0;
+			return -1;
+		}
+		free_blocks = DBG_NEW spsc_ring<uint8_t*>(this->block_count);
+		for (uint32_t i = 0; i < this->block_count; ++i)
+			free_blocks->try_push(arena + size_t(i) * this->block_size);
+
+		hits = 0; misses = 0; blocks_in_use = 0; high_water_mark = 0;
+		std::printf("info: pcm buffer pool initialized, block_size=%u, block_count=%u\n",
+			this->block_size, this->block_count);
+		return 0;
+	}
+
+	void pcm_buffer_pool::uninitialize()
+	{
+		if (free_blocks)
+		{
+			delete free_blocks;
+			free_blocks = nullptr;
+		}
+		if (arena)
+		{
+			av_free(arena);
+			arena = nullptr;
+		}
+		block_size = 0;
+		block_count = 0;
+	}
+
+	uint8_t* pcm_buffer_pool::acquire(uint32_t bytes)
+	{
+		uint8_t* block = nullptr;
+		if (bytes <= block_size && free_blocks->try_pop(block))
+		{
+			hits.fetch_add(1, std::memory_order_relaxed);
+			get_audio_metrics().add(metric_counter::buffer_pool_hits);
+		}
+		else
+		{
+			misses.fetch_add(1, std::memory_order_relaxed);
+			get_audio_metrics().add(metric_counter::buffer_pool_misses);
+			AUDIO_TRACE_VERBOSE_INSTANT(output, "buffer pool miss", bytes);
+			block = reinterpret_cast<uint8_t*>(av_malloc(bytes));
+			if (!block)
+				return nullptr;
+		}
+		// 只有acquire一方写high_water_mark
+		uint32_t in_use = blocks_in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+		if (in_use > high_water_mark.load(std::memory_order_relaxed))
+			high_water_mark.store(in_use, std::memory_order_relaxed);
+		return block;
+	}
+
+	void pcm_buffer_pool::release(uint8_t* block)
+	{
+		if (!block)
+			return;
+		blocks_in_use.fetch_sub(1, std::memory_order_relaxed);
+		if (owns(block))
+			free_blocks->try_push(block);
+		else
+			av_free(block);
+	}
+
+	void pcm_buffer_pool::get_stats(buffer_pool_stats& stats) const
+	{
+		stats.block_size = block_size;
+		stats.block_count = block_count;
+		stats.hits = hits.load(std::memory_order_relaxed);
+		stats.misses = misses.load(std::memory_order_relaxed);
+		stats.blocks_in_use = blocks_in_use.load(std::memory_order_relaxed);
+		stats.high_water_mark = high_water_mark.load(std::memory_order_relaxed);
+	}
+}
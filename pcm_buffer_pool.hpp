@@ -0,0 +1,53 @@
+﻿#if !defined(PCM_BUFFER_POOL_HPP_)
+#define PCM_BUFFER_POOL_HPP_
+#include "audio_play_interface.hpp"
+#include "spsc_ring.hpp"
+#include <atomic>
+
+namespace audio
+{
+	// 预分配的pcm缓冲区池
+	// 所有块在initialize时从一块对齐的连续内存(arena)中切出，稳态下acquire/release不分配内存，
+	// 复用时也不清零；acquire与release可以分别在两个线程中调用（单生产者/单消费者）
+	class pcm_buffer_pool
+	{
+	public:
+		// 块的起始地址与大小均按此对齐，满足SIMD对齐加载的要求
+		static constexpr uint32_t block_alignment = 64;
+
+		pcm_buffer_pool() = default;
+		~pcm_buffer_pool() { uninitialize(); }
+		pcm_buffer_pool(const pcm_buffer_pool&) = delete;
+		pcm_buffer_pool& operator=(const pcm_buffer_pool&) = delete;
+
+		// block_count会向上取整为2的幂
+		int initialize(uint32_t block_size, uint32_t block_count);
+		void uninitialize();
+
+		// 取得一个至少bytes字节的块
+		// 池中没有空闲块或块大小不足时（miss），从堆上单独分配，release时释放
+		uint8_t* acquire(uint32_t bytes);
+		void release(uint8_t* block);
+
+		uint32_t get_block_size() const { return block_size; }
+		void get_stats(buffer_pool_stats& stats) const;
+
+	private:
+		bool owns(const uint8_t* block) const
+		{
+			return block >= arena && block < arena + size_t(block_size) * block_count;
+		}
+
+		uint8_t* arena = nullptr;
+		uint32_t block_size = 0;
+		uint32_t block_count = 0;
+		spsc_ring<uint8_t*>* free_blocks = nullptr;
+
+		std::atomic<uint64_t> hits{ 0 };
+		std::atomic<uint64_t> misses{ 0 };
+		std::atomic<uint32_t> blocks_in_use{ 0 };
+		std::atomic<uint32_t> high_water_mark{ 0 };
+	};
+}
+
+#endif // PCM_BUFFER_POOL_HPP_
@@ -0,0 +1,80 @@
+﻿#if !defined(PIPELINE_QUEUE_HPP_)
+#define PIPELINE_QUEUE_HPP_
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <cstddef>
+
+namespace audio
+{
+	// 流水线各阶段之间的有界队列
+	// 各阶段是线程池上的任务，使用不阻塞的try_push/try_pop：失败时返回，由相邻阶段重新调度，逐级形成反压；
+	// 停止流水线时设置stop_requested并等待各阶段的任务空闲，之后用try_pop取出剩余的元素释放
+	// push只用于回收空闲元素的队列，其容量不小于元素总数，实际不会阻塞
+	template <typename T>
+	class pipeline_queue
+	{
+	public:
+		explicit pipeline_queue(size_t capacity) : items(capacity) {}
+		pipeline_queue(const pipeline_queue&) = delete;
+		pipeline_queue& operator=(const pipeline_queue&) = delete;
+
+		bool push(const T& item)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			not_full.wait(lock, [this] { return count < items.size(); });
+			items[(head + count) % items.size()] = item;
+			count++;
+			return true;
+		}
+
+		// 不阻塞，队列已满时返回false
+		bool try_push(const T& item)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (count == items.size())
+				return false;
+			items[(head + count) % items.size()] = item;
+			count++;
+			return true;
+		}
+
+		// 不阻塞，队列为空时返回false
+		bool try_pop(T& item)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (count == 0)
+				return false;
+			item = items[head];
+			head = (head + 1) % items.size();
+			count--;
+			lock.unlock();
+			not_full.notify_one();
+			return true;
+		}
+
+		void reset()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			head = 0;
+			count = 0;
+		}
+
+		size_t size()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return count;
+		}
+
+		size_t capacity() const { return items.size(); }
+
+	private:
+		std::mutex mutex;
+		std::condition_variable not_full;
+		std::vector<T> items;
+		size_t head = 0;
+		size_t count = 0;
+	};
+}
+
+#endif // PIPELINE_QUEUE_HPP_
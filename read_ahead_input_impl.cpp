@@ -0,0 +1,309 @@
+﻿#include "audio_input_source.hpp"
+#include "audio_trace.hpp"
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+namespace audio
+{
+	// 预读输入：i/o线程从inner中读取数据填充环形缓冲区，read只从缓冲区中复制
+	// inner只在持有io_mutex时访问；i/o线程从计算写入区域到提交数据全程持有io_mutex，
+	// seek/调整窗口时先取得io_mutex，因此不会与正在进行的读取交错
+	class read_ahead_input_source : public audio_input_source
+	{
+	public:
+		read_ahead_input_source(audio_input_source* inner, size_t window_bytes)
+			: inner(inner), capacity(window_bytes)
+		{
+			ring_buffer = DBG_NEW uint8_t[capacity];
+			length = inner->seek(0, AVSEEK_SIZE);
+			io_thread = std::thread(&read_ahead_input_source::io_thread_proc, this);
+		}
+
+		~read_ahead_input_source() override
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				io_thread_exit = true;
+			}
+			space_cv.notify_all();
+			io_thread.join();
+			if (stall_count)
+				std::printf("info: read ahead stalled %llu times\n", static_cast<unsigned long long>(stall_count));
+			delete[] ring_buffer;
+			delete inner;
+		}
+
+		int read(uint8_t* buf, int buf_size) override
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (write_index == read_index && !inner_eof)
+			{
+				// 预读没有跟上，解码线程只能等待i/o
+				stall_count++;
+				AUDIO_TRACE_SCOPE(read, "read ahead stall");
+				data_cv.wait(lock, [this] { return write_index != read_index || inner_eof; });
+			}
+			if (write_index == read_index)
+				return inner_error ? inner_error : AVERROR_EOF;
+
+			int copied = 0;
+			while (copied < buf_size && write_index != read_index)
+			{
+				size_t offset = read_index % capacity;
+				size_t chunk = write_index - read_index;
+				if (chunk > capacity - offset) chunk = capacity - offset;
+				if (chunk > size_t(buf_size - copied)) chunk = size_t(buf_size - copied);
+				// [read_index, write_index)只由本线程读取，i/o线程不会写入，复制时无需持锁
+				lock.unlock();
+				std::memcpy(buf + copied, ring_buffer + offset, chunk);
+				lock.lock();
+				read_index += chunk;
+				position += chunk;
+				copied += static_cast<int>(chunk);
+			}
+			lock.unlock();
+			space_cv.notify_one();
+			return copied;
+		}
+
+		int64_t seek(int64_t offset, int whence) override
+		{
+			if (whence & AVSEEK_SIZE)
+				return length;
+			whence &= ~AVSEEK_FORCE;
+			std::lock_guard<std::mutex> io_lock(io_mutex);
+			std::unique_lock<std::mutex> lock(mutex);
+			int64_t target;
+			switch (whence)
+			{
+			case SEEK_SET: target = offset; break;
+			case SEEK_CUR: target = position + offset; break;
+			case SEEK_END:
+				if (length < 0)
+					return -1;
+				target = length + offset;
+				break;
+			default: return -1;
+			}
+
+			// 目标仍在已预读的窗口内，直接跳过中间的数据
+			size_t buffered = write_index - read_index;
+			if (target >= position && target <= position + int64_t(buffered))
+			{
+				read_index += size_t(target - position);
+				position = target;
+				lock.unlock();
+				space_cv.notify_one();
+				return position;
+			}
+
+			// 取消当前窗口，从目标位置重新预读
+			int64_t res = inner->seek(target, SEEK_SET);
+			if (res < 0)
+				return res;
+			position = res;
+			read_index = write_index = 0;
+			inner_eof = false;
+			inner_error = 0;
+			hinted_until = 0;
+			lock.unlock();
+			space_cv.notify_one();
+			return position;
+		}
+
+		bool is_seekable() const override { return inner->is_seekable(); }
+
+		void prefetch_hint(int64_t offset, int64_t hint_length) override
+		{
+			std::lock_guard<std::mutex> io_lock(io_mutex);
+			inner->prefetch_hint(offset, hint_length);
+		}
+
+		void set_read_ahead_window(size_t window_bytes) override
+		{
+			std::lock_guard<std::mutex> io_lock(io_mutex);
+			std::unique_lock<std::mutex> lock(mutex);
+			size_t buffered = write_index - read_index;
+			if (window_bytes < buffered)
+				window_bytes = buffered;
+			if (window_bytes == capacity)
+				return;
+			// 保留已预读的数据，线性化到新缓冲区的开头
+			uint8_t* new_buffer = DBG_NEW uint8_t[window_bytes];
+			for (size_t i = 0; i < buffered;)
+			{
+				size_t offset = (read_index + i) % capacity;
+				size_t chunk = buffered - i;
+				if (chunk > capacity - offset) chunk = capacity - offset;
+				std::memcpy(new_buffer + i, ring_buffer + offset, chunk);
+				i += chunk;
+			}
+			delete[] ring_buffer;
+			ring_buffer = new_buffer;
+			capacity = window_bytes;
+			read_index = 0;
+			write_index = buffered;
+			std::printf("info: read ahead window set to %zu bytes\n", capacity);
+			lock.unlock();
+			space_cv.notify_one();
+		}
+
+		const char* get_name() const override
+		{
+			static thread_local char name[64];
+			std::snprintf(name, sizeof(name), "%s, read ahead", inner->get_name());
+			return name;
+		}
+
+	private:
+		// 每次从inner读取的最大字节数，也决定了seek最多需要等待多久
+		static constexpr size_t max_read_chunk = 64 * 1024;
+
+		void io_thread_proc()
+		{
+			set_audio_trace_thread_name("read ahead");
+			while (true)
+			{
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					space_cv.wait(lock, [this] {
+						return io_thread_exit || (!inner_eof && write_index - read_index < capacity);
+						});
+					if (io_thread_exit)
+						break;
+				}
+
+				std::lock_guard<std::mutex> io_lock(io_mutex);
+				uint8_t* dest;
+				size_t chunk;
+				int64_t inner_position;
+				{
+					// 等待期间可能发生了seek或窗口调整，重新计算写入区域
+					std::lock_guard<std::mutex> lock(mutex);
+					if (io_thread_exit)
+						break;
+					size_t buffered = write_index - read_index;
+					if (inner_eof || buffered >= capacity)
+						continue;
+					size_t offset = write_index % capacity;
+					chunk = capacity - buffered;
+					if (chunk > capacity - offset) chunk = capacity - offset;
+					if (chunk > max_read_chunk) chunk = max_read_chunk;
+					dest = ring_buffer + offset;
+					inner_position = position + int64_t(buffered);
+				}
+
+				// 预读窗口推进过半时，提示内核提前读入下一个窗口
+				if (inner_position + int64_t(capacity / 2) >= hinted_until)
+				{
+					inner->prefetch_hint(inner_position, int64_t(capacity));
+					hinted_until = inner_position + int64_t(capacity);
+				}
+
+				int res;
+				{
+					AUDIO_TRACE_SCOPE(read, "read ahead fill");
+					res = inner->read(dest, static_cast<int>(chunk));
+				}
+
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (res > 0)
+						write_index += size_t(res);
+					else
+					{
+						inner_eof = true;
+						if (res != AVERROR_EOF)
+							inner_error = res;
+					}
+				}
+				data_cv.notify_one();
+			}
+		}
+
+		audio_input_source* inner;
+		int64_t length = -1;
+
+		std::thread io_thread;
+		std::mutex io_mutex;
+		std::mutex mutex;
+		std::condition_variable data_cv;
+		std::condition_variable space_cv;
+
+		// 以下由mutex保护；read_index/write_index为单调递增的字节计数
+		uint8_t* ring_buffer;
+		size_t capacity;
+		size_t read_index = 0;
+		size_t write_index = 0;
+		// read_index处对应的文件位置
+		int64_t position = 0;
+		bool inner_eof = false;
+		int inner_error = 0;
+		bool io_thread_exit = false;
+		uint64_t stall_count = 0;
+
+		// 仅由i/o线程在持有io_mutex时访问
+		int64_t hinted_until = 0;
+	};
+
+	// 限速输入，每次最多读取约20ms的数据并按速率休眠
+	class throttled_input_source : public audio_input_source
+	{
+	public:
+		throttled_input_source(audio_input_source* inner, size_t bytes_per_second)
+			: inner(inner), bytes_per_second(bytes_per_second) {}
+		~throttled_input_source() override { delete inner; }
+
+		int read(uint8_t* buf, int buf_size) override
+		{
+			using clock = std::chrono::steady_clock;
+			if (budget_bytes == 0)
+				start_time = clock::now();
+			size_t max_chunk = bytes_per_second / 50;
+			if (max_chunk < 512) max_chunk = 512;
+			if (size_t(buf_size) > max_chunk)
+				buf_size = static_cast<int>(max_chunk);
+			int res = inner->read(buf, buf_size);
+			if (res > 0)
+			{
+				budget_bytes += size_t(res);
+				std::this_thread::sleep_until(start_time + std::chrono::duration_cast<clock::duration>(
+					std::chrono::duration<double>(double(budget_bytes) / bytes_per_second)));
+			}
+			return res;
+		}
+
+		int64_t seek(int64_t offset, int whence) override { return inner->seek(offset, whence); }
+		bool is_seekable() const override { return inner->is_seekable(); }
+		void prefetch_hint(int64_t offset, int64_t hint_length) override { inner->prefetch_hint(offset, hint_length); }
+
+		const char* get_name() const override
+		{
+			static thread_local char name[64];
+			std::snprintf(name, sizeof(name), "%s, throttled", inner->get_name());
+			return name;
+		}
+
+	private:
+		audio_input_source* inner;
+		size_t bytes_per_second;
+		size_t budget_bytes = 0;
+		std::chrono::steady_clock::time_point start_time;
+	};
+
+	audio_input_source* create_read_ahead_input_source(audio_input_source* inner, size_t window_bytes)
+	{
+		if (window_bytes < 4096)
+			window_bytes = 4096;
+		return DBG_NEW read_ahead_input_source(inner, window_bytes);
+	}
+
+	audio_input_source* create_throttled_input_source(audio_input_source* inner, size_t bytes_per_second)
+	{
+		return DBG_NEW throttled_input_source(inner, bytes_per_second);
+	}
+}
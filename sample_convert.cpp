@@ -0,0 +1,185 @@
+﻿#include "sample_convert.hpp"
+#include <cmath>
+#if defined(SAMPLE_CONVERT_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace audio
+{
+	template <typename T>
+	static void interleave_scalar(T* dest, const T* const* src, int channels, int samples)
+	{
+		for (int i = 0; i < samples; ++i)
+			for (int ch = 0; ch < channels; ++ch)
+				*dest++ = src[ch][i];
+	}
+
+	static void interleave_16_scalar(int16_t* dest, const int16_t* const* src, int channels, int samples)
+	{
+		interleave_scalar(dest, src, channels, samples);
+	}
+
+	static void interleave_32_scalar(int32_t* dest, const int32_t* const* src, int channels, int samples)
+	{
+		interleave_scalar(dest, src, channels, samples);
+	}
+
+	static inline uint32_t xorshift32(uint32_t& state)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	// 取随机数的高23位作为[1, 2)之间的float，两者之差即为(-1, 1)上的三角分布
+	static inline float tpdf_noise(uint32_t& state)
+	{
+		union { uint32_t u; float f; } a, b;
+		a.u = (xorshift32(state) >> 9) | 0x3F800000u;
+		b.u = (xorshift32(state) >> 9) | 0x3F800000u;
+		return a.f - b.f;
+	}
+
+	static void float_to_s16_scalar(int16_t* dest, const float* const* src, int channels, int samples, tpdf_dither* dither)
+	{
+		for (int i = 0; i < samples; ++i)
+		{
+			for (int ch = 0; ch < channels; ++ch)
+			{
+				float value = src[ch][i] * 32768.0f;
+				if (dither)
+					value += tpdf_noise(dither->state[0]);
+				// 先在float上饱和，避免超出int范围
+				value = value < -32768.0f ? -32768.0f : (value > 32767.0f ? 32767.0f : value);
+				*dest++ = static_cast<int16_t>(std::lrintf(value));
+			}
+		}
+	}
+
+	static void s32_to_s16_scalar(int16_t* dest, const int32_t* const* src, int channels, int samples)
+	{
+		for (int i = 0; i < samples; ++i)
+			for (int ch = 0; ch < channels; ++ch)
+				*dest++ = static_cast<int16_t>(src[ch][i] >> 16);
+	}
+
+	static void downmix_to_stereo_scalar(float* dest, const float* const* src, int channels, int samples,
+		const downmix_coefficients& coefficients)
+	{
+		for (int i = 0; i < samples; ++i)
+		{
+			float center = src[2][i] * coefficients.center;
+			float left = src[0][i] * coefficients.front + center;
+			float right = src[1][i] * coefficients.front + center;
+			// src[3]为LFE
+			for (int ch = 4; ch + 1 < channels; ch += 2)
+			{
+				left += src[ch][i] * coefficients.surround;
+				right += src[ch + 1][i] * coefficients.surround;
+			}
+			*dest++ = left;
+			*dest++ = right;
+		}
+	}
+
+	const sample_convert_kernels& get_scalar_sample_convert_kernels()
+	{
+		static const sample_convert_kernels kernels = {
+			"scalar",
+			interleave_16_scalar,
+			interleave_32_scalar,
+			float_to_s16_scalar,
+			s32_to_s16_scalar,
+			downmix_to_stereo_scalar
+		};
+		return kernels;
+	}
+
+#if defined(SAMPLE_CONVERT_X86)
+	static void cpuid(int leaf, int subleaf, unsigned regs[4])
+	{
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuidex(info, leaf, subleaf);
+		for (int i = 0; i < 4; ++i)
+			regs[i] = static_cast<unsigned>(info[i]);
+#else
+		__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	}
+
+	bool cpu_has_sse2()
+	{
+		unsigned regs[4];
+		cpuid(1, 0, regs);
+		return (regs[3] & (1u << 26)) != 0;
+	}
+
+	bool cpu_has_avx2()
+	{
+		unsigned regs[4];
+		cpuid(0, 0, regs);
+		if (regs[0] < 7)
+			return false;
+		cpuid(1, 0, regs);
+		// 需要操作系统保存ymm寄存器（OSXSAVE且XCR0的bit 1、2均置位）
+		if (!(regs[2] & (1u << 27)) || !(regs[2] & (1u << 28)))
+			return false;
+#if defined(_MSC_VER)
+		unsigned long long xcr0 = _xgetbv(0);
+#else
+		unsigned eax, edx;
+		__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		unsigned long long xcr0 = (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+		if ((xcr0 & 6) != 6)
+			return false;
+		cpuid(7, 0, regs);
+		return (regs[1] & (1u << 5)) != 0;
+	}
+#endif
+
+	int get_available_sample_convert_kernels(const sample_convert_kernels** kernels, int max_count)
+	{
+		int count = 0;
+		auto add = [&](const sample_convert_kernels* candidate) {
+			if (candidate && count < max_count)
+				kernels[count++] = candidate;
+		};
+		add(&get_scalar_sample_convert_kernels());
+#if defined(SAMPLE_CONVERT_X86)
+		if (cpu_has_sse2())
+			add(get_sse2_sample_convert_kernels());
+		if (cpu_has_avx2())
+			add(get_avx2_sample_convert_kernels());
+#endif
+#if defined(SAMPLE_CONVERT_NEON)
+		// aarch64上neon总是可用
+		add(get_neon_sample_convert_kernels());
+#endif
+		return count;
+	}
+
+	const sample_convert_kernels& get_sample_convert_kernels()
+	{
+		static const sample_convert_kernels* best = [] {
+			const sample_convert_kernels* kernels[4];
+			int count = get_available_sample_convert_kernels(kernels, 4);
+			return kernels[count - 1];
+		}();
+		return *best;
+	}
+
+	bool is_stereo_downmix_layout(const AVChannelLayout& layout)
+	{
+		if (layout.order != AV_CHANNEL_ORDER_NATIVE)
+			return false;
+		return layout.u.mask == AV_CH_LAYOUT_5POINT1 || layout.u.mask == AV_CH_LAYOUT_5POINT1_BACK
+			|| layout.u.mask == AV_CH_LAYOUT_7POINT1;
+	}
+}
@@ -0,0 +1,86 @@
+﻿#if !defined(SAMPLE_CONVERT_HPP_)
+#define SAMPLE_CONVERT_HPP_
+#include "audio_play_interface.hpp"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SAMPLE_CONVERT_X86
+#endif
+// 只在aarch64上启用neon：vcvtnq_s32_f32（就近舍入）为armv8指令
+#if defined(_M_ARM64) || defined(__aarch64__)
+#define SAMPLE_CONVERT_NEON
+#endif
+
+// 各模块的SIMD实现共用：不要求整个文件以-mavx2编译，函数只在运行时检测（cpu_has_*）通过后调用
+#if defined(SAMPLE_CONVERT_X86)
+#if defined(__GNUC__) || defined(__clang__)
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define SSE2_TARGET
+#define AVX2_TARGET
+#endif
+#endif
+
+namespace audio
+{
+	// TPDF抖动的随机数状态，每个SIMD通道一个xorshift32
+	struct tpdf_dither
+	{
+		uint32_t state[8] = { 0x9E3779B9u, 0x7F4A7C15u, 0x85EBCA6Bu, 0xC2B2AE35u,
+			0x27D4EB2Fu, 0x165667B1u, 0xD3A2646Cu, 0xFD7046C5u };
+	};
+
+	// 5.1/7.1下混到立体声的系数：L = front * FL + center * FC + surround * (SL + BL)，R同理，LFE丢弃
+	struct downmix_coefficients
+	{
+		float front = 1.0f;
+		float center = 0.70710678f;
+		float surround = 0.70710678f;
+	};
+
+	// 一组样本转换内核；src为每个声道一个平面，dest为交错存储
+	// 交错存储的输入等同于samples * channels个样本的单个平面，以channels = 1调用即可
+	struct sample_convert_kernels
+	{
+		const char* name;
+		// 平面 -> 交错，样本类型不变；32-bit同时用于s32与float
+		void (*interleave_16)(int16_t* dest, const int16_t* const* src, int channels, int samples);
+		void (*interleave_32)(int32_t* dest, const int32_t* const* src, int channels, int samples);
+		// 平面float -> 交错s16，与swresample一致：lrintf(x * 32768)并饱和；dither非空时加入±1 LSB的TPDF抖动
+		void (*float_to_s16)(int16_t* dest, const float* const* src, int channels, int samples, tpdf_dither* dither);
+		// 平面s32 -> 交错s16，与swresample一致：取高16位
+		void (*s32_to_s16)(int16_t* dest, const int32_t* const* src, int channels, int samples);
+		// 平面float 5.1/7.1（FL FR FC LFE之后为成对的环绕声道）-> 交错立体声float
+		void (*downmix_to_stereo)(float* dest, const float* const* src, int channels, int samples,
+			const downmix_coefficients& coefficients);
+	};
+
+	const sample_convert_kernels& get_scalar_sample_convert_kernels();
+	// 未编译对应实现时返回nullptr，不检查cpu是否支持
+	const sample_convert_kernels* get_sse2_sample_convert_kernels();
+	const sample_convert_kernels* get_avx2_sample_convert_kernels();
+	const sample_convert_kernels* get_neon_sample_convert_kernels();
+
+	// 当前cpu上可运行的实现，按从慢到快的顺序写入kernels，返回个数
+	int get_available_sample_convert_kernels(const sample_convert_kernels** kernels, int max_count);
+	// 当前cpu上最快的实现，第一次调用时检测
+	const sample_convert_kernels& get_sample_convert_kernels();
+
+#if defined(SAMPLE_CONVERT_X86)
+	// 运行时检测，其他模块的SIMD实现也据此选择
+	bool cpu_has_sse2();
+	// 同时检查操作系统是否保存ymm寄存器
+	bool cpu_has_avx2();
+#endif
+
+	// 下混内核可以处理的声道布局
+	bool is_stereo_downmix_layout(const AVChannelLayout& layout);
+
+	// 逐个实现与swresample对比输出，整数输出要求一致（抖动为±1 LSB），float输出要求误差在1e-5以内
+	// 返回非0表示存在超出误差的实现
+	int run_sample_convert_selftest();
+	// 测量每个实现中各内核以及swresample的吞吐量（样本/秒）
+	void run_sample_convert_benchmark();
+}
+
+#endif // SAMPLE_CONVERT_HPP_
@@ -0,0 +1,210 @@
+﻿#include "sample_convert.hpp"
+#include "kernel_check.hpp"
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <functional>
+
+namespace audio
+{
+	// 一次自检/基准测试中用到的一种转换
+	struct convert_case
+	{
+		const char* name;
+		AVSampleFormat in_fmt;  // 平面格式，mono时等同于交错格式
+		AVChannelLayout in_layout;
+		AVSampleFormat out_fmt;
+		AVChannelLayout out_layout;
+		bool dither;
+	};
+
+	static const convert_case convert_cases[] = {
+		{ "interleave s16p->s16 2ch", AV_SAMPLE_FMT_S16P, AV_CHANNEL_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, AV_CHANNEL_LAYOUT_STEREO, false },
+		{ "interleave s16p->s16 6ch", AV_SAMPLE_FMT_S16P, AV_CHANNEL_LAYOUT_5POINT1, AV_SAMPLE_FMT_S16, AV_CHANNEL_LAYOUT_5POINT1, false },
+		{ "interleave fltp->flt 2ch", AV_SAMPLE_FMT_FLTP, AV_CHANNEL_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, AV_CHANNEL_LAYOUT_STEREO, false },
+		{ "fltp->s16 2ch", AV_SAMPLE_FMT_FLTP, AV_CHANNEL_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, AV_CHANNEL_LAYOUT_STEREO, false },
+		{ "flt->s16 1ch", AV_SAMPLE_FMT_FLTP, AV_CHANNEL_LAYOUT_MONO, AV_SAMPLE_FMT_S16, AV_CHANNEL_LAYOUT_MONO, false },
+		{ "fltp->s16 2ch tpdf", AV_SAMPLE_FMT_FLTP, AV_CHANNEL_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, AV_CHANNEL_LAYOUT_STEREO, true },
+		{ "s32p->s16 2ch", AV_SAMPLE_FMT_S32P, AV_CHANNEL_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, AV_CHANNEL_LAYOUT_STEREO, false },
+		{ "downmix fltp 5.1->flt 2ch", AV_SAMPLE_FMT_FLTP, AV_CHANNEL_LAYOUT_5POINT1, AV_SAMPLE_FMT_FLT, AV_CHANNEL_LAYOUT_STEREO, false },
+		{ "downmix fltp 7.1->flt 2ch", AV_SAMPLE_FMT_FLTP, AV_CHANNEL_LAYOUT_7POINT1, AV_SAMPLE_FMT_FLT, AV_CHANNEL_LAYOUT_STEREO, false },
+	};
+
+	// 测试数据：每个声道一个平面；float取[-1.2, 1.2]以覆盖饱和
+	class convert_test_data
+	{
+	public:
+		explicit convert_test_data(const convert_case& test_case)
+			: test_case(test_case), channels(test_case.in_layout.nb_channels)
+		{
+			uint32_t seed = 0x12345678u;
+			for (int ch = 0; ch < channels; ++ch)
+			{
+				planes[ch] = reinterpret_cast<uint8_t*>(av_malloc(size_t(kernel_check_frames) * 4));
+				for (int i = 0; i < kernel_check_frames; ++i)
+				{
+					switch (test_case.in_fmt)
+					{
+					case AV_SAMPLE_FMT_S16P: reinterpret_cast<int16_t*>(planes[ch])[i] = int16_t(next_check_random(seed) >> 16); break;
+					case AV_SAMPLE_FMT_S32P: reinterpret_cast<int32_t*>(planes[ch])[i] = int32_t(next_check_random(seed)); break;
+					default: reinterpret_cast<float*>(planes[ch])[i] = random_check_float(seed) * 1.2f; break;
+					}
+				}
+			}
+			out_channels = test_case.out_layout.nb_channels;
+			out_bytes = size_t(kernel_check_frames) * out_channels * av_get_bytes_per_sample(test_case.out_fmt);
+		}
+
+		~convert_test_data()
+		{
+			for (int ch = 0; ch < channels; ++ch)
+				av_free(planes[ch]);
+		}
+
+		// 用kernels中对应的内核转换，dest至少out_bytes字节
+		void run_kernel(const sample_convert_kernels& kernels, uint8_t* dest, tpdf_dither* dither) const
+		{
+			const void* const* src = reinterpret_cast<const void* const*>(planes);
+			if (test_case.out_layout.nb_channels != channels)
+				kernels.downmix_to_stereo(reinterpret_cast<float*>(dest), reinterpret_cast<const float* const*>(src),
+					channels, kernel_check_frames, downmix_coefficients());
+			else if (test_case.in_fmt == AV_SAMPLE_FMT_FLTP && test_case.out_fmt == AV_SAMPLE_FMT_S16)
+				kernels.float_to_s16(reinterpret_cast<int16_t*>(dest), reinterpret_cast<const float* const*>(src),
+					channels, kernel_check_frames, test_case.dither ? dither : nullptr);
+			else if (test_case.in_fmt == AV_SAMPLE_FMT_S32P)
+				kernels.s32_to_s16(reinterpret_cast<int16_t*>(dest), reinterpret_cast<const int32_t* const*>(src), channels, kernel_check_frames);
+			else if (test_case.in_fmt == AV_SAMPLE_FMT_S16P)
+				kernels.interleave_16(reinterpret_cast<int16_t*>(dest), reinterpret_cast<const int16_t* const*>(src), channels, kernel_check_frames);
+			else
+				kernels.interleave_32(reinterpret_cast<int32_t*>(dest), reinterpret_cast<const int32_t* const*>(src), channels, kernel_check_frames);
+		}
+
+		// swresample的参考输出；swr为nullptr时先创建
+		int run_swr(SwrContext*& swr, uint8_t* dest) const
+		{
+			if (!swr)
+			{
+				// 输入为单声道时平面与交错格式相同
+				swr_alloc_set_opts2(&swr, &test_case.out_layout, test_case.out_fmt, 48000,
+					&test_case.in_layout, test_case.in_fmt, 48000, 0, nullptr);
+				if (!swr || swr_init(swr) < 0)
+					return -1;
+			}
+			return swr_convert(swr, &dest, kernel_check_frames, const_cast<const uint8_t**>(planes), kernel_check_frames);
+		}
+
+		const convert_case& test_case;
+		int channels;
+		int out_channels;
+		size_t out_bytes;
+		uint8_t* planes[8] = {};
+	};
+
+	// 返回最大误差，整数格式以LSB为单位
+	static double max_difference(AVSampleFormat fmt, const uint8_t* a, const uint8_t* b, size_t count)
+	{
+		double max_diff = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			double diff;
+			if (fmt == AV_SAMPLE_FMT_S16)
+				diff = std::fabs(double(reinterpret_cast<const int16_t*>(a)[i]) - reinterpret_cast<const int16_t*>(b)[i]);
+			else if (fmt == AV_SAMPLE_FMT_S32)
+				diff = std::fabs(double(reinterpret_cast<const int32_t*>(a)[i]) - reinterpret_cast<const int32_t*>(b)[i]);
+			else
+				diff = std::fabs(double(reinterpret_cast<const float*>(a)[i]) - reinterpret_cast<const float*>(b)[i]);
+			if (diff > max_diff)
+				max_diff = diff;
+		}
+		return max_diff;
+	}
+
+	int run_sample_convert_selftest()
+	{
+		const sample_convert_kernels* kernels[4];
+		int kernel_count = get_available_sample_convert_kernels(kernels, 4);
+		kernel_check_report report;
+		for (const auto& test_case : convert_cases)
+		{
+			convert_test_data data(test_case);
+			uint8_t* reference = reinterpret_cast<uint8_t*>(av_malloc(data.out_bytes));
+			uint8_t* output = reinterpret_cast<uint8_t*>(av_malloc(data.out_bytes));
+			SwrContext* swr = nullptr;
+			// 参考输出始终不加抖动
+			int res = data.run_swr(swr, reference);
+			swr_free(&swr);
+			if (res != kernel_check_frames)
+				report(false, "swr reference for %s failed (%d)", test_case.name, res);
+			else
+			{
+				// 抖动允许±1 LSB，float允许1e-5的累加误差
+				double tolerance = test_case.dither ? 1.0 : (test_case.out_fmt == AV_SAMPLE_FMT_FLT ? 1e-5 : 0.0);
+				size_t count = size_t(kernel_check_frames) * data.out_channels;
+				for (int k = 0; k < kernel_count; ++k)
+				{
+					tpdf_dither dither;
+					data.run_kernel(*kernels[k], output, &dither);
+					double diff = max_difference(test_case.out_fmt, reference, output, count);
+					report(diff <= tolerance, "%-28s %-6s max diff=%g", test_case.name, kernels[k]->name, diff);
+				}
+			}
+			av_free(reference);
+			av_free(output);
+		}
+		return report.finish("sample convert");
+	}
+
+	// 重复执行run直到超过约0.25秒，返回每秒处理的单声道样本数
+	static double measure_samples_per_second(const std::function<void()>& run)
+	{
+		using clock = std::chrono::steady_clock;
+		run(); // 预热
+		uint64_t iterations = 0;
+		auto begin = clock::now();
+		double elapsed = 0;
+		do
+		{
+			for (int i = 0; i < 16; ++i)
+				run();
+			iterations += 16;
+			elapsed = std::chrono::duration<double>(clock::now() - begin).count();
+		} while (elapsed < 0.25);
+		return double(iterations) * kernel_check_frames / elapsed;
+	}
+
+	void run_sample_convert_benchmark()
+	{
+		const sample_convert_kernels* kernels[4];
+		int kernel_count = get_available_sample_convert_kernels(kernels, 4);
+		std::printf("info: sample convert benchmark, %d samples per call, Msamples/s (all channels)\n", kernel_check_frames);
+		std::printf("%-28s %10s", "conversion", "swr");
+		for (int k = 0; k < kernel_count; ++k)
+			std::printf(" %10s", kernels[k]->name);
+		std::printf("\n");
+		for (const auto& test_case : convert_cases)
+		{
+			convert_test_data data(test_case);
+			uint8_t* output = reinterpret_cast<uint8_t*>(av_malloc(data.out_bytes));
+			SwrContext* swr = nullptr;
+			if (data.run_swr(swr, output) < 0)
+			{
+				std::printf("%-28s %10s\n", test_case.name, "n/a");
+				swr_free(&swr);
+				av_free(output);
+				continue;
+			}
+			std::printf("%-28s %10.1f", test_case.name,
+				measure_samples_per_second([&] { data.run_swr(swr, output); }) * test_case.in_layout.nb_channels / 1e6);
+			swr_free(&swr);
+			tpdf_dither dither;
+			for (int k = 0; k < kernel_count; ++k)
+			{
+				std::printf(" %10.1f", measure_samples_per_second([&] { data.run_kernel(*kernels[k], output, &dither); })
+					* test_case.in_layout.nb_channels / 1e6);
+			}
+			std::printf("\n");
+			av_free(output);
+		}
+	}
+}
@@ -0,0 +1,605 @@
+﻿#include "sample_convert.hpp"
+#include <cstring>
+#if defined(SAMPLE_CONVERT_X86)
+#include <immintrin.h>
+#endif
+#if defined(SAMPLE_CONVERT_NEON)
+#include <arm_neon.h>
+#endif
+
+// 单声道（含交错输入）与立体声使用SIMD，其余声道数以及不足一个向量的尾部交给标量实现
+// 下混的运算顺序与标量实现一致
+
+namespace audio
+{
+	// 从第offset个样本开始，用标量实现处理剩余的样本
+	template <typename D, typename S>
+	static inline void stereo_tail(void (*kernel)(D*, const S* const*, int, int), D* dest, const S* const* src, int offset, int samples)
+	{
+		if (offset >= samples)
+			return;
+		const S* tail_src[2] = { src[0] + offset, src[1] + offset };
+		kernel(dest + 2 * offset, tail_src, 2, samples - offset);
+	}
+
+#if defined(SAMPLE_CONVERT_X86)
+	// ---- SSE2 ----
+
+	SSE2_TARGET static inline __m128i xorshift32_sse2(__m128i x)
+	{
+		x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+		return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	}
+
+	SSE2_TARGET static inline __m128 tpdf_noise_sse2(__m128i& state)
+	{
+		const __m128i one = _mm_set1_epi32(0x3F800000);
+		state = xorshift32_sse2(state);
+		__m128 a = _mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(state, 9), one));
+		state = xorshift32_sse2(state);
+		__m128 b = _mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(state, 9), one));
+		return _mm_sub_ps(a, b);
+	}
+
+	// 8个float -> 8个s16
+	SSE2_TARGET static inline __m128i float8_to_s16_sse2(const float* src, __m128i* dither_state)
+	{
+		const __m128 scale = _mm_set1_ps(32768.0f);
+		const __m128 min_value = _mm_set1_ps(-32768.0f);
+		const __m128 max_value = _mm_set1_ps(32767.0f);
+		__m128 x0 = _mm_mul_ps(_mm_loadu_ps(src), scale);
+		__m128 x1 = _mm_mul_ps(_mm_loadu_ps(src + 4), scale);
+		if (dither_state)
+		{
+			x0 = _mm_add_ps(x0, tpdf_noise_sse2(*dither_state));
+			x1 = _mm_add_ps(x1, tpdf_noise_sse2(*dither_state));
+		}
+		x0 = _mm_min_ps(_mm_max_ps(x0, min_value), max_value);
+		x1 = _mm_min_ps(_mm_max_ps(x1, min_value), max_value);
+		// cvtps2dq按mxcsr就近舍入，与lrintf一致
+		return _mm_packs_epi32(_mm_cvtps_epi32(x0), _mm_cvtps_epi32(x1));
+	}
+
+	SSE2_TARGET static inline __m128i s32x8_to_s16_sse2(const int32_t* src)
+	{
+		__m128i x0 = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src)), 16);
+		__m128i x1 = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4)), 16);
+		return _mm_packs_epi32(x0, x1);
+	}
+
+	SSE2_TARGET static inline void store_stereo_s16_sse2(int16_t* dest, __m128i left, __m128i right)
+	{
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_unpacklo_epi16(left, right));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 8), _mm_unpackhi_epi16(left, right));
+	}
+
+	SSE2_TARGET static void interleave_16_sse2(int16_t* dest, const int16_t* const* src, int channels, int samples)
+	{
+		if (channels == 1)
+		{
+			std::memcpy(dest, src[0], size_t(samples) * sizeof(int16_t));
+			return;
+		}
+		if (channels != 2)
+		{
+			get_scalar_sample_convert_kernels().interleave_16(dest, src, channels, samples);
+			return;
+		}
+		int i = 0;
+		for (; i + 8 <= samples; i += 8)
+		{
+			__m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[0] + i));
+			__m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[1] + i));
+			store_stereo_s16_sse2(dest + 2 * i, left, right);
+		}
+		stereo_tail(get_scalar_sample_convert_kernels().interleave_16, dest, src, i, samples);
+	}
+
+	SSE2_TARGET static void interleave_32_sse2(int32_t* dest, const int32_t* const* src, int channels, int samples)
+	{
+		if (channels == 1)
+		{
+			std::memcpy(dest, src[0], size_t(samples) * sizeof(int32_t));
+			return;
+		}
+		if (channels != 2)
+		{
+			get_scalar_sample_convert_kernels().interleave_32(dest, src, channels, samples);
+			return;
+		}
+		int i = 0;
+		for (; i + 4 <= samples; i += 4)
+		{
+			__m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[0] + i));
+			__m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[1] + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 2 * i), _mm_unpacklo_epi32(left, right));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 2 * i + 4), _mm_unpackhi_epi32(left, right));
+		}
+		stereo_tail(get_scalar_sample_convert_kernels().interleave_32, dest, src, i, samples);
+	}
+
+	SSE2_TARGET static void float_to_s16_sse2(int16_t* dest, const float* const* src, int channels, int samples, tpdf_dither* dither)
+	{
+		auto scalar = get_scalar_sample_convert_kernels().float_to_s16;
+		if (channels > 2)
+		{
+			scalar(dest, src, channels, samples, dither);
+			return;
+		}
+		__m128i state = dither ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(dither->state)) : _mm_setzero_si128();
+		__m128i* state_ptr = dither ? &state : nullptr;
+		int i = 0;
+		if (channels == 1)
+		{
+			for (; i + 8 <= samples; i += 8)
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), float8_to_s16_sse2(src[0] + i, state_ptr));
+			const float* tail_src = src[0] + i;
+			if (i < samples)
+				scalar(dest + i, &tail_src, 1, samples - i, dither);
+		}
+		else
+		{
+			for (; i + 8 <= samples; i += 8)
+			{
+				__m128i left = float8_to_s16_sse2(src[0] + i, state_ptr);
+				__m128i right = float8_to_s16_sse2(src[1] + i, state_ptr);
+				store_stereo_s16_sse2(dest + 2 * i, left, right);
+			}
+			const float* tail_src[2] = { src[0] + i, src[1] + i };
+			if (i < samples)
+				scalar(dest + 2 * i, tail_src, 2, samples - i, dither);
+		}
+		if (dither)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dither->state), state);
+	}
+
+	SSE2_TARGET static void s32_to_s16_sse2(int16_t* dest, const int32_t* const* src, int channels, int samples)
+	{
+		auto scalar = get_scalar_sample_convert_kernels().s32_to_s16;
+		if (channels > 2)
+		{
+			scalar(dest, src, channels, samples);
+			return;
+		}
+		int i = 0;
+		if (channels == 1)
+		{
+			for (; i + 8 <= samples; i += 8)
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), s32x8_to_s16_sse2(src[0] + i));
+			const int32_t* tail_src = src[0] + i;
+			if (i < samples)
+				scalar(dest + i, &tail_src, 1, samples - i);
+			return;
+		}
+		for (; i + 8 <= samples; i += 8)
+			store_stereo_s16_sse2(dest + 2 * i, s32x8_to_s16_sse2(src[0] + i), s32x8_to_s16_sse2(src[1] + i));
+		stereo_tail(scalar, dest, src, i, samples);
+	}
+
+	SSE2_TARGET static void downmix_to_stereo_sse2(float* dest, const float* const* src, int channels, int samples,
+		const downmix_coefficients& coefficients)
+	{
+		const __m128 front = _mm_set1_ps(coefficients.front);
+		const __m128 center_gain = _mm_set1_ps(coefficients.center);
+		const __m128 surround = _mm_set1_ps(coefficients.surround);
+		int i = 0;
+		for (; i + 4 <= samples; i += 4)
+		{
+			__m128 center = _mm_mul_ps(_mm_loadu_ps(src[2] + i), center_gain);
+			__m128 left = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src[0] + i), front), center);
+			__m128 right = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src[1] + i), front), center);
+			for (int ch = 4; ch + 1 < channels; ch += 2)
+			{
+				left = _mm_add_ps(left, _mm_mul_ps(_mm_loadu_ps(src[ch] + i), surround));
+				right = _mm_add_ps(right, _mm_mul_ps(_mm_loadu_ps(src[ch + 1] + i), surround));
+			}
+			_mm_storeu_ps(dest + 2 * i, _mm_unpacklo_ps(left, right));
+			_mm_storeu_ps(dest + 2 * i + 4, _mm_unpackhi_ps(left, right));
+		}
+		if (i < samples)
+		{
+			const float* tail_src[8];
+			for (int ch = 0; ch < channels && ch < 8; ++ch)
+				tail_src[ch] = src[ch] + i;
+			get_scalar_sample_convert_kernels().downmix_to_stereo(dest + 2 * i, tail_src, channels, samples - i, coefficients);
+		}
+	}
+
+	const sample_convert_kernels* get_sse2_sample_convert_kernels()
+	{
+		static const sample_convert_kernels kernels = {
+			"sse2",
+			interleave_16_sse2,
+			interleave_32_sse2,
+			float_to_s16_sse2,
+			s32_to_s16_sse2,
+			downmix_to_stereo_sse2
+		};
+		return &kernels;
+	}
+
+	// ---- AVX2 ----
+	// 256-bit的unpack/pack只在各自的128-bit半边内进行，之后需要跨半边重排
+
+	AVX2_TARGET static inline __m256i xorshift32_avx2(__m256i x)
+	{
+		x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+		x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+		return _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+	}
+
+	AVX2_TARGET static inline __m256 tpdf_noise_avx2(__m256i& state)
+	{
+		const __m256i one = _mm256_set1_epi32(0x3F800000);
+		state = xorshift32_avx2(state);
+		__m256 a = _mm256_castsi256_ps(_mm256_or_si256(_mm256_srli_epi32(state, 9), one));
+		state = xorshift32_avx2(state);
+		__m256 b = _mm256_castsi256_ps(_mm256_or_si256(_mm256_srli_epi32(state, 9), one));
+		return _mm256_sub_ps(a, b);
+	}
+
+	// 16个float -> 按顺序排列的16个s16
+	AVX2_TARGET static inline __m256i float16_to_s16_avx2(const float* src, __m256i* dither_state)
+	{
+		const __m256 scale = _mm256_set1_ps(32768.0f);
+		const __m256 min_value = _mm256_set1_ps(-32768.0f);
+		const __m256 max_value = _mm256_set1_ps(32767.0f);
+		__m256 x0 = _mm256_mul_ps(_mm256_loadu_ps(src), scale);
+		__m256 x1 = _mm256_mul_ps(_mm256_loadu_ps(src + 8), scale);
+		if (dither_state)
+		{
+			x0 = _mm256_add_ps(x0, tpdf_noise_avx2(*dither_state));
+			x1 = _mm256_add_ps(x1, tpdf_noise_avx2(*dither_state));
+		}
+		x0 = _mm256_min_ps(_mm256_max_ps(x0, min_value), max_value);
+		x1 = _mm256_min_ps(_mm256_max_ps(x1, min_value), max_value);
+		__m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(x0), _mm256_cvtps_epi32(x1));
+		return _mm256_permute4x64_epi64(packed, 0xD8);
+	}
+
+	AVX2_TARGET static inline __m256i s32x16_to_s16_avx2(const int32_t* src)
+	{
+		__m256i x0 = _mm256_srai_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src)), 16);
+		__m256i x1 = _mm256_srai_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 8)), 16);
+		return _mm256_permute4x64_epi64(_mm256_packs_epi32(x0, x1), 0xD8);
+	}
+
+	AVX2_TARGET static inline void store_stereo_s16_avx2(int16_t* dest, __m256i left, __m256i right)
+	{
+		__m256i lo = _mm256_unpacklo_epi16(left, right);
+		__m256i hi = _mm256_unpackhi_epi16(left, right);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	AVX2_TARGET static void interleave_16_avx2(int16_t* dest, const int16_t* const* src, int channels, int samples)
+	{
+		if (channels != 2)
+		{
+			interleave_16_sse2(dest, src, channels, samples);
+			return;
+		}
+		int i = 0;
+		for (; i + 16 <= samples; i += 16)
+		{
+			__m256i left = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src[0] + i));
+			__m256i right = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src[1] + i));
+			store_stereo_s16_avx2(dest + 2 * i, left, right);
+		}
+		stereo_tail(get_scalar_sample_convert_kernels().interleave_16, dest, src, i, samples);
+	}
+
+	AVX2_TARGET static void interleave_32_avx2(int32_t* dest, const int32_t* const* src, int channels, int samples)
+	{
+		if (channels != 2)
+		{
+			interleave_32_sse2(dest, src, channels, samples);
+			return;
+		}
+		int i = 0;
+		for (; i + 8 <= samples; i += 8)
+		{
+			__m256i left = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src[0] + i));
+			__m256i right = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src[1] + i));
+			__m256i lo = _mm256_unpacklo_epi32(left, right);
+			__m256i hi = _mm256_unpackhi_epi32(left, right);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 2 * i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+		}
+		stereo_tail(get_scalar_sample_convert_kernels().interleave_32, dest, src, i, samples);
+	}
+
+	AVX2_TARGET static void float_to_s16_avx2(int16_t* dest, const float* const* src, int channels, int samples, tpdf_dither* dither)
+	{
+		auto scalar = get_scalar_sample_convert_kernels().float_to_s16;
+		if (channels > 2)
+		{
+			scalar(dest, src, channels, samples, dither);
+			return;
+		}
+		__m256i state = dither ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dither->state)) : _mm256_setzero_si256();
+		__m256i* state_ptr = dither ? &state : nullptr;
+		int i = 0;
+		if (channels == 1)
+		{
+			for (; i + 16 <= samples; i += 16)
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i), float16_to_s16_avx2(src[0] + i, state_ptr));
+			const float* tail_src = src[0] + i;
+			if (i < samples)
+				scalar(dest + i, &tail_src, 1, samples - i, dither);
+		}
+		else
+		{
+			for (; i + 16 <= samples; i += 16)
+			{
+				__m256i left = float16_to_s16_avx2(src[0] + i, state_ptr);
+				__m256i right = float16_to_s16_avx2(src[1] + i, state_ptr);
+				store_stereo_s16_avx2(dest + 2 * i, left, right);
+			}
+			const float* tail_src[2] = { src[0] + i, src[1] + i };
+			if (i < samples)
+				scalar(dest + 2 * i, tail_src, 2, samples - i, dither);
+		}
+		if (dither)
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(dither->state), state);
+	}
+
+	AVX2_TARGET static void s32_to_s16_avx2(int16_t* dest, const int32_t* const* src, int channels, int samples)
+	{
+		auto scalar = get_scalar_sample_convert_kernels().s32_to_s16;
+		if (channels > 2)
+		{
+			scalar(dest, src, channels, samples);
+			return;
+		}
+		int i = 0;
+		if (channels == 1)
+		{
+			for (; i + 16 <= samples; i += 16)
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i), s32x16_to_s16_avx2(src[0] + i));
+			const int32_t* tail_src = src[0] + i;
+			if (i < samples)
+				scalar(dest + i, &tail_src, 1, samples - i);
+			return;
+		}
+		for (; i + 16 <= samples; i += 16)
+			store_stereo_s16_avx2(dest + 2 * i, s32x16_to_s16_avx2(src[0] + i), s32x16_to_s16_avx2(src[1] + i));
+		stereo_tail(scalar, dest, src, i, samples);
+	}
+
+	AVX2_TARGET static void downmix_to_stereo_avx2(float* dest, const float* const* src, int channels, int samples,
+		const downmix_coefficients& coefficients)
+	{
+		const __m256 front = _mm256_set1_ps(coefficients.front);
+		const __m256 center_gain = _mm256_set1_ps(coefficients.center);
+		const __m256 surround = _mm256_set1_ps(coefficients.surround);
+		int i = 0;
+		for (; i + 8 <= samples; i += 8)
+		{
+			__m256 center = _mm256_mul_ps(_mm256_loadu_ps(src[2] + i), center_gain);
+			__m256 left = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(src[0] + i), front), center);
+			__m256 right = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(src[1] + i), front), center);
+			for (int ch = 4; ch + 1 < channels; ch += 2)
+			{
+				left = _mm256_add_ps(left, _mm256_mul_ps(_mm256_loadu_ps(src[ch] + i), surround));
+				right = _mm256_add_ps(right, _mm256_mul_ps(_mm256_loadu_ps(src[ch + 1] + i), surround));
+			}
+			__m256 lo = _mm256_unpacklo_ps(left, right);
+			__m256 hi = _mm256_unpackhi_ps(left, right);
+			_mm256_storeu_ps(dest + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+			_mm256_storeu_ps(dest + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+		}
+		if (i < samples)
+		{
+			const float* tail_src[8];
+			for (int ch = 0; ch < channels && ch < 8; ++ch)
+				tail_src[ch] = src[ch] + i;
+			get_scalar_sample_convert_kernels().downmix_to_stereo(dest + 2 * i, tail_src, channels, samples - i, coefficients);
+		}
+	}
+
+	const sample_convert_kernels* get_avx2_sample_convert_kernels()
+	{
+		static const sample_convert_kernels kernels = {
+			"avx2",
+			interleave_16_avx2,
+			interleave_32_avx2,
+			float_to_s16_avx2,
+			s32_to_s16_avx2,
+			downmix_to_stereo_avx2
+		};
+		return &kernels;
+	}
+#else
+	const sample_convert_kernels* get_sse2_sample_convert_kernels() { return nullptr; }
+	const sample_convert_kernels* get_avx2_sample_convert_kernels() { return nullptr; }
+#endif // SAMPLE_CONVERT_X86
+
+#if defined(SAMPLE_CONVERT_NEON)
+	// ---- NEON ----
+
+	static inline uint32x4_t xorshift32_neon(uint32x4_t x)
+	{
+		x = veorq_u32(x, vshlq_n_u32(x, 13));
+		x = veorq_u32(x, vshrq_n_u32(x, 17));
+		return veorq_u32(x, vshlq_n_u32(x, 5));
+	}
+
+	static inline float32x4_t tpdf_noise_neon(uint32x4_t& state)
+	{
+		const uint32x4_t one = vdupq_n_u32(0x3F800000u);
+		state = xorshift32_neon(state);
+		float32x4_t a = vreinterpretq_f32_u32(vorrq_u32(vshrq_n_u32(state, 9), one));
+		state = xorshift32_neon(state);
+		float32x4_t b = vreinterpretq_f32_u32(vorrq_u32(vshrq_n_u32(state, 9), one));
+		return vsubq_f32(a, b);
+	}
+
+	static inline int16x8_t float8_to_s16_neon(const float* src, uint32x4_t* dither_state)
+	{
+		const float32x4_t min_value = vdupq_n_f32(-32768.0f);
+		const float32x4_t max_value = vdupq_n_f32(32767.0f);
+		float32x4_t x0 = vmulq_n_f32(vld1q_f32(src), 32768.0f);
+		float32x4_t x1 = vmulq_n_f32(vld1q_f32(src + 4), 32768.0f);
+		if (dither_state)
+		{
+			x0 = vaddq_f32(x0, tpdf_noise_neon(*dither_state));
+			x1 = vaddq_f32(x1, tpdf_noise_neon(*dither_state));
+		}
+		x0 = vminq_f32(vmaxq_f32(x0, min_value), max_value);
+		x1 = vminq_f32(vmaxq_f32(x1, min_value), max_value);
+		// vcvtnq为就近舍入（偶数优先），与lrintf的默认舍入模式一致
+		return vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(x0)), vqmovn_s32(vcvtnq_s32_f32(x1)));
+	}
+
+	static inline int16x8_t s32x8_to_s16_neon(const int32_t* src)
+	{
+		return vcombine_s16(vshrn_n_s32(vld1q_s32(src), 16), vshrn_n_s32(vld1q_s32(src + 4), 16));
+	}
+
+	static void interleave_16_neon(int16_t* dest, const int16_t* const* src, int channels, int samples)
+	{
+		if (channels == 1)
+		{
+			std::memcpy(dest, src[0], size_t(samples) * sizeof(int16_t));
+			return;
+		}
+		if (channels != 2)
+		{
+			get_scalar_sample_convert_kernels().interleave_16(dest, src, channels, samples);
+			return;
+		}
+		int i = 0;
+		for (; i + 8 <= samples; i += 8)
+		{
+			int16x8x2_t pair = { { vld1q_s16(src[0] + i), vld1q_s16(src[1] + i) } };
+			vst2q_s16(dest + 2 * i, pair);
+		}
+		stereo_tail(get_scalar_sample_convert_kernels().interleave_16, dest, src, i, samples);
+	}
+
+	static void interleave_32_neon(int32_t* dest, const int32_t* const* src, int channels, int samples)
+	{
+		if (channels == 1)
+		{
+			std::memcpy(dest, src[0], size_t(samples) * sizeof(int32_t));
+			return;
+		}
+		if (channels != 2)
+		{
+			get_scalar_sample_convert_kernels().interleave_32(dest, src, channels, samples);
+			return;
+		}
+		int i = 0;
+		for (; i + 4 <= samples; i += 4)
+		{
+			int32x4x2_t pair = { { vld1q_s32(src[0] + i), vld1q_s32(src[1] + i) } };
+			vst2q_s32(dest + 2 * i, pair);
+		}
+		stereo_tail(get_scalar_sample_convert_kernels().interleave_32, dest, src, i, samples);
+	}
+
+	static void float_to_s16_neon(int16_t* dest, const float* const* src, int channels, int samples, tpdf_dither* dither)
+	{
+		auto scalar = get_scalar_sample_convert_kernels().float_to_s16;
+		if (channels > 2)
+		{
+			scalar(dest, src, channels, samples, dither);
+			return;
+		}
+		uint32x4_t state = dither ? vld1q_u32(dither->state) : vdupq_n_u32(0);
+		uint32x4_t* state_ptr = dither ? &state : nullptr;
+		int i = 0;
+		if (channels == 1)
+		{
+			for (; i + 8 <= samples; i += 8)
+				vst1q_s16(dest + i, float8_to_s16_neon(src[0] + i, state_ptr));
+			const float* tail_src = src[0] + i;
+			if (i < samples)
+				scalar(dest + i, &tail_src, 1, samples - i, dither);
+		}
+		else
+		{
+			for (; i + 8 <= samples; i += 8)
+			{
+				int16x8x2_t pair = { { float8_to_s16_neon(src[0] + i, state_ptr), float8_to_s16_neon(src[1] + i, state_ptr) } };
+				vst2q_s16(dest + 2 * i, pair);
+			}
+			const float* tail_src[2] = { src[0] + i, src[1] + i };
+			if (i < samples)
+				scalar(dest + 2 * i, tail_src, 2, samples - i, dither);
+		}
+		if (dither)
+			vst1q_u32(dither->state, state);
+	}
+
+	static void s32_to_s16_neon(int16_t* dest, const int32_t* const* src, int channels, int samples)
+	{
+		auto scalar = get_scalar_sample_convert_kernels().s32_to_s16;
+		if (channels > 2)
+		{
+			scalar(dest, src, channels, samples);
+			return;
+		}
+		int i = 0;
+		if (channels == 1)
+		{
+			for (; i + 8 <= samples; i += 8)
+				vst1q_s16(dest + i, s32x8_to_s16_neon(src[0] + i));
+			const int32_t* tail_src = src[0] + i;
+			if (i < samples)
+				scalar(dest + i, &tail_src, 1, samples - i);
+			return;
+		}
+		for (; i + 8 <= samples; i += 8)
+		{
+			int16x8x2_t pair = { { s32x8_to_s16_neon(src[0] + i), s32x8_to_s16_neon(src[1] + i) } };
+			vst2q_s16(dest + 2 * i, pair);
+		}
+		stereo_tail(scalar, dest, src, i, samples);
+	}
+
+	static void downmix_to_stereo_neon(float* dest, const float* const* src, int channels, int samples,
+		const downmix_coefficients& coefficients)
+	{
+		int i = 0;
+		for (; i + 4 <= samples; i += 4)
+		{
+			// 乘加分开写，避免编译为融合乘加(fmla)而与标量结果不一致
+			float32x4_t center = vmulq_n_f32(vld1q_f32(src[2] + i), coefficients.center);
+			float32x4_t left = vaddq_f32(vmulq_n_f32(vld1q_f32(src[0] + i), coefficients.front), center);
+			float32x4_t right = vaddq_f32(vmulq_n_f32(vld1q_f32(src[1] + i), coefficients.front), center);
+			for (int ch = 4; ch + 1 < channels; ch += 2)
+			{
+				left = vaddq_f32(left, vmulq_n_f32(vld1q_f32(src[ch] + i), coefficients.surround));
+				right = vaddq_f32(right, vmulq_n_f32(vld1q_f32(src[ch + 1] + i), coefficients.surround));
+			}
+			float32x4x2_t pair = { { left, right } };
+			vst2q_f32(dest + 2 * i, pair);
+		}
+		if (i < samples)
+		{
+			const float* tail_src[8];
+			for (int ch = 0; ch < channels && ch < 8; ++ch)
+				tail_src[ch] = src[ch] + i;
+			get_scalar_sample_convert_kernels().downmix_to_stereo(dest + 2 * i, tail_src, channels, samples - i, coefficients);
+		}
+	}
+
+	const sample_convert_kernels* get_neon_sample_convert_kernels()
+	{
+		static const sample_convert_kernels kernels = {
+			"neon",
+			interleave_16_neon,
+			interleave_32_neon,
+			float_to_s16_neon,
+			s32_to_s16_neon,
+			downmix_to_stereo_neon
+		};
+		return &kernels;
+	}
+#else
+	const sample_convert_kernels* get_neon_sample_convert_kernels() { return nullptr; }
+#endif // SAMPLE_CONVERT_NEON
+}
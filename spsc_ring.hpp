@@ -0,0 +1,123 @@
+﻿#if !defined(SPSC_RING_HPP_)
+#define SPSC_RING_HPP_
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+
+namespace audio
+{
+	// 缓存行大小，head/tail分别独占一个缓存行，避免生产者与消费者之间的伪共享
+	constexpr size_t cache_line_size = 64;
+
+	// 固定容量、无锁、无等待的单生产者/单消费者环形队列
+	// 容量必须为2的幂；槽位在构造时一次性分配，push/pop不分配内存
+	// 生产者只写tail，消费者只写head，双方均不会阻塞对方
+	template <typename T>
+	class spsc_ring
+	{
+	public:
+		explicit spsc_ring(size_t capacity)
+			: slots(new T[capacity]()), mask(capacity - 1)
+		{
+			assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+		}
+		~spsc_ring() { delete[] slots; }
+		spsc_ring(const spsc_ring&) = delete;
+		spsc_ring& operator=(const spsc_ring&) = delete;
+
+		size_t capacity() const { return mask + 1; }
+
+		// 当前队列中的元素个数，仅为快照
+		size_t size() const
+		{
+			return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+		}
+		bool empty() const { return size() == 0; }
+
+		// ---- 生产者 ----
+		// 取得下一个可写槽位，队列已满时返回nullptr；写完后调用commit_push发布
+		T* producer_slot()
+		{
+			size_t current_tail = tail.load(std::memory_order_relaxed);
+			if (current_tail - cached_head > mask)
+			{
+				cached_head = head.load(std::memory_order_acquire);
+				if (current_tail - cached_head > mask)
+					return nullptr;
+			}
+			return &slots[current_tail & mask];
+		}
+
+		void commit_push()
+		{
+			tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		bool try_push(const T& value)
+		{
+			T* slot = producer_slot();
+			if (!slot)
+				return false;
+			*slot = value;
+			commit_push();
+			return true;
+		}
+
+		// ---- 消费者 ----
+		// 取得队首元素，队列为空时返回nullptr；用完后调用commit_pop归还槽位
+		T* consumer_slot()
+		{
+			size_t current_head = head.load(std::memory_order_relaxed);
+			if (current_head == cached_tail)
+			{
+				cached_tail = tail.load(std::memory_order_acquire);
+				if (current_head == cached_tail)
+					return nullptr;
+			}
+			return &slots[current_head & mask];
+		}
+
+		void commit_pop()
+		{
+			head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		bool try_pop(T& value)
+		{
+			T* slot = consumer_slot();
+			if (!slot)
+				return false;
+			value = *slot;
+			commit_pop();
+			return true;
+		}
+
+		// 按下标访问槽位（不论是否在队列中），用于初始化/释放槽位中的资源
+		// 只能在没有并发读写时调用
+		T& slot_at(size_t index) { return slots[index & mask]; }
+
+		// 清空队列，只能在没有并发读写时调用
+		void reset()
+		{
+			head.store(0, std::memory_order_relaxed);
+			tail.store(0, std::memory_order_relaxed);
+			cached_head = 0;
+			cached_tail = 0;
+		}
+
+	private:
+		T* const slots;
+		const size_t mask;
+
+		// 消费者独占
+		alignas(cache_line_size) std::atomic<size_t> head{ 0 };
+		size_t cached_tail = 0;
+		// 生产者独占
+		alignas(cache_line_size) std::atomic<size_t> tail{ 0 };
+		size_t cached_head = 0;
+		char padding[cache_line_size - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+	};
+}
+
+#endif // SPSC_RING_HPP_